@@ -17,6 +17,7 @@
 #import "CloudControllerHelper.h"
 #import "CloudEntity.h"
 #import "CloudEntityCollection.h"
+#import "CloudEntityStore.h"
 #import "CloudMessagingManager.h"
 #import "EditModeUITextView.h"
 #import "GTMHTTPFetcherLogging.h"
@@ -50,6 +51,10 @@ static NSString *kCloudControllerClientIDFiller = @"{{{ INSERT ID }}}";
 static NSString *kCloudControllerClientSecretFiller = @"{{{ INSERT SECRET }}}";
 static NSString *kCloudControllerServiceURLFiller = @"{{{ INSERT APP ID }}}";
 static const int kCloudControllerOfflineMessageMax = 50;
+// Quiet time that ends a burst of push notifications for a topic, in seconds
+static const NSTimeInterval kCloudControllerPushDebounceInterval = 0.3;
+// Longest delay of a fetch for a push notification, in seconds
+static const NSTimeInterval kCloudControllerPushMaxLatency = 1.5;
 
 #pragma mark - Instance methods
 
@@ -85,6 +90,15 @@ static const int kCloudControllerOfflineMessageMax = 50;
   [CloudEntity setCloudEndpointService:self.cloudEndpointService];
   [_entityCollection setCloudEndpointService:self.cloudEndpointService];
 
+  // Write cloud entity responses through to the on-device entity store
+  CloudEntityStore *entityStore = [CloudEntityStore sharedInstance];
+  [CloudEntity setEntityStore:entityStore];
+  [_entityCollection setEntityStore:entityStore];
+
+  [_entityCollection
+      setPushDebounceInterval:kCloudControllerPushDebounceInterval
+                   maxLatency:kCloudControllerPushMaxLatency];
+
   // Delegate the authentication flow to CloudAuthenticationHelper, but
   // this class implements CloudAuthenticationDelegate so that
   // CloudAuthenticationHelper can callback for actions after authentciation
@@ -0,0 +1,35 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity.h"
+
+// CloudEntity methods for the classes of the client library only.
+@interface CloudEntity ()
+
+// Point this instance at another native object.  Used to walk many native
+// objects through one reused CloudEntity, and to update an entity in place.
+- (void)rebindToRawObject:(GTLMobilebackendEntityDto *)rawObject;
+
+// Forget the edits made since the last read or write, once the backend holds
+// them.
+- (void)resetChangeTracking;
+
+// Return a deep copy of a native object whose containers are mutable.  Unlike
+// -copy, which only copies property list types, it copies the NSNull values
+// of the JSON.
++ (GTLMobilebackendEntityDto *)deepCopyOfRawObject:
+    (GTLMobilebackendEntityDto *)rawObject;
+
+@end
@@ -13,15 +13,33 @@
  * limitations under the License.
  */
 
+#import "CloudEntityStore.h"
 #import "GTLMobileBackendEntityDto.h"
 #import "GTLServiceMobilebackend.h"
 
 @class CloudEntity;
+@class CloudEntityWriteCoalescer;
 
 typedef void (^CloudEntityQueryCompletionCallback)(CloudEntity *, NSError *);
 
+// Defines where a fetch request may be answered from.  Remote always asks the
+// cloud backend; LocalFirst answers from the entity store when it holds the
+// entity.
+typedef enum { CloudEntityFetchPolicyRemote, CloudEntityFetchPolicyLocalFirst }
+  CloudEntityFetchPolicy;
+
+// Defines what a put sends.  Full sends the whole entity with an update
+// request.  Patch sends only the properties changed since the entity was
+// loaded with a patch request, and falls back to Full for entities it has no
+// snapshot of.
+typedef enum { CloudEntityPutModeFull, CloudEntityPutModePatch }
+  CloudEntityPutMode;
+
 // Wraps around GTLCbDto object and provides methods to send create, update and
 // delete requests to cloud backend.
+// Entities are equal if they have the same kind name and identifier; the hash
+// is cached, so an entity should not be renamed while it is in a set or used
+// as a dictionary key.
 @interface CloudEntity : NSObject
 
 // Generic id used for a Cloud Entity instance if an identifier was not defined.
@@ -63,12 +81,37 @@ extern NSString *const kCloudEntityScopeFutureAndPast;
 + (CloudEntity *)entityWithKind:(NSString *)kindName
                      properties:(NSDictionary *)properties;
 
-// Instantiate a CloudEntity object with the native object.
+// Instantiate a CloudEntity object with the native object.  Responses hand
+// out the instance of CloudEntityIdentityMap instead.
 + (CloudEntity *)entityWithRawObject:(GTLMobilebackendEntityDto *)rawObject;
 
 // Bind cloud endpoint service for all CloudEntity instances.
 + (void)setCloudEndpointService:(GTLServiceMobilebackend *)service;
 
+// Bind the entity store that all responses for CloudEntity requests are
+// written through to.  Pass nil to stop writing through.
++ (void)setEntityStore:(CloudEntityStore *)store;
+
+// Route insert, put and remove requests of all CloudEntity instances through
+// the coalescer, which sends them as batch requests.  Pass nil to send every
+// request on its own again.
++ (void)setWriteCoalescer:(CloudEntityWriteCoalescer *)coalescer;
+
+// Choose what puts of all CloudEntity instances send, CloudEntityPutModeFull
+// by default.  In patch mode an entity loaded from the backend snapshots its
+// properties before they are first handed out, so that edits can be told
+// apart, and a put of an edited entity sends a patch on its own, bypassing
+// any write coalescer.
++ (void)setPutMode:(CloudEntityPutMode)mode;
+
+// Set a property and mark it changed, even if the value is the same.
+- (void)setValue:(id)value forPropertyName:(NSString *)name;
+
+// Names of the properties changed since the snapshot: those set with
+// setValue:forPropertyName: and those whose value differs.  nil if the
+// entity has no snapshot.
+- (NSSet *)dirtyPropertyNames;
+
 // Delete a cloud instance in the cloud backend with the provided identifier and
 // kindName.  Caller to define callback block with cloud entity and error
 // response objects as input from the cloud backend server.
@@ -84,9 +127,29 @@ extern NSString *const kCloudEntityScopeFutureAndPast;
                            kindName:(NSString *)name
                            callback:(CloudEntityQueryCompletionCallback)block;
 
+// Retrieve a CloudEntity based on the ID and kindName.  With
+// CloudEntityFetchPolicyLocalFirst the entity store answers if it holds the
+// entity, otherwise the request goes to the backend.
++ (void)fetchInstanceWithIdentifier:(NSString *)identifier
+                           kindName:(NSString *)name
+                             policy:(CloudEntityFetchPolicy)policy
+                           callback:(CloudEntityQueryCompletionCallback)block;
+
 // Convert UTC time datetime to local time zone date time.
 + (NSString *)localDateTimeStringFromUTC:(NSDate *)datetime;
 
+// Return a comparator that orders CloudEntity objects by a backend field name,
+// the way the backend sorts a query: values of different types by type, as
+// +[CloudFilterEvaluator compareValue:toValue:] orders them, and lists by
+// their smallest value ascending or their largest descending.  Entities
+// without the field go last.
++ (NSComparator)comparatorForFieldName:(NSString *)name
+                             ascending:(BOOL)isAscending;
+
+// Return the value of a backend field name, such as kCloudEntityFieldNameOwner
+// or a property name.  Date fields are returned as NSDate.
+- (id)valueForFieldName:(NSString *)name;
+
 // Insert this instance via the cloud backend.  Caller to define callback block
 // with cloud entity and error response objects as input from the cloud backend
 // server.
@@ -94,7 +157,7 @@ extern NSString *const kCloudEntityScopeFutureAndPast;
 
 // Update this instance via the cloud backend. Caller to define callback block
 // with cloud entity and error response objects as input from the cloud backend
-// server.
+// server.  See setPutMode: for what is sent.
 - (void)putInstanceAtIndexPath:(NSIndexPath *)indexPath
                       callback:(CloudEntityQueryCompletionCallback)block;
 
@@ -13,9 +13,66 @@
  * limitations under the License.
  */
 
+#import "CloudEntity+Private.h"
 #import "CloudEntity.h"
+#import "CloudEntityIdentityMap.h"
+#import "CloudEntityWriteCoalescer.h"
+#import "CloudFilterEvaluator.h"
 #import "GTLQueryMobilebackend.h"
 
+@interface CloudEntity() {
+  // Hash of the kind name and identifier, computed when first asked for
+  NSUInteger _hash;
+  BOOL _isHashCached;
+  // Copy of the inner object before its properties were first handed out in
+  // patch mode, nil until then
+  GTLMobilebackendEntityDto *_originalObject;
+  // Names of the properties set with setValue:forPropertyName:
+  NSMutableSet *_dirtyPropertyNames;
+}
+@end
+
+
+// Return a deep copy of a JSON value with mutable containers.
+static id MutableCopyOfJSONValue(id value) {
+  if ([value isKindOfClass:[NSDictionary class]]) {
+    NSMutableDictionary *copy =
+        [NSMutableDictionary dictionaryWithCapacity:[value count]];
+    for (id key in value) {
+      copy[key] = MutableCopyOfJSONValue(value[key]);
+    }
+    return copy;
+  }
+  if ([value isKindOfClass:[NSArray class]]) {
+    NSMutableArray *copy = [NSMutableArray arrayWithCapacity:[value count]];
+    for (id element in value) {
+      [copy addObject:MutableCopyOfJSONValue(element)];
+    }
+    return copy;
+  }
+  return [value copy];
+}
+
+// Return the value a field sorts by: a list sorts by its smallest value in
+// ascending order and its largest in descending order, as the backend sorts
+// multi-valued properties, and an empty list counts as missing.
+static id SortValueOfFieldValue(id value, BOOL isAscending) {
+  if (![value isKindOfClass:[NSArray class]]) {
+    return value;
+  }
+
+  id extreme = nil;
+  NSComparisonResult wanted =
+      isAscending ? NSOrderedAscending : NSOrderedDescending;
+  for (id element in value) {
+    if (!extreme ||
+        [CloudFilterEvaluator compareValue:element toValue:extreme] == wanted) {
+      extreme = element;
+    }
+  }
+  return extreme;
+}
+
 
 @implementation CloudEntity
 
@@ -34,6 +91,9 @@ NSString *const kCloudEntityScopeFuture = @"FUTURE";
 NSString *const kCloudEntityScopeFutureAndPast = @"FUTURE_AND_PAST";
 
 static GTLServiceMobilebackend *gCloudEndpointService;
+static CloudEntityStore *gCloudEntityStore;
+static CloudEntityWriteCoalescer *gCloudEntityWriteCoalescer;
+static CloudEntityPutMode gCloudEntityPutMode = CloudEntityPutModeFull;
 
 @synthesize innerObject = _innerObject;
 
@@ -48,6 +108,7 @@ static GTLServiceMobilebackend *gCloudEndpointService;
 
 - (void)setKindName:(NSString *)string {
   _innerObject.kindName = string;
+  _isHashCached = NO;
 }
 
 - (NSString *)kindName {
@@ -55,11 +116,13 @@ static GTLServiceMobilebackend *gCloudEndpointService;
 }
 
 - (void)setProperties:(NSDictionary *)dictionary {
+  [self snapshotIfNeeded];
   _innerObject.properties = [dictionary mutableCopy];
   [_innerObject setJSONValue:dictionary forKey:kCloudEntityFieldNameProperties];
 }
 
 - (NSMutableDictionary *)properties {
+  [self snapshotIfNeeded];
   return [_innerObject JSONValueForKey:kCloudEntityFieldNameProperties];
 }
 
@@ -97,10 +160,113 @@ static GTLServiceMobilebackend *gCloudEndpointService;
   return [CloudEntity localDateTimeStringFromUTC:self.createdAtUTC];
 }
 
+- (id)valueForFieldName:(NSString *)name {
+  if ([name isEqualToString:kCloudEntityFieldNameUpdatedAt]) {
+    return self.updatedAtUTC;
+  } else if ([name isEqualToString:kCloudEntityFieldNameCreatedAt]) {
+    return self.createdAtUTC;
+  } else if ([name isEqualToString:kCloudEntityFieldNameUpdatedBy]) {
+    return self.updatedBy;
+  } else if ([name isEqualToString:kCloudEntityFieldNameCreatedBy]) {
+    return self.createdBy;
+  } else if ([name isEqualToString:kCloudEntityFieldNameOwner]) {
+    return self.owner;
+  } else if ([name isEqualToString:kCloudEntityFieldNameIdentity]) {
+    return _innerObject.identifier;
+  } else if ([name isEqualToString:kCloudEntityFieldNameKindName]) {
+    return self.kindName;
+  }
+
+  // Read the properties without taking a snapshot
+  return [_innerObject JSONValueForKey:kCloudEntityFieldNameProperties][name];
+}
+
+- (void)rebindToRawObject:(GTLMobilebackendEntityDto *)rawObject {
+  _innerObject = rawObject;
+  _isHashCached = NO;
+  [self resetChangeTracking];
+}
+
+- (void)setValue:(id)value forPropertyName:(NSString *)name {
+  if (!self.properties) {
+    self.properties = [NSMutableDictionary dictionary];
+  }
+  NSMutableDictionary *properties = self.properties;
+
+  if (value) {
+    properties[name] = value;
+  } else {
+    [properties removeObjectForKey:name];
+  }
+
+  if (_originalObject) {
+    if (!_dirtyPropertyNames) {
+      _dirtyPropertyNames = [NSMutableSet set];
+    }
+    [_dirtyPropertyNames addObject:name];
+  }
+}
+
+- (NSSet *)dirtyPropertyNames {
+  NSDictionary *changedProperties = [self changedProperties];
+  return changedProperties ? [NSSet setWithArray:[changedProperties allKeys]]
+                           : nil;
+}
+
+// Entities are equal when they stand for the same backend entity, i.e. have
+// the same kind name and identifier.  An entity without an identifier is only
+// equal to itself.
+- (BOOL)isEqual:(id)object {
+  if (self == object) {
+    return YES;
+  }
+  if (![object isKindOfClass:[CloudEntity class]]) {
+    return NO;
+  }
+
+  CloudEntity *other = object;
+  NSString *identifier = _innerObject.identifier;
+  if (!identifier || [self hash] != [other hash]) {
+    return NO;
+  }
+
+  NSString *kindName = self.kindName;
+  NSString *otherKindName = other.kindName;
+  return [identifier isEqualToString:other.innerObject.identifier] &&
+      (kindName == otherKindName || [kindName isEqualToString:otherKindName]);
+}
+
+- (NSUInteger)hash {
+  if (!_isHashCached) {
+    NSString *identifier = _innerObject.identifier;
+    _hash = identifier ? [identifier hash] ^ [self.kindName hash]
+                       : (NSUInteger)(__bridge void *)self;
+    _isHashCached = YES;
+  }
+  return _hash;
+}
+
 + (void)setCloudEndpointService:(GTLServiceMobilebackend *)service {
   gCloudEndpointService = service;
 }
 
++ (void)setEntityStore:(CloudEntityStore *)store {
+  gCloudEntityStore = store;
+}
+
++ (CloudEntityStore *)entityStore {
+  return gCloudEntityStore;
+}
+
++ (void)setWriteCoalescer:(CloudEntityWriteCoalescer *)coalescer {
+  [gCloudEntityWriteCoalescer flush];
+  gCloudEntityWriteCoalescer = coalescer;
+}
+
++ (void)setPutMode:(CloudEntityPutMode)mode {
+  gCloudEntityPutMode = mode;
+}
+
 + (GTLServiceMobilebackend *)cloudEndpointService {
   NSAssert(gCloudEndpointService != nil,
            @"cloudEndpointService not initialized");
@@ -135,7 +301,8 @@ static GTLServiceMobilebackend *gCloudEndpointService;
   }
 
   if (block) {
-    CloudEntity *entity = [CloudEntity entityWithRawObject:object];
+    CloudEntity *entity =
+        [[CloudEntityIdentityMap sharedInstance] entityWithRawObject:object];
     block(entity, error);
   }
 }
@@ -151,6 +318,10 @@ static GTLServiceMobilebackend *gCloudEndpointService;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityDto *object,
                           NSError *error) {
+          if (!error) {
+            [[CloudEntity entityStore] removeEntityWithKind:name
+                                                 identifier:identifier];
+          }
           [self logAndExecuteWithObject:object
                           responseError:error
                             requestType:@"DELETE"
@@ -161,6 +332,32 @@ static GTLServiceMobilebackend *gCloudEndpointService;
 + (void)fetchInstanceWithIdentifier:(NSString *)identifier
                            kindName:(NSString *)name
                            callback:(CloudEntityQueryCompletionCallback)block {
+  [self fetchInstanceWithIdentifier:identifier
+                           kindName:name
+                             policy:CloudEntityFetchPolicyRemote
+                           callback:block];
+}
+
++ (void)fetchInstanceWithIdentifier:(NSString *)identifier
+                           kindName:(NSString *)name
+                             policy:(CloudEntityFetchPolicy)policy
+                           callback:(CloudEntityQueryCompletionCallback)block {
+  if (policy == CloudEntityFetchPolicyLocalFirst) {
+    GTLMobilebackendEntityDto *storedObject =
+        [[CloudEntity entityStore] entityWithKind:name identifier:identifier];
+
+    // Keep the callback asynchronous as it is for backend responses
+    if (storedObject) {
+      dispatch_async(dispatch_get_main_queue(), ^{
+          [self logAndExecuteWithObject:storedObject
+                          responseError:nil
+                            requestType:@"GET (LOCAL)"
+                               callBack:block];
+      });
+      return;
+    }
+  }
+
   GTLQueryMobilebackend *query =
       [GTLQueryMobilebackend queryForEndpointV1GetWithKind:name
                                                 identifier:identifier];
@@ -170,6 +367,9 @@ static GTLServiceMobilebackend *gCloudEndpointService;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityDto *object,
                           NSError *error) {
+          if (!error) {
+            [[CloudEntity entityStore] putEntity:object];
+          }
           [self logAndExecuteWithObject:object
                           responseError:error
                             requestType:@"GET"
@@ -185,7 +385,32 @@ static GTLServiceMobilebackend *gCloudEndpointService;
   return [dateFormatter stringFromDate:datetime];
 }
 
++ (NSComparator)comparatorForFieldName:(NSString *)name
+                             ascending:(BOOL)isAscending {
+  return ^NSComparisonResult(CloudEntity *entity, CloudEntity *other) {
+      id value = SortValueOfFieldValue([entity valueForFieldName:name],
+                                       isAscending);
+      id otherValue = SortValueOfFieldValue([other valueForFieldName:name],
+                                            isAscending);
+      if (!value || !otherValue) {
+        if (value) {
+          return NSOrderedAscending;
+        }
+        return otherValue ? NSOrderedDescending : NSOrderedSame;
+      }
+
+      NSComparisonResult result =
+          [CloudFilterEvaluator compareValue:value toValue:otherValue];
+      return isAscending ? result : (NSComparisonResult)-result;
+  };
+}
+
 - (void)insertInstanceWithCallback:(CloudEntityQueryCompletionCallback)block {
+  if (gCloudEntityWriteCoalescer) {
+    [gCloudEntityWriteCoalescer insertEntity:self callback:block];
+    return;
+  }
+
   GTLQueryMobilebackend *query =
       [GTLQueryMobilebackend queryForEndpointV1InsertWithObject:self.innerObject
                                                            kind:self.kindName];
@@ -195,6 +420,9 @@ static GTLServiceMobilebackend *gCloudEndpointService;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityDto *object,
                           NSError *error) {
+          if (!error) {
+            [[CloudEntity entityStore] putEntity:object];
+          }
           [CloudEntity logAndExecuteWithObject:object
                                 responseError:error
                                   requestType:@"INSERT"
@@ -204,15 +432,37 @@ static GTLServiceMobilebackend *gCloudEndpointService;
 
 - (void)putInstanceAtIndexPath:(NSIndexPath *)indexPath
                       callback:(CloudEntityQueryCompletionCallback)block {
-  GTLQueryMobilebackend *query =
-      [GTLQueryMobilebackend queryForEndpointV1UpdateWithObject:self.innerObject
-                                                           kind:self.kindName];
+  // Patches are sent one by one, as the backend has no batch request for
+  // them; the coalescer sends full updates
+  NSDictionary *changedProperties = [self changedProperties];
+  if (gCloudEntityWriteCoalescer && [changedProperties count] == 0) {
+    [gCloudEntityWriteCoalescer putEntity:self callback:block];
+    return;
+  }
+
+  GTLQueryMobilebackend *query = nil;
+  if ([changedProperties count] > 0) {
+    query = [GTLQueryMobilebackend queryForEndpointV1PatchWithKind:
+                self.kindName];
+    query.identifier = _innerObject.identifier;
+    query.kindName = self.kindName;
+    query.properties = changedProperties;
+  } else {
+    query = [GTLQueryMobilebackend
+        queryForEndpointV1UpdateWithObject:self.innerObject
+                                      kind:self.kindName];
+  }
 
   GTLServiceMobilebackend *service = [CloudEntity cloudEndpointService];
   [service executeQuery:query
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityDto *object,
                           NSError *error) {
+          if (!error) {
+            [[CloudEntity entityStore] putEntity:object];
+            // The backend holds the edits now
+            [self resetChangeTracking];
+          }
           [CloudEntity logAndExecuteWithObject:object
                                  responseError:error
                                    requestType:@"UPDATE"
@@ -222,14 +472,25 @@ static GTLServiceMobilebackend *gCloudEndpointService;
 
 - (void)removeInstanceAtIndexPath:(NSIndexPath *)indexPath
                          callback:(CloudEntityQueryCompletionCallback)block {
+  if (gCloudEntityWriteCoalescer) {
+    [gCloudEntityWriteCoalescer removeEntity:self callback:block];
+    return;
+  }
+
+  NSString *kindName = self.kindName;
+  NSString *identifier = self.identifier;
   GTLQueryMobilebackend *query =
-      [GTLQueryMobilebackend queryForEndpointV1DeleteWithKind:self.kindName
-                                                   identifier:self.identifier];
+      [GTLQueryMobilebackend queryForEndpointV1DeleteWithKind:kindName
+                                                   identifier:identifier];
   GTLServiceMobilebackend *service = [CloudEntity cloudEndpointService];
   [service executeQuery:query
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityDto *object,
                           NSError *error) {
+          if (!error) {
+            [[CloudEntity entityStore] removeEntityWithKind:kindName
+                                                 identifier:identifier];
+          }
           [CloudEntity logAndExecuteWithObject:object
                                 responseError:error
                                   requestType:@"DELETE"
@@ -237,4 +498,70 @@ static GTLServiceMobilebackend *gCloudEndpointService;
       }];
 }
 
+#pragma mark - Change tracking
+
+// Copy the inner object in patch mode, unless done already or the entity was
+// never stored in the backend.
+- (void)snapshotIfNeeded {
+  if (_originalObject || gCloudEntityPutMode != CloudEntityPutModePatch ||
+      !_innerObject.identifier) {
+    return;
+  }
+  _originalObject = [CloudEntity deepCopyOfRawObject:_innerObject];
+}
+
+- (void)resetChangeTracking {
+  _originalObject = nil;
+  _dirtyPropertyNames = nil;
+}
+
++ (GTLMobilebackendEntityDto *)deepCopyOfRawObject:
+    (GTLMobilebackendEntityDto *)rawObject {
+  if (!rawObject) {
+    return nil;
+  }
+  GTLMobilebackendEntityDto *copy =
+      [[rawObject class] objectWithJSON:MutableCopyOfJSONValue(rawObject.JSON)];
+  copy.surrogates = rawObject.surrogates;
+  return copy;
+}
+
+// Return the properties changed since the snapshot, the way a patch request
+// takes them: nested dictionaries only hold their changes and removed values
+// are NSNull.  Return nil if there is no snapshot.
+- (NSDictionary *)changedProperties {
+  if (!_originalObject) {
+    return nil;
+  }
+
+  GTLMobilebackendEntityDto *patch =
+      [_innerObject patchObjectFromOriginal:_originalObject];
+  NSMutableDictionary *changedProperties = [NSMutableDictionary dictionary];
+  id patchedProperties =
+      [patch JSONValueForKey:kCloudEntityFieldNameProperties];
+  if ([patchedProperties isKindOfClass:[NSDictionary class]]) {
+    [changedProperties addEntriesFromDictionary:patchedProperties];
+  } else if (patchedProperties) {
+    // The properties were added or removed as a whole
+    NSDictionary *properties =
+        [_innerObject JSONValueForKey:kCloudEntityFieldNameProperties];
+    NSDictionary *originalProperties =
+        [_originalObject JSONValueForKey:kCloudEntityFieldNameProperties];
+    [changedProperties addEntriesFromDictionary:properties];
+    for (NSString *name in originalProperties) {
+      if (!properties[name]) {
+        changedProperties[name] = [NSNull null];
+      }
+    }
+  }
+
+  NSDictionary *properties =
+      [_innerObject JSONValueForKey:kCloudEntityFieldNameProperties];
+  for (NSString *name in _dirtyPropertyNames) {
+    id value = properties[name];
+    changedProperties[name] = value ? value : [NSNull null];
+  }
+  return changedProperties;
+}
+
 @end
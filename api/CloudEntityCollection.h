@@ -13,12 +13,38 @@
  * limitations under the License.
  */
 
+#import "CloudEntity.h"
+#import "CloudEntityCursor.h"
+#import "CloudEntityIndex.h"
+#import "CloudEntityResultSet.h"
+#import "CloudNotificationAggregator.h"
+#import "CloudTopicRegistry.h"
+#import "CloudEntityStore.h"
 #import "GTLMobilebackendEntityListDto.h"
 #import "GTLMobilebackendQueryDto.h"
 #import "GTLServiceMobilebackend.h"
 
 typedef void(^CloudEntityCollectionQueryCompletion)(NSArray *, NSError *);
+typedef void(^CloudEntityCollectionPushHandler)(NSString *topicID);
+typedef void(^CloudEntityCollectionChangeCompletion)(CloudEntityResultSet *,
+                                                     CloudEntityChangeSet *,
+                                                     NSError *);
+typedef void(^CloudEntityCollectionPageCompletion)(NSArray *,
+                                                   CloudEntityCursor *,
+                                                   NSError *);
 extern const NSString *kCloudEntityCollectionIOSDevicePrefix;
+// Keys of a push notification payload that names the changed entities.  The
+// identifiers are an array of NSString; truncated is set when the backend
+// left some out.
+extern NSString *const kCloudEntityCollectionPushEntityIDsKey;
+extern NSString *const kCloudEntityCollectionPushTruncatedKey;
+
+// Defines what happens when a list query is sent while an identical one is
+// still in flight.  None sends both.  Share attaches the new caller to the
+// outstanding request.  Supersede cancels the outstanding request and sends a
+// new one, whose result is delivered to all callers.
+typedef enum { CloudQueryCoalescingNone, CloudQueryCoalescingShare,
+  CloudQueryCoalescingSupersede } CloudQueryCoalescingPolicy;
 
 // Singleton class wraps around GTLCloudBackendEntityListDto. Provide methods
 // to send listAll, getAll, insertAll, putAll and deleteAll requests to the
@@ -26,29 +52,112 @@ extern const NSString *kCloudEntityCollectionIOSDevicePrefix;
 // callback actions for subscribed queries.
 @interface CloudEntityCollection : NSObject
 
+// Coalescing of identical list queries in flight, CloudQueryCoalescingNone by
+// default.  Applies to every list query, including those sent for push
+// notifications, that does not name its own policy.
+@property(nonatomic) CloudQueryCoalescingPolicy queryCoalescingPolicy;
+
+// Aggregator of push notifications set up by
+// setPushDebounceInterval:maxLatency:, e.g. to give a chatty topic a longer
+// debounce interval.  nil if push notifications are not aggregated.
+@property(nonatomic, readonly) CloudNotificationAggregator *
+    notificationAggregator;
+
 // Shared instance for GTMObject Singleton Boilerplate
 + (CloudEntityCollection *)sharedInstance;
 
 // Bind cloud endpoint service to all CloudEntityCollection instances.
 - (void)setCloudEndpointService:(GTLServiceMobilebackend *)service;
 
-// Return a dictionary that maps a subscribed topic to its handler/callback.
+// Bind the entity store that all collection responses are written through to.
+// Pass nil to stop writing through.
+- (void)setEntityStore:(CloudEntityStore *)store;
+
+// Return a registry that maps a subscribed topic to its handler/callback.
 // Key is subscription id as NSString, object is handler/callback as
-// CloudNotificationHandler.
-- (NSMutableDictionary *)topicHandlerDictionary;
+// CloudNotificationHandler.  Safe to use from any thread.
+- (CloudTopicRegistry *)topicHandlerDictionary;
 
 // Handle dispatched push notification for a specific topicID by triggering
 // corresponding handlers and/or callbacks.
 - (void)handlePushNotificationWithTopicID:(NSString *)topicID;
 
+// Same as handlePushNotificationWithTopicID:, for a notification naming the
+// identifiers of the entities that changed.  Those entities alone are fetched
+// with a getAll request and merged into the last result of the topic.  The
+// query is sent in full when entityIDs is nil, e.g. for a truncated payload,
+// when the topic has no result yet, or when the merged result may lack
+// entities beyond the query limit.
+- (void)handlePushNotificationWithTopicID:(NSString *)topicID
+                                entityIDs:(NSArray *)entityIDs;
+
+// Pass push notifications for a topic to the handler, on the main thread,
+// instead of fetching the topic, e.g. to schedule the fetch for later.  The
+// handler fetches with refreshTopicsWithIDs:.  Pass nil to remove it.
+- (void)setPushHandler:(CloudEntityCollectionPushHandler)handler
+            forTopicID:(NSString *)topicID;
+
+// Fetch the results of the continuous queries of the topics and pass them to
+// their handlers.  Several topics are fetched with one batch request.
+- (void)refreshTopicsWithIDs:(NSArray *)topicIDs;
+
+// Collapse push notifications per topic with a CloudNotificationAggregator:
+// a burst of notifications for a topic leads to one fetch, at most
+// maxLatency seconds after its first notification, and topics due together
+// are fetched with one batch request.  Pass a zero interval to fetch on every
+// notification again, which is the default.
+- (void)setPushDebounceInterval:(NSTimeInterval)interval
+                     maxLatency:(NSTimeInterval)maxLatency;
+
 // Retreive a collection of cloud entity from the backend based on the input
 // cbQuery requirement.  If the retrieval is successful, caller can manipulate
 // the returned ClounEntityCollection in the callback block.
 - (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
                        callback:(CloudEntityCollectionQueryCompletion)block;
 
+// Same as listCollectionWithQuery:callback:, coalescing the query with an
+// identical one in flight according to the policy instead of
+// queryCoalescingPolicy, e.g. CloudQueryCoalescingSupersede for a refresh of
+// which only the newest result matters.  Queries are matched and sent on the
+// main thread; a call from another thread sends its query from there.
+- (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+               coalescingPolicy:(CloudQueryCoalescingPolicy)policy
+                       callback:(CloudEntityCollectionQueryCompletion)block;
+
+// Same as listCollectionWithQuery:callback:.  With deltaSync, push
+// notifications for a continuous query only fetch the entities updated since
+// the latest "updatedAt" seen and merge them into the previous result, which
+// is passed to the callback in query order and within the query limit.
+// Deleted entities are not noticed by a delta; they drop out of the result on
+// the next full listing.
+- (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+                      deltaSync:(BOOL)deltaSync
+                       callback:(CloudEntityCollectionQueryCompletion)block;
+
+// Same as listCollectionWithQuery:deltaSync:callback:, for consumers which
+// update incrementally.  Every result, the first one and those of later push
+// notifications, is applied to the returned result set, and the block gets
+// the changes from the previous result.  On error the result set is left as
+// it was and the change set is nil.
+- (CloudEntityResultSet *)listCollectionWithQuery:
+    (GTLMobilebackendQueryDto *)cbQuery
+    deltaSync:(BOOL)deltaSync
+    changeHandler:(CloudEntityCollectionChangeCompletion)block;
+
+// Answer cbQuery from the entities held by the entity store, without a
+// request to the backend.  The filter, sort order and limit of cbQuery are
+// applied on the device; the result can be shown while the query is sent to
+// the backend to revalidate it.
+- (NSArray *)localCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery;
+
+// Return the secondary indexes of a kind over the entity store, creating them
+// on first use.  Fields indexed on it are used by localCollectionWithQuery:
+// for queries of the kind.  Return nil if no entity store is bound.
+- (CloudEntityIndex *)indexForKind:(NSString *)kindName;
+
 // Retreive a collection of cloud entity based on kind name.  By default, it
-// returns top 100 items in descending order based on "updatedAt" field.
+// returns top 100 items in descending order based on "updatedAt" field.  Use
+// listPageWithKind:pageSize:sortAscending:sortBy:callback: to go past them.
 - (void)listCollectionWithKind:(NSString *)name
                          scope:(NSString *)scopeName
                       callback:(CloudEntityCollectionQueryCompletion)block;
@@ -62,6 +171,28 @@ extern const NSString *kCloudEntityCollectionIOSDevicePrefix;
                          scope:(NSString *)scopeName
                       callback:(CloudEntityCollectionQueryCompletion)block;
 
+// Retrieve the first page of cloud entities matching cbQuery.  The limit of
+// cbQuery is the page size; its sort property and order define the page order
+// (descending "updatedAt" if not set).  The callback receives the page and
+// a cursor to pass to listPageWithCursor:callback: for the next page.  With
+// prefetch, the next page is requested while the current one is delivered.
+- (void)listPageWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+         prefetchNextPage:(BOOL)prefetch
+                 callback:(CloudEntityCollectionPageCompletion)block;
+
+// Retrieve a page of cloud entities based on kind name, page size, sort order
+// and sort property name.
+- (void)listPageWithKind:(NSString *)name
+                pageSize:(NSInteger)size
+           sortAscending:(BOOL)isAscending
+                  sortBy:(NSString *)propertyName
+                callback:(CloudEntityCollectionPageCompletion)block;
+
+// Retrieve the page after the cursor returned with the previous page.  If the
+// request fails, the callback receives the same cursor so it can be retried.
+- (void)listPageWithCursor:(CloudEntityCursor *)cursor
+                  callback:(CloudEntityCollectionPageCompletion)block;
+
 // Send insertAll request to cloud backend to bulk insert a list of cloud
 // entities.  All input entities items should be in CloudEntity type.
 // If the retrieval is successful, caller can manipulate the
@@ -91,4 +222,13 @@ extern const NSString *kCloudEntityCollectionIOSDevicePrefix;
                           kindName:(NSString *)name
                           callback:(CloudEntityCollectionQueryCompletion)block;
 
+// Send getAll request for a list of cloud entities.  With
+// CloudEntityFetchPolicyLocalFirst, entities held by the entity store are
+// answered locally and only the missing IDs are requested from the backend.
+// The returned array follows the order of IDArray.
+- (void)fetchCollectionWithIDArray:(NSArray *)IDArray
+                          kindName:(NSString *)name
+                            policy:(CloudEntityFetchPolicy)policy
+                          callback:(CloudEntityCollectionQueryCompletion)block;
+
 @end
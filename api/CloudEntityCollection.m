@@ -16,15 +16,44 @@
 #import "CloudBackendIOSClientAppDelegate.h"
 #import "CloudEntity.h"
 #import "CloudEntityCollection.h"
+#import "CloudEntityLazyArray.h"
+#import "CloudFilter.h"
+#import "CloudFilterEvaluator.h"
 #import "CloudNotificationHandler.h"
+#import "GTLBatchQuery.h"
+#import "GTLBatchResult.h"
+#import "GTLErrorObject.h"
 #import "GTLQueryMobilebackend.h"
 #import "GTLMobilebackendQueryDto+Helper.h"
 
+// An outstanding list request and the callbacks waiting for its result.
+@interface CloudEntityInFlightQuery : NSObject
+@property(nonatomic, strong) GTLServiceTicket *ticket;
+@property(nonatomic, strong) NSMutableArray *callbacks;
+@end
+
+@implementation CloudEntityInFlightQuery
+@end
+
+
 @interface CloudEntityCollection() {
-  // Dictionary which can only be accessed via topicHandlerDictionary method.
+  // Registry which can only be accessed via topicHandlerDictionary method.
   // Key is topic as NSString, object is handler as CloudNotificationHandler.
-  NSMutableDictionary *_topicHandlerDictionary;
+  CloudTopicRegistry *_topicHandlerDictionary;
+  // Key is topic as NSString, object is CloudEntityCollectionPushHandler.
+  CloudTopicRegistry *_pushHandlers;
   GTLServiceMobilebackend *_cloudEndpointService;
+  CloudEntityStore *_entityStore;
+  // Key is kind name as NSString, object is CloudEntityIndex over
+  // _entityStore.
+  NSMutableDictionary *_entityIndexes;
+  // Queries in flight, only accessed on the main thread.  Key is canonical
+  // query key as NSString, object is CloudEntityInFlightQuery.
+  NSMutableDictionary *_inFlightQueries;
+  // Entities changed per topic since its last refresh, only accessed on the
+  // main thread.  Key is topic as NSString, object is NSMutableOrderedSet of
+  // identifiers, or NSNull if the topic needs the full query.
+  NSMutableDictionary *_changedEntityIDs;
   CloudBackendIOSClientAppDelegate *_appDelegate;
 }
 @end
@@ -34,6 +63,10 @@
 
 // Match with the Java backend prefix
 NSString const *kCloudEntityCollectionIOSDevicePrefix = @"ios_";
+NSString *const kCloudEntityCollectionPushEntityIDsKey = @"entityIds";
+NSString *const kCloudEntityCollectionPushTruncatedKey = @"truncated";
+// Changed entities above which a topic is fetched with its full query
+static const NSUInteger kCloudEntityCollectionMaxChangedEntityIDs = 100;
 static CloudEntityCollection *singleton;
 
 + (CloudEntityCollection *)sharedInstance {
@@ -51,7 +84,11 @@ static CloudEntityCollection *singleton;
     UIResponder <UIApplicationDelegate> *myDelegate =
         [[UIApplication sharedApplication] delegate];
     _appDelegate = (CloudBackendIOSClientAppDelegate *) myDelegate;
-    _topicHandlerDictionary = [NSMutableDictionary dictionary];
+    _topicHandlerDictionary = [[CloudTopicRegistry alloc] init];
+    _pushHandlers = [[CloudTopicRegistry alloc] init];
+    _inFlightQueries = [NSMutableDictionary dictionary];
+    _changedEntityIDs = [NSMutableDictionary dictionary];
+    _entityIndexes = [NSMutableDictionary dictionary];
   }
 
   return self;
@@ -63,28 +100,132 @@ static CloudEntityCollection *singleton;
   _cloudEndpointService = service;
 }
 
-- (NSMutableDictionary *)topicHandlerDictionary {
+- (void)setEntityStore:(CloudEntityStore *)store {
+  @synchronized(_entityIndexes) {
+    _entityStore = store;
+    [_entityIndexes removeAllObjects];
+  }
+}
+
+- (CloudTopicRegistry *)topicHandlerDictionary {
   return _topicHandlerDictionary;
 }
 
 // Called by application delegate didReceiveRemoteNotification method when
 // push notification is received.
 - (void)handlePushNotificationWithTopicID:(NSString *)topicID {
-  // Retrieve the callback handler corresponding to the topicID
-  CloudNotificationHandler *handler = self.topicHandlerDictionary[topicID];
+  [self handlePushNotificationWithTopicID:topicID entityIDs:nil];
+}
+
+- (void)handlePushNotificationWithTopicID:(NSString *)topicID
+                                entityIDs:(NSArray *)entityIDs {
+  // Push handlers, the aggregator and the changed entities live on the main
+  // thread
+  if (![NSThread isMainThread]) {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self handlePushNotificationWithTopicID:topicID entityIDs:entityIDs];
+    });
+    return;
+  }
 
-  if (!handler) {
-    NSLog(@"The client does not have a handler registered for topicID: %@",
-        topicID);
+  CloudEntityCollectionPushHandler pushHandler = _pushHandlers[topicID];
+  if (pushHandler) {
+    pushHandler(topicID);
     return;
   }
 
-  // Execute the query based on the handler information
-  [self listCollectionWithQuery:handler.query callback:handler.callback];
+  [self addChangedEntityIDs:entityIDs forTopicID:topicID];
+  if (_notificationAggregator) {
+    [_notificationAggregator addNotificationForTopicID:topicID];
+  } else {
+    [self refreshChangedTopicsWithIDs:@[topicID]];
+  }
+}
+
+- (void)setPushHandler:(CloudEntityCollectionPushHandler)handler
+            forTopicID:(NSString *)topicID {
+  _pushHandlers[topicID] = [handler copy];
+}
+
+- (void)refreshTopicsWithIDs:(NSArray *)topicIDs {
+  NSMutableArray *handlers = [NSMutableArray array];
+  for (NSString *topicID in topicIDs) {
+    // Retrieve the callback handler corresponding to the topicID
+    CloudNotificationHandler *handler = self.topicHandlerDictionary[topicID];
+    if (handler) {
+      [handlers addObject:handler];
+    } else {
+      NSLog(@"The client does not have a handler registered for topicID: %@",
+          topicID);
+    }
+  }
+
+  if ([handlers count] == 1) {
+    GTLMobilebackendQueryDto *cbQuery = nil;
+    CloudEntityCollectionQueryCompletion block =
+        [self refreshCallbackForHandler:handlers[0] query:&cbQuery];
+    [self listCollectionWithQuery:cbQuery callback:block];
+  } else if ([handlers count] > 1) {
+    [self refreshHandlersWithBatch:handlers];
+  }
+}
+
+- (void)setPushDebounceInterval:(NSTimeInterval)interval
+                     maxLatency:(NSTimeInterval)maxLatency {
+  [_notificationAggregator flush];
+  _notificationAggregator = nil;
+  if (interval <= 0) {
+    return;
+  }
+
+  __weak CloudEntityCollection *weakSelf = self;
+  _notificationAggregator = [[CloudNotificationAggregator alloc]
+      initWithDebounceInterval:interval
+                    maxLatency:maxLatency
+                  flushHandler:^(NSArray *topicIDs) {
+                      [weakSelf refreshChangedTopicsWithIDs:topicIDs];
+                  }];
 }
 
 - (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
                        callback:(CloudEntityCollectionQueryCompletion)block {
+  [self listCollectionWithQuery:cbQuery deltaSync:NO callback:block];
+}
+
+- (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+               coalescingPolicy:(CloudQueryCoalescingPolicy)policy
+                       callback:(CloudEntityCollectionQueryCompletion)block {
+  [self listCollectionWithQuery:cbQuery
+                      deltaSync:NO
+               coalescingPolicy:policy
+                       callback:block];
+}
+
+- (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+                      deltaSync:(BOOL)deltaSync
+                       callback:(CloudEntityCollectionQueryCompletion)block {
+  [self listCollectionWithQuery:cbQuery
+                      deltaSync:deltaSync
+               coalescingPolicy:self.queryCoalescingPolicy
+                       callback:block];
+}
+
+- (void)listCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+                      deltaSync:(BOOL)deltaSync
+               coalescingPolicy:(CloudQueryCoalescingPolicy)policy
+                       callback:(CloudEntityCollectionQueryCompletion)block {
+  // Send the canonical filter, which keeps the request small and the query
+  // ID the same for equal filters.  A filter which never matches needs no
+  // request at all.
+  if (![cbQuery normalizeFilter]) {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (block) {
+          block(@[], nil);
+        }
+    });
+    return;
+  }
+
   // If this is a continuous query, clone the query and put it in the
   // dictionary.
   // When a push notification comes in with the queryID i.e. topicID in future,
@@ -111,8 +252,17 @@ static CloudEntityCollection *singleton;
         [[CloudNotificationHandler alloc] init];
     handler.callback = block;
     handler.query = newQueryDto;
+    handler.isDeltaSync = deltaSync;
 
     self.topicHandlerDictionary[topicID] = handler;
+
+    // Keep the first result as the base that deltas and changed entities
+    // are merged into
+    if (deltaSync) {
+      block = [self mergingCallbackForHandler:handler];
+    } else {
+      block = [self recordingCallbackForHandler:handler];
+    }
   }
 
   // Add the device's token to regId field of the current query
@@ -122,19 +272,62 @@ static CloudEntityCollection *singleton;
                       stringByAppendingString:myApp.tokenString];
 
   // Finally execute the current query to get a collection of Cloud Entities
-  GTLQueryMobilebackend *query =
-      [GTLQueryMobilebackend queryForEndpointV1ListWithObject:cbQuery];
+  [self executeListQuery:cbQuery coalescingPolicy:policy callback:block];
+}
 
-  GTLServiceMobilebackend *service = [self cloudEndpointService];
-  [service executeQuery:query
-      completionHandler:^(GTLServiceTicket *ticket,
-                          GTLMobilebackendEntityListDto *object,
-                          NSError *error) {
-          [self executeWithArray:object.entries
-                     requestType:@"LIST ALL"
-                           error:error
-                        callback:block];
-      }];
+- (CloudEntityResultSet *)listCollectionWithQuery:
+    (GTLMobilebackendQueryDto *)cbQuery
+    deltaSync:(BOOL)deltaSync
+    changeHandler:(CloudEntityCollectionChangeCompletion)block {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [self listCollectionWithQuery:cbQuery
+                      deltaSync:deltaSync
+                       callback:^(NSArray *entities, NSError *error) {
+      CloudEntityChangeSet *changeSet = nil;
+      if (!error) {
+        changeSet = [resultSet applyEntities:entities];
+      }
+      if (block) {
+        block(resultSet, changeSet, error);
+      }
+  }];
+  return resultSet;
+}
+
+- (NSArray *)localCollectionWithQuery:(GTLMobilebackendQueryDto *)cbQuery {
+  CloudEntityIndex *index = nil;
+  if (cbQuery.kindName) {
+    @synchronized(_entityIndexes) {
+      index = _entityIndexes[cbQuery.kindName];
+    }
+  }
+  if (index) {
+    return [index resultOfQuery:cbQuery];
+  }
+
+  NSArray *objects = [_entityStore entitiesWithKind:cbQuery.kindName];
+  NSArray *entities = [self convertToCloudEntityArray:objects];
+  return [CloudFilterEvaluator resultOfQuery:cbQuery withEntities:entities];
+}
+
+- (CloudEntityIndex *)indexForKind:(NSString *)kindName {
+  if (!kindName) {
+    return nil;
+  }
+
+  @synchronized(_entityIndexes) {
+    if (!_entityStore) {
+      return nil;
+    }
+
+    CloudEntityIndex *index = _entityIndexes[kindName];
+    if (!index) {
+      index = [[CloudEntityIndex alloc] initWithKindName:kindName
+                                                   store:_entityStore];
+      _entityIndexes[kindName] = index;
+    }
+    return index;
+  }
 }
 
 - (void)listCollectionWithKind:(NSString *)name
@@ -165,6 +358,56 @@ static CloudEntityCollection *singleton;
   [self listCollectionWithQuery:cloudBackendQuery callback:block];
 }
 
+- (void)listPageWithQuery:(GTLMobilebackendQueryDto *)cbQuery
+         prefetchNextPage:(BOOL)prefetch
+                 callback:(CloudEntityCollectionPageCompletion)block {
+  CloudEntityCursor *cursor = [CloudEntityCursor cursorWithQuery:cbQuery
+                                                prefetchNextPage:prefetch];
+  [self listPageWithCursor:cursor callback:block];
+}
+
+- (void)listPageWithKind:(NSString *)name
+                pageSize:(NSInteger)size
+           sortAscending:(BOOL)isAscending
+                  sortBy:(NSString *)propertyName
+                callback:(CloudEntityCollectionPageCompletion)block {
+  GTLMobilebackendQueryDto *cloudBackendQuery =
+      [GTLMobilebackendQueryDto object];
+  cloudBackendQuery.limit = [NSNumber numberWithInteger:size];
+  cloudBackendQuery.kindName = name;
+  cloudBackendQuery.sortAscending = @(isAscending);
+  cloudBackendQuery.sortedPropertyName = propertyName;
+
+  [self listPageWithQuery:cloudBackendQuery
+         prefetchNextPage:YES
+                 callback:block];
+}
+
+- (void)listPageWithCursor:(CloudEntityCursor *)cursor
+                  callback:(CloudEntityCollectionPageCompletion)block {
+  if (cursor.isExhausted) {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        if (block) {
+          block(@[], cursor, nil);
+        }
+    });
+    return;
+  }
+
+  CloudEntityCollectionQueryCompletion completion =
+      ^(NSArray *entities, NSError *error) {
+          [self completePageWithCursor:cursor
+                              entities:entities
+                                 error:error
+                              callback:block];
+      };
+
+  // Use the page prefetched while the previous page was delivered, if any
+  if (![cursor deliverPrefetchedEntitiesTo:completion]) {
+    [self fetchPageAfterCursor:cursor callback:completion];
+  }
+}
+
 - (void)insertCollectionWithArray:(NSArray *)entities
                          callback:(CloudEntityCollectionQueryCompletion)block {
   GTLMobilebackendEntityListDto *list =
@@ -177,6 +420,9 @@ static CloudEntityCollection *singleton;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityListDto *object,
                           NSError *error) {
+          if (!error) {
+            [_entityStore putEntities:object.entries];
+          }
           [self executeWithArray:object.entries
                      requestType:@"INSERT ALL"
                            error:error
@@ -196,6 +442,9 @@ static CloudEntityCollection *singleton;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityListDto *object,
                           NSError *error) {
+          if (!error) {
+            [_entityStore removeEntities:list.entries];
+          }
           [self executeWithArray:object.entries
                      requestType:@"REMOVE ALL"
                            error:error
@@ -215,6 +464,9 @@ static CloudEntityCollection *singleton;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityListDto *object,
                           NSError *error) {
+          if (!error) {
+            [_entityStore putEntities:object.entries];
+          }
           [self executeWithArray:object.entries
                      requestType:@"UPDATE ALL"
                            error:error
@@ -225,6 +477,91 @@ static CloudEntityCollection *singleton;
 - (void)fetchCollectionWithIDArray:(NSArray *)IDArray
                           kindName:(NSString *)name
                           callback:(CloudEntityCollectionQueryCompletion)block {
+  [self fetchCollectionWithIDArray:IDArray
+                          kindName:name
+                            policy:CloudEntityFetchPolicyRemote
+                          callback:block];
+}
+
+- (void)fetchCollectionWithIDArray:(NSArray *)IDArray
+                          kindName:(NSString *)name
+                            policy:(CloudEntityFetchPolicy)policy
+                          callback:(CloudEntityCollectionQueryCompletion)block {
+  if (policy == CloudEntityFetchPolicyRemote || !_entityStore) {
+    [self fetchRemoteCollectionWithIDArray:IDArray
+                                  kindName:name
+                                  callback:block];
+    return;
+  }
+
+  // Answer what the entity store holds and only ask for the missing IDs.
+  // Key is identifier as NSString, object is GTLMobilebackendEntityDto.
+  NSMutableDictionary *objectsByID = [NSMutableDictionary dictionary];
+  NSMutableArray *missingIDArray = [NSMutableArray array];
+  for (NSString *identifier in IDArray) {
+    GTLMobilebackendEntityDto *object =
+        [_entityStore entityWithKind:name identifier:identifier];
+    if (object) {
+      objectsByID[identifier] = object;
+    } else {
+      [missingIDArray addObject:identifier];
+    }
+  }
+
+  if ([missingIDArray count] == 0) {
+    // Keep the callback asynchronous as it is for backend responses
+    NSArray *array = [objectsByID objectsForKeys:IDArray
+                                  notFoundMarker:[NSNull null]];
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self executeWithArray:array
+                   requestType:@"GET ALL (LOCAL)"
+                         error:nil
+                      callback:block];
+    });
+    return;
+  }
+
+  [self fetchRemoteCollectionWithIDArray:missingIDArray
+                                kindName:name
+                                callback:^(NSArray *entities, NSError *error) {
+      if (error) {
+        if (block) {
+          block(entities, error);
+        }
+        return;
+      }
+
+      if ([entities isKindOfClass:[CloudEntityLazyArray class]]) {
+        [(CloudEntityLazyArray *)entities
+            enumerateEntitiesWithFlyweightUsingBlock:^(CloudEntity *entity,
+                                                       NSUInteger idx,
+                                                       BOOL *stop) {
+                objectsByID[entity.identifier] = entity.innerObject;
+            }];
+      } else {
+        for (CloudEntity *entity in entities) {
+          objectsByID[entity.identifier] = entity.innerObject;
+        }
+      }
+
+      // Restore the requested order, skipping IDs the backend did not return
+      NSMutableArray *objects = [NSMutableArray array];
+      for (NSString *identifier in IDArray) {
+        GTLMobilebackendEntityDto *object = objectsByID[identifier];
+        if (object) {
+          [objects addObject:object];
+        }
+      }
+
+      if (block) {
+        block([self convertToCloudEntityArray:objects], nil);
+      }
+  }];
+}
+
+- (void)fetchRemoteCollectionWithIDArray:(NSArray *)IDArray
+    kindName:(NSString *)name
+    callback:(CloudEntityCollectionQueryCompletion)block {
   // Create a GTLCbDtoList from ID array
   GTLMobilebackendEntityListDto *list =
       [self convertIDArrayToGTLMobilebackendEntityListDto:IDArray
@@ -239,6 +576,9 @@ static CloudEntityCollection *singleton;
       completionHandler:^(GTLServiceTicket *ticket,
                           GTLMobilebackendEntityListDto *object,
                           NSError *error) {
+          if (!error) {
+            [_entityStore putEntities:object.entries];
+          }
           [self executeWithArray:object.entries
                      requestType:@"GET ALL"
                            error:error
@@ -248,6 +588,490 @@ static CloudEntityCollection *singleton;
 
 #pragma mark - Private methods
 
+// Remember the entities changed in a topic until the topic is refreshed.  A
+// notification without them, or too many of them, calls for the full query.
+- (void)addChangedEntityIDs:(NSArray *)entityIDs
+                 forTopicID:(NSString *)topicID {
+  NSMutableOrderedSet *changed = _changedEntityIDs[topicID];
+  if ((id)changed == [NSNull null]) {
+    return;
+  }
+
+  if ([entityIDs count] == 0) {
+    _changedEntityIDs[topicID] = [NSNull null];
+    return;
+  }
+
+  if (!changed) {
+    changed = [NSMutableOrderedSet orderedSet];
+    _changedEntityIDs[topicID] = changed;
+  }
+  [changed addObjectsFromArray:entityIDs];
+  if ([changed count] > kCloudEntityCollectionMaxChangedEntityIDs) {
+    _changedEntityIDs[topicID] = [NSNull null];
+  }
+}
+
+// Refresh topics by fetching their changed entities where they are known,
+// and with their full queries otherwise.
+- (void)refreshChangedTopicsWithIDs:(NSArray *)topicIDs {
+  NSMutableArray *fullTopicIDs = [NSMutableArray array];
+  for (NSString *topicID in topicIDs) {
+    id changed = _changedEntityIDs[topicID];
+    [_changedEntityIDs removeObjectForKey:topicID];
+
+    CloudNotificationHandler *handler = self.topicHandlerDictionary[topicID];
+    if ([changed isKindOfClass:[NSOrderedSet class]] && handler.results &&
+        handler.query.kindName) {
+      [self refreshHandler:handler
+                   topicID:topicID
+             withEntityIDs:[changed array]];
+    } else {
+      [fullTopicIDs addObject:topicID];
+    }
+  }
+
+  if ([fullTopicIDs count] > 0) {
+    [self refreshTopicsWithIDs:fullTopicIDs];
+  }
+}
+
+// Fetch the changed entities of the handler's topic and pass its merged
+// result to the handler's callback, or send the full query if the merge
+// cannot be trusted.
+- (void)refreshHandler:(CloudNotificationHandler *)handler
+               topicID:(NSString *)topicID
+         withEntityIDs:(NSArray *)entityIDs {
+  [self fetchCollectionWithIDArray:entityIDs
+                          kindName:handler.query.kindName
+                          callback:^(NSArray *entities, NSError *error) {
+      NSArray *results = nil;
+      if (!error) {
+        results = [self resultsOfHandler:handler
+                      mergedWithEntities:entities
+                               entityIDs:entityIDs];
+      }
+      if (!results) {
+        [self refreshTopicsWithIDs:@[topicID]];
+        return;
+      }
+
+      handler.results = results;
+      if (handler.callback) {
+        handler.callback(results, nil);
+      }
+  }];
+}
+
+// Return the handler's result with the changed entities replaced by their
+// fetched state.  Entities that were not returned are deleted, those that no
+// longer match the query drop out.  Return nil if the result was at the query
+// limit and shrank, as entities beyond the limit would have to move up.
+- (NSArray *)resultsOfHandler:(CloudNotificationHandler *)handler
+           mergedWithEntities:(NSArray *)entities
+                    entityIDs:(NSArray *)entityIDs {
+  // Key is identifier as NSString, object is CloudEntity
+  NSMutableDictionary *entitiesByID = [NSMutableDictionary dictionary];
+  for (CloudEntity *entity in handler.results) {
+    entitiesByID[entity.identifier] = entity;
+  }
+  [entitiesByID removeObjectsForKeys:entityIDs];
+  for (CloudEntity *entity in entities) {
+    entitiesByID[entity.identifier] = entity;
+  }
+
+  NSArray *results =
+      [CloudFilterEvaluator resultOfQuery:handler.query
+                             withEntities:[entitiesByID allValues]];
+  NSInteger limit = [handler.query.limit integerValue];
+  if (limit > 0 && (NSInteger)[handler.results count] >= limit &&
+      (NSInteger)[results count] < limit) {
+    return nil;
+  }
+  return results;
+}
+
+// Return a callback which keeps a full result as the handler's result before
+// passing it on, so that later notifications can be merged into it.
+- (CloudEntityCollectionQueryCompletion)recordingCallbackForHandler:
+    (CloudNotificationHandler *)handler {
+  return ^(NSArray *entities, NSError *error) {
+      if (!error) {
+        handler.results = entities;
+      }
+      if (handler.callback) {
+        handler.callback(entities, error);
+      }
+  };
+}
+
+// Return the query to send for a push notification to the handler's topic,
+// and the callback for its result.  Handlers with delta sync only fetch what
+// changed since their last result, if there is one.
+- (CloudEntityCollectionQueryCompletion)refreshCallbackForHandler:
+    (CloudNotificationHandler *)handler
+    query:(GTLMobilebackendQueryDto **)query {
+  if (handler.isDeltaSync && handler.highWaterMark &&
+      [self canSyncDeltaWithHandler:handler]) {
+    GTLMobilebackendQueryDto *deltaQuery = [self deltaQueryForHandler:handler];
+    *query = deltaQuery;
+    return [self deltaCallbackForHandler:handler query:deltaQuery];
+  }
+
+  *query = handler.query;
+  if (handler.isDeltaSync) {
+    return [self mergingCallbackForHandler:handler];
+  }
+  return [self recordingCallbackForHandler:handler];
+}
+
+// Send the queries of several handlers as one batch request.
+- (void)refreshHandlersWithBatch:(NSArray *)handlers {
+  CloudBackendIOSClientAppDelegate *myApp = [self appDelegate];
+  NSAssert([myApp.tokenString length], @"Device token is invalid");
+  NSString *regId = [kCloudEntityCollectionIOSDevicePrefix
+                        stringByAppendingString:myApp.tokenString];
+
+  GTLBatchQuery *batchQuery = [GTLBatchQuery batchQuery];
+  // Key is request ID as NSString, object is
+  // CloudEntityCollectionQueryCompletion.
+  NSMutableDictionary *callbacks = [NSMutableDictionary dictionary];
+  for (CloudNotificationHandler *handler in handlers) {
+    GTLMobilebackendQueryDto *cbQuery = nil;
+    CloudEntityCollectionQueryCompletion block =
+        [self refreshCallbackForHandler:handler query:&cbQuery];
+
+    // A filter which never matches needs no query
+    if (![cbQuery normalizeFilter]) {
+      if (block) {
+        block(@[], nil);
+      }
+      continue;
+    }
+    cbQuery.regId = regId;
+
+    GTLQueryMobilebackend *query =
+        [GTLQueryMobilebackend queryForEndpointV1ListWithObject:cbQuery];
+    query.requestID = [NSString stringWithFormat:@"topic%u",
+                          (unsigned int)[batchQuery.queries count]];
+    [batchQuery addQuery:query];
+    if (block) {
+      callbacks[query.requestID] = [block copy];
+    }
+  }
+
+  if ([batchQuery.queries count] == 0) {
+    return;
+  }
+
+  GTLServiceMobilebackend *service = [self cloudEndpointService];
+  [service executeQuery:batchQuery
+      completionHandler:^(GTLServiceTicket *ticket,
+                          GTLBatchResult *result,
+                          NSError *error) {
+          for (GTLQuery *query in batchQuery.queries) {
+            NSString *requestID = query.requestID;
+            GTLMobilebackendEntityListDto *object =
+                result.successes[requestID];
+            NSError *queryError = error;
+            if (!queryError && !object) {
+              queryError = [result.failures[requestID] foundationError];
+            }
+            if (!queryError) {
+              [_entityStore putEntities:object.entries];
+            }
+
+            [self executeWithArray:object.entries
+                       requestType:@"LIST ALL"
+                             error:queryError
+                          callback:callbacks[requestID]];
+          }
+      }];
+}
+
+// Send the list query, or join or supersede an identical one in flight
+// according to the policy.
+- (void)executeListQuery:(GTLMobilebackendQueryDto *)cbQuery
+        coalescingPolicy:(CloudQueryCoalescingPolicy)policy
+                callback:(CloudEntityCollectionQueryCompletion)block {
+  // The queries in flight and their callbacks live on the main thread, where
+  // the service calls back
+  if (![NSThread isMainThread]) {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self executeListQuery:cbQuery coalescingPolicy:policy callback:block];
+    });
+    return;
+  }
+
+  NSString *key = nil;
+  CloudEntityInFlightQuery *inFlight = nil;
+  if (policy != CloudQueryCoalescingNone) {
+    key = [cbQuery canonicalQueryKey];
+    inFlight = _inFlightQueries[key];
+  }
+
+  if (inFlight && policy == CloudQueryCoalescingShare) {
+    if (block) {
+      [inFlight.callbacks addObject:[block copy]];
+    }
+    return;
+  }
+
+  NSMutableArray *callbacks = [NSMutableArray array];
+  if (inFlight) {
+    // A cancelled ticket never calls back; its callers wait for the new one
+    [inFlight.ticket cancelTicket];
+    [callbacks addObjectsFromArray:inFlight.callbacks];
+  }
+  if (block) {
+    [callbacks addObject:[block copy]];
+  }
+
+  CloudEntityInFlightQuery *newInFlight =
+      [[CloudEntityInFlightQuery alloc] init];
+  newInFlight.callbacks = callbacks;
+
+  GTLQueryMobilebackend *query =
+      [GTLQueryMobilebackend queryForEndpointV1ListWithObject:cbQuery];
+
+  GTLServiceMobilebackend *service = [self cloudEndpointService];
+  newInFlight.ticket = [service executeQuery:query
+      completionHandler:^(GTLServiceTicket *ticket,
+                          GTLMobilebackendEntityListDto *object,
+                          NSError *error) {
+          if (key && _inFlightQueries[key] == newInFlight) {
+            [_inFlightQueries removeObjectForKey:key];
+          }
+          newInFlight.ticket = nil;
+          if (!error) {
+            [_entityStore putEntities:object.entries];
+          }
+
+          // The result array is immutable, so all callers can share it
+          [self executeWithArray:object.entries
+                     requestType:@"LIST ALL"
+                           error:error
+                        callback:^(NSArray *entities, NSError *listError) {
+              for (CloudEntityCollectionQueryCompletion callback
+                       in newInFlight.callbacks) {
+                callback(entities, listError);
+              }
+          }];
+      }];
+
+  if (key) {
+    _inFlightQueries[key] = newInFlight;
+  }
+}
+
+// List the entities of the handler's query updated after its high-water mark,
+// oldest first, and pass the merged result to the handler's callback.
+- (void)syncDeltaWithHandler:(CloudNotificationHandler *)handler {
+  GTLMobilebackendQueryDto *deltaQuery = [self deltaQueryForHandler:handler];
+  [self listCollectionWithQuery:deltaQuery
+                       callback:[self deltaCallbackForHandler:handler
+                                                        query:deltaQuery]];
+}
+
+// Return YES if the handler's query can be restricted to recently updated
+// entities.  The backend allows inequality filters on one property only and
+// requires sorting on it, so a query with an inequality on another property
+// is refreshed in full instead.
+- (BOOL)canSyncDeltaWithHandler:(CloudNotificationHandler *)handler {
+  return ![self filterDto:handler.query.filterDto
+      hasInequalityOnPropertyOtherThan:kCloudEntityFieldNameUpdatedAt];
+}
+
+- (BOOL)filterDto:(GTLMobilebackendFilterDto *)filterDto
+    hasInequalityOnPropertyOtherThan:(NSString *)property {
+  NSString *operator = filterDto.operatorProperty;
+  if ([operator isEqualToString:@"AND"] || [operator isEqualToString:@"OR"]) {
+    for (GTLMobilebackendFilterDto *subfilter in filterDto.subfilters) {
+      if ([self filterDto:subfilter
+              hasInequalityOnPropertyOtherThan:property]) {
+        return YES;
+      }
+    }
+    return NO;
+  }
+
+  static NSSet *inequalityOperators;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    inequalityOperators = [NSSet setWithObjects:@"LT", @"LE", @"GT", @"GE",
+                                                @"NE", nil];
+  });
+  if (![inequalityOperators containsObject:operator]) {
+    return NO;
+  }
+  NSArray *values = filterDto.values;
+  return [values count] == 0 || ![values[0] isEqual:property];
+}
+
+// Return the handler's query restricted to the entities updated at or after
+// its high-water mark.  Entities written in the same timestamp as the last
+// one seen are listed again; merging drops the duplicates by identifier.
+- (GTLMobilebackendQueryDto *)deltaQueryForHandler:
+    (CloudNotificationHandler *)handler {
+  GTLMobilebackendQueryDto *deltaQuery = [handler.query copy];
+  CloudFilter *changedFilter =
+      [CloudFilter cloudFilterGe:kCloudEntityFieldNameUpdatedAt
+                           value:handler.highWaterMark];
+  if (deltaQuery.filterDto) {
+    CloudFilter *queryFilter =
+        [CloudFilter cloudFilterWithFilterDto:deltaQuery.filterDto];
+    changedFilter = [CloudFilter cloudFilterAndFilters:queryFilter,
+                                                       changedFilter, nil];
+  }
+  deltaQuery.filterDto = changedFilter.filterDto;
+
+  // The inequality filter requires sorting on the same property.  Oldest
+  // first, so a delta larger than the limit is drained by repeating.
+  deltaQuery.sortedPropertyName = kCloudEntityFieldNameUpdatedAt;
+  deltaQuery.sortAscending = @(YES);
+  return deltaQuery;
+}
+
+// Return a callback which merges the result of a delta query into the
+// handler's result, and syncs again while the delta fills the query limit.
+- (CloudEntityCollectionQueryCompletion)deltaCallbackForHandler:
+    (CloudNotificationHandler *)handler
+    query:(GTLMobilebackendQueryDto *)deltaQuery {
+  return ^(NSArray *entities, NSError *error) {
+      if (error) {
+        if (handler.callback) {
+          handler.callback(handler.results, error);
+        }
+        return;
+      }
+
+      NSDate *previousHighWaterMark = handler.highWaterMark;
+      [self mergeEntities:entities intoHandler:handler];
+
+      NSInteger limit = [deltaQuery.limit integerValue];
+      if (limit > 0 && (NSInteger)[entities count] >= limit) {
+        if ([handler.highWaterMark isEqualToDate:previousHighWaterMark]) {
+          // A full page in one timestamp; repeating would list it again
+          [self listCollectionWithQuery:handler.query
+                               callback:[self mergingCallbackForHandler:
+                                             handler]];
+        } else {
+          [self syncDeltaWithHandler:handler];
+        }
+        return;
+      }
+
+      if (handler.callback) {
+        handler.callback(handler.results, nil);
+      }
+  };
+}
+
+// Return a callback which makes a full result the handler's result before
+// passing it on to the handler's callback.
+- (CloudEntityCollectionQueryCompletion)mergingCallbackForHandler:
+    (CloudNotificationHandler *)handler {
+  return ^(NSArray *entities, NSError *error) {
+      if (!error) {
+        handler.results = nil;
+        [self mergeEntities:entities intoHandler:handler];
+      }
+      if (handler.callback) {
+        handler.callback(handler.results, error);
+      }
+  };
+}
+
+// Merge entities into the handler's result by identifier, keep the result in
+// query order and within the query limit, and raise the high-water mark.
+- (void)mergeEntities:(NSArray *)entities
+          intoHandler:(CloudNotificationHandler *)handler {
+  // Key is identifier as NSString, object is CloudEntity
+  NSMutableDictionary *entitiesByID = [NSMutableDictionary dictionary];
+  for (CloudEntity *entity in handler.results) {
+    entitiesByID[entity.identifier] = entity;
+  }
+
+  NSDate *highWaterMark = handler.highWaterMark;
+  for (CloudEntity *entity in entities) {
+    entitiesByID[entity.identifier] = entity;
+
+    NSDate *updatedAt = entity.updatedAtUTC;
+    if (updatedAt && (!highWaterMark ||
+                      [updatedAt compare:highWaterMark] ==
+                          NSOrderedDescending)) {
+      highWaterMark = updatedAt;
+    }
+  }
+
+  GTLMobilebackendQueryDto *query = handler.query;
+  NSString *property = query.sortedPropertyName ?
+      query.sortedPropertyName : kCloudEntityFieldNameUpdatedAt;
+  NSComparator comparator =
+      [CloudEntity comparatorForFieldName:property
+                                ascending:[query.sortAscending boolValue]];
+  NSArray *results =
+      [[entitiesByID allValues] sortedArrayUsingComparator:comparator];
+
+  NSInteger limit = [query.limit integerValue];
+  if (limit > 0 && (NSInteger)[results count] > limit) {
+    results = [results subarrayWithRange:NSMakeRange(0, limit)];
+  }
+
+  handler.results = results;
+  handler.highWaterMark = highWaterMark;
+}
+
+// List the entities for the page after the cursor, without trimming them.
+- (void)fetchPageAfterCursor:(CloudEntityCursor *)cursor
+                    callback:(CloudEntityCollectionQueryCompletion)block {
+  GTLQueryMobilebackend *query = [GTLQueryMobilebackend
+      queryForEndpointV1ListWithObject:[cursor queryForNextPage]];
+
+  GTLServiceMobilebackend *service = [self cloudEndpointService];
+  [service executeQuery:query
+      completionHandler:^(GTLServiceTicket *ticket,
+                          GTLMobilebackendEntityListDto *object,
+                          NSError *error) {
+          if (!error) {
+            [_entityStore putEntities:object.entries];
+          }
+          [self executeWithArray:object.entries
+                     requestType:@"LIST PAGE"
+                           error:error
+                        callback:block];
+      }];
+}
+
+// Deliver a page and start prefetching the one after it.
+- (void)completePageWithCursor:(CloudEntityCursor *)cursor
+                      entities:(NSArray *)entities
+                         error:(NSError *)error
+                      callback:(CloudEntityCollectionPageCompletion)block {
+  if (error) {
+    if (block) {
+      block(nil, cursor, error);
+    }
+    return;
+  }
+
+  NSArray *page = nil;
+  CloudEntityCursor *nextCursor = [cursor cursorAfterEntities:entities
+                                                          page:&page];
+
+  if (nextCursor.prefetchesNextPage && !nextCursor.isExhausted) {
+    [nextCursor beginPrefetch];
+    [self fetchPageAfterCursor:nextCursor
+                      callback:^(NSArray *nextEntities, NSError *nextError) {
+        [nextCursor finishPrefetchWithEntities:nextEntities error:nextError];
+    }];
+  }
+
+  if (block) {
+    block(page, nextCursor, nil);
+  }
+}
+
 - (void)executeWithArray:(NSArray *)array
              requestType:(NSString *)requestType
                    error:(NSError *)error
@@ -293,17 +1117,10 @@ static CloudEntityCollection *singleton;
   return list;
 }
 
-// Input array of GTLMobilebackendEntityDto
+// Input array of GTLMobilebackendEntityDto.  CloudEntity objects are created
+// as the caller accesses them.
 - (NSArray *)convertToCloudEntityArray:(NSArray *)array {
-  NSMutableArray *resultArray = [NSMutableArray array];
-
-  CloudEntity *entity = nil;
-  for (GTLMobilebackendEntityDto *object in array) {
-    entity = [CloudEntity entityWithRawObject:object];
-    [resultArray addObject:entity];
-  }
-
-  return resultArray;
+  return [[CloudEntityLazyArray alloc] initWithRawObjects:array];
 }
 
 #pragma mark - Private methods
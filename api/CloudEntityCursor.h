@@ -0,0 +1,59 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "GTLMobilebackendQueryDto.h"
+
+// Opaque continuation point of a paginated listing.  A cursor remembers the
+// sort property value of the last entity delivered and the identifiers of the
+// delivered entities sharing that value, so the next page starts right after
+// them without relying on offsets.  Cursors are immutable from the caller's
+// point of view; every page comes with a new cursor for the page after it.
+@interface CloudEntityCursor : NSObject
+
+// YES when no entity follows the last page.
+@property(nonatomic, readonly) BOOL isExhausted;
+// YES when the page after this cursor is fetched while the current one is
+// being delivered.
+@property(nonatomic, readonly) BOOL prefetchesNextPage;
+
+// Create the cursor for the first page of the query.  The limit of the query
+// is used as page size and its sort property and order define the page order;
+// the query is listed with PAST scope.
++ (CloudEntityCursor *)cursorWithQuery:(GTLMobilebackendQueryDto *)query
+                      prefetchNextPage:(BOOL)prefetch;
+
+// The following methods are used by CloudEntityCollection to run the listing.
+
+// Return the list query for the page after this cursor.
+- (GTLMobilebackendQueryDto *)queryForNextPage;
+
+// Return the cursor following the page made of the given CloudEntity array,
+// which is the response to queryForNextPage.  The page itself, without the
+// entities delivered before, is returned via page.
+- (CloudEntityCursor *)cursorAfterEntities:(NSArray *)entities
+                                      page:(NSArray **)page;
+
+// Mark that the page after this cursor is being prefetched.
+- (void)beginPrefetch;
+
+// Store the prefetched response, or hand it over to a waiting delivery.
+- (void)finishPrefetchWithEntities:(NSArray *)entities error:(NSError *)error;
+
+// Deliver the prefetched response to the block once it is available.  Return
+// NO if no prefetch was started, in which case the block is not called.
+- (BOOL)deliverPrefetchedEntitiesTo:(void (^)(NSArray *, NSError *))block;
+
+@end
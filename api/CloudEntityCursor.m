@@ -0,0 +1,191 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity.h"
+#import "CloudEntityCursor.h"
+#import "CloudFilter.h"
+#import "GTLMobilebackendQueryDto+Helper.h"
+
+typedef enum { CursorPrefetchNone, CursorPrefetchRunning,
+  CursorPrefetchFinished } CursorPrefetchState;
+
+@interface CloudEntityCursor() {
+  // Query of the first page; shared by all cursors of a listing
+  GTLMobilebackendQueryDto *_query;
+  NSInteger _pageSize;
+  // Sort property value of the last delivered entity, nil before the first
+  // page
+  id _lastSortValue;
+  // Identifiers of the delivered entities whose sort property value equals
+  // _lastSortValue
+  NSSet *_identifiersAtLastSortValue;
+
+  CursorPrefetchState _prefetchState;
+  NSArray *_prefetchedEntities;
+  NSError *_prefetchError;
+  void (^_prefetchDelivery)(NSArray *, NSError *);
+}
+@end
+
+
+@implementation CloudEntityCursor
+
+// Page size used when the query has no limit, the same as listCollection
+static const NSInteger kCloudEntityCursorDefaultPageSize = 100;
+
++ (CloudEntityCursor *)cursorWithQuery:(GTLMobilebackendQueryDto *)query
+                      prefetchNextPage:(BOOL)prefetch {
+  GTLMobilebackendQueryDto *pageQuery = [query copy];
+  pageQuery.scope = kCloudEntityScopePast;
+  pageQuery.queryId = nil;
+  pageQuery.regId = nil;
+
+  // Paging needs a total order
+  if (!pageQuery.sortedPropertyName) {
+    pageQuery.sortedPropertyName = kCloudEntityFieldNameUpdatedAt;
+  }
+  if (!pageQuery.sortAscending) {
+    pageQuery.sortAscending = @(NO);
+  }
+
+  CloudEntityCursor *cursor = [[CloudEntityCursor alloc] init];
+  cursor->_query = pageQuery;
+  cursor->_pageSize = [query.limit integerValue] > 0 ?
+      [query.limit integerValue] : kCloudEntityCursorDefaultPageSize;
+  cursor->_prefetchesNextPage = prefetch;
+  cursor->_identifiersAtLastSortValue = [NSSet set];
+  return cursor;
+}
+
+- (GTLMobilebackendQueryDto *)queryForNextPage {
+  GTLMobilebackendQueryDto *query = [_query copy];
+
+  // Ask for the entities delivered at the last sort value again, since the
+  // filter includes that value, and drop them from the response.
+  NSInteger limit = _pageSize + [_identifiersAtLastSortValue count];
+  query.limit = @(limit);
+
+  if (_lastSortValue) {
+    NSString *property = _query.sortedPropertyName;
+    CloudFilter *pageFilter = [_query.sortAscending boolValue] ?
+        [CloudFilter cloudFilterGe:property value:_lastSortValue] :
+        [CloudFilter cloudFilterLe:property value:_lastSortValue];
+
+    if (_query.filterDto) {
+      CloudFilter *queryFilter =
+          [CloudFilter cloudFilterWithFilterDto:_query.filterDto];
+      pageFilter = [CloudFilter cloudFilterAndFilters:queryFilter,
+                                                      pageFilter, nil];
+    }
+    query.filterDto = pageFilter.filterDto;
+  }
+
+  return query;
+}
+
+- (CloudEntityCursor *)cursorAfterEntities:(NSArray *)entities
+                                      page:(NSArray **)page {
+  NSString *property = _query.sortedPropertyName;
+  NSMutableArray *pageEntities = [NSMutableArray arrayWithCapacity:_pageSize];
+  id lastSortValue = _lastSortValue;
+  NSMutableSet *identifiers = [_identifiersAtLastSortValue mutableCopy];
+
+  for (CloudEntity *entity in entities) {
+    if ((NSInteger)[pageEntities count] == _pageSize) {
+      break;
+    }
+
+    id sortValue = [entity valueForFieldName:property];
+    BOOL isAtLastSortValue = [sortValue isEqual:lastSortValue];
+    if (isAtLastSortValue &&
+        [_identifiersAtLastSortValue containsObject:entity.identifier]) {
+      continue;
+    }
+
+    if (!isAtLastSortValue) {
+      lastSortValue = sortValue;
+      [identifiers removeAllObjects];
+    }
+    [identifiers addObject:entity.identifier];
+    [pageEntities addObject:entity];
+  }
+
+  CloudEntityCursor *cursor = [[CloudEntityCursor alloc] init];
+  cursor->_query = _query;
+  cursor->_pageSize = _pageSize;
+  cursor->_prefetchesNextPage = _prefetchesNextPage;
+  cursor->_lastSortValue = lastSortValue;
+  cursor->_identifiersAtLastSortValue = identifiers;
+
+  // A short response means the backend ran out of entities.  Entities without
+  // the sort property cannot be continued from either.
+  NSInteger requested = _pageSize + [_identifiersAtLastSortValue count];
+  cursor->_isExhausted = ((NSInteger)[entities count] < requested) ||
+      ([pageEntities count] > 0 && !lastSortValue);
+
+  if (page) {
+    *page = pageEntities;
+  }
+  return cursor;
+}
+
+#pragma mark - Prefetch
+
+- (void)beginPrefetch {
+  _prefetchState = CursorPrefetchRunning;
+}
+
+- (void)finishPrefetchWithEntities:(NSArray *)entities error:(NSError *)error {
+  if (_prefetchDelivery) {
+    void (^delivery)(NSArray *, NSError *) = _prefetchDelivery;
+    _prefetchDelivery = nil;
+    _prefetchState = CursorPrefetchNone;
+    delivery(entities, error);
+    return;
+  }
+
+  // A failed prefetch is dropped so that the page is fetched again on demand
+  if (error) {
+    _prefetchState = CursorPrefetchNone;
+    return;
+  }
+
+  _prefetchState = CursorPrefetchFinished;
+  _prefetchedEntities = entities;
+  _prefetchError = error;
+}
+
+- (BOOL)deliverPrefetchedEntitiesTo:(void (^)(NSArray *, NSError *))block {
+  switch (_prefetchState) {
+    case CursorPrefetchRunning:
+      _prefetchDelivery = [block copy];
+      return YES;
+
+    case CursorPrefetchFinished: {
+      NSArray *entities = _prefetchedEntities;
+      NSError *error = _prefetchError;
+      _prefetchedEntities = nil;
+      _prefetchError = nil;
+      _prefetchState = CursorPrefetchNone;
+      block(entities, error);
+      return YES;
+    }
+
+    default:
+      return NO;
+  }
+}
+
+@end
@@ -0,0 +1,54 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+
+// Hands out one CloudEntity per kind name and identifier, so that every
+// response naming an entity yields the instance the application already
+// holds.  A response with a newer _updatedAt than the instance is bound into
+// it in place, on the main thread; an older or equally old one leaves it as it
+// is.  So does any response while the instance has unsaved edits; one that
+// arrives while a write of the instance is in flight is bound once the write
+// ends, unless the instance has newer or unsaved state by then.  Instances are
+// held weakly and forgotten once nothing else holds them.
+// Thread-safe.
+@interface CloudEntityIdentityMap : NSObject
+
+// Shared instance for GTMObject Singleton Boilerplate
++ (CloudEntityIdentityMap *)sharedInstance;
+
+// Return the instance for the kind name and identifier of the raw object,
+// creating it if needed.  A raw object without both gets an instance of its
+// own.
+- (CloudEntity *)entityWithRawObject:(GTLMobilebackendEntityDto *)rawObject;
+
+// Return the instance held for the kind name and identifier, or nil.
+- (CloudEntity *)entityWithKind:(NSString *)kindName
+                     identifier:(NSString *)identifier;
+
+// Make the entity the instance held for its kind name and identifier, in
+// place of any held before.  Used to keep a locally created entity once its
+// insert has given it an identifier.
+- (void)adoptEntity:(CloudEntity *)entity;
+
+// Mark a write of the entity in flight, so that responses do not replace its
+// state until the write ends.  Calls nest.  Used on the main thread.
+- (void)beginWriteOfEntity:(CloudEntity *)entity;
+
+// End a write begun with beginWriteOfEntity:.
+- (void)endWriteOfEntity:(CloudEntity *)entity;
+
+@end
@@ -0,0 +1,207 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity+Private.h"
+#import "CloudEntityIdentityMap.h"
+
+@interface CloudEntityIdentityMap() {
+  // Key is kind name as NSString, object is NSMapTable of identifier to a
+  // weakly held CloudEntity.
+  NSMutableDictionary *_entitiesByKind;
+  // Entities with writes in flight, compared by identity, and the number of
+  // writes as NSNumber.
+  NSMapTable *_writeCountsByEntity;
+  // Newest raw object that arrived for an entity during its writes.
+  NSMapTable *_deferredObjectsByEntity;
+}
+@end
+
+
+@implementation CloudEntityIdentityMap
+
+static CloudEntityIdentityMap *singleton;
+
++ (CloudEntityIdentityMap *)sharedInstance {
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    singleton = [[CloudEntityIdentityMap alloc] init];
+  });
+
+  return singleton;
+}
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    _entitiesByKind = [NSMutableDictionary dictionary];
+    _writeCountsByEntity = [NSMapTable
+        mapTableWithKeyOptions:(NSPointerFunctionsStrongMemory |
+                                NSPointerFunctionsObjectPointerPersonality)
+                  valueOptions:NSPointerFunctionsStrongMemory];
+    _deferredObjectsByEntity = [NSMapTable
+        mapTableWithKeyOptions:(NSPointerFunctionsStrongMemory |
+                                NSPointerFunctionsObjectPointerPersonality)
+                  valueOptions:NSPointerFunctionsStrongMemory];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (CloudEntity *)entityWithRawObject:(GTLMobilebackendEntityDto *)rawObject {
+  NSString *kindName = rawObject.kindName;
+  NSString *identifier = rawObject.identifier;
+  if (!kindName || !identifier) {
+    return [CloudEntity entityWithRawObject:rawObject];
+  }
+
+  @synchronized(self) {
+    NSMapTable *entities = _entitiesByKind[kindName];
+    if (!entities) {
+      entities = [NSMapTable strongToWeakObjectsMapTable];
+      _entitiesByKind[kindName] = entities;
+    }
+
+    CloudEntity *entity = [entities objectForKey:identifier];
+    if (!entity) {
+      entity = [CloudEntity entityWithRawObject:rawObject];
+      [entities setObject:entity forKey:identifier];
+      return entity;
+    }
+
+    [self rebindEntity:entity toRawObject:rawObject];
+    return entity;
+  }
+}
+
+- (CloudEntity *)entityWithKind:(NSString *)kindName
+                     identifier:(NSString *)identifier {
+  if (!kindName || !identifier) {
+    return nil;
+  }
+
+  @synchronized(self) {
+    return [_entitiesByKind[kindName] objectForKey:identifier];
+  }
+}
+
+- (void)adoptEntity:(CloudEntity *)entity {
+  NSString *kindName = entity.kindName;
+  NSString *identifier = entity.innerObject.identifier;
+  if (!kindName || !identifier) {
+    return;
+  }
+
+  @synchronized(self) {
+    NSMapTable *entities = _entitiesByKind[kindName];
+    if (!entities) {
+      entities = [NSMapTable strongToWeakObjectsMapTable];
+      _entitiesByKind[kindName] = entities;
+    }
+    [entities setObject:entity forKey:identifier];
+  }
+}
+
+- (void)beginWriteOfEntity:(CloudEntity *)entity {
+  if (!entity) {
+    return;
+  }
+
+  @synchronized(self) {
+    NSUInteger count =
+        [[_writeCountsByEntity objectForKey:entity] unsignedIntegerValue];
+    [_writeCountsByEntity setObject:@(count + 1) forKey:entity];
+  }
+}
+
+- (void)endWriteOfEntity:(CloudEntity *)entity {
+  if (!entity) {
+    return;
+  }
+
+  @synchronized(self) {
+    NSUInteger count =
+        [[_writeCountsByEntity objectForKey:entity] unsignedIntegerValue];
+    if (count > 1) {
+      [_writeCountsByEntity setObject:@(count - 1) forKey:entity];
+      return;
+    }
+    [_writeCountsByEntity removeObjectForKey:entity];
+
+    // Bind what the backend answered meanwhile, e.g. the write's own response
+    GTLMobilebackendEntityDto *rawObject =
+        [_deferredObjectsByEntity objectForKey:entity];
+    if (rawObject) {
+      [_deferredObjectsByEntity removeObjectForKey:entity];
+      [self rebindEntity:entity toRawObject:rawObject];
+    }
+  }
+}
+
+#pragma mark - Private methods
+
+// Bind a newer raw object into the held entity on the main thread, where the
+// application reads it.  Off the main thread the entity is rebound later, if
+// the raw object is still newer by then.
+- (void)rebindEntity:(CloudEntity *)entity
+         toRawObject:(GTLMobilebackendEntityDto *)rawObject {
+  if (![NSThread isMainThread]) {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        @synchronized(self) {
+          [self rebindEntity:entity toRawObject:rawObject];
+        }
+    });
+    return;
+  }
+
+  if (entity.innerObject == rawObject ||
+      ![self isRawObject:rawObject newerThanEntity:entity]) {
+    return;
+  }
+
+  // Keep the state a write in flight may roll back to until it ends
+  if ([_writeCountsByEntity objectForKey:entity]) {
+    GTLMobilebackendEntityDto *deferred =
+        [_deferredObjectsByEntity objectForKey:entity];
+    NSDate *deferredUpdatedAt = deferred.updatedAt.date;
+    if (!deferred || (deferredUpdatedAt &&
+        [rawObject.updatedAt.date compare:deferredUpdatedAt] ==
+            NSOrderedDescending)) {
+      [_deferredObjectsByEntity setObject:rawObject forKey:entity];
+    }
+    return;
+  }
+
+  // Keep unsaved edits
+  if ([[entity dirtyPropertyNames] count]) {
+    return;
+  }
+
+  [entity rebindToRawObject:rawObject];
+}
+
+- (BOOL)isRawObject:(GTLMobilebackendEntityDto *)rawObject
+    newerThanEntity:(CloudEntity *)entity {
+  NSDate *updatedAt = rawObject.updatedAt.date;
+  NSDate *entityUpdatedAt = entity.updatedAtUTC;
+  if (!updatedAt) {
+    return NO;
+  }
+  return !entityUpdatedAt ||
+      [updatedAt compare:entityUpdatedAt] == NSOrderedDescending;
+}
+
+@end
@@ -0,0 +1,73 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+#import "CloudEntityStore.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Secondary indexes over the entities of one kind held by an entity store.
+// A hash index maps the value of a field to its entities and answers EQ and
+// IN filters; an ordered index keeps the entities sorted by a field and
+// answers range filters and sorting by the field.  Field names are the backend
+// names accepted by -[CloudEntity valueForFieldName:], so system fields such as
+// kCloudEntityFieldNameCreatedAt and kCloudEntityFieldNameOwner can be indexed
+// as well as properties.
+// Values are indexed the way the backend compares them: dates, whether held
+// as RFC 3339 strings or NSDate, as dates, values of different types apart,
+// and a list by each of its elements.  Entities without the field are not
+// indexed.
+// The indexes follow the store: every entity written to or removed from it,
+// by a list, insert, update or delete response, updates them incrementally.
+@interface CloudEntityIndex : NSObject
+
+@property(nonatomic, readonly, copy) NSString *kindName;
+
+// Index the entities of a kind held by the store.  No field is indexed until
+// one is added.
+- (id)initWithKindName:(NSString *)kindName store:(CloudEntityStore *)store;
+
+// Add a hash index on a field name.  Does nothing if one exists.
+- (void)addHashIndexForFieldName:(NSString *)name;
+
+// Add an ordered index on a field name.  Does nothing if one exists.
+- (void)addOrderedIndexForFieldName:(NSString *)name;
+
+// Number of entities of the kind.
+- (NSUInteger)count;
+
+// Return the entities whose field equals one of the values, using the hash or
+// ordered index of the field.  Return nil if the field is not indexed.
+- (NSArray *)entitiesWithFieldName:(NSString *)name inValues:(NSArray *)values;
+
+// Return the entities whose field lies between the bounds in field order,
+// using the ordered index of the field.  A nil bound leaves the range open on
+// that side; values of a type other than the bounds' are out of range.
+// Return nil if the field has no ordered index.
+- (NSArray *)entitiesWithFieldName:(NSString *)name
+                        lowerBound:(id)lowerBound
+                         inclusive:(BOOL)isLowerInclusive
+                        upperBound:(id)upperBound
+                         inclusive:(BOOL)isUpperInclusive
+                         ascending:(BOOL)isAscending;
+
+// Answer a query for the kind the way
+// +[CloudFilterEvaluator resultOfQuery:withEntities:] does, but only evaluate
+// the filter on the entities an index selects: the smallest candidate set of
+// an indexed EQ, IN or range filter, or the ordered index of the sort field
+// walked up to the query limit.  Falls back to a full scan otherwise.
+- (NSArray *)resultOfQuery:(GTLMobilebackendQueryDto *)query;
+
+@end
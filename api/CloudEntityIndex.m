@@ -0,0 +1,659 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity+Private.h"
+#import "CloudEntityIndex.h"
+#import "CloudFilterEvaluator.h"
+#import "GTLMobilebackendFilterDto.h"
+
+// Return a value in the form it is indexed in: dates, which entities hold as
+// RFC 3339 strings and filters as GTLDateTime, become NSDate, so that they
+// compare as dates whatever their time zone offset.
+static id IndexKeyOfValue(id value, CloudFilterValueRank rank) {
+  return rank == CloudFilterValueRankDate
+      ? [CloudFilterEvaluator dateFromValue:value] : value;
+}
+
+// Return YES if the values of a rank have an order of their own.
+static BOOL IsRankOrdered(CloudFilterValueRank rank) {
+  return rank != CloudFilterValueRankNull && rank != CloudFilterValueRankOther;
+}
+
+// Entry of an ordered index.
+@interface CloudEntityIndexEntry : NSObject
+@property(nonatomic) CloudFilterValueRank rank;
+@property(nonatomic, strong) id value;
+@property(nonatomic, copy) NSString *identifier;
+@end
+
+@implementation CloudEntityIndexEntry
+
++ (CloudEntityIndexEntry *)entryWithValue:(id)value
+                               identifier:(NSString *)identifier {
+  CloudEntityIndexEntry *entry = [[CloudEntityIndexEntry alloc] init];
+  entry.rank = [CloudFilterEvaluator rankOfValue:value];
+  entry.value = value;
+  entry.identifier = identifier;
+  return entry;
+}
+
+// Order by rank, value and identifier, as the backend sorts values.
+- (NSComparisonResult)compare:(CloudEntityIndexEntry *)other {
+  if (_rank != other.rank) {
+    return _rank < other.rank ? NSOrderedAscending : NSOrderedDescending;
+  }
+  NSComparisonResult result =
+      IsRankOrdered(_rank) ? [_value compare:other.value] : NSOrderedSame;
+  if (result == NSOrderedSame) {
+    result = [_identifier compare:other.identifier];
+  }
+  return result;
+}
+
+@end
+
+// Return the first index of the sorted entries for which isBefore is NO.
+static NSUInteger PartitionPoint(NSArray *entries,
+                                 BOOL (^isBefore)(CloudEntityIndexEntry *)) {
+  NSUInteger low = 0;
+  NSUInteger high = [entries count];
+  while (low < high) {
+    NSUInteger middle = low + (high - low) / 2;
+    if (isBefore(entries[middle])) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+
+@interface CloudEntityIndex() {
+  CloudEntityStore *_store;
+  // Key is identifier as NSString, object is CloudEntity.
+  NSMutableDictionary *_entities;
+  // Key is indexed field name as NSString, object is NSMutableDictionary
+  // which maps identifier to the NSArray of distinct values the entity was
+  // indexed with: one value, every element of a list, or none if the field
+  // is missing.
+  NSMutableDictionary *_indexedValues;
+  // Key is field name as NSString, object is NSMutableDictionary which maps
+  // a CloudFilterValueRank as NSNumber to an NSMutableDictionary of the values
+  // of that type, each mapped to the NSMutableSet of identifiers having it.
+  // Values are kept apart by type, as equal NSNumbers such as true and 1 are
+  // different values to the backend.
+  NSMutableDictionary *_hashIndexes;
+  // Key is field name as NSString, object is NSMutableArray of
+  // CloudEntityIndexEntry in ascending order.
+  NSMutableDictionary *_orderedIndexes;
+}
+@end
+
+
+@implementation CloudEntityIndex
+
+- (id)initWithKindName:(NSString *)kindName store:(CloudEntityStore *)store {
+  self = [super init];
+  if (self) {
+    _kindName = [kindName copy];
+    _store = store;
+    _entities = [NSMutableDictionary dictionary];
+    _indexedValues = [NSMutableDictionary dictionary];
+    _hashIndexes = [NSMutableDictionary dictionary];
+    _orderedIndexes = [NSMutableDictionary dictionary];
+
+    @synchronized(self) {
+      [[NSNotificationCenter defaultCenter]
+          addObserver:self
+             selector:@selector(storeDidChange:)
+                 name:kCloudEntityStoreDidChangeNotification
+               object:_store];
+      for (GTLMobilebackendEntityDto *object in
+           [_store entitiesWithKind:_kindName]) {
+        [self addEntity:[CloudEntity entityWithRawObject:object]];
+      }
+    }
+  }
+
+  return self;
+}
+
+- (void)dealloc {
+  [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+#pragma mark - Public methods
+
+- (void)addHashIndexForFieldName:(NSString *)name {
+  @synchronized(self) {
+    if (_hashIndexes[name]) {
+      return;
+    }
+
+    NSMutableDictionary *hashIndex = [NSMutableDictionary dictionary];
+    NSDictionary *values = [self indexedValuesForFieldName:name];
+    for (NSString *identifier in values) {
+      [self insertIdentifier:identifier
+                      values:values[identifier]
+               intoHashIndex:hashIndex];
+    }
+    _hashIndexes[name] = hashIndex;
+  }
+}
+
+- (void)addOrderedIndexForFieldName:(NSString *)name {
+  @synchronized(self) {
+    if (_orderedIndexes[name]) {
+      return;
+    }
+
+    NSMutableArray *orderedIndex = [NSMutableArray array];
+    NSDictionary *values = [self indexedValuesForFieldName:name];
+    for (NSString *identifier in values) {
+      for (id value in values[identifier]) {
+        [orderedIndex addObject:
+            [CloudEntityIndexEntry entryWithValue:value
+                                       identifier:identifier]];
+      }
+    }
+    [orderedIndex sortUsingSelector:@selector(compare:)];
+    _orderedIndexes[name] = orderedIndex;
+  }
+}
+
+- (NSUInteger)count {
+  @synchronized(self) {
+    return [_entities count];
+  }
+}
+
+- (NSArray *)entitiesWithFieldName:(NSString *)name inValues:(NSArray *)values {
+  @synchronized(self) {
+    NSSet *identifiers = [self identifiersWithFieldName:name inValues:values];
+    if (!identifiers) {
+      return nil;
+    }
+    return [self entitiesWithIdentifiers:identifiers];
+  }
+}
+
+- (NSArray *)entitiesWithFieldName:(NSString *)name
+                        lowerBound:(id)lowerBound
+                         inclusive:(BOOL)isLowerInclusive
+                        upperBound:(id)upperBound
+                         inclusive:(BOOL)isUpperInclusive
+                         ascending:(BOOL)isAscending {
+  @synchronized(self) {
+    NSArray *entries = [self entriesWithFieldName:name
+                                       lowerBound:lowerBound
+                                        inclusive:isLowerInclusive
+                                       upperBound:upperBound
+                                        inclusive:isUpperInclusive];
+    if (!entries) {
+      return nil;
+    }
+
+    // An entity with a list value has an entry per element; it takes the
+    // place of the first one, its smallest or largest element in range
+    NSMutableArray *entities =
+        [NSMutableArray arrayWithCapacity:[entries count]];
+    NSMutableSet *seen = [NSMutableSet setWithCapacity:[entries count]];
+    NSEnumerator *enumerator = isAscending ? [entries objectEnumerator]
+                                           : [entries reverseObjectEnumerator];
+    for (CloudEntityIndexEntry *entry in enumerator) {
+      if (![seen containsObject:entry.identifier]) {
+        [seen addObject:entry.identifier];
+        [entities addObject:_entities[entry.identifier]];
+      }
+    }
+    return entities;
+  }
+}
+
+- (NSArray *)resultOfQuery:(GTLMobilebackendQueryDto *)query {
+  if (query.kindName && ![query.kindName isEqualToString:_kindName]) {
+    return @[];
+  }
+
+  NSString *sortName = query.sortedPropertyName;
+  NSArray *candidates = nil;
+  @synchronized(self) {
+    NSSet *identifiers = [self identifiersForFilterDto:query.filterDto];
+    if (identifiers) {
+      candidates = [self entitiesWithIdentifiers:identifiers];
+    } else if (sortName && _orderedIndexes[sortName]) {
+      return [self resultOfQuery:query
+          walkingOrderedIndexForFieldName:sortName];
+    } else {
+      candidates = [_entities allValues];
+    }
+  }
+
+  return [CloudFilterEvaluator resultOfQuery:query withEntities:candidates];
+}
+
+#pragma mark - Private methods
+
+- (void)storeDidChange:(NSNotification *)notification {
+  NSDictionary *userInfo = [notification userInfo];
+  @synchronized(self) {
+    if (userInfo[kCloudEntityStoreRemovedAllKey]) {
+      [self removeAllEntities];
+      return;
+    }
+
+    for (GTLMobilebackendEntityDto *object in
+         userInfo[kCloudEntityStoreRemovedEntitiesKey]) {
+      if ([object.kindName isEqualToString:_kindName]) {
+        [self removeEntityWithIdentifier:object.identifier];
+      }
+    }
+    // Index a copy, which the application cannot change behind the index
+    for (GTLMobilebackendEntityDto *object in
+         userInfo[kCloudEntityStorePutEntitiesKey]) {
+      if ([object.kindName isEqualToString:_kindName]) {
+        [self addEntity:[CloudEntity entityWithRawObject:
+                            [CloudEntity deepCopyOfRawObject:object]]];
+      }
+    }
+  }
+}
+
+- (void)addEntity:(CloudEntity *)entity {
+  NSString *identifier = entity.identifier;
+  if (!identifier) {
+    return;
+  }
+
+  [self removeEntityWithIdentifier:identifier];
+  _entities[identifier] = entity;
+  for (NSString *name in _indexedValues) {
+    NSArray *values = [self indexedValuesOfEntity:entity fieldName:name];
+    _indexedValues[name][identifier] = values;
+    [self insertIdentifier:identifier
+                    values:values
+             intoHashIndex:_hashIndexes[name]];
+    [self insertIdentifier:identifier
+                    values:values
+          intoOrderedIndex:_orderedIndexes[name]];
+  }
+}
+
+- (void)removeEntityWithIdentifier:(NSString *)identifier {
+  if (!identifier || !_entities[identifier]) {
+    return;
+  }
+
+  for (NSString *name in _indexedValues) {
+    NSMutableDictionary *values = _indexedValues[name];
+    NSArray *entityValues = values[identifier];
+    [self removeIdentifier:identifier
+                    values:entityValues
+             fromHashIndex:_hashIndexes[name]];
+    [self removeIdentifier:identifier
+                    values:entityValues
+          fromOrderedIndex:_orderedIndexes[name]];
+    [values removeObjectForKey:identifier];
+  }
+  [_entities removeObjectForKey:identifier];
+}
+
+- (void)removeAllEntities {
+  [_entities removeAllObjects];
+  for (NSString *name in _indexedValues) {
+    [_indexedValues[name] removeAllObjects];
+    [_hashIndexes[name] removeAllObjects];
+    [_orderedIndexes[name] removeAllObjects];
+  }
+}
+
+// Return the distinct values of a field of the entity in their indexed form.
+// A list is indexed by its elements, as the backend matches any of them.
+- (NSArray *)indexedValuesOfEntity:(CloudEntity *)entity
+                         fieldName:(NSString *)name {
+  id value = [entity valueForFieldName:name];
+  if (!value) {
+    return @[];
+  }
+
+  NSArray *elements =
+      [value isKindOfClass:[NSArray class]] ? value : @[ value ];
+  NSMutableArray *values = [NSMutableArray arrayWithCapacity:[elements count]];
+  for (id element in elements) {
+    CloudFilterValueRank rank = [CloudFilterEvaluator rankOfValue:element];
+    id key = IndexKeyOfValue(element, rank);
+    BOOL isDuplicate = NO;
+    for (id other in values) {
+      if ([CloudFilterEvaluator rankOfValue:other] == rank &&
+          (!IsRankOrdered(rank) || [other isEqual:key])) {
+        isDuplicate = YES;
+        break;
+      }
+    }
+    if (!isDuplicate) {
+      [values addObject:key];
+    }
+  }
+  return values;
+}
+
+// Return the indexed values of a field, working them out on first use.
+- (NSDictionary *)indexedValuesForFieldName:(NSString *)name {
+  NSMutableDictionary *values = _indexedValues[name];
+  if (!values) {
+    values = [NSMutableDictionary dictionaryWithCapacity:[_entities count]];
+    for (NSString *identifier in _entities) {
+      values[identifier] = [self indexedValuesOfEntity:_entities[identifier]
+                                             fieldName:name];
+    }
+    _indexedValues[name] = values;
+  }
+  return values;
+}
+
+- (void)insertIdentifier:(NSString *)identifier
+                  values:(NSArray *)values
+           intoHashIndex:(NSMutableDictionary *)hashIndex {
+  if (!hashIndex) {
+    return;
+  }
+
+  for (id value in values) {
+    // Arrays and dictionaries equal nothing, so they are not hashed
+    CloudFilterValueRank valueRank = [CloudFilterEvaluator rankOfValue:value];
+    if (valueRank == CloudFilterValueRankOther) {
+      continue;
+    }
+    NSNumber *rank = @(valueRank);
+    NSMutableDictionary *valuesOfRank = hashIndex[rank];
+    if (!valuesOfRank) {
+      valuesOfRank = [NSMutableDictionary dictionary];
+      hashIndex[rank] = valuesOfRank;
+    }
+    NSMutableSet *identifiers = valuesOfRank[value];
+    if (!identifiers) {
+      identifiers = [NSMutableSet set];
+      valuesOfRank[value] = identifiers;
+    }
+    [identifiers addObject:identifier];
+  }
+}
+
+- (void)removeIdentifier:(NSString *)identifier
+                  values:(NSArray *)values
+           fromHashIndex:(NSMutableDictionary *)hashIndex {
+  for (id value in values) {
+    NSMutableDictionary *valuesOfRank =
+        hashIndex[@([CloudFilterEvaluator rankOfValue:value])];
+    NSMutableSet *identifiers = valuesOfRank[value];
+    [identifiers removeObject:identifier];
+    if (identifiers && [identifiers count] == 0) {
+      [valuesOfRank removeObjectForKey:value];
+    }
+  }
+}
+
+- (void)insertIdentifier:(NSString *)identifier
+                  values:(NSArray *)values
+        intoOrderedIndex:(NSMutableArray *)orderedIndex {
+  if (!orderedIndex) {
+    return;
+  }
+
+  for (id value in values) {
+    CloudEntityIndexEntry *entry =
+        [CloudEntityIndexEntry entryWithValue:value identifier:identifier];
+    NSUInteger index = PartitionPoint(orderedIndex,
+        ^BOOL(CloudEntityIndexEntry *other) {
+            return [other compare:entry] == NSOrderedAscending;
+        });
+    [orderedIndex insertObject:entry atIndex:index];
+  }
+}
+
+- (void)removeIdentifier:(NSString *)identifier
+                  values:(NSArray *)values
+        fromOrderedIndex:(NSMutableArray *)orderedIndex {
+  if (!orderedIndex) {
+    return;
+  }
+
+  for (id value in values) {
+    CloudEntityIndexEntry *entry =
+        [CloudEntityIndexEntry entryWithValue:value identifier:identifier];
+    NSUInteger index = PartitionPoint(orderedIndex,
+        ^BOOL(CloudEntityIndexEntry *other) {
+            return [other compare:entry] == NSOrderedAscending;
+        });
+    if (index < [orderedIndex count] &&
+        [orderedIndex[index] compare:entry] == NSOrderedSame) {
+      [orderedIndex removeObjectAtIndex:index];
+    }
+  }
+}
+
+- (NSArray *)entitiesWithIdentifiers:(NSSet *)identifiers {
+  NSMutableArray *entities =
+      [NSMutableArray arrayWithCapacity:[identifiers count]];
+  for (NSString *identifier in identifiers) {
+    [entities addObject:_entities[identifier]];
+  }
+  return entities;
+}
+
+// Return the identifiers of the entities whose field equals one of the
+// values, or nil if no index of the field can tell.
+- (NSSet *)identifiersWithFieldName:(NSString *)name
+                           inValues:(NSArray *)values {
+  NSDictionary *hashIndex = _hashIndexes[name];
+  if (!hashIndex && !_orderedIndexes[name]) {
+    return nil;
+  }
+
+  NSMutableSet *identifiers = [NSMutableSet set];
+  for (id value in values) {
+    // Arrays and dictionaries equal nothing
+    CloudFilterValueRank rank = [CloudFilterEvaluator rankOfValue:value];
+    if (rank == CloudFilterValueRankOther) {
+      continue;
+    }
+
+    id key = IndexKeyOfValue(value, rank);
+    if (hashIndex) {
+      NSSet *matches = hashIndex[@(rank)][key];
+      if (matches) {
+        [identifiers unionSet:matches];
+      }
+    } else {
+      for (CloudEntityIndexEntry *entry in
+           [self entriesWithFieldName:name
+                           lowerBound:key
+                            inclusive:YES
+                           upperBound:key
+                            inclusive:YES]) {
+        [identifiers addObject:entry.identifier];
+      }
+    }
+  }
+  return identifiers;
+}
+
+// Return the entries of the ordered index of a field between the bounds, or
+// nil if the field has no ordered index.  The backend only compares values of
+// the same type, so a range holds the entries of the type of its bounds, and
+// is empty for bounds of different types or of a type without an order
+// between its values.  Without bounds the range holds every entry.
+- (NSArray *)entriesWithFieldName:(NSString *)name
+                       lowerBound:(id)lowerBound
+                        inclusive:(BOOL)isLowerInclusive
+                       upperBound:(id)upperBound
+                        inclusive:(BOOL)isUpperInclusive {
+  NSArray *orderedIndex = _orderedIndexes[name];
+  if (!orderedIndex) {
+    return nil;
+  }
+  if (!lowerBound && !upperBound) {
+    return orderedIndex;
+  }
+
+  id bound = lowerBound ? lowerBound : upperBound;
+  CloudFilterValueRank rank = [CloudFilterEvaluator rankOfValue:bound];
+  if (rank == CloudFilterValueRankOther ||
+      (lowerBound && upperBound &&
+       [CloudFilterEvaluator rankOfValue:upperBound] != rank)) {
+    return @[];
+  }
+  BOOL isOrdered = IsRankOrdered(rank);
+  id lower = lowerBound ? IndexKeyOfValue(lowerBound, rank) : nil;
+  id upper = upperBound ? IndexKeyOfValue(upperBound, rank) : nil;
+
+  // All null values are the same, so a range over them holds all or none
+  NSUInteger start = PartitionPoint(orderedIndex,
+      ^BOOL(CloudEntityIndexEntry *entry) {
+          if (entry.rank != rank) {
+            return entry.rank < rank;
+          }
+          if (!lower) {
+            return NO;
+          }
+          NSComparisonResult result =
+              isOrdered ? [entry.value compare:lower] : NSOrderedSame;
+          return isLowerInclusive ? result == NSOrderedAscending
+                                  : result != NSOrderedDescending;
+      });
+  NSUInteger end = PartitionPoint(orderedIndex,
+      ^BOOL(CloudEntityIndexEntry *entry) {
+          if (entry.rank != rank) {
+            return entry.rank < rank;
+          }
+          if (!upper) {
+            return YES;
+          }
+          NSComparisonResult result =
+              isOrdered ? [entry.value compare:upper] : NSOrderedSame;
+          return isUpperInclusive ? result != NSOrderedDescending
+                                  : result == NSOrderedAscending;
+      });
+  if (start >= end) {
+    return @[];
+  }
+  return [orderedIndex subarrayWithRange:NSMakeRange(start, end - start)];
+}
+
+// Return the identifiers of a superset of the entities matching a filter,
+// taken from the indexes, or nil if the indexes cannot narrow the filter down.
+- (NSSet *)identifiersForFilterDto:(GTLMobilebackendFilterDto *)filterDto {
+  NSString *operatorName = filterDto.operatorProperty;
+  if (!operatorName) {
+    return nil;
+  }
+
+  if ([operatorName isEqualToString:@"AND"]) {
+    // Any child will do; take the one with the fewest candidates
+    NSSet *fewest = nil;
+    for (GTLMobilebackendFilterDto *subfilter in filterDto.subfilters) {
+      NSSet *identifiers = [self identifiersForFilterDto:subfilter];
+      if (identifiers && (!fewest || [identifiers count] < [fewest count])) {
+        fewest = identifiers;
+      }
+    }
+    return fewest;
+  } else if ([operatorName isEqualToString:@"OR"]) {
+    // Every child must be narrowed down
+    NSMutableSet *all = [NSMutableSet set];
+    for (GTLMobilebackendFilterDto *subfilter in filterDto.subfilters) {
+      NSSet *identifiers = [self identifiersForFilterDto:subfilter];
+      if (!identifiers) {
+        return nil;
+      }
+      [all unionSet:identifiers];
+    }
+    return all;
+  }
+
+  NSArray *values = filterDto.values;
+  if ([values count] < 2) {
+    return nil;
+  }
+  NSString *name = values[0];
+  id value = values[1];
+
+  if ([operatorName isEqualToString:@"EQ"]) {
+    return [self identifiersWithFieldName:name inValues:@[value]];
+  } else if ([operatorName isEqualToString:@"IN"]) {
+    NSArray *operands =
+        [values subarrayWithRange:NSMakeRange(1, [values count] - 1)];
+    return [self identifiersWithFieldName:name inValues:operands];
+  }
+
+  BOOL isLower = [operatorName isEqualToString:@"GT"] ||
+                 [operatorName isEqualToString:@"GE"];
+  BOOL isUpper = [operatorName isEqualToString:@"LT"] ||
+                 [operatorName isEqualToString:@"LE"];
+  if (!isLower && !isUpper) {
+    return nil;
+  }
+
+  BOOL isInclusive = [operatorName hasSuffix:@"E"];
+  NSArray *entries = [self entriesWithFieldName:name
+                                     lowerBound:isLower ? value : nil
+                                      inclusive:isInclusive
+                                     upperBound:isUpper ? value : nil
+                                      inclusive:isInclusive];
+  if (!entries) {
+    return nil;
+  }
+
+  NSMutableSet *identifiers = [NSMutableSet setWithCapacity:[entries count]];
+  for (CloudEntityIndexEntry *entry in entries) {
+    [identifiers addObject:entry.identifier];
+  }
+  return identifiers;
+}
+
+// Evaluate the filter along the ordered index of the sort field and stop at
+// the query limit.  Entities without the field are left out, as the backend
+// does, and an entity with a list value is taken at its first element in
+// sort order.
+- (NSArray *)resultOfQuery:(GTLMobilebackendQueryDto *)query
+    walkingOrderedIndexForFieldName:(NSString *)name {
+  CloudFilterEvaluator *evaluator =
+      [CloudFilterEvaluator evaluatorWithFilterDto:query.filterDto];
+  NSInteger limit = [query.limit integerValue];
+  NSMutableArray *results = [NSMutableArray array];
+  NSMutableSet *seen = [NSMutableSet set];
+
+  NSArray *orderedIndex = _orderedIndexes[name];
+  NSEnumerator *enumerator = [query.sortAscending boolValue]
+      ? [orderedIndex objectEnumerator]
+      : [orderedIndex reverseObjectEnumerator];
+  for (CloudEntityIndexEntry *entry in enumerator) {
+    if (limit > 0 && (NSInteger)[results count] >= limit) {
+      break;
+    }
+    if ([seen containsObject:entry.identifier]) {
+      continue;
+    }
+    [seen addObject:entry.identifier];
+    CloudEntity *entity = _entities[entry.identifier];
+    if ([evaluator evaluateWithEntity:entity]) {
+      [results addObject:entity];
+    }
+  }
+  return results;
+}
+
+@end
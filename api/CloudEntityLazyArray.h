@@ -0,0 +1,38 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+
+// Immutable array of CloudEntity backed by an array of
+// GTLMobilebackendEntityDto.  A CloudEntity is only looked up in the
+// CloudEntityIdentityMap when its index is first accessed, and is then kept so
+// that later accesses return the same instance.
+@interface CloudEntityLazyArray : NSArray
+
+// Wrap an array of GTLMobilebackendEntityDto without copying it.
+- (id)initWithRawObjects:(NSArray *)rawObjects;
+
+// The wrapped array of GTLMobilebackendEntityDto.
+- (NSArray *)rawObjects;
+
+// Enumerate the entities through one reused CloudEntity which is pointed at
+// each native object in turn, without creating or caching any entity.  The
+// entity passed to the block is only valid during the call; use objectAtIndex:
+// to keep one.
+- (void)enumerateEntitiesWithFlyweightUsingBlock:
+    (void (^)(CloudEntity *entity, NSUInteger idx, BOOL *stop))block;
+
+@end
@@ -0,0 +1,79 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity+Private.h"
+#import "CloudEntityIdentityMap.h"
+#import "CloudEntityLazyArray.h"
+
+@interface CloudEntityLazyArray() {
+  NSArray *_rawObjects;
+  // Entities created so far, NULL at indexes not accessed yet
+  NSPointerArray *_entities;
+}
+@end
+
+
+@implementation CloudEntityLazyArray
+
+- (id)initWithRawObjects:(NSArray *)rawObjects {
+  self = [super init];
+  if (self) {
+    _rawObjects = rawObjects ? rawObjects : @[];
+    _entities = [NSPointerArray strongObjectsPointerArray];
+    [_entities setCount:[_rawObjects count]];
+  }
+
+  return self;
+}
+
+- (NSArray *)rawObjects {
+  return _rawObjects;
+}
+
+#pragma mark - NSArray primitive methods
+
+- (NSUInteger)count {
+  return [_rawObjects count];
+}
+
+- (id)objectAtIndex:(NSUInteger)index {
+  @synchronized(self) {
+    CloudEntity *entity =
+        (__bridge CloudEntity *)[_entities pointerAtIndex:index];
+    if (!entity) {
+      entity = [[CloudEntityIdentityMap sharedInstance]
+                   entityWithRawObject:_rawObjects[index]];
+      [_entities replacePointerAtIndex:index
+                           withPointer:(__bridge void *)entity];
+    }
+    return entity;
+  }
+}
+
+#pragma mark - Flyweight enumeration
+
+- (void)enumerateEntitiesWithFlyweightUsingBlock:
+    (void (^)(CloudEntity *entity, NSUInteger idx, BOOL *stop))block {
+  CloudEntity *flyweight = [CloudEntity entityWithRawObject:nil];
+  BOOL stop = NO;
+  NSUInteger count = [_rawObjects count];
+
+  for (NSUInteger idx = 0; idx < count && !stop; idx++) {
+    [flyweight rebindToRawObject:_rawObjects[idx]];
+    block(flyweight, idx, &stop);
+  }
+}
+
+@end
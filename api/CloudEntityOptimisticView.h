@@ -0,0 +1,69 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+#import "CloudEntityResultSet.h"
+#import "GTLMobilebackendQueryDto.h"
+
+typedef void(^CloudEntityOptimisticViewChange)(CloudEntityResultSet *,
+                                               CloudEntityChangeSet *);
+
+// Local view of a collection which shows writes before the backend answers.
+// An insert, update or remove made through the view changes the view at once
+// and is tagged pending until its response arrives.  A successful response
+// reconciles the change with what the backend returned; an error undoes
+// exactly that change and nothing else.  The view is the latest backend
+// result with the pending changes laid over it, and every change to either is
+// passed to the change handler as the difference from what was shown before.
+// Used on the main thread, which responses are delivered on.
+@interface CloudEntityOptimisticView : NSObject
+
+// What the view shows.  Only changed by the view.
+@property(nonatomic, readonly) CloudEntityResultSet *resultSet;
+
+// Create a view of a query.  The query places inserted entities the way the
+// backend would, e.g. leaves out those its filter does not match; without
+// one, inserted entities are shown first, newest on top.
+- (id)initWithQuery:(GTLMobilebackendQueryDto *)query
+      changeHandler:(CloudEntityOptimisticViewChange)handler;
+
+// Replace the backend result the pending changes are laid over, e.g. with
+// every response of a list request.
+- (void)applyServerEntities:(NSArray *)entities;
+
+// Show the entity and insert it via the cloud backend.  Once inserted, the
+// entity is bound to the response and kept as its instance, so that its row
+// stays.  The callback gets the entity and the error, if any.
+- (void)insertEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block;
+
+// Edit the entity in the block, show the edit and put the entity via the
+// cloud backend.  On error the entity is bound back to its state before the
+// edit, unless a later edit or response replaced that state since.  The
+// entity must have been inserted.
+- (void)updateEntity:(CloudEntity *)entity
+           withBlock:(void (^)(CloudEntity *entity))edit
+            callback:(CloudEntityQueryCompletionCallback)block;
+
+// Hide the entity and remove it via the cloud backend.  On error it is shown
+// again where it belongs.  The entity must have been inserted.
+- (void)removeEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block;
+
+// Return YES if a write of the entity made through the view is in flight.
+- (BOOL)isPendingEntity:(CloudEntity *)entity;
+
+@end
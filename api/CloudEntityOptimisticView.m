@@ -0,0 +1,185 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity+Private.h"
+#import "CloudEntityIdentityMap.h"
+#import "CloudEntityOptimisticView.h"
+#import "CloudFilterEvaluator.h"
+
+@interface CloudEntityOptimisticView() {
+  GTLMobilebackendQueryDto *_query;
+  CloudEntityOptimisticViewChange _changeHandler;
+  // Latest backend result, array of CloudEntity
+  NSArray *_serverEntities;
+  // Entities whose insert is in flight, newest last.  Matched by pointer, as
+  // they have no identifier yet.
+  NSMutableArray *_pendingInserts;
+  // Entities with updates in flight, counted per update
+  NSCountedSet *_pendingUpdates;
+  // Entities with removes in flight, counted per remove
+  NSCountedSet *_pendingRemovals;
+}
+@end
+
+
+@implementation CloudEntityOptimisticView
+
+- (id)initWithQuery:(GTLMobilebackendQueryDto *)query
+      changeHandler:(CloudEntityOptimisticViewChange)handler {
+  self = [super init];
+  if (self) {
+    _query = query;
+    _changeHandler = [handler copy];
+    _resultSet = [[CloudEntityResultSet alloc] init];
+    _serverEntities = @[];
+    _pendingInserts = [NSMutableArray array];
+    _pendingUpdates = [NSCountedSet set];
+    _pendingRemovals = [NSCountedSet set];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (void)applyServerEntities:(NSArray *)entities {
+  _serverEntities = entities ? [entities copy] : @[];
+  [self refresh];
+}
+
+- (void)insertEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block {
+  [_pendingInserts addObject:entity];
+  [self refresh];
+
+  [entity insertInstanceWithCallback:^(CloudEntity *inserted, NSError *error) {
+      [_pendingInserts removeObjectIdenticalTo:entity];
+      if (!error) {
+        // The entity shown becomes the instance of the inserted one
+        [entity rebindToRawObject:inserted.innerObject];
+        [[CloudEntityIdentityMap sharedInstance] adoptEntity:entity];
+        _serverEntities = [@[entity]
+            arrayByAddingObjectsFromArray:_serverEntities];
+      }
+      [self refresh];
+
+      if (block) {
+        block(entity, error);
+      }
+  }];
+}
+
+- (void)updateEntity:(CloudEntity *)entity
+           withBlock:(void (^)(CloudEntity *entity))edit
+            callback:(CloudEntityQueryCompletionCallback)block {
+  if (!entity.innerObject.identifier) {
+    NSLog(@"Cannot update entity which was not inserted: %@", entity);
+    return;
+  }
+
+  // Edit a copy, which keeps the state before the edit for a rollback and
+  // shows the result set that the entity changed
+  GTLMobilebackendEntityDto *previousObject = entity.innerObject;
+  [entity rebindToRawObject:[CloudEntity deepCopyOfRawObject:previousObject]];
+  edit(entity);
+  GTLMobilebackendEntityDto *editedObject = entity.innerObject;
+  [_pendingUpdates addObject:entity];
+  [[CloudEntityIdentityMap sharedInstance] beginWriteOfEntity:entity];
+  [self refresh];
+
+  [entity putInstanceAtIndexPath:nil
+                        callback:^(CloudEntity *updated, NSError *error) {
+      [_pendingUpdates removeObject:entity];
+      if (error && entity.innerObject == editedObject) {
+        [entity rebindToRawObject:previousObject];
+      }
+      [[CloudEntityIdentityMap sharedInstance] endWriteOfEntity:entity];
+      [self refresh];
+
+      if (block) {
+        block(entity, error);
+      }
+  }];
+}
+
+- (void)removeEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block {
+  if (!entity.innerObject.identifier) {
+    NSLog(@"Cannot remove entity which was not inserted: %@", entity);
+    return;
+  }
+
+  [_pendingRemovals addObject:entity];
+  [[CloudEntityIdentityMap sharedInstance] beginWriteOfEntity:entity];
+  [self refresh];
+
+  [entity removeInstanceAtIndexPath:nil
+                           callback:^(CloudEntity *removed, NSError *error) {
+      [_pendingRemovals removeObject:entity];
+      [[CloudEntityIdentityMap sharedInstance] endWriteOfEntity:entity];
+      if (!error) {
+        NSMutableArray *entities = [_serverEntities mutableCopy];
+        [entities removeObject:entity];
+        _serverEntities = [entities copy];
+      }
+      [self refresh];
+
+      if (block) {
+        block(entity, error);
+      }
+  }];
+}
+
+- (BOOL)isPendingEntity:(CloudEntity *)entity {
+  return [_pendingInserts indexOfObjectIdenticalTo:entity] != NSNotFound ||
+      [_pendingUpdates countForObject:entity] > 0 ||
+      [_pendingRemovals countForObject:entity] > 0;
+}
+
+#pragma mark - Private methods
+
+// Lay the pending changes over the backend result and pass on what changed
+// in the view.  Updates need no laying over, as the entities shown are the
+// ones edited.
+- (void)refresh {
+  NSMutableArray *entities =
+      [NSMutableArray arrayWithCapacity:[_serverEntities count] +
+                                        [_pendingInserts count]];
+  for (CloudEntity *entity in _serverEntities) {
+    if ([_pendingRemovals countForObject:entity] == 0) {
+      [entities addObject:entity];
+    }
+  }
+
+  NSArray *shownEntities = nil;
+  if (_query) {
+    [entities addObjectsFromArray:_pendingInserts];
+    shownEntities = [CloudFilterEvaluator resultOfQuery:_query
+                                           withEntities:entities];
+  } else {
+    NSArray *inserts = [[_pendingInserts reverseObjectEnumerator] allObjects];
+    NSRange range = NSMakeRange(0, [inserts count]);
+    [entities insertObjects:inserts
+                  atIndexes:[NSIndexSet indexSetWithIndexesInRange:range]];
+    shownEntities = entities;
+  }
+
+  CloudEntityChangeSet *changes = [_resultSet applyEntities:shownEntities];
+  if ([changes hasChanges] && _changeHandler) {
+    _changeHandler(_resultSet, changes);
+  }
+}
+
+@end
@@ -0,0 +1,75 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+
+// An entity which kept its place in the result set but changed its position.
+@interface CloudEntityMove : NSObject
+// Index in the previous result.
+@property(nonatomic, readonly) NSUInteger fromIndex;
+// Index in the new result.
+@property(nonatomic, readonly) NSUInteger toIndex;
+@end
+
+// Difference between two consecutive states of a CloudEntityResultSet, in the
+// form UITableView and UICollectionView batch updates take: deletions and the
+// sources of moves are indexes of the previous result, insertions and the
+// destinations of moves indexes of the new one.  Updated entities are given
+// by their index in the new result, to be reloaded once the batch is applied.
+@interface CloudEntityChangeSet : NSObject
+@property(nonatomic, readonly) NSIndexSet *deletedIndexes;
+@property(nonatomic, readonly) NSIndexSet *insertedIndexes;
+@property(nonatomic, readonly) NSArray *moves;  // of CloudEntityMove
+@property(nonatomic, readonly) NSIndexSet *updatedIndexes;
+
+// Return YES if the result changed at all.
+- (BOOL)hasChanges;
+@end
+
+// Ordered result of a query, keyed by entity identifier.  Every new response
+// replaces the result and yields the changes from the previous one, so that a
+// view can animate them instead of reloading.  Entities are matched by
+// identifier with hashing; inserts, deletes and updates are found in linear
+// time, and moves are kept to the fewest needed to reorder the entities the
+// results share.  An entity without identifier, i.e. not inserted yet, only
+// matches itself, and keeps its place once the insert gives it one.  An
+// entity counts as updated when it was bound to another native object whose
+// updatedAt, or content, differs.
+@interface CloudEntityResultSet : NSObject
+
+// The current result, an array of CloudEntity in query order.
+@property(nonatomic, readonly) NSArray *entities;
+
+// Number of entities in the result.
+- (NSUInteger)count;
+
+// Return the entity at the index of the result.  Also available through
+// subscripting, e.g. resultSet[row].
+- (CloudEntity *)entityAtIndex:(NSUInteger)index;
+- (CloudEntity *)objectAtIndexedSubscript:(NSUInteger)index;
+
+// Return the index of the entity with the identifier, or NSNotFound.
+- (NSUInteger)indexOfEntityWithIdentifier:(NSString *)identifier;
+
+// Replace the result with a new response and return what changed.  Later
+// entities with the identifier of an earlier one are ignored.
+- (CloudEntityChangeSet *)applyEntities:(NSArray *)entities;
+
+// Remove the entity at the index, e.g. after deleting it on the device, so
+// that the next change set starts from what the view shows.
+- (void)removeEntityAtIndex:(NSUInteger)index;
+
+@end
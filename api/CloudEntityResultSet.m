@@ -0,0 +1,315 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntityResultSet.h"
+
+@interface CloudEntityMove()
+@property(nonatomic, readwrite) NSUInteger fromIndex;
+@property(nonatomic, readwrite) NSUInteger toIndex;
+@end
+
+@implementation CloudEntityMove
+@end
+
+
+@interface CloudEntityChangeSet()
+@property(nonatomic, readwrite) NSIndexSet *deletedIndexes;
+@property(nonatomic, readwrite) NSIndexSet *insertedIndexes;
+@property(nonatomic, readwrite) NSArray *moves;
+@property(nonatomic, readwrite) NSIndexSet *updatedIndexes;
+@end
+
+@implementation CloudEntityChangeSet
+
+- (BOOL)hasChanges {
+  return [_deletedIndexes count] > 0 || [_insertedIndexes count] > 0 ||
+      [_moves count] > 0 || [_updatedIndexes count] > 0;
+}
+
+@end
+
+
+@interface CloudEntityResultSet() {
+  // Key is the identifier as NSString, or for an entity without one the
+  // entity as NSValue, object is index in _entities as NSNumber.
+  NSDictionary *_indexesByKey;
+  // Key is an entity without identifier, by pointer, object is its index as
+  // NSNumber.  Lets such an entity keep its row once it gets an identifier.
+  NSMapTable *_unsavedIndexes;
+  // The native object of every entity when it was applied, or NSNull.
+  // Entities from the identity map are updated in place, so the entity itself
+  // cannot tell.
+  NSArray *_innerObjects;
+}
+@end
+
+
+@implementation CloudEntityResultSet
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    _entities = @[];
+    _indexesByKey = @{};
+    _unsavedIndexes = [self unsavedIndexesOfEntities:_entities];
+    _innerObjects = @[];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (NSUInteger)count {
+  return [_entities count];
+}
+
+- (CloudEntity *)entityAtIndex:(NSUInteger)index {
+  return _entities[index];
+}
+
+- (CloudEntity *)objectAtIndexedSubscript:(NSUInteger)index {
+  return _entities[index];
+}
+
+- (NSUInteger)indexOfEntityWithIdentifier:(NSString *)identifier {
+  NSNumber *index = identifier ? _indexesByKey[identifier] : nil;
+  return index ? [index unsignedIntegerValue] : NSNotFound;
+}
+
+- (CloudEntityChangeSet *)applyEntities:(NSArray *)entities {
+  NSMutableArray *newEntities =
+      [NSMutableArray arrayWithCapacity:[entities count]];
+  NSMutableDictionary *newIndexesByKey =
+      [NSMutableDictionary dictionaryWithCapacity:[entities count]];
+  for (CloudEntity *entity in entities) {
+    id key = [self keyOfEntity:entity];
+    if (!newIndexesByKey[key]) {
+      newIndexesByKey[key] = @([newEntities count]);
+      [newEntities addObject:entity];
+    }
+  }
+
+  // Old index of every new entity that the old result holds, or NSNotFound
+  NSUInteger newCount = [newEntities count];
+  NSUInteger *matchedIndexes = malloc(sizeof(NSUInteger) * MAX(newCount, 1));
+  NSUInteger oldCount = [_entities count];
+  BOOL *isMatched = calloc(MAX(oldCount, 1), sizeof(BOOL));
+  for (NSUInteger j = 0; j < newCount; j++) {
+    NSUInteger i = [self oldIndexOfEntity:newEntities[j]];
+    if (i != NSNotFound && isMatched[i]) {
+      i = NSNotFound;
+    }
+    matchedIndexes[j] = i;
+    if (i != NSNotFound) {
+      isMatched[i] = YES;
+    }
+  }
+
+  NSMutableIndexSet *deletedIndexes = [NSMutableIndexSet indexSet];
+  for (NSUInteger i = 0; i < oldCount; i++) {
+    if (!isMatched[i]) {
+      [deletedIndexes addIndex:i];
+    }
+  }
+  free(isMatched);
+
+  // Indexes of the entities both results hold, in the order of the new one
+  NSUInteger *oldIndexes = malloc(sizeof(NSUInteger) * MAX(newCount, 1));
+  NSUInteger *newIndexes = malloc(sizeof(NSUInteger) * MAX(newCount, 1));
+  NSUInteger commonCount = 0;
+
+  NSMutableIndexSet *insertedIndexes = [NSMutableIndexSet indexSet];
+  NSMutableIndexSet *updatedIndexes = [NSMutableIndexSet indexSet];
+  for (NSUInteger j = 0; j < newCount; j++) {
+    NSUInteger i = matchedIndexes[j];
+    if (i == NSNotFound) {
+      [insertedIndexes addIndex:j];
+      continue;
+    }
+
+    oldIndexes[commonCount] = i;
+    newIndexes[commonCount] = j;
+    commonCount++;
+    if ([self isEntity:newEntities[j] updatedFromIndex:i]) {
+      [updatedIndexes addIndex:j];
+    }
+  }
+
+  NSArray *moves = [self movesWithOldIndexes:oldIndexes
+                                  newIndexes:newIndexes
+                                       count:commonCount];
+  free(matchedIndexes);
+  free(oldIndexes);
+  free(newIndexes);
+
+  _entities = [newEntities copy];
+  _indexesByKey = [newIndexesByKey copy];
+  _unsavedIndexes = [self unsavedIndexesOfEntities:_entities];
+  _innerObjects = [self innerObjectsOfEntities:_entities];
+
+  CloudEntityChangeSet *changeSet = [[CloudEntityChangeSet alloc] init];
+  changeSet.deletedIndexes = deletedIndexes;
+  changeSet.insertedIndexes = insertedIndexes;
+  changeSet.moves = moves;
+  changeSet.updatedIndexes = updatedIndexes;
+  return changeSet;
+}
+
+- (void)removeEntityAtIndex:(NSUInteger)index {
+  NSMutableArray *entities = [_entities mutableCopy];
+  [entities removeObjectAtIndex:index];
+  NSMutableArray *innerObjects = [_innerObjects mutableCopy];
+  [innerObjects removeObjectAtIndex:index];
+
+  NSMutableDictionary *indexesByKey =
+      [NSMutableDictionary dictionaryWithCapacity:[entities count]];
+  [entities enumerateObjectsUsingBlock:^(CloudEntity *entity, NSUInteger idx,
+                                         BOOL *stop) {
+      indexesByKey[[self keyOfEntity:entity]] = @(idx);
+  }];
+
+  _entities = [entities copy];
+  _indexesByKey = [indexesByKey copy];
+  _unsavedIndexes = [self unsavedIndexesOfEntities:_entities];
+  _innerObjects = [innerObjects copy];
+}
+
+#pragma mark - Private methods
+
+// Entities are keyed by identifier; one not stored in the backend yet has
+// none and only matches itself.
+- (id)keyOfEntity:(CloudEntity *)entity {
+  NSString *identifier = entity.innerObject.identifier;
+  return identifier ? identifier : [NSValue valueWithNonretainedObject:entity];
+}
+
+// Return the index of the entity in the current result, or NSNotFound.
+- (NSUInteger)oldIndexOfEntity:(CloudEntity *)entity {
+  NSNumber *index = _indexesByKey[[self keyOfEntity:entity]];
+  if (!index) {
+    // It may have been inserted since it was applied
+    index = [_unsavedIndexes objectForKey:entity];
+  }
+  return index ? [index unsignedIntegerValue] : NSNotFound;
+}
+
+- (NSMapTable *)unsavedIndexesOfEntities:(NSArray *)entities {
+  NSMapTable *indexes = [[NSMapTable alloc]
+      initWithKeyOptions:NSPointerFunctionsStrongMemory |
+                         NSPointerFunctionsObjectPointerPersonality
+            valueOptions:NSPointerFunctionsStrongMemory
+                capacity:0];
+  [entities enumerateObjectsUsingBlock:^(CloudEntity *entity, NSUInteger idx,
+                                         BOOL *stop) {
+      if (!entity.innerObject.identifier) {
+        [indexes setObject:@(idx) forKey:entity];
+      }
+  }];
+  return indexes;
+}
+
+- (NSArray *)innerObjectsOfEntities:(NSArray *)entities {
+  NSMutableArray *innerObjects =
+      [NSMutableArray arrayWithCapacity:[entities count]];
+  for (CloudEntity *entity in entities) {
+    GTLMobilebackendEntityDto *innerObject = entity.innerObject;
+    [innerObjects addObject:innerObject ? innerObject : [NSNull null]];
+  }
+  return innerObjects;
+}
+
+// Compare the entity with what the one at the index of the current result
+// was bound to when it was applied.  An entity still bound to the same native
+// object is unchanged; one bound to another is compared by updatedAt, and by
+// content when the updatedAt is missing or the same, as after a local edit.
+- (BOOL)isEntity:(CloudEntity *)entity updatedFromIndex:(NSUInteger)index {
+  GTLMobilebackendEntityDto *innerObject = entity.innerObject;
+  id previousObject = _innerObjects[index];
+  if (innerObject == previousObject) {
+    return NO;
+  }
+  if (previousObject == [NSNull null]) {
+    return YES;
+  }
+
+  NSDate *updatedAt = innerObject.updatedAt.date;
+  NSDate *previousUpdatedAt =
+      ((GTLMobilebackendEntityDto *)previousObject).updatedAt.date;
+  if (updatedAt && previousUpdatedAt &&
+      ![updatedAt isEqualToDate:previousUpdatedAt]) {
+    return YES;
+  }
+  return ![innerObject.JSON isEqual:[previousObject JSON]];
+}
+
+// Return the moves of the entities both results hold.  The longest run of
+// them that kept its relative order stays in place and everything else moves
+// around it, which takes the fewest moves.  The run is found by patience
+// sorting the old indexes taken in new order.
+- (NSArray *)movesWithOldIndexes:(const NSUInteger *)oldIndexes
+                      newIndexes:(const NSUInteger *)newIndexes
+                           count:(NSUInteger)count {
+  if (count == 0) {
+    return @[];
+  }
+
+  // tails[k] is the position of the smallest last old index of an increasing
+  // run of length k + 1, predecessors[p] the position before p in its run.
+  NSUInteger *tails = malloc(sizeof(NSUInteger) * count);
+  NSUInteger *predecessors = malloc(sizeof(NSUInteger) * count);
+  NSUInteger length = 0;
+  for (NSUInteger p = 0; p < count; p++) {
+    NSUInteger low = 0;
+    NSUInteger high = length;
+    while (low < high) {
+      NSUInteger mid = low + (high - low) / 2;
+      if (oldIndexes[tails[mid]] < oldIndexes[p]) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+
+    predecessors[p] = low > 0 ? tails[low - 1] : NSNotFound;
+    tails[low] = p;
+    if (low == length) {
+      length++;
+    }
+  }
+
+  BOOL *isInPlace = calloc(count, sizeof(BOOL));
+  for (NSUInteger p = tails[length - 1]; p != NSNotFound;
+       p = predecessors[p]) {
+    isInPlace[p] = YES;
+  }
+
+  NSMutableArray *moves = [NSMutableArray array];
+  for (NSUInteger p = 0; p < count; p++) {
+    if (!isInPlace[p]) {
+      CloudEntityMove *move = [[CloudEntityMove alloc] init];
+      move.fromIndex = oldIndexes[p];
+      move.toIndex = newIndexes[p];
+      [moves addObject:move];
+    }
+  }
+
+  free(tails);
+  free(predecessors);
+  free(isInPlace);
+  return moves;
+}
+
+@end
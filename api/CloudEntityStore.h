@@ -0,0 +1,74 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "GTLMobilebackendEntityDto.h"
+
+// Notification posted after entities were written to or removed from a store.
+// The object is the store; the user info holds the written and removed
+// GTLMobilebackendEntityDto arrays, or kCloudEntityStoreRemovedAllKey when the
+// store was emptied.
+extern NSString *const kCloudEntityStoreDidChangeNotification;
+extern NSString *const kCloudEntityStorePutEntitiesKey;
+extern NSString *const kCloudEntityStoreRemovedEntitiesKey;
+extern NSString *const kCloudEntityStoreRemovedAllKey;
+
+// On-disk store of GTLMobilebackendEntityDto objects keyed by kind name and
+// identifier.  Entities are appended to a log file which is memory mapped when
+// the store is opened.  Only the record headers are scanned at startup; the
+// JSON of an entity is parsed when it is first read.  Superseded and removed
+// records are dropped by compaction.
+@interface CloudEntityStore : NSObject
+
+// Shared instance backed by a log file in the application documents
+// directory.
++ (CloudEntityStore *)sharedInstance;
+
+// Open the store at the given path, creating the log file if needed.
+- (id)initWithPath:(NSString *)path;
+
+// Number of entities held in the store.
+- (NSUInteger)count;
+
+// Return the stored entity for kind name and identifier, or nil if the store
+// does not hold it.
+- (GTLMobilebackendEntityDto *)entityWithKind:(NSString *)kindName
+                                   identifier:(NSString *)identifier;
+
+// Return all stored entities of a kind, in no particular order.
+- (NSArray *)entitiesWithKind:(NSString *)kindName;
+
+// Write an entity to the store, replacing any entity with the same kind name
+// and identifier.  Entities without kind name or identifier are ignored.
+- (void)putEntity:(GTLMobilebackendEntityDto *)entity;
+
+// Write an array of GTLMobilebackendEntityDto with a single append.
+- (void)putEntities:(NSArray *)entities;
+
+// Remove the entity with kind name and identifier from the store.
+- (void)removeEntityWithKind:(NSString *)kindName
+                  identifier:(NSString *)identifier;
+
+// Remove an array of GTLMobilebackendEntityDto with a single append.
+- (void)removeEntities:(NSArray *)entities;
+
+// Remove all entities and truncate the log file.
+- (void)removeAllEntities;
+
+// Rewrite the log file so that it only holds the live entities.  The store
+// compacts itself when superseded records outweigh live ones.
+- (void)compact;
+
+@end
@@ -0,0 +1,470 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#import "CloudEntityStore.h"
+#import "GTLJSONParser.h"
+
+// Every record in the log file is this header followed by the UTF-8 encoded
+// key ("<kindName>\x1f<identifier>") and the JSON of the entity.  A record
+// without value marks the removal of the entity.
+typedef struct {
+  uint32_t magic;
+  uint32_t keyLength;
+  uint32_t valueLength;
+} CloudEntityStoreRecordHeader;
+
+@interface CloudEntityStore() {
+  NSString *_path;
+  NSFileHandle *_fileHandle;
+  // Read only mapping of the log file.  Records appended after the mapping
+  // was made are read after remapping.
+  NSData *_mappedData;
+  // Key is kind name as NSString, object is NSMutableDictionary which maps
+  // identifier to the range of its latest record in the log file as NSValue.
+  NSMutableDictionary *_index;
+  unsigned long long _fileLength;
+  unsigned long long _liveBytes;
+  unsigned long long _deadBytes;
+}
+@end
+
+
+@implementation CloudEntityStore
+
+NSString *const kCloudEntityStoreDidChangeNotification =
+    @"cloudEntityStoreDidChangeNotification";
+NSString *const kCloudEntityStorePutEntitiesKey = @"putEntities";
+NSString *const kCloudEntityStoreRemovedEntitiesKey = @"removedEntities";
+NSString *const kCloudEntityStoreRemovedAllKey = @"removedAll";
+
+static const uint32_t kCloudEntityStoreRecordMagic = 0x31534543; // "CES1"
+static NSString *const kCloudEntityStoreKeySeparator = @"\x1f";
+// Superseded bytes tolerated before compaction is considered
+static const unsigned long long kCloudEntityStoreCompactionThreshold =
+    1024 * 1024;
+// Bytes buffered in memory while the log file is rewritten
+static const NSUInteger kCloudEntityStoreCompactionChunkSize = 256 * 1024;
+static CloudEntityStore *singleton;
+
++ (CloudEntityStore *)sharedInstance {
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    NSArray *paths = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory,
+                                                         NSUserDomainMask,
+                                                         YES);
+    NSString *documentsDirectory = [paths lastObject];
+    NSString *name = @"com.google.cloudentities.log";
+    NSString *location =
+        [documentsDirectory stringByAppendingPathComponent:name];
+    singleton = [[CloudEntityStore alloc] initWithPath:location];
+  });
+
+  return singleton;
+}
+
+- (id)initWithPath:(NSString *)path {
+  self = [super init];
+  if (self) {
+    _path = [path copy];
+    _index = [NSMutableDictionary dictionary];
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (![fileManager fileExistsAtPath:_path]) {
+      [fileManager createFileAtPath:_path contents:nil attributes:nil];
+    }
+
+    [self loadIndex];
+
+    // Drop a record which was cut short by a crash, if any
+    _fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+    [_fileHandle truncateFileAtOffset:_fileLength];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (NSUInteger)count {
+  @synchronized(self) {
+    NSUInteger count = 0;
+    for (NSString *kindName in _index) {
+      count += [_index[kindName] count];
+    }
+    return count;
+  }
+}
+
+- (GTLMobilebackendEntityDto *)entityWithKind:(NSString *)kindName
+                                   identifier:(NSString *)identifier {
+  if (!kindName || !identifier) {
+    return nil;
+  }
+
+  @synchronized(self) {
+    NSValue *recordRange = _index[kindName][identifier];
+    if (!recordRange) {
+      return nil;
+    }
+    return [self entityWithRecordRange:[recordRange rangeValue]];
+  }
+}
+
+- (NSArray *)entitiesWithKind:(NSString *)kindName {
+  @synchronized(self) {
+    NSDictionary *kindIndex = _index[kindName];
+    NSMutableArray *entities =
+        [NSMutableArray arrayWithCapacity:[kindIndex count]];
+
+    for (NSValue *recordRange in [kindIndex objectEnumerator]) {
+      GTLMobilebackendEntityDto *entity =
+          [self entityWithRecordRange:[recordRange rangeValue]];
+      if (entity) {
+        [entities addObject:entity];
+      }
+    }
+    return entities;
+  }
+}
+
+- (void)putEntity:(GTLMobilebackendEntityDto *)entity {
+  if (entity) {
+    [self putEntities:@[entity]];
+  }
+}
+
+- (void)putEntities:(NSArray *)entities {
+  NSArray *written = nil;
+  @synchronized(self) {
+    written = [self appendRecordsForEntities:entities removal:NO];
+  }
+  [self postChangeWithUserInfo:@{kCloudEntityStorePutEntitiesKey: written}];
+}
+
+- (void)removeEntityWithKind:(NSString *)kindName
+                  identifier:(NSString *)identifier {
+  GTLMobilebackendEntityDto *entity = [GTLMobilebackendEntityDto object];
+  entity.kindName = kindName;
+  entity.identifier = identifier;
+  [self removeEntities:@[entity]];
+}
+
+- (void)removeEntities:(NSArray *)entities {
+  NSArray *removed = nil;
+  @synchronized(self) {
+    removed = [self appendRecordsForEntities:entities removal:YES];
+  }
+  [self postChangeWithUserInfo:
+      @{kCloudEntityStoreRemovedEntitiesKey: removed}];
+}
+
+- (void)removeAllEntities {
+  @synchronized(self) {
+    [_fileHandle truncateFileAtOffset:0];
+    [_index removeAllObjects];
+    _fileLength = 0;
+    _liveBytes = 0;
+    _deadBytes = 0;
+    [self remap];
+  }
+  [self postChangeWithUserInfo:@{kCloudEntityStoreRemovedAllKey: @(YES)}];
+}
+
+- (void)compact {
+  @synchronized(self) {
+    NSString *compactedPath = [_path stringByAppendingPathExtension:@"tmp"];
+    [[NSFileManager defaultManager] createFileAtPath:compactedPath
+                                            contents:nil
+                                          attributes:nil];
+    NSFileHandle *compactedHandle =
+        [NSFileHandle fileHandleForWritingAtPath:compactedPath];
+    if (!compactedHandle) {
+      NSLog(@"Cannot create compacted entity store at %@", compactedPath);
+      return;
+    }
+
+    [self remap];
+    const uint8_t *bytes = [_mappedData bytes];
+    NSMutableDictionary *compactedIndex = [NSMutableDictionary dictionary];
+    NSMutableData *buffer =
+        [NSMutableData dataWithCapacity:kCloudEntityStoreCompactionChunkSize];
+    unsigned long long compactedLength = 0;
+
+    // Copy the latest record of every entity, without parsing it
+    @try {
+      for (NSString *kindName in _index) {
+        NSDictionary *kindIndex = _index[kindName];
+        NSMutableDictionary *compactedKindIndex =
+            [NSMutableDictionary dictionaryWithCapacity:[kindIndex count]];
+
+        for (NSString *identifier in kindIndex) {
+          NSRange range = [kindIndex[identifier] rangeValue];
+          NSRange compactedRange =
+              NSMakeRange((NSUInteger)compactedLength, range.length);
+          compactedKindIndex[identifier] =
+              [NSValue valueWithRange:compactedRange];
+          [buffer appendBytes:bytes + range.location length:range.length];
+          compactedLength += range.length;
+
+          if ([buffer length] >= kCloudEntityStoreCompactionChunkSize) {
+            [compactedHandle writeData:buffer];
+            [buffer setLength:0];
+          }
+        }
+        compactedIndex[kindName] = compactedKindIndex;
+      }
+      [compactedHandle writeData:buffer];
+      [compactedHandle synchronizeFile];
+    } @catch (NSException *exception) {
+      NSLog(@"Cannot compact entity store %@: %@", _path, exception);
+      [compactedHandle closeFile];
+      [[NSFileManager defaultManager] removeItemAtPath:compactedPath
+                                                 error:NULL];
+      return;
+    }
+    [compactedHandle closeFile];
+
+    // Atomically replace the log file with the compacted one
+    if (rename([compactedPath fileSystemRepresentation],
+               [_path fileSystemRepresentation]) != 0) {
+      NSLog(@"Cannot replace entity store %@", _path);
+      return;
+    }
+
+    [_fileHandle closeFile];
+    _fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+    _index = compactedIndex;
+    _fileLength = compactedLength;
+    _liveBytes = compactedLength;
+    _deadBytes = 0;
+    [self remap];
+  }
+}
+
+#pragma mark - Private methods
+
+// Tell observers about a change, outside of the store lock.
+- (void)postChangeWithUserInfo:(NSDictionary *)userInfo {
+  NSArray *entities = userInfo[kCloudEntityStorePutEntitiesKey];
+  if (!entities) {
+    entities = userInfo[kCloudEntityStoreRemovedEntitiesKey];
+  }
+  if (entities && [entities count] == 0) {
+    return;
+  }
+
+  [[NSNotificationCenter defaultCenter]
+      postNotificationName:kCloudEntityStoreDidChangeNotification
+                    object:self
+                  userInfo:userInfo];
+}
+
+- (NSString *)keyWithKind:(NSString *)kindName
+               identifier:(NSString *)identifier {
+  return [NSString stringWithFormat:@"%@%@%@",
+      kindName, kCloudEntityStoreKeySeparator, identifier];
+}
+
+// Map the current content of the log file.
+- (void)remap {
+  NSError *error = nil;
+  _mappedData = [NSData dataWithContentsOfFile:_path
+                                       options:NSDataReadingMappedAlways
+                                         error:&error];
+
+  // An empty file cannot be mapped
+  if (!_mappedData) {
+    _mappedData = [NSData data];
+  }
+}
+
+// Scan the record headers of the log file to rebuild the index.  The scan
+// stops at the first record which is incomplete.
+- (void)loadIndex {
+  [self remap];
+
+  const uint8_t *bytes = [_mappedData bytes];
+  unsigned long long length = [_mappedData length];
+  unsigned long long offset = 0;
+  CloudEntityStoreRecordHeader header;
+
+  while (offset + sizeof(header) <= length) {
+    memcpy(&header, bytes + offset, sizeof(header));
+    unsigned long long recordLength = sizeof(header) +
+        (unsigned long long)header.keyLength + header.valueLength;
+    if (header.magic != kCloudEntityStoreRecordMagic ||
+        recordLength > length - offset) {
+      NSLog(@"Entity store %@ is truncated at offset %llu", _path, offset);
+      break;
+    }
+
+    NSString *key =
+        [[NSString alloc] initWithBytes:bytes + offset + sizeof(header)
+                                 length:header.keyLength
+                               encoding:NSUTF8StringEncoding];
+    NSRange recordRange =
+        NSMakeRange((NSUInteger)offset, (NSUInteger)recordLength);
+    [self indexRecordWithKey:key
+                 recordRange:recordRange
+                     removal:(header.valueLength == 0)];
+    offset += recordLength;
+  }
+
+  _fileLength = offset;
+}
+
+// Point the index at a record and account for the record it supersedes.
+- (void)indexRecordWithKey:(NSString *)key
+               recordRange:(NSRange)recordRange
+                   removal:(BOOL)isRemoval {
+  NSArray *components =
+      [key componentsSeparatedByString:kCloudEntityStoreKeySeparator];
+  if ([components count] != 2) {
+    _deadBytes += recordRange.length;
+    return;
+  }
+
+  NSString *kindName = components[0];
+  NSString *identifier = components[1];
+  NSMutableDictionary *kindIndex = _index[kindName];
+  if (!kindIndex) {
+    kindIndex = [NSMutableDictionary dictionary];
+    _index[kindName] = kindIndex;
+  }
+
+  NSValue *previous = kindIndex[identifier];
+  if (previous) {
+    _liveBytes -= [previous rangeValue].length;
+    _deadBytes += [previous rangeValue].length;
+  }
+
+  if (isRemoval) {
+    [kindIndex removeObjectForKey:identifier];
+    _deadBytes += recordRange.length;
+  } else {
+    kindIndex[identifier] = [NSValue valueWithRange:recordRange];
+    _liveBytes += recordRange.length;
+  }
+}
+
+// Append one record per entity with a single write, then index them.  Return
+// the entities that were written.
+- (NSArray *)appendRecordsForEntities:(NSArray *)entities
+                              removal:(BOOL)isRemoval {
+  NSMutableData *buffer = [NSMutableData data];
+  NSMutableArray *written = [NSMutableArray arrayWithCapacity:[entities count]];
+  NSMutableArray *keys = [NSMutableArray arrayWithCapacity:[entities count]];
+  NSMutableArray *ranges = [NSMutableArray arrayWithCapacity:[entities count]];
+
+  for (GTLMobilebackendEntityDto *entity in entities) {
+    if (!entity.kindName || !entity.identifier) {
+      continue;
+    }
+
+    NSData *value = nil;
+    if (!isRemoval) {
+      NSError *error = nil;
+      value = [GTLJSONParser dataWithObject:entity.JSON
+                              humanReadable:NO
+                                      error:&error];
+      if ([value length] == 0) {
+        NSLog(@"Cannot store entity %@: %@", entity.identifier, error);
+        continue;
+      }
+    }
+
+    NSString *key = [self keyWithKind:entity.kindName
+                           identifier:entity.identifier];
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    CloudEntityStoreRecordHeader header = {
+      kCloudEntityStoreRecordMagic,
+      (uint32_t)[keyData length],
+      (uint32_t)[value length]
+    };
+    NSRange recordRange =
+        NSMakeRange((NSUInteger)_fileLength + [buffer length],
+                    sizeof(header) + [keyData length] + [value length]);
+
+    [buffer appendBytes:&header length:sizeof(header)];
+    [buffer appendData:keyData];
+    if (value) {
+      [buffer appendData:value];
+    }
+
+    [keys addObject:key];
+    [ranges addObject:[NSValue valueWithRange:recordRange]];
+    [written addObject:entity];
+  }
+
+  if ([buffer length] == 0) {
+    return written;
+  }
+
+  @try {
+    [_fileHandle seekToFileOffset:_fileLength];
+    [_fileHandle writeData:buffer];
+  } @catch (NSException *exception) {
+    NSLog(@"Cannot write to entity store %@: %@", _path, exception);
+    return @[];
+  }
+  _fileLength += [buffer length];
+
+  for (NSUInteger i = 0; i < [keys count]; i++) {
+    [self indexRecordWithKey:keys[i]
+                 recordRange:[ranges[i] rangeValue]
+                     removal:isRemoval];
+  }
+
+  if (_deadBytes > kCloudEntityStoreCompactionThreshold &&
+      _deadBytes > _liveBytes) {
+    [self compact];
+  }
+  return written;
+}
+
+// Parse the entity held by the record at the given range of the log file.
+- (GTLMobilebackendEntityDto *)entityWithRecordRange:(NSRange)recordRange {
+  if (NSMaxRange(recordRange) > [_mappedData length]) {
+    [self remap];
+  }
+  if (NSMaxRange(recordRange) > [_mappedData length]) {
+    return nil;
+  }
+
+  const uint8_t *bytes =
+      (const uint8_t *)[_mappedData bytes] + recordRange.location;
+  CloudEntityStoreRecordHeader header;
+  memcpy(&header, bytes, sizeof(header));
+
+  // Parse in place; the mapping outlives this call, and GTLJSONLazyParser,
+  // whose containers outlive it too, copies the bytes
+  void *valueBytes = (void *)(bytes + sizeof(header) + header.keyLength);
+  NSData *value = [NSData dataWithBytesNoCopy:valueBytes
+                                       length:header.valueLength
+                                 freeWhenDone:NO];
+  NSError *error = nil;
+  NSMutableDictionary *json = [GTLJSONParser objectWithData:value
+                                                      error:&error];
+  if (![json isKindOfClass:[NSDictionary class]]) {
+    NSLog(@"Cannot read entity from store %@: %@", _path, error);
+    return nil;
+  }
+
+  return [GTLMobilebackendEntityDto objectWithJSON:json];
+}
+
+@end
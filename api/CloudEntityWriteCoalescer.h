@@ -0,0 +1,66 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+
+// Error domain of writes that the coalescer could not match to a response.
+extern NSString *const kCloudEntityWriteCoalescerErrorDomain;
+
+// Error codes in kCloudEntityWriteCoalescerErrorDomain.
+// ResponseMismatch: the batch response does not hold one entity per buffered
+// insert.
+typedef enum { CloudEntityWriteCoalescerErrorResponseMismatch = 1 }
+  CloudEntityWriteCoalescerErrorCode;
+
+// Buffers single cloud entity inserts, updates and deletes and sends them to
+// the cloud backend as insertAll, updateAll and deleteAll requests.  Each
+// buffered mutation keeps its own callback, which is called with the matching
+// entity of the batch response.
+// Buffers are flushed when the flush interval elapses after the first buffered
+// mutation, or as soon as maxBatchSize mutations are buffered.  Within one
+// flush, all mutations of an entity are merged into a single final one, so the
+// order of the three batch requests does not matter: updates of a pending
+// insert are sent with the insert, a delete supersedes pending updates and
+// later updates of the same entity, and deleting a pending insert sends
+// neither.
+// Used on the main thread.
+@interface CloudEntityWriteCoalescer : NSObject
+
+// Time a mutation may wait in the buffer, in seconds.
+@property(nonatomic) NSTimeInterval flushInterval;
+// Number of buffered mutations that triggers a flush.
+@property(nonatomic) NSUInteger maxBatchSize;
+
+// Create a coalescer with the given flush window.
+- (id)initWithFlushInterval:(NSTimeInterval)interval
+               maxBatchSize:(NSUInteger)size;
+
+// Buffer an insert of the entity.
+- (void)insertEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block;
+
+// Buffer an update of the entity.
+- (void)putEntity:(CloudEntity *)entity
+         callback:(CloudEntityQueryCompletionCallback)block;
+
+// Buffer a delete of the entity.
+- (void)removeEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block;
+
+// Send all buffered mutations now.
+- (void)flush;
+
+@end
@@ -0,0 +1,285 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudEntity+Private.h"
+#import "CloudEntityCollection.h"
+#import "CloudEntityWriteCoalescer.h"
+
+NSString *const kCloudEntityWriteCoalescerErrorDomain =
+    @"CloudEntityWriteCoalescerErrorDomain";
+
+// Final mutation of a buffered entity.
+typedef enum { CloudEntityPendingOperationInsert,
+  CloudEntityPendingOperationUpdate, CloudEntityPendingOperationRemove }
+  CloudEntityPendingOperation;
+
+// A buffered mutation of one entity and the callbacks waiting for it.
+@interface CloudEntityPendingWrite : NSObject
+@property(nonatomic) CloudEntityPendingOperation operation;
+@property(nonatomic, strong) CloudEntity *entity;
+@property(nonatomic, strong) NSMutableArray *callbacks;
+@end
+
+@implementation CloudEntityPendingWrite
+@end
+
+
+@interface CloudEntityWriteCoalescer() {
+  // Array of CloudEntityPendingWrite in the order they were buffered, holding
+  // at most one write per entity.
+  NSMutableArray *_pendingWrites;
+  // Incremented on every flush so that a scheduled flush for an earlier
+  // window does nothing.
+  NSUInteger _flushGeneration;
+  BOOL _isFlushScheduled;
+}
+@end
+
+
+@implementation CloudEntityWriteCoalescer
+
+- (id)initWithFlushInterval:(NSTimeInterval)interval
+               maxBatchSize:(NSUInteger)size {
+  self = [super init];
+  if (self) {
+    _flushInterval = interval;
+    _maxBatchSize = MAX(1, size);
+    _pendingWrites = [NSMutableArray array];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (void)insertEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block {
+  // Inserting the same instance twice in a window creates it once
+  CloudEntityPendingWrite *write = [self pendingWriteWithEntity:entity];
+  if (!write) {
+    write = [self addPendingWriteWithEntity:entity
+                                  operation:CloudEntityPendingOperationInsert];
+  }
+
+  [self addCallback:block toPendingWrite:write];
+  [self scheduleFlush];
+}
+
+- (void)putEntity:(CloudEntity *)entity
+         callback:(CloudEntityQueryCompletionCallback)block {
+  CloudEntityPendingWrite *write = [self pendingWriteWithEntity:entity];
+  if (!write) {
+    write = [self addPendingWriteWithEntity:entity
+                                  operation:CloudEntityPendingOperationUpdate];
+  } else if (write.operation != CloudEntityPendingOperationRemove) {
+    // A pending insert or update is sent with the latest state.  An update of
+    // an entity pending removal is not sent; it is answered by the delete.
+    write.entity = entity;
+  }
+
+  [self addCallback:block toPendingWrite:write];
+  [self scheduleFlush];
+}
+
+- (void)removeEntity:(CloudEntity *)entity
+            callback:(CloudEntityQueryCompletionCallback)block {
+  CloudEntityPendingWrite *write = [self pendingWriteWithEntity:entity];
+  if (write && write.operation == CloudEntityPendingOperationInsert) {
+    // The entity never reached the backend, so neither request is sent
+    [self addCallback:block toPendingWrite:write];
+    [_pendingWrites removeObject:write];
+    NSArray *callbacks = write.callbacks;
+    dispatch_async(dispatch_get_main_queue(), ^{
+        for (CloudEntityQueryCompletionCallback callback in callbacks) {
+          callback(nil, nil);
+        }
+    });
+    return;
+  }
+
+  // A pending update of the deleted entity is not sent; its callbacks are
+  // answered by the delete.
+  if (write) {
+    write.operation = CloudEntityPendingOperationRemove;
+    write.entity = entity;
+  } else {
+    write = [self addPendingWriteWithEntity:entity
+                                  operation:CloudEntityPendingOperationRemove];
+  }
+
+  [self addCallback:block toPendingWrite:write];
+  [self scheduleFlush];
+}
+
+- (void)flush {
+  _flushGeneration++;
+  _isFlushScheduled = NO;
+
+  NSArray *writes = _pendingWrites;
+  _pendingWrites = [NSMutableArray array];
+
+  // Every entity has one write, so the batches touch disjoint entities
+  NSArray *inserts =
+      [self writesInArray:writes operation:CloudEntityPendingOperationInsert];
+  NSArray *updates =
+      [self writesInArray:writes operation:CloudEntityPendingOperationUpdate];
+  NSArray *removals =
+      [self writesInArray:writes operation:CloudEntityPendingOperationRemove];
+
+  CloudEntityCollection *entityCollection =
+      [CloudEntityCollection sharedInstance];
+
+  if ([inserts count]) {
+    [entityCollection insertCollectionWithArray:[inserts valueForKey:@"entity"]
+        callback:^(NSArray *entities, NSError *error) {
+            [self completePendingWrites:inserts withEntities:entities
+                                  error:error];
+        }];
+  }
+
+  if ([updates count]) {
+    [entityCollection putCollectionWithArray:[updates valueForKey:@"entity"]
+        callback:^(NSArray *entities, NSError *error) {
+            [self completePendingWrites:updates withEntities:entities
+                                  error:error];
+        }];
+  }
+
+  if ([removals count]) {
+    [entityCollection removeCollectionWithArray:[removals valueForKey:@"entity"]
+        callback:^(NSArray *entities, NSError *error) {
+            [self completePendingWrites:removals withEntities:entities
+                                  error:error];
+        }];
+  }
+}
+
+#pragma mark - Private methods
+
+- (CloudEntityPendingWrite *)addPendingWriteWithEntity:(CloudEntity *)entity
+    operation:(CloudEntityPendingOperation)operation {
+  CloudEntityPendingWrite *write = [[CloudEntityPendingWrite alloc] init];
+  write.operation = operation;
+  write.entity = entity;
+  write.callbacks = [NSMutableArray array];
+  [_pendingWrites addObject:write];
+  return write;
+}
+
+- (void)addCallback:(CloudEntityQueryCompletionCallback)block
+     toPendingWrite:(CloudEntityPendingWrite *)write {
+  if (block) {
+    [write.callbacks addObject:[block copy]];
+  }
+}
+
+// Find the pending write of the same instance, or of the same kind name and
+// identifier, if any.  Entities that were never inserted have no identifier
+// and only match themselves.
+- (CloudEntityPendingWrite *)pendingWriteWithEntity:(CloudEntity *)entity {
+  for (CloudEntityPendingWrite *write in _pendingWrites) {
+    if (write.entity == entity) {
+      return write;
+    }
+    if (entity.identifier &&
+        [write.entity.identifier isEqualToString:entity.identifier] &&
+        [write.entity.kindName isEqualToString:entity.kindName]) {
+      return write;
+    }
+  }
+  return nil;
+}
+
+- (NSArray *)writesInArray:(NSArray *)writes
+                 operation:(CloudEntityPendingOperation)operation {
+  NSPredicate *predicate =
+      [NSPredicate predicateWithBlock:^BOOL(CloudEntityPendingWrite *write,
+                                            NSDictionary *bindings) {
+          return write.operation == operation;
+      }];
+  return [writes filteredArrayUsingPredicate:predicate];
+}
+
+// Flush right away once the batch is full, otherwise at the end of the
+// window opened by the first buffered mutation.
+- (void)scheduleFlush {
+  if ([_pendingWrites count] >= _maxBatchSize) {
+    [self flush];
+    return;
+  }
+
+  if (_isFlushScheduled || [_pendingWrites count] == 0) {
+    return;
+  }
+  _isFlushScheduled = YES;
+
+  NSUInteger generation = _flushGeneration;
+  int64_t delta = (int64_t)(_flushInterval * NSEC_PER_SEC);
+  dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, delta);
+  dispatch_after(time, dispatch_get_main_queue(), ^{
+      if (generation == _flushGeneration) {
+        [self flush];
+      }
+  });
+}
+
+// Call back every pending write with its entity of the batch response.  The
+// backend answers in request order.  Inserted entities have no identifier
+// until the backend assigns one, so inserts are only matched by position and
+// fail when the response does not hold one entry per request; updates and
+// deletes fall back to matching by identifier.
+- (void)completePendingWrites:(NSArray *)writes
+                 withEntities:(NSArray *)entities
+                        error:(NSError *)error {
+  BOOL matchByIndex = ([entities count] == [writes count]);
+  CloudEntityPendingWrite *firstWrite = [writes firstObject];
+  if (!error && !matchByIndex &&
+      firstWrite.operation == CloudEntityPendingOperationInsert) {
+    NSString *description = [NSString stringWithFormat:
+        @"Insert response holds %lu entities for %lu requests",
+        (unsigned long)[entities count], (unsigned long)[writes count]];
+    error = [NSError errorWithDomain:kCloudEntityWriteCoalescerErrorDomain
+        code:CloudEntityWriteCoalescerErrorResponseMismatch
+        userInfo:@{NSLocalizedDescriptionKey : description}];
+  }
+
+  NSMutableDictionary *entitiesByID = [NSMutableDictionary dictionary];
+  if (!matchByIndex && !error) {
+    for (CloudEntity *entity in entities) {
+      if (entity.identifier) {
+        entitiesByID[entity.identifier] = entity;
+      }
+    }
+  }
+
+  [writes enumerateObjectsUsingBlock:^(CloudEntityPendingWrite *write,
+                                       NSUInteger idx, BOOL *stop) {
+      CloudEntity *entity = nil;
+      if (matchByIndex) {
+        entity = entities[idx];
+      } else if (write.entity.identifier) {
+        entity = entitiesByID[write.entity.identifier];
+      }
+      if (!error) {
+        // The backend holds the edits now
+        [write.entity resetChangeTracking];
+      }
+      for (CloudEntityQueryCompletionCallback block in write.callbacks) {
+        block(entity, error);
+      }
+  }];
+}
+
+@end
@@ -0,0 +1,69 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+
+typedef void (^CloudFetchSchedulerFetch)(NSString *topicID);
+
+// Normal spreads fetches over the window.  High fetches right away, for
+// latency-sensitive applications, at the cost of joining the herd.
+typedef enum { CloudFetchPriorityNormal, CloudFetchPriorityHigh }
+    CloudFetchPriority;
+
+// Delays applied to the fetches since the last reset, in seconds.  Pushes
+// which arrived while a fetch of their topic was waiting are counted as
+// coalesced.
+typedef struct {
+  NSUInteger fetchCount;
+  NSUInteger coalescedCount;
+  NSTimeInterval minDelay;
+  NSTimeInterval maxDelay;
+  NSTimeInterval meanDelay;
+  NSTimeInterval standardDeviation;
+} CloudFetchSpread;
+
+typedef void (^CloudFetchSchedulerSpreadHandler)(CloudFetchSpread spread);
+
+// Spreads the fetches that a push notification to many devices sets off.
+// Every device waits a random delay, uniformly distributed over the window,
+// before it fetches, so that the backend sees the fetches at an even rate
+// instead of all at once.  Pushes for a topic whose fetch is waiting are
+// answered by that fetch.
+// Used on the main thread.
+@interface CloudFetchScheduler : NSObject
+
+// Time the fetches are spread over, in seconds.
+@property(nonatomic) NSTimeInterval window;
+// CloudFetchPriorityNormal by default.
+@property(nonatomic) CloudFetchPriority priority;
+// Spread of the fetches made so far.
+@property(nonatomic, readonly) CloudFetchSpread spread;
+// Called with the spread after every fetch, e.g. to log or chart it.
+@property(nonatomic, copy) CloudFetchSchedulerSpreadHandler spreadHandler;
+
+// Create a scheduler which passes the topic IDs due to the fetch block.
+- (id)initWithWindow:(NSTimeInterval)window
+               fetch:(CloudFetchSchedulerFetch)fetch;
+
+// Schedule a fetch of the topic, unless one is waiting already.
+- (void)scheduleFetchForTopicID:(NSString *)topicID;
+
+// Fetch the waiting topics now.
+- (void)flush;
+
+// Start a new spread.
+- (void)resetSpread;
+
+@end
@@ -0,0 +1,117 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+
+#import "CloudFetchScheduler.h"
+
+@interface CloudFetchScheduler() {
+  CloudFetchSchedulerFetch _fetch;
+  // Key is topic ID as NSString, object is the time the fetch was scheduled
+  // at as NSDate.
+  NSMutableDictionary *_scheduledFetches;
+  // Sum of squared deviations from the mean delay
+  double _squaredDeviationSum;
+}
+@end
+
+
+@implementation CloudFetchScheduler
+
+- (id)initWithWindow:(NSTimeInterval)window
+               fetch:(CloudFetchSchedulerFetch)fetch {
+  self = [super init];
+  if (self) {
+    _window = window;
+    _fetch = [fetch copy];
+    _scheduledFetches = [NSMutableDictionary dictionary];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (void)scheduleFetchForTopicID:(NSString *)topicID {
+  if (!topicID) {
+    return;
+  }
+
+  if (_scheduledFetches[topicID]) {
+    _spread.coalescedCount++;
+    return;
+  }
+
+  NSTimeInterval delay = 0;
+  if (_priority == CloudFetchPriorityNormal && _window > 0) {
+    delay = _window * arc4random_uniform(10001) / 10000.0;
+  }
+
+  NSDate *scheduledDate = [NSDate date];
+  _scheduledFetches[topicID] = scheduledDate;
+  dispatch_time_t time =
+      dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC));
+  dispatch_after(time, dispatch_get_main_queue(), ^{
+      // Skip the fetch if a flush made it already
+      if (_scheduledFetches[topicID] == scheduledDate) {
+        [self fetchTopicID:topicID];
+      }
+  });
+}
+
+- (void)flush {
+  for (NSString *topicID in [_scheduledFetches allKeys]) {
+    [self fetchTopicID:topicID];
+  }
+}
+
+- (void)resetSpread {
+  memset(&_spread, 0, sizeof(_spread));
+  _squaredDeviationSum = 0;
+}
+
+#pragma mark - Private methods
+
+- (void)fetchTopicID:(NSString *)topicID {
+  NSDate *scheduledDate = _scheduledFetches[topicID];
+  [_scheduledFetches removeObjectForKey:topicID];
+  [self addDelayToSpread:-[scheduledDate timeIntervalSinceNow]];
+
+  if (_fetch) {
+    _fetch(topicID);
+  }
+  if (_spreadHandler) {
+    _spreadHandler(_spread);
+  }
+}
+
+// Update the spread with Welford's method, which needs no history of delays.
+- (void)addDelayToSpread:(NSTimeInterval)delay {
+  _spread.fetchCount++;
+  if (_spread.fetchCount == 1) {
+    _spread.minDelay = delay;
+    _spread.maxDelay = delay;
+  } else {
+    _spread.minDelay = MIN(_spread.minDelay, delay);
+    _spread.maxDelay = MAX(_spread.maxDelay, delay);
+  }
+
+  double deviation = delay - _spread.meanDelay;
+  _spread.meanDelay += deviation / _spread.fetchCount;
+  _squaredDeviationSum += deviation * (delay - _spread.meanDelay);
+  _spread.standardDeviation = sqrt(_squaredDeviationSum / _spread.fetchCount);
+}
+
+@end
@@ -0,0 +1,53 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudFilter.h"
+
+// Defines the constant a filter folds to, if any.  A tautology matches every
+// entity, a contradiction none.
+typedef enum { CloudFilterFoldNone, CloudFilterFoldTautology,
+  CloudFilterFoldContradiction } CloudFilterFold;
+
+// Rewrites filters into a canonical form, so that filters which ask the
+// backend the same question are equal and as small as possible:
+//   - nested AND and OR filters are flattened into their parent,
+//   - children of AND and OR and values of IN are sorted and deduplicated,
+//     and IN with a single value becomes EQ,
+//   - range filters on a property within an AND are reduced to the tightest
+//     bounds, and bounds that exclude each other fold the AND to a
+//     contradiction,
+//   - contradictions and tautologies are folded into their parents.
+// Equality filters are not folded against each other: a list property can
+// hold both values of "x = 1 AND x = 2".
+@interface CloudFilter (Normalization)
+
+// Return the canonical form of the filter.  Return nil if the filter folds to
+// a constant, which is then stored at fold.  fold may be NULL.
+- (CloudFilter *)normalizedFilterWithFold:(CloudFilterFold *)fold;
+
+// Return a byte encoding of the canonical form of the filter, which is equal
+// for equal canonical filters and stable across launches and devices.
+- (NSData *)canonicalEncoding;
+
+// Same as normalizedFilterWithFold: for a filterDto.  A nil filterDto folds to
+// a tautology.
++ (GTLMobilebackendFilterDto *)normalizedFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto fold:(CloudFilterFold *)fold;
+
+// Same as canonicalEncoding for a filterDto.
++ (NSData *)canonicalEncodingOfFilterDto:(GTLMobilebackendFilterDto *)filterDto;
+
+@end
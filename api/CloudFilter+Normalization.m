@@ -0,0 +1,480 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudFilter+Normalization.h"
+#import "GTLDateTime.h"
+
+// Tags of the canonical encoding.  Lengths and counts are unsigned LEB128,
+// numbers are 8 bytes big endian.
+static const uint8_t kTagTautology = 'T';
+static const uint8_t kTagContradiction = 'F';
+static const uint8_t kTagFilter = 'f';
+static const uint8_t kTagNull = 'n';
+static const uint8_t kTagBoolean = 'b';
+static const uint8_t kTagInteger = 'i';
+static const uint8_t kTagDouble = 'd';
+static const uint8_t kTagString = 's';
+static const uint8_t kTagArray = 'a';
+static const uint8_t kTagObject = 'o';
+
+static void AppendByte(NSMutableData *data, uint8_t byte) {
+  [data appendBytes:&byte length:1];
+}
+
+static void AppendVarint(NSMutableData *data, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      byte |= 0x80;
+    }
+    AppendByte(data, byte);
+  } while (value);
+}
+
+static void AppendUInt64(NSMutableData *data, uint64_t value) {
+  uint64_t bigEndian = CFSwapInt64HostToBig(value);
+  [data appendBytes:&bigEndian length:sizeof(bigEndian)];
+}
+
+static void AppendString(NSMutableData *data, NSString *string) {
+  NSData *utf8 = [string dataUsingEncoding:NSUTF8StringEncoding];
+  AppendVarint(data, [utf8 length]);
+  [data appendData:utf8];
+}
+
+// Dates are encoded the way they are sent, as RFC 3339 strings, and integral
+// numbers alike whether they were parsed as integers or as doubles.
+static void AppendValue(NSMutableData *data, id value) {
+  if (!value || value == [NSNull null]) {
+    AppendByte(data, kTagNull);
+  } else if ([value isKindOfClass:[NSNumber class]]) {
+    if (CFGetTypeID((__bridge CFTypeRef)value) == CFBooleanGetTypeID()) {
+      AppendByte(data, kTagBoolean);
+      AppendByte(data, [value boolValue] ? 1 : 0);
+      return;
+    }
+
+    double doubleValue = [value doubleValue];
+    long long integerValue = [value longLongValue];
+    if ((double)integerValue == doubleValue) {
+      AppendByte(data, kTagInteger);
+      AppendUInt64(data, (uint64_t)integerValue);
+    } else {
+      uint64_t bits;
+      memcpy(&bits, &doubleValue, sizeof(bits));
+      AppendByte(data, kTagDouble);
+      AppendUInt64(data, bits);
+    }
+  } else if ([value isKindOfClass:[NSString class]]) {
+    AppendByte(data, kTagString);
+    AppendString(data, value);
+  } else if ([value isKindOfClass:[GTLDateTime class]]) {
+    AppendByte(data, kTagString);
+    AppendString(data, [value RFC3339String]);
+  } else if ([value isKindOfClass:[NSDate class]]) {
+    // CloudFilter sends dates in the local time zone
+    GTLDateTime *dateTime =
+        [GTLDateTime dateTimeWithDate:value
+                             timeZone:[NSTimeZone localTimeZone]];
+    AppendByte(data, kTagString);
+    AppendString(data, [dateTime RFC3339String]);
+  } else if ([value isKindOfClass:[NSArray class]]) {
+    AppendByte(data, kTagArray);
+    AppendVarint(data, [value count]);
+    for (id item in value) {
+      AppendValue(data, item);
+    }
+  } else if ([value isKindOfClass:[NSDictionary class]]) {
+    NSArray *keys =
+        [[value allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    AppendByte(data, kTagObject);
+    AppendVarint(data, [keys count]);
+    for (NSString *key in keys) {
+      AppendString(data, key);
+      AppendValue(data, value[key]);
+    }
+  } else {
+    AppendByte(data, kTagString);
+    AppendString(data, [value description]);
+  }
+}
+
+static void AppendFilter(NSMutableData *data,
+                         GTLMobilebackendFilterDto *filterDto) {
+  AppendByte(data, kTagFilter);
+  NSString *operatorName = filterDto.operatorProperty;
+  AppendString(data, operatorName ? operatorName : @"");
+
+  NSArray *values = filterDto.values;
+  AppendVarint(data, [values count]);
+  for (id value in values) {
+    AppendValue(data, value);
+  }
+
+  NSArray *subfilters = filterDto.subfilters;
+  AppendVarint(data, [subfilters count]);
+  for (GTLMobilebackendFilterDto *subfilter in subfilters) {
+    AppendFilter(data, subfilter);
+  }
+
+  AppendValue(data, filterDto.datastoreFilter.JSON);
+}
+
+static NSData *EncodingOfFilter(id filterDto) {
+  NSMutableData *data = [NSMutableData data];
+  AppendFilter(data, filterDto);
+  return data;
+}
+
+static NSData *EncodingOfValue(id value) {
+  NSMutableData *data = [NSMutableData data];
+  AppendValue(data, value);
+  return data;
+}
+
+// Order encodings by their bytes, a shorter encoding first when it is a
+// prefix of the other.
+static NSComparisonResult CompareEncodings(NSData *data, NSData *other) {
+  NSUInteger length = MIN([data length], [other length]);
+  int result = memcmp([data bytes], [other bytes], length);
+  if (result == 0) {
+    if ([data length] == [other length]) {
+      return NSOrderedSame;
+    }
+    result = [data length] < [other length] ? -1 : 1;
+  }
+  return result < 0 ? NSOrderedAscending : NSOrderedDescending;
+}
+
+// Return the objects without duplicates, in the order of their encodings.
+static NSArray *SortedUniqueObjects(NSArray *objects,
+                                    NSData *(*encode)(id)) {
+  NSMutableDictionary *objectsByEncoding =
+      [NSMutableDictionary dictionaryWithCapacity:[objects count]];
+  for (id object in objects) {
+    NSData *encoding = encode(object);
+    if (!objectsByEncoding[encoding]) {
+      objectsByEncoding[encoding] = object;
+    }
+  }
+
+  NSArray *encodings = [[objectsByEncoding allKeys]
+      sortedArrayUsingComparator:^NSComparisonResult(id data, id other) {
+          return CompareEncodings(data, other);
+      }];
+  return [objectsByEncoding objectsForKeys:encodings
+                            notFoundMarker:[NSNull null]];
+}
+
+// Return the date of a range bound, or nil if it is not a date.  Dates which
+// went through JSON are RFC 3339 strings.
+static NSDate *DateOfBound(id value) {
+  static NSRegularExpression *dateExpression;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    dateExpression = [NSRegularExpression
+        regularExpressionWithPattern:@"^\\d{4}-\\d{2}-\\d{2}"
+                                     @"([Tt ]\\d{2}:\\d{2}:\\d{2}(\\.\\d+)?"
+                                     @"([Zz]|[+-]\\d{2}:\\d{2})?)?$"
+                             options:0
+                               error:NULL];
+  });
+
+  if ([value isKindOfClass:[GTLDateTime class]]) {
+    return [value date];
+  } else if ([value isKindOfClass:[NSString class]] &&
+             [dateExpression numberOfMatchesInString:value
+                                             options:0
+                                               range:NSMakeRange(0,
+                                                   [value length])]) {
+    return [[GTLDateTime dateTimeWithRFC3339String:value] date];
+  }
+  return nil;
+}
+
+// Compare two range bounds.  Return NO if their order is not known for sure:
+// values of different types, or strings that order differently as dates.
+static BOOL CompareBounds(id value, id other, NSComparisonResult *result) {
+  if ([value isKindOfClass:[NSNumber class]] &&
+      [other isKindOfClass:[NSNumber class]]) {
+    *result = [value compare:other];
+    return YES;
+  }
+
+  NSDate *date = DateOfBound(value);
+  NSDate *otherDate = DateOfBound(other);
+  if ([value isKindOfClass:[NSString class]] &&
+      [other isKindOfClass:[NSString class]]) {
+    *result = [value compare:other options:NSLiteralSearch];
+    if (date || otherDate) {
+      return date && otherDate && [date compare:otherDate] == *result;
+    }
+    return YES;
+  }
+
+  if (date && otherDate) {
+    *result = [date compare:otherDate];
+    return YES;
+  }
+  return NO;
+}
+
+static BOOL IsLowerBoundOperator(NSString *operatorName) {
+  return [operatorName isEqualToString:@"GT"] ||
+         [operatorName isEqualToString:@"GE"];
+}
+
+static BOOL IsUpperBoundOperator(NSString *operatorName) {
+  return [operatorName isEqualToString:@"LT"] ||
+         [operatorName isEqualToString:@"LE"];
+}
+
+static BOOL IsInclusiveOperator(NSString *operatorName) {
+  return [operatorName isEqualToString:@"GE"] ||
+         [operatorName isEqualToString:@"LE"];
+}
+
+
+@implementation CloudFilter (Normalization)
+
+#pragma mark - Public methods
+
+- (CloudFilter *)normalizedFilterWithFold:(CloudFilterFold *)fold {
+  GTLMobilebackendFilterDto *normalized =
+      [CloudFilter normalizedFilterDto:self.filterDto fold:fold];
+  if (!normalized) {
+    return nil;
+  }
+  return [CloudFilter cloudFilterWithFilterDto:normalized];
+}
+
+- (NSData *)canonicalEncoding {
+  return [CloudFilter canonicalEncodingOfFilterDto:self.filterDto];
+}
+
++ (GTLMobilebackendFilterDto *)normalizedFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto fold:(CloudFilterFold *)fold {
+  CloudFilterFold result = CloudFilterFoldTautology;
+  GTLMobilebackendFilterDto *normalized = nil;
+  if (filterDto) {
+    result = CloudFilterFoldNone;
+    normalized = [self normalizeFilterDto:filterDto fold:&result];
+  }
+
+  if (fold) {
+    *fold = result;
+  }
+  return normalized;
+}
+
++ (NSData *)canonicalEncodingOfFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto {
+  CloudFilterFold fold;
+  GTLMobilebackendFilterDto *normalized =
+      [self normalizedFilterDto:filterDto fold:&fold];
+
+  NSMutableData *data = [NSMutableData data];
+  if (fold == CloudFilterFoldTautology) {
+    AppendByte(data, kTagTautology);
+  } else if (fold == CloudFilterFoldContradiction) {
+    AppendByte(data, kTagContradiction);
+  } else {
+    AppendFilter(data, normalized);
+  }
+  return data;
+}
+
+#pragma mark - Private methods
+
++ (GTLMobilebackendFilterDto *)normalizeFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto fold:(CloudFilterFold *)fold {
+  NSString *operatorName = filterDto.operatorProperty;
+
+  // A raw datastore filter is sent as it is
+  if (filterDto.datastoreFilter) {
+    return [filterDto copy];
+  }
+
+  if ([operatorName isEqualToString:@"AND"] ||
+      [operatorName isEqualToString:@"OR"]) {
+    return [self normalizeJunctionFilterDto:filterDto fold:fold];
+  } else if ([operatorName isEqualToString:@"IN"]) {
+    return [self normalizeInFilterDto:filterDto fold:fold];
+  }
+  return [filterDto copy];
+}
+
++ (GTLMobilebackendFilterDto *)normalizeJunctionFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto fold:(CloudFilterFold *)fold {
+  NSString *operatorName = filterDto.operatorProperty;
+  BOOL isAnd = [operatorName isEqualToString:@"AND"];
+  // AND is absorbed by a contradiction and ignores tautologies, OR the other
+  // way round
+  CloudFilterFold absorbing =
+      isAnd ? CloudFilterFoldContradiction : CloudFilterFoldTautology;
+
+  NSMutableArray *children = [NSMutableArray array];
+  for (GTLMobilebackendFilterDto *subfilter in filterDto.subfilters) {
+    CloudFilterFold childFold = CloudFilterFoldNone;
+    GTLMobilebackendFilterDto *child =
+        [self normalizeFilterDto:subfilter fold:&childFold];
+    if (childFold == absorbing) {
+      *fold = absorbing;
+      return nil;
+    } else if (childFold != CloudFilterFoldNone) {
+      continue;
+    }
+
+    if ([child.operatorProperty isEqualToString:operatorName] &&
+        !child.datastoreFilter) {
+      [children addObjectsFromArray:child.subfilters];
+    } else {
+      [children addObject:child];
+    }
+  }
+
+  if (isAnd) {
+    children = [self tightenRangeFilterDtos:children fold:fold];
+    if (!children) {
+      return nil;
+    }
+  }
+
+  NSArray *uniqueChildren =
+      SortedUniqueObjects(children, EncodingOfFilter);
+  if ([uniqueChildren count] == 0) {
+    *fold = isAnd ? CloudFilterFoldTautology : CloudFilterFoldContradiction;
+    return nil;
+  } else if ([uniqueChildren count] == 1) {
+    return uniqueChildren[0];
+  }
+
+  GTLMobilebackendFilterDto *normalized = [GTLMobilebackendFilterDto object];
+  normalized.operatorProperty = operatorName;
+  normalized.subfilters = uniqueChildren;
+  return normalized;
+}
+
++ (GTLMobilebackendFilterDto *)normalizeInFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto fold:(CloudFilterFold *)fold {
+  NSArray *values = filterDto.values;
+  if ([values count] == 0) {
+    return [filterDto copy];
+  }
+
+  NSArray *operands = SortedUniqueObjects(
+      [values subarrayWithRange:NSMakeRange(1, [values count] - 1)],
+      EncodingOfValue);
+  if ([operands count] == 0) {
+    *fold = CloudFilterFoldContradiction;
+    return nil;
+  }
+
+  GTLMobilebackendFilterDto *normalized = [GTLMobilebackendFilterDto object];
+  normalized.operatorProperty = [operands count] == 1 ? @"EQ" : @"IN";
+  normalized.values = [@[values[0]] arrayByAddingObjectsFromArray:operands];
+  return normalized;
+}
+
+// Keep only the tightest lower and upper bound of the range filters on each
+// property among the children of an AND; a single value of the property has
+// to satisfy all of them.  Return nil if the bounds exclude each other.
++ (NSMutableArray *)tightenRangeFilterDtos:(NSArray *)filterDtos
+                                      fold:(CloudFilterFold *)fold {
+  NSMutableArray *result = [NSMutableArray array];
+  // Key is property name as NSString, object is NSMutableArray of range
+  // filterDto on the property.
+  NSMutableDictionary *rangesByProperty = [NSMutableDictionary dictionary];
+  for (GTLMobilebackendFilterDto *filterDto in filterDtos) {
+    NSString *operatorName = filterDto.operatorProperty;
+    NSArray *values = filterDto.values;
+    BOOL isRange = IsLowerBoundOperator(operatorName) ||
+                   IsUpperBoundOperator(operatorName);
+    if (!isRange || [values count] != 2 ||
+        ![values[0] isKindOfClass:[NSString class]]) {
+      [result addObject:filterDto];
+      continue;
+    }
+
+    NSMutableArray *ranges = rangesByProperty[values[0]];
+    if (!ranges) {
+      ranges = [NSMutableArray array];
+      rangesByProperty[values[0]] = ranges;
+    }
+    [ranges addObject:filterDto];
+  }
+
+  for (NSString *property in rangesByProperty) {
+    NSArray *ranges = rangesByProperty[property];
+    GTLMobilebackendFilterDto *lower = nil;
+    GTLMobilebackendFilterDto *upper = nil;
+    BOOL isComparable = YES;
+
+    for (GTLMobilebackendFilterDto *range in ranges) {
+      BOOL isLower = IsLowerBoundOperator(range.operatorProperty);
+      GTLMobilebackendFilterDto *bound = isLower ? lower : upper;
+      if (bound) {
+        NSComparisonResult order;
+        if (!CompareBounds(range.values[1], bound.values[1], &order)) {
+          isComparable = NO;
+          break;
+        }
+        // A higher lower bound or a lower upper bound is tighter, and an
+        // exclusive bound at the same value
+        BOOL isTighter = (order == NSOrderedSame)
+            ? !IsInclusiveOperator(range.operatorProperty)
+            : (order == NSOrderedDescending) == isLower;
+        if (!isTighter) {
+          continue;
+        }
+      }
+
+      if (isLower) {
+        lower = range;
+      } else {
+        upper = range;
+      }
+    }
+
+    if (!isComparable) {
+      [result addObjectsFromArray:ranges];
+      continue;
+    }
+
+    NSComparisonResult order;
+    if (lower && upper &&
+        CompareBounds(lower.values[1], upper.values[1], &order)) {
+      BOOL isEmpty = (order == NSOrderedDescending) ||
+          (order == NSOrderedSame &&
+           !(IsInclusiveOperator(lower.operatorProperty) &&
+             IsInclusiveOperator(upper.operatorProperty)));
+      if (isEmpty) {
+        *fold = CloudFilterFoldContradiction;
+        return nil;
+      }
+    }
+
+    if (lower) {
+      [result addObject:lower];
+    }
+    if (upper) {
+      [result addObject:upper];
+    }
+  }
+  return result;
+}
+
+@end
@@ -26,6 +26,10 @@ typedef enum { FilterOperatorEQ, FilterOperatorLT, FilterOperatorLE,
 
 @property(nonatomic, strong) GTLMobilebackendFilterDto *filterDto;
 
+// Wrap an existing filterDto, e.g. the filter of a query, to combine it with
+// other filters.
++ (CloudFilter *)cloudFilterWithFilterDto:(GTLMobilebackendFilterDto *)dto;
+
 // Create a Filter for EQUAL operation.
 + (CloudFilter *)cloudFilterEq:(NSString *)property value:(id)value;
 
@@ -68,6 +68,12 @@ static NSArray *operators;
   return nil;
 }
 
++ (CloudFilter *)cloudFilterWithFilterDto:(GTLMobilebackendFilterDto *)dto {
+  CloudFilter *f = [[CloudFilter alloc] init];
+  f.filterDto = dto;
+  return f;
+}
+
 + (CloudFilter *)cloudFilterEq:(NSString *)property value:(id)value {
   return [self filterWithOperator:FilterOperatorEQ
                          property:property
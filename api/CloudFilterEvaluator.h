@@ -0,0 +1,71 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+#import "CloudFilter.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Types of property values, in the order the backend sorts values of
+// different types.  Dates include RFC 3339 strings, as entities hold date
+// properties; Other is arrays and dictionaries, which have no order.
+typedef enum { CloudFilterValueRankNull, CloudFilterValueRankNumber,
+  CloudFilterValueRankDate, CloudFilterValueRankBoolean,
+  CloudFilterValueRankString, CloudFilterValueRankOther }
+  CloudFilterValueRank;
+
+// Evaluates a CloudFilter against CloudEntity objects held on the device.
+// The filter tree is compiled once into a predicate: filter values are
+// converted up front (dates sent as GTLDateTime or RFC 3339 strings become
+// NSDate, IN values become a set) so that evaluation is a walk over
+// precomputed comparisons.  Date properties, which entities hold as RFC 3339
+// strings, are compared to date values as dates.
+// Values are compared the way the backend compares them: only values of the
+// same type compare, so a comparison between values of different types is
+// false, NE included, and a missing property matches no filter.  A list
+// matches when any of its elements does.
+@interface CloudFilterEvaluator : NSObject
+
+// Compile a filter.  A nil filter matches every entity.
++ (CloudFilterEvaluator *)evaluatorWithFilter:(CloudFilter *)filter;
+
+// Compile the filter of a query, or the filterDto of a CloudFilter.
++ (CloudFilterEvaluator *)evaluatorWithFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto;
+
+// Return YES if the entity matches the filter.
+- (BOOL)evaluateWithEntity:(CloudEntity *)entity;
+
+// Return the entities of the array that match the filter, in array order.
+- (NSArray *)filteredArrayUsingEntities:(NSArray *)entities;
+
+// Answer a query from the given CloudEntity array as the backend would: the
+// entities of the query kind that match its filter, in its sort order and
+// within its limit.  Entities without the sort property are left out.
++ (NSArray *)resultOfQuery:(GTLMobilebackendQueryDto *)query
+              withEntities:(NSArray *)entities;
+
+// Return the date a value stands for: an NSDate, a GTLDateTime or an RFC 3339
+// string.  Return nil for any other value.
++ (NSDate *)dateFromValue:(id)value;
+
+// Return the type of a value; nil counts as NSNull.
++ (CloudFilterValueRank)rankOfValue:(id)value;
+
+// Order two values the way the backend sorts them: by type first, then by
+// value within a type.  Values of type Other are all the same.
++ (NSComparisonResult)compareValue:(id)value toValue:(id)otherValue;
+
+@end
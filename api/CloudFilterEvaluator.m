@@ -0,0 +1,384 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudFilterEvaluator.h"
+#import "GTLDateTime.h"
+
+typedef BOOL (^CloudFilterPredicate)(CloudEntity *entity);
+
+// Return the date a value stands for, or nil.  Dates are GTLDateTime when set
+// through CloudFilter, and RFC 3339 strings once they went through JSON, as
+// the filter values of a filterDto and the date properties of an entity have.
+static NSDate *CloudFilterDateFromValue(id value) {
+  if ([value isKindOfClass:[NSDate class]]) {
+    return value;
+  }
+  if ([value isKindOfClass:[GTLDateTime class]]) {
+    return [value date];
+  }
+  if (![value isKindOfClass:[NSString class]]) {
+    return nil;
+  }
+
+  // Only parse strings shaped like "yyyy-mm-ddThh:mm", which GTLDateTime
+  // would otherwise turn into an arbitrary date
+  NSString *string = value;
+  if ([string length] < 16 || [string characterAtIndex:4] != '-' ||
+      [string characterAtIndex:7] != '-' ||
+      ([string characterAtIndex:10] != 'T' &&
+       [string characterAtIndex:10] != 't') ||
+      [string characterAtIndex:13] != ':') {
+    return nil;
+  }
+  NSCharacterSet *digits = [NSCharacterSet decimalDigitCharacterSet];
+  for (NSUInteger i = 0; i < 16; i++) {
+    if (i == 4 || i == 7 || i == 10 || i == 13) {
+      continue;
+    }
+    if (![digits characterIsMember:[string characterAtIndex:i]]) {
+      return nil;
+    }
+  }
+  return [[GTLDateTime dateTimeWithRFC3339String:string] date];
+}
+
+// Return YES if the value of a property, or any element of a list value,
+// passes the test.  A missing property and an empty list never match, as the
+// backend does not index them.
+static BOOL CloudFilterAnyValuePasses(id value, BOOL (^test)(id element)) {
+  if (!value) {
+    return NO;
+  }
+  if ([value isKindOfClass:[NSArray class]]) {
+    for (id element in value) {
+      if (test(element)) {
+        return YES;
+      }
+    }
+    return NO;
+  }
+  return test(value);
+}
+
+// A filter value together with its type and the form it is compared in,
+// which are worked out when the filter is compiled.
+@interface CloudFilterOperand : NSObject
+@property(nonatomic, strong) id value;
+@property(nonatomic) CloudFilterValueRank rank;
+
+// Compare an entity value, not a list, to the operand.  Return NO if the
+// values cannot be compared: the backend only compares values of the same
+// type, and never arrays or dictionaries.
+- (BOOL)compareEntityValue:(id)entityValue
+                    result:(NSComparisonResult *)result;
+@end
+
+@implementation CloudFilterOperand
+
++ (CloudFilterOperand *)operandWithValue:(id)value {
+  CloudFilterOperand *operand = [[CloudFilterOperand alloc] init];
+  operand.rank = [CloudFilterEvaluator rankOfValue:value];
+  operand.value = (operand.rank == CloudFilterValueRankDate)
+      ? CloudFilterDateFromValue(value) : value;
+  return operand;
+}
+
+- (BOOL)compareEntityValue:(id)entityValue
+                    result:(NSComparisonResult *)result {
+  if (_rank == CloudFilterValueRankOther ||
+      [CloudFilterEvaluator rankOfValue:entityValue] != _rank) {
+    return NO;
+  }
+
+  switch (_rank) {
+    case CloudFilterValueRankNull:
+      *result = NSOrderedSame;
+      break;
+    case CloudFilterValueRankDate:
+      *result = [CloudFilterDateFromValue(entityValue) compare:_value];
+      break;
+    default:
+      *result = [entityValue compare:_value];
+      break;
+  }
+  return YES;
+}
+
+@end
+
+
+@interface CloudFilterEvaluator() {
+  CloudFilterPredicate _predicate;
+}
+@end
+
+
+@implementation CloudFilterEvaluator
+
+static NSDictionary *gOperatorsByName;
+
++ (void)initialize {
+  gOperatorsByName = @{
+    @"EQ": @(FilterOperatorEQ), @"LT": @(FilterOperatorLT),
+    @"LE": @(FilterOperatorLE), @"GT": @(FilterOperatorGT),
+    @"GE": @(FilterOperatorGE), @"NE": @(FilterOperatorNE),
+    @"IN": @(FilterOperatorIN), @"AND": @(FilterOperatorAND),
+    @"OR": @(FilterOperatorOR)
+  };
+}
+
++ (CloudFilterEvaluator *)evaluatorWithFilter:(CloudFilter *)filter {
+  return [self evaluatorWithFilterDto:filter.filterDto];
+}
+
++ (CloudFilterEvaluator *)evaluatorWithFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto {
+  CloudFilterEvaluator *evaluator = [[CloudFilterEvaluator alloc] init];
+  if (filterDto) {
+    evaluator->_predicate = [self predicateWithFilterDto:filterDto];
+  } else {
+    evaluator->_predicate = ^BOOL(CloudEntity *entity) {
+        return YES;
+    };
+  }
+  return evaluator;
+}
+
+- (BOOL)evaluateWithEntity:(CloudEntity *)entity {
+  return _predicate(entity);
+}
+
+- (NSArray *)filteredArrayUsingEntities:(NSArray *)entities {
+  NSMutableArray *matches = [NSMutableArray array];
+  for (CloudEntity *entity in entities) {
+    if (_predicate(entity)) {
+      [matches addObject:entity];
+    }
+  }
+  return matches;
+}
+
++ (NSArray *)resultOfQuery:(GTLMobilebackendQueryDto *)query
+              withEntities:(NSArray *)entities {
+  CloudFilterEvaluator *evaluator =
+      [self evaluatorWithFilterDto:query.filterDto];
+  NSString *kindName = query.kindName;
+
+  // The backend only sorts entities which have the sort property
+  NSString *sortName = query.sortedPropertyName;
+  NSMutableArray *results = [NSMutableArray array];
+  for (CloudEntity *entity in entities) {
+    if ((!kindName || [entity.kindName isEqualToString:kindName]) &&
+        (!sortName || [self hasValueForFieldName:sortName entity:entity]) &&
+        [evaluator evaluateWithEntity:entity]) {
+      [results addObject:entity];
+    }
+  }
+
+  if (sortName) {
+    NSComparator comparator =
+        [CloudEntity comparatorForFieldName:sortName
+                                  ascending:[query.sortAscending boolValue]];
+    [results sortUsingComparator:comparator];
+  }
+
+  NSInteger limit = [query.limit integerValue];
+  if (limit > 0 && (NSInteger)[results count] > limit) {
+    [results removeObjectsInRange:
+        NSMakeRange(limit, [results count] - limit)];
+  }
+  return results;
+}
+
++ (NSDate *)dateFromValue:(id)value {
+  return CloudFilterDateFromValue(value);
+}
+
++ (CloudFilterValueRank)rankOfValue:(id)value {
+  if (!value || value == [NSNull null]) {
+    return CloudFilterValueRankNull;
+  }
+  if ([value isKindOfClass:[NSNumber class]]) {
+    // JSON true and false are the CFBoolean singletons
+    BOOL isBoolean =
+        CFGetTypeID((__bridge CFTypeRef)value) == CFBooleanGetTypeID();
+    return isBoolean ? CloudFilterValueRankBoolean : CloudFilterValueRankNumber;
+  }
+  if (CloudFilterDateFromValue(value)) {
+    return CloudFilterValueRankDate;
+  }
+  if ([value isKindOfClass:[NSString class]]) {
+    return CloudFilterValueRankString;
+  }
+  return CloudFilterValueRankOther;
+}
+
++ (NSComparisonResult)compareValue:(id)value toValue:(id)otherValue {
+  CloudFilterValueRank rank = [self rankOfValue:value];
+  CloudFilterValueRank otherRank = [self rankOfValue:otherValue];
+  if (rank != otherRank) {
+    return rank < otherRank ? NSOrderedAscending : NSOrderedDescending;
+  }
+
+  switch (rank) {
+    case CloudFilterValueRankNumber:
+    case CloudFilterValueRankBoolean:
+    case CloudFilterValueRankString:
+      return [value compare:otherValue];
+    case CloudFilterValueRankDate:
+      return [CloudFilterDateFromValue(value)
+          compare:CloudFilterDateFromValue(otherValue)];
+    default:
+      return NSOrderedSame;
+  }
+}
+
+#pragma mark - Private methods
+
+// Return YES if the entity has a value for the field, which an empty list is
+// not.
++ (BOOL)hasValueForFieldName:(NSString *)name entity:(CloudEntity *)entity {
+  id value = [entity valueForFieldName:name];
+  return value && !([value isKindOfClass:[NSArray class]] &&
+                    [value count] == 0);
+}
+
+#pragma mark - Compilation
+
++ (CloudFilterPredicate)predicateWithFilterDto:
+    (GTLMobilebackendFilterDto *)filterDto {
+  NSNumber *operatorNumber = gOperatorsByName[filterDto.operatorProperty];
+  NSAssert(operatorNumber, @"Not supported operator: %@",
+           filterDto.operatorProperty);
+  if (!operatorNumber) {
+    return ^BOOL(CloudEntity *entity) {
+        return NO;
+    };
+  }
+
+  FilterOperator operator = [operatorNumber intValue];
+  if (operator == FilterOperatorAND || operator == FilterOperatorOR) {
+    return [self predicateWithOperator:operator
+                            subfilters:filterDto.subfilters];
+  }
+
+  NSArray *values = filterDto.values;
+  NSAssert([values count] >= 2, @"Filter has no value: %@", values);
+  if ([values count] < 2) {
+    return ^BOOL(CloudEntity *entity) {
+        return NO;
+    };
+  }
+
+  NSString *property = values[0];
+  NSArray *operands = [values subarrayWithRange:
+      NSMakeRange(1, [values count] - 1)];
+  if (operator == FilterOperatorIN) {
+    return [self predicateWithProperty:property inValues:operands];
+  }
+
+  return [self predicateWithOperator:operator
+                            property:property
+                               value:operands[0]];
+}
+
++ (CloudFilterPredicate)predicateWithOperator:(FilterOperator)operator
+                                   subfilters:(NSArray *)subfilters {
+  NSMutableArray *predicates =
+      [NSMutableArray arrayWithCapacity:[subfilters count]];
+  for (GTLMobilebackendFilterDto *subfilter in subfilters) {
+    [predicates addObject:[self predicateWithFilterDto:subfilter]];
+  }
+
+  BOOL isAnd = (operator == FilterOperatorAND);
+  return ^BOOL(CloudEntity *entity) {
+      // Short-circuit on the first false child for AND, true child for OR
+      for (CloudFilterPredicate predicate in predicates) {
+        if (predicate(entity) != isAnd) {
+          return !isAnd;
+        }
+      }
+      return isAnd;
+  };
+}
+
++ (CloudFilterPredicate)predicateWithOperator:(FilterOperator)operator
+                                     property:(NSString *)property
+                                        value:(id)value {
+  CloudFilterOperand *operand = [CloudFilterOperand operandWithValue:value];
+
+  return ^BOOL(CloudEntity *entity) {
+      id entityValue = [entity valueForFieldName:property];
+      return CloudFilterAnyValuePasses(entityValue, ^BOOL(id element) {
+          NSComparisonResult result;
+          if (![operand compareEntityValue:element result:&result]) {
+            return NO;
+          }
+
+          switch (operator) {
+            case FilterOperatorEQ:
+              return result == NSOrderedSame;
+            case FilterOperatorLT:
+              return result == NSOrderedAscending;
+            case FilterOperatorLE:
+              return result != NSOrderedDescending;
+            case FilterOperatorGT:
+              return result == NSOrderedDescending;
+            case FilterOperatorGE:
+              return result != NSOrderedAscending;
+            case FilterOperatorNE:
+              return result != NSOrderedSame;
+            default:
+              return NO;
+          }
+      });
+  };
+}
+
++ (CloudFilterPredicate)predicateWithProperty:(NSString *)property
+                                     inValues:(NSArray *)values {
+  // Hash lookups per type, so that values equal across types, such as true
+  // and 1, do not match each other.  Key is CloudFilterValueRank as NSNumber,
+  // object is NSMutableSet of values in their compared form.
+  NSMutableDictionary *valueSets = [NSMutableDictionary dictionary];
+  for (id value in values) {
+    CloudFilterOperand *operand = [CloudFilterOperand operandWithValue:value];
+    if (operand.rank == CloudFilterValueRankOther) {
+      continue;
+    }
+    NSMutableSet *valueSet = valueSets[@(operand.rank)];
+    if (!valueSet) {
+      valueSet = [NSMutableSet set];
+      valueSets[@(operand.rank)] = valueSet;
+    }
+    [valueSet addObject:operand.value ? operand.value : [NSNull null]];
+  }
+
+  return ^BOOL(CloudEntity *entity) {
+      id entityValue = [entity valueForFieldName:property];
+      return CloudFilterAnyValuePasses(entityValue, ^BOOL(id element) {
+          CloudFilterValueRank rank = [self rankOfValue:element];
+          NSSet *valueSet = valueSets[@(rank)];
+          if (!valueSet) {
+            return NO;
+          }
+          id key = (rank == CloudFilterValueRankDate)
+              ? CloudFilterDateFromValue(element) : element;
+          return [valueSet containsObject:key];
+      });
+  };
+}
+
+@end
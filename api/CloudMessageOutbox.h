@@ -0,0 +1,57 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+#import "CloudEntity.h"
+
+// Durable queue of outbound cloud messages.  A queued message is appended to
+// a log file before anything is sent, so that messages still queued when the
+// application is terminated are sent after the next launch.  The queue is
+// drained in insertAll batches of up to maxBatchSize messages with at most
+// maxInFlightBatches requests outstanding.  A batch failing with a transient
+// error, such as a lost connection or a server error, stays queued and is
+// retried with exponential backoff, though a message which never got an
+// HTTP status back is dropped after a number of attempts.  A rejected batch
+// of several messages is sent again one message at a time, so that only the
+// messages rejected on their own are dropped.
+// Messages are delivered at least once, and batches in flight together may
+// arrive out of order.  Callbacks are kept in memory only, so messages sent
+// after a relaunch are delivered silently.
+// Used on the main thread.
+@interface CloudMessageOutbox : NSObject
+
+// Number of messages sent in one insertAll request.
+@property(nonatomic) NSUInteger maxBatchSize;
+// Number of insertAll requests outstanding at any time.
+@property(nonatomic) NSUInteger maxInFlightBatches;
+
+// Open the outbox at the given path, creating the file if needed.  Messages
+// left in the file are sent on the next drain.
+- (id)initWithPath:(NSString *)path
+          maxBatchSize:(NSUInteger)batchSize
+    maxInFlightBatches:(NSUInteger)inFlightBatches;
+
+// Queue a message and start sending it.  The callback is called once with the
+// inserted entity, or with the error if the backend rejected the message.
+- (void)enqueueMessage:(CloudEntity *)message
+              callback:(CloudEntityQueryCompletionCallback)block;
+
+// Send queued messages, as far as the in-flight bound and backoff allow.
+- (void)drain;
+
+// Number of messages queued, including those in flight.
+- (NSUInteger)count;
+
+@end
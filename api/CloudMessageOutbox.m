@@ -0,0 +1,495 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#import "CloudEntityCollection.h"
+#import "CloudMessageOutbox.h"
+#import "GTLJSONParser.h"
+#import "GTLService.h"
+#import "GTMHTTPFetcher.h"
+
+// Every record in the outbox file is this header followed by the JSON of a
+// queued message.  A record without JSON acknowledges the message of the same
+// sequence number, which was delivered or rejected.
+typedef struct {
+  uint32_t magic;
+  uint32_t valueLength;
+  uint64_t sequence;
+} CloudMessageOutboxRecordHeader;
+
+// A queued message and the callback waiting for it.
+@interface CloudOutboundMessage : NSObject
+@property(nonatomic) uint64_t sequence;
+@property(nonatomic, strong) CloudEntity *message;
+@property(nonatomic, copy) CloudEntityQueryCompletionCallback callback;
+@property(nonatomic) BOOL isInFlight;
+// Set once a batch holding the message was rejected, so that it is sent on
+// its own to tell whether it was the one rejected.
+@property(nonatomic) BOOL isSentAlone;
+// Failed attempts to send the message without an HTTP status in return
+@property(nonatomic) NSUInteger unansweredCount;
+@end
+
+@implementation CloudOutboundMessage
+@end
+
+
+@interface CloudMessageOutbox() {
+  NSString *_path;
+  NSFileHandle *_fileHandle;
+  // Serial queue which the file is synced to disk on
+  dispatch_queue_t _syncQueue;
+  BOOL _isSyncScheduled;
+  // Array of CloudOutboundMessage in the order they were queued.
+  NSMutableArray *_messages;
+  uint64_t _nextSequence;
+  NSUInteger _inFlightBatchCount;
+  // Transient failures in a row, which the backoff grows with
+  NSUInteger _failureCount;
+  BOOL _isBackingOff;
+  // Acknowledgement records in the file
+  NSUInteger _acknowledgementCount;
+}
+@end
+
+
+@implementation CloudMessageOutbox
+
+static const uint32_t kCloudMessageOutboxRecordMagic = 0x314f4d43; // "CMO1"
+// Acknowledgements below which the file is never compacted
+static const NSUInteger kCloudMessageOutboxCompactionMinimum = 64;
+// Backoff after the first transient failure, doubled with every further one
+static const NSTimeInterval kCloudMessageOutboxInitialBackoff = 1.0;
+static const NSTimeInterval kCloudMessageOutboxMaxBackoff = 60.0;
+// Attempts after which a message that never got an HTTP status is dropped
+static const NSUInteger kCloudMessageOutboxMaxUnansweredAttempts = 10;
+
+- (id)initWithPath:(NSString *)path
+          maxBatchSize:(NSUInteger)batchSize
+    maxInFlightBatches:(NSUInteger)inFlightBatches {
+  self = [super init];
+  if (self) {
+    _path = [path copy];
+    _maxBatchSize = MAX(1, batchSize);
+    _maxInFlightBatches = MAX(1, inFlightBatches);
+    _syncQueue = dispatch_queue_create("com.google.cloudmessages.outbox",
+                                       DISPATCH_QUEUE_SERIAL);
+    _messages = [NSMutableArray array];
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (![fileManager fileExistsAtPath:_path]) {
+      [fileManager createFileAtPath:_path contents:nil attributes:nil];
+    }
+
+    unsigned long long validLength = [self loadOutbox];
+
+    // Drop a record which was cut short by a crash, if any
+    _fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+    [_fileHandle truncateFileAtOffset:validLength];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (void)enqueueMessage:(CloudEntity *)message
+              callback:(CloudEntityQueryCompletionCallback)block {
+  if (!message) {
+    return;
+  }
+
+  CloudOutboundMessage *outbound = [[CloudOutboundMessage alloc] init];
+  outbound.sequence = _nextSequence++;
+  outbound.message = message;
+  outbound.callback = block;
+
+  // A message which cannot be written is still sent, it only does not
+  // survive a restart
+  [self appendRecordsForMessages:@[outbound] acknowledgement:NO];
+  [_messages addObject:outbound];
+  [self drain];
+}
+
+- (void)drain {
+  if (_isBackingOff) {
+    return;
+  }
+
+  NSUInteger index = 0;
+  while (_inFlightBatchCount < _maxInFlightBatches) {
+    NSMutableArray *batch = [NSMutableArray array];
+    for (; index < [_messages count] && [batch count] < _maxBatchSize;
+         index++) {
+      CloudOutboundMessage *outbound = _messages[index];
+      if (outbound.isInFlight) {
+        continue;
+      }
+      if (outbound.isSentAlone) {
+        if ([batch count] == 0) {
+          [batch addObject:outbound];
+          index++;
+        }
+        break;
+      }
+      [batch addObject:outbound];
+    }
+
+    if ([batch count] == 0) {
+      return;
+    }
+    [self sendBatch:batch];
+  }
+}
+
+- (NSUInteger)count {
+  return [_messages count];
+}
+
+#pragma mark - Private methods
+
+- (void)sendBatch:(NSArray *)batch {
+  for (CloudOutboundMessage *outbound in batch) {
+    outbound.isInFlight = YES;
+  }
+  _inFlightBatchCount++;
+
+  CloudEntityCollection *entityCollection =
+      [CloudEntityCollection sharedInstance];
+  [entityCollection insertCollectionWithArray:[batch valueForKey:@"message"]
+      callback:^(NSArray *entities, NSError *error) {
+          [self completeBatch:batch withEntities:entities error:error];
+      }];
+}
+
+// Call back the messages of a batch, unless the batch is to be retried.  The
+// backend answers insertAll in request order.  A batch of several messages
+// which was rejected is sent again one message at a time, so that only the
+// messages which are rejected on their own are dropped.
+- (void)completeBatch:(NSArray *)batch
+         withEntities:(NSArray *)entities
+                error:(NSError *)error {
+  _inFlightBatchCount--;
+  for (CloudOutboundMessage *outbound in batch) {
+    outbound.isInFlight = NO;
+  }
+
+  if (error && [self isTransientError:error]) {
+    if (![self isHTTPStatusError:error]) {
+      // Without a status the request may never get through, such as one the
+      // server cannot parse, so it is only retried so many times
+      NSMutableArray *exhausted = [NSMutableArray array];
+      for (CloudOutboundMessage *outbound in batch) {
+        outbound.unansweredCount++;
+        if (outbound.unansweredCount >=
+            kCloudMessageOutboxMaxUnansweredAttempts) {
+          [exhausted addObject:outbound];
+        }
+      }
+      if ([exhausted count]) {
+        NSLog(@"Dropping %lu messages after %lu attempts: %@",
+              (unsigned long)[exhausted count],
+              (unsigned long)kCloudMessageOutboxMaxUnansweredAttempts, error);
+        [self finishMessages:exhausted withEntities:nil error:error];
+      }
+    }
+
+    NSLog(@"Cannot send %lu messages, retrying: %@",
+          (unsigned long)[batch count], error);
+    [self backOff];
+    return;
+  }
+
+  if (error && [batch count] > 1) {
+    NSLog(@"Sending %lu rejected messages one at a time: %@",
+          (unsigned long)[batch count], error);
+    for (CloudOutboundMessage *outbound in batch) {
+      outbound.isSentAlone = YES;
+    }
+    [self drain];
+    return;
+  }
+
+  if (error) {
+    NSLog(@"Dropping rejected message: %@", error);
+  } else {
+    _failureCount = 0;
+  }
+  [self finishMessages:batch withEntities:entities error:error];
+  [self drain];
+}
+
+// Remove delivered or dropped messages from the outbox and call them back
+// with their entities of the response, in order, or with the error.
+- (void)finishMessages:(NSArray *)messages
+          withEntities:(NSArray *)entities
+                 error:(NSError *)error {
+  [_messages removeObjectsInArray:messages];
+  [self appendRecordsForMessages:messages acknowledgement:YES];
+  [self compactIfNeeded];
+
+  [messages enumerateObjectsUsingBlock:^(CloudOutboundMessage *outbound,
+                                         NSUInteger idx, BOOL *stop) {
+      if (outbound.callback) {
+        CloudEntity *entity =
+            (!error && idx < [entities count]) ? entities[idx] : nil;
+        outbound.callback(entity, error);
+      }
+  }];
+}
+
+// Rejected requests are not retried, except for those which may succeed
+// later: expired authorization, timeouts and throttling.  Everything else,
+// such as a lost connection or a server error, is transient.
+- (BOOL)isTransientError:(NSError *)error {
+  if (![self isHTTPStatusError:error]) {
+    return YES;
+  }
+
+  NSInteger status = [error code];
+  if (status < 400 || status >= 500) {
+    return YES;
+  }
+  return status == 401 || status == 408 || status == 429;
+}
+
+// Return YES if the error carries the HTTP status the server answered with.
+// JSON-RPC errors also carry protocol error codes, which are negative.
+- (BOOL)isHTTPStatusError:(NSError *)error {
+  NSString *domain = [error domain];
+  NSInteger code = [error code];
+  return ([domain isEqual:kGTLJSONRPCErrorDomain] ||
+          [domain isEqual:kGTMHTTPFetcherStatusDomain]) &&
+      code >= 100 && code < 600;
+}
+
+// Hold off sending until the backoff of the failures so far elapsed.
+- (void)backOff {
+  _failureCount++;
+  if (_isBackingOff) {
+    return;
+  }
+  _isBackingOff = YES;
+
+  double exponent = MIN(_failureCount - 1, 16);
+  NSTimeInterval delay = MIN(kCloudMessageOutboxMaxBackoff,
+                             kCloudMessageOutboxInitialBackoff *
+                                 pow(2, exponent));
+  // Jitter keeps clients which failed together from retrying together
+  delay *= 0.5 + arc4random_uniform(1001) / 2000.0;
+
+  dispatch_time_t time =
+      dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC));
+  dispatch_after(time, dispatch_get_main_queue(), ^{
+      _isBackingOff = NO;
+      [self drain];
+  });
+}
+
+- (void)appendRecordForMessage:(CloudOutboundMessage *)outbound
+               acknowledgement:(BOOL)isAcknowledgement
+                        toData:(NSMutableData *)data {
+  NSData *value = nil;
+  if (!isAcknowledgement) {
+    NSError *error = nil;
+    value = [GTLJSONParser dataWithObject:outbound.message.innerObject.JSON
+                            humanReadable:NO
+                                    error:&error];
+    if ([value length] == 0) {
+      NSLog(@"Cannot store outbound message: %@", error);
+      return;
+    }
+  }
+
+  CloudMessageOutboxRecordHeader header = {
+    kCloudMessageOutboxRecordMagic,
+    (uint32_t)[value length],
+    outbound.sequence
+  };
+  [data appendBytes:&header length:sizeof(header)];
+  if (value) {
+    [data appendData:value];
+  }
+}
+
+// Append the records of the messages to the file, and have them synced to
+// disk soon.
+- (void)appendRecordsForMessages:(NSArray *)messages
+                 acknowledgement:(BOOL)isAcknowledgement {
+  NSMutableData *data = [NSMutableData data];
+  for (CloudOutboundMessage *outbound in messages) {
+    [self appendRecordForMessage:outbound
+                 acknowledgement:isAcknowledgement
+                          toData:data];
+  }
+
+  if ([data length] == 0) {
+    return;
+  }
+
+  @try {
+    [_fileHandle seekToEndOfFile];
+    [_fileHandle writeData:data];
+  } @catch (NSException *exception) {
+    NSLog(@"Cannot write to outbox %@: %@", _path, exception);
+    return;
+  }
+
+  if (isAcknowledgement) {
+    _acknowledgementCount += [messages count];
+  }
+  [self scheduleSync];
+}
+
+// Sync the file once the current run loop pass is done, so that all records
+// appended in it share one sync.
+- (void)scheduleSync {
+  if (_isSyncScheduled) {
+    return;
+  }
+  _isSyncScheduled = YES;
+
+  dispatch_async(dispatch_get_main_queue(), ^{
+      _isSyncScheduled = NO;
+      // The block keeps the file handle open even if compaction replaces it
+      NSFileHandle *fileHandle = _fileHandle;
+      dispatch_async(_syncQueue, ^{
+          @try {
+            [fileHandle synchronizeFile];
+          } @catch (NSException *exception) {
+            NSLog(@"Cannot sync outbox %@: %@", _path, exception);
+          }
+      });
+  });
+}
+
+// Read the queued messages into memory.  Return the length of the valid
+// records.
+- (unsigned long long)loadOutbox {
+  NSData *data = [NSData dataWithContentsOfFile:_path
+                                        options:NSDataReadingMappedIfSafe
+                                          error:NULL];
+  const uint8_t *bytes = [data bytes];
+  NSUInteger length = [data length];
+  NSUInteger offset = 0;
+  // Key is sequence number as NSNumber, object is CloudOutboundMessage.
+  NSMutableDictionary *messages = [NSMutableDictionary dictionary];
+
+  while (offset + sizeof(CloudMessageOutboxRecordHeader) <= length) {
+    CloudMessageOutboxRecordHeader header;
+    memcpy(&header, bytes + offset, sizeof(header));
+    NSUInteger valueOffset = offset + sizeof(header);
+    if (header.magic != kCloudMessageOutboxRecordMagic ||
+        header.valueLength > length - valueOffset) {
+      break;
+    }
+
+    NSNumber *sequence = @(header.sequence);
+    if (header.valueLength == 0) {
+      [messages removeObjectForKey:sequence];
+      _acknowledgementCount++;
+    } else {
+      CloudOutboundMessage *outbound =
+          [self messageWithBytes:bytes + valueOffset
+                          length:header.valueLength];
+      if (outbound) {
+        outbound.sequence = header.sequence;
+        messages[sequence] = outbound;
+      }
+    }
+    _nextSequence = MAX(_nextSequence, header.sequence + 1);
+    offset = valueOffset + header.valueLength;
+  }
+
+  NSArray *sequences =
+      [[messages allKeys] sortedArrayUsingSelector:@selector(compare:)];
+  [_messages addObjectsFromArray:[messages objectsForKeys:sequences
+                                           notFoundMarker:[NSNull null]]];
+  return offset;
+}
+
+- (CloudOutboundMessage *)messageWithBytes:(const uint8_t *)bytes
+                                    length:(NSUInteger)length {
+  NSData *value = [NSData dataWithBytes:bytes length:length];
+  NSError *error = nil;
+  NSMutableDictionary *json = [GTLJSONParser objectWithData:value
+                                                      error:&error];
+  if (![json isKindOfClass:[NSDictionary class]]) {
+    NSLog(@"Cannot read outbound message from %@: %@", _path, error);
+    return nil;
+  }
+
+  CloudOutboundMessage *outbound = [[CloudOutboundMessage alloc] init];
+  outbound.message = [CloudEntity entityWithRawObject:
+      [GTLMobilebackendEntityDto objectWithJSON:json]];
+  return outbound;
+}
+
+// Empty the file once every message went out, or rewrite it with the queued
+// messages only when acknowledgements pile up.
+- (void)compactIfNeeded {
+  if ([_messages count] == 0) {
+    @try {
+      [_fileHandle truncateFileAtOffset:0];
+    } @catch (NSException *exception) {
+      NSLog(@"Cannot truncate outbox %@: %@", _path, exception);
+      return;
+    }
+    _acknowledgementCount = 0;
+    return;
+  }
+
+  if (_acknowledgementCount <= kCloudMessageOutboxCompactionMinimum ||
+      _acknowledgementCount <= [_messages count]) {
+    return;
+  }
+
+  NSMutableData *data = [NSMutableData data];
+  for (CloudOutboundMessage *outbound in _messages) {
+    [self appendRecordForMessage:outbound acknowledgement:NO toData:data];
+  }
+
+  NSString *compactedPath = [_path stringByAppendingPathExtension:@"tmp"];
+  [[NSFileManager defaultManager] createFileAtPath:compactedPath
+                                          contents:nil
+                                        attributes:nil];
+  NSFileHandle *compactedHandle =
+      [NSFileHandle fileHandleForWritingAtPath:compactedPath];
+  if (!compactedHandle) {
+    NSLog(@"Cannot create compacted outbox at %@", compactedPath);
+    return;
+  }
+
+  @try {
+    [compactedHandle writeData:data];
+    [compactedHandle synchronizeFile];
+  } @catch (NSException *exception) {
+    NSLog(@"Cannot compact outbox %@: %@", _path, exception);
+    return;
+  }
+
+  if (rename([compactedPath fileSystemRepresentation],
+             [_path fileSystemRepresentation]) != 0) {
+    NSLog(@"Cannot replace outbox %@", _path);
+    return;
+  }
+
+  _fileHandle = compactedHandle;
+  _acknowledgementCount = 0;
+}
+
+@end
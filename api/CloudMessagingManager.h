@@ -16,6 +16,7 @@
 #import <Foundation/Foundation.h>
 #import "CloudEntity.h"
 #import "CloudEntityCollection.h"
+#import "CloudFetchScheduler.h"
 
 // Enable a publish and subscribe model on iOS client where messages are
 // persisted by Cloud Mobile Backend.
@@ -32,6 +33,13 @@ extern NSString *const kCloudMessagingPropDuration;
 // TopicId for broadcast messages.
 extern NSString *const kCloudMessagingManagerTopicIDBroadcast;
 
+// Schedules the fetches of broadcast messages.  A broadcast pushes to every
+// device, so each device fetches at a random time within the window of the
+// scheduler rather than all at once.  Set its priority to
+// CloudFetchPriorityHigh to fetch right away, and its spreadHandler to watch
+// the resulting spread.
+@property(nonatomic, readonly) CloudFetchScheduler *broadcastFetchScheduler;
+
 // Shared instance for the GTMObject Singleton Boilerplate
 + (CloudMessagingManager *)sharedInstance;
 
@@ -48,10 +56,13 @@ extern NSString *const kCloudMessagingManagerTopicIDBroadcast;
 // devices.
 - (CloudEntity *)createBroadcastMessage;
 
-// Send a message by persisting the Cloud Entity.
+// Send a message by persisting the Cloud Entity.  Messages are queued on disk
+// until the backend has them, so they are retried after transient errors and
+// across restarts.
 - (void)sendMessage:(CloudEntity *)message;
 
-// Send a message by persisting the Cloud Entity asynchronously.
+// Send a message by persisting the Cloud Entity asynchronously.  The callback
+// is called once the message is delivered or rejected.
 - (void)sendMessage:(NSString *)message
            onFinish:(CloudEntityQueryCompletionCallback)callback;
 
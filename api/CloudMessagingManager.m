@@ -17,17 +17,22 @@
 #import "CloudMessagingManager.h"
 #import "CloudNotificationHandler.h"
 #import "CloudFilter.h"
+#import "CloudMessageOutbox.h"
+#import "CloudWatermarkJournal.h"
 #import "GTLMobilebackendQueryDto.h"
 #import "GTLQueryMobilebackend.h"
 
 @interface CloudMessagingManager() {
-  // Dictionary which can only be accessed via topicHandlerDictionary
+  // Registry which can only be accessed via topicHandlerDictionary
   // method.
   // Key is topic as NSString, object is handler as
   // CloudEntityCollectionQueryCompletion.
-  NSMutableDictionary *_topicHandlerDictionary;
-  // Local plist location
-  NSString *_localPlistLocation;
+  CloudTopicRegistry *_topicHandlerDictionary;
+  // Timestamp of the latest message received per topic.  Key is the pref key
+  // of the topic.
+  CloudWatermarkJournal *_watermarks;
+  // Messages sent but not delivered yet
+  CloudMessageOutbox *_outbox;
 }
 @end
 
@@ -46,6 +51,14 @@ NSString *const kCloudMessagingPrefKeyPrefixMsgTimestamp =
 static const int kCloudMessagingSubscriptionDuration = 0;
 // Max number of past messages to receive
 static const int kCloudMessagingDefaultMaxMessagesToReceive = 100;
+// Seconds within which received timestamps are synced to disk together
+static const NSTimeInterval kCloudMessagingWatermarkCommitInterval = 1.0;
+// Seconds over which the fetches of a broadcast are spread
+static const NSTimeInterval kCloudMessagingBroadcastFetchWindow = 5.0;
+// Max number of messages sent in one request
+static const NSUInteger kCloudMessagingOutboxBatchSize = 50;
+// Max number of message requests outstanding at once
+static const NSUInteger kCloudMessagingOutboxInFlightBatches = 2;
 static CloudMessagingManager *singleton;
 
 + (CloudMessagingManager *)sharedInstance {
@@ -59,47 +72,78 @@ static CloudMessagingManager *singleton;
 
 - (id)init {
   self = [super init];
-  _topicHandlerDictionary = [NSMutableDictionary dictionary];
+  _topicHandlerDictionary = [[CloudTopicRegistry alloc] init];
 
   NSArray *paths = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory,
                                                        NSUserDomainMask,
                                                        YES);
   NSString *documentsDirectory = [paths lastObject];
-  NSString *name = @"com.google.cloudmessages.plist";
-  _localPlistLocation =
+  NSString *name = @"com.google.cloudmessages.journal";
+  NSString *location =
       [documentsDirectory stringByAppendingPathComponent:name];
+  _watermarks = [[CloudWatermarkJournal alloc]
+                    initWithPath:location
+                  commitInterval:kCloudMessagingWatermarkCommitInterval];
+  [self importPlistAtLocation:
+      [documentsDirectory stringByAppendingPathComponent:
+          @"com.google.cloudmessages.plist"]];
+
+  NSString *outboxLocation = [documentsDirectory
+      stringByAppendingPathComponent:@"com.google.cloudmessages.outbox"];
+  _outbox = [[CloudMessageOutbox alloc]
+            initWithPath:outboxLocation
+            maxBatchSize:kCloudMessagingOutboxBatchSize
+      maxInFlightBatches:kCloudMessagingOutboxInFlightBatches];
+
+  _broadcastFetchScheduler = [[CloudFetchScheduler alloc]
+      initWithWindow:kCloudMessagingBroadcastFetchWindow
+               fetch:^(NSString *topicID) {
+                   [[CloudEntityCollection sharedInstance]
+                       refreshTopicsWithIDs:@[topicID]];
+               }];
+
+  // Send the messages left over from the last run
+  dispatch_async(dispatch_get_main_queue(), ^{
+      [_outbox drain];
+  });
+
+  // Do not leave timestamps behind in memory when the application may be
+  // terminated
+  [[NSNotificationCenter defaultCenter]
+      addObserver:_watermarks
+         selector:@selector(synchronize)
+             name:UIApplicationDidEnterBackgroundNotification
+           object:nil];
 
   return self;
 }
 
-- (NSMutableDictionary *)topicHandlerDictionary {
+- (CloudTopicRegistry *)topicHandlerDictionary {
   return _topicHandlerDictionary;
 }
 
-// Return the location of .plist file
-- (NSString *)plistLocation {
-  return _localPlistLocation;
-}
-
-// Refresh an internal dictionary representation of the application .plist file
-- (NSDictionary *)plistDictionary {
-  NSString *location = [self plistLocation];
-  return [[NSDictionary alloc] initWithContentsOfFile:location];
-}
-
-// Write local data value to plist file
-- (void)writeLocalDataWithKey:(NSString *)key
-                         date:(NSDate *)value {
-  NSMutableDictionary *dictionary = [[self plistDictionary] mutableCopy];
-
+// Move the timestamps of the plist file that earlier versions kept into the
+// watermark journal, and remove the file.
+- (void)importPlistAtLocation:(NSString *)location {
+  NSDictionary *dictionary =
+      [[NSDictionary alloc] initWithContentsOfFile:location];
   if (!dictionary) {
-    dictionary = [[NSMutableDictionary alloc] init];
+    return;
+  }
+
+  for (NSString *key in dictionary) {
+    id value = dictionary[key];
+    if (![value isKindOfClass:[NSDate class]]) {
+      continue;
+    }
+    NSString *prefKey =
+        [key hasPrefix:kCloudMessagingPrefKeyPrefixMsgTimestamp]
+            ? key : [self prefKeyForTopic:key];
+    [_watermarks setWatermark:value forKey:prefKey];
   }
 
-  dictionary[key] = value;
-  NSString *location = [self plistLocation];
-  NSLog(@"Write %@ to %@", dictionary, location);
-  [dictionary writeToFile:location atomically:YES];
+  [_watermarks synchronize];
+  [[NSFileManager defaultManager] removeItemAtPath:location error:NULL];
 }
 
 #pragma mark - Interface methods
@@ -117,7 +161,8 @@ static CloudMessagingManager *singleton;
   CloudEntity *lastMessage = [returnedArray objectAtIndex:0];
   NSString *topicID =
       [lastMessage.properties objectForKey:kCloudMessagingPropTopicID];
-  [self writeLocalDataWithKey:topicID date:lastMessage.createdAtUTC ];
+  [_watermarks setWatermark:lastMessage.createdAtUTC
+                     forKey:[self prefKeyForTopic:topicID]];
 
   // Get the callback for the returned array of CloudEntity during subscribe
   CloudEntityCollectionQueryCompletion block =
@@ -137,12 +182,15 @@ static CloudMessagingManager *singleton;
       [CloudEntityCollection sharedInstance];
   CloudNotificationHandler *handler =
       entityCollection.topicHandlerDictionary[topicID];
-  CloudNotificationHandler *newHandler =
-      [[CloudNotificationHandler alloc] init];
-  newHandler.query = newQueryDto; // use the new query
-  newHandler.callback = handler.callback; // reuse the callback
-
-  entityCollection.topicHandlerDictionary[topicID] = newHandler;
+  if (handler) {
+    // Keep the handler's results and high-water mark, which pushes naming
+    // changed entities are merged into
+    handler.query = newQueryDto;
+  } else {
+    handler = [[CloudNotificationHandler alloc] init];
+    handler.query = newQueryDto;
+    entityCollection.topicHandlerDictionary[topicID] = handler;
+  }
 
   // Finally call the callback to deal with the CloudEntityCollection
   block(returnedArray, error);
@@ -162,16 +210,17 @@ static CloudMessagingManager *singleton;
 }
 
 - (void)sendMessage:(CloudEntity *)message {
-  [message insertInstanceWithCallback:^(CloudEntity *entity, NSError *error) {
-    if (error) {
-      NSLog(@"%@", error);
-    }
+  [_outbox enqueueMessage:message
+                 callback:^(CloudEntity *entity, NSError *error) {
+      if (error) {
+        NSLog(@"%@", error);
+      }
   }];
 }
 
 - (void)sendMessage:(CloudEntity *)message
            onFinish:(CloudEntityQueryCompletionCallback)completionHandler {
-  [message insertInstanceWithCallback:completionHandler];
+  [_outbox enqueueMessage:message callback:completionHandler];
 }
 
 - (void)subscribe:(NSString *)topicID
@@ -181,14 +230,21 @@ static CloudMessagingManager *singleton;
   // after this call back
   self.topicHandlerDictionary[topicID] = completionHandler;
 
+  CloudEntityCollection *entityCollection =
+      [CloudEntityCollection sharedInstance];
+  if ([topicID isEqualToString:kCloudMessagingManagerTopicIDBroadcast]) {
+    CloudFetchScheduler *scheduler = _broadcastFetchScheduler;
+    [entityCollection setPushHandler:^(NSString *pushedTopicID) {
+        [scheduler scheduleFetchForTopicID:pushedTopicID];
+    } forTopicID:topicID];
+  }
+
   // List message with a callback
   max = MAX(0, max);
   GTLMobilebackendQueryDto *queryDto =
       [self queryForCloudMessageForTopic:topicID maxOfflineMessage:max];
 
   // Get a list of messages
-  CloudEntityCollection *entityCollection =
-      [CloudEntityCollection sharedInstance];
   [entityCollection listCollectionWithQuery:queryDto
       callback:^(NSArray *entities, NSError *error) {
           [self listCollectionCompletedWithArray:entities error:error];
@@ -196,11 +252,12 @@ static CloudMessagingManager *singleton;
 }
 
 - (void)unsubscribe:(NSString *)topicID {
-  [self.topicHandlerDictionary delete:topicID];
+  [self.topicHandlerDictionary removeObjectForTopicID:topicID];
 
   CloudEntityCollection *entityCollection =
       [CloudEntityCollection sharedInstance];
-  [[entityCollection topicHandlerDictionary] delete:topicID];
+  [[entityCollection topicHandlerDictionary] removeObjectForTopicID:topicID];
+  [entityCollection setPushHandler:nil forTopicID:topicID];
 }
 
 #pragma mark - Internal methods
@@ -220,13 +277,12 @@ static CloudMessagingManager *singleton;
   NSDate *lastTime = [NSDate date];
 
   if (includeOfflineMessage) {
-    NSString *key = [self prefKeyForTopic:topicID];
-    NSString *localValue = self.plistDictionary[key];
+    NSDate *watermark =
+        [_watermarks watermarkForKey:[self prefKeyForTopic:topicID]];
 
     // Only change lastTime if local value exists
-    if (localValue) {
-      NSTimeInterval interval = [localValue doubleValue];
-      lastTime = [NSDate dateWithTimeIntervalSince1970:interval];
+    if (watermark) {
+      lastTime = watermark;
     }
 
     NSLog(@"Last message read timestamp: %@", lastTime);
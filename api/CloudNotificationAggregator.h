@@ -0,0 +1,49 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+
+typedef void (^CloudNotificationAggregatorFlush)(NSArray *topicIDs);
+
+// Collapses bursts of push notifications per topic.  A notification marks its
+// topic dirty; the topic is flushed once no further notification came for the
+// debounce interval, and no later than the max latency after the first
+// notification of the burst.  Topics due at about the same time are flushed
+// together, so that they can be fetched with one request.
+// Used on the main thread, which push notifications are delivered on.
+@interface CloudNotificationAggregator : NSObject
+
+// Quiet time that ends a burst, in seconds.
+@property(nonatomic) NSTimeInterval debounceInterval;
+// Longest time a notification may wait, in seconds.
+@property(nonatomic) NSTimeInterval maxLatency;
+
+// Create an aggregator which passes the topic IDs due to the handler.
+- (id)initWithDebounceInterval:(NSTimeInterval)debounceInterval
+                    maxLatency:(NSTimeInterval)maxLatency
+                  flushHandler:(CloudNotificationAggregatorFlush)handler;
+
+// Use another debounce interval for a topic, e.g. a longer one for a chatty
+// topic.  Pass a negative interval to use the default again.
+- (void)setDebounceInterval:(NSTimeInterval)interval
+                 forTopicID:(NSString *)topicID;
+
+// Mark the topic dirty.
+- (void)addNotificationForTopicID:(NSString *)topicID;
+
+// Flush all dirty topics now.
+- (void)flush;
+
+@end
@@ -0,0 +1,137 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudNotificationAggregator.h"
+
+// Burst of notifications of a dirty topic.
+@interface CloudNotificationBurst : NSObject
+@property(nonatomic) CFAbsoluteTime firstNotificationTime;
+@property(nonatomic) CFAbsoluteTime deadline;
+@end
+
+@implementation CloudNotificationBurst
+@end
+
+
+@interface CloudNotificationAggregator() {
+  CloudNotificationAggregatorFlush _flushHandler;
+  // Key is topic ID as NSString, object is CloudNotificationBurst.
+  NSMutableDictionary *_bursts;
+  // Key is topic ID as NSString, object is debounce interval as NSNumber.
+  NSMutableDictionary *_debounceIntervals;
+  // Incremented whenever the flush timer is set again, to ignore older ones
+  NSUInteger _timerGeneration;
+}
+@end
+
+
+@implementation CloudNotificationAggregator
+
+- (id)initWithDebounceInterval:(NSTimeInterval)debounceInterval
+                    maxLatency:(NSTimeInterval)maxLatency
+                  flushHandler:(CloudNotificationAggregatorFlush)handler {
+  self = [super init];
+  if (self) {
+    _debounceInterval = debounceInterval;
+    _maxLatency = maxLatency;
+    _flushHandler = [handler copy];
+    _bursts = [NSMutableDictionary dictionary];
+    _debounceIntervals = [NSMutableDictionary dictionary];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (void)setDebounceInterval:(NSTimeInterval)interval
+                 forTopicID:(NSString *)topicID {
+  if (interval < 0) {
+    [_debounceIntervals removeObjectForKey:topicID];
+  } else {
+    _debounceIntervals[topicID] = @(interval);
+  }
+}
+
+- (void)addNotificationForTopicID:(NSString *)topicID {
+  if (!topicID) {
+    return;
+  }
+
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  CloudNotificationBurst *burst = _bursts[topicID];
+  if (!burst) {
+    burst = [[CloudNotificationBurst alloc] init];
+    burst.firstNotificationTime = now;
+    _bursts[topicID] = burst;
+  }
+
+  NSNumber *topicInterval = _debounceIntervals[topicID];
+  NSTimeInterval interval =
+      topicInterval ? [topicInterval doubleValue] : _debounceInterval;
+  burst.deadline = MIN(now + interval,
+                       burst.firstNotificationTime + _maxLatency);
+  [self scheduleTimer];
+}
+
+- (void)flush {
+  [self flushTopicsDueBy:INFINITY];
+}
+
+#pragma mark - Private methods
+
+// Set the timer to the earliest deadline of the dirty topics.
+- (void)scheduleTimer {
+  _timerGeneration++;
+  if ([_bursts count] == 0) {
+    return;
+  }
+
+  CFAbsoluteTime deadline = INFINITY;
+  for (CloudNotificationBurst *burst in [_bursts objectEnumerator]) {
+    deadline = MIN(deadline, burst.deadline);
+  }
+
+  NSTimeInterval delay = MAX(0, deadline - CFAbsoluteTimeGetCurrent());
+  NSUInteger generation = _timerGeneration;
+  dispatch_time_t time =
+      dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC));
+  dispatch_after(time, dispatch_get_main_queue(), ^{
+      if (generation == _timerGeneration) {
+        // Topics due within a quarter of the debounce interval go along,
+        // which brings them forward slightly but saves them a request
+        [self flushTopicsDueBy:
+            CFAbsoluteTimeGetCurrent() + _debounceInterval / 4];
+      }
+  });
+}
+
+- (void)flushTopicsDueBy:(CFAbsoluteTime)time {
+  NSMutableArray *topicIDs = [NSMutableArray array];
+  for (NSString *topicID in _bursts) {
+    CloudNotificationBurst *burst = _bursts[topicID];
+    if (burst.deadline <= time) {
+      [topicIDs addObject:topicID];
+    }
+  }
+  [_bursts removeObjectsForKeys:topicIDs];
+  [self scheduleTimer];
+
+  if ([topicIDs count] > 0 && _flushHandler) {
+    _flushHandler(topicIDs);
+  }
+}
+
+@end
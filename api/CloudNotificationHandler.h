@@ -21,4 +21,12 @@
 @interface CloudNotificationHandler : NSObject
 @property(nonatomic, strong) GTLMobilebackendQueryDto *query;
 @property(nonatomic, strong) CloudEntityCollectionQueryCompletion callback;
+
+// Delta sync state.  When isDeltaSync is set, a notification only fetches
+// entities updated after highWaterMark and merges them into results, which is
+// what the callback receives.  Without delta sync, results is the latest
+// result passed to the callback.
+@property(nonatomic) BOOL isDeltaSync;
+@property(nonatomic, strong) NSDate *highWaterMark;
+@property(nonatomic, copy) NSArray *results;  // of CloudEntity
 @end
@@ -0,0 +1,45 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+
+// Thread-safe map of topic IDs to their handlers, optimized for lookups.
+// The registry publishes an immutable snapshot of the map through an atomic
+// property, so a lookup retains the current snapshot and never blocks on a
+// change.  A change copies the snapshot, applies itself to the copy and
+// publishes it, serialized with other changes.
+// Supports subscripting, e.g. registry[topicID] = handler.
+@interface CloudTopicRegistry : NSObject
+
+// Return the handler of a topic, or nil.
+- (id)objectForTopicID:(NSString *)topicID;
+
+// Register a handler for a topic, replacing any registered before.
+- (void)setObject:(id)object forTopicID:(NSString *)topicID;
+
+// Remove the handler of a topic.
+- (void)removeObjectForTopicID:(NSString *)topicID;
+
+// Return the current map of topic IDs to handlers, which later changes leave
+// untouched.
+- (NSDictionary *)snapshot;
+
+// Number of registered topics.
+- (NSUInteger)count;
+
+- (id)objectForKeyedSubscript:(NSString *)topicID;
+- (void)setObject:(id)object forKeyedSubscript:(NSString *)topicID;
+
+@end
@@ -0,0 +1,90 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudTopicRegistry.h"
+
+@interface CloudTopicRegistry()
+// Current snapshot.  Atomic so that a reader gets it retained while a change
+// publishes its replacement; only replaced while the registry is locked.
+@property(atomic, copy) NSDictionary *currentSnapshot;
+@end
+
+
+@implementation CloudTopicRegistry
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    _currentSnapshot = [NSDictionary dictionary];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (id)objectForTopicID:(NSString *)topicID {
+  if (!topicID) {
+    return nil;
+  }
+  return [self snapshot][topicID];
+}
+
+- (void)setObject:(id)object forTopicID:(NSString *)topicID {
+  if (!topicID) {
+    return;
+  }
+
+  [self updateWithBlock:^(NSMutableDictionary *map) {
+      if (object) {
+        map[topicID] = object;
+      } else {
+        [map removeObjectForKey:topicID];
+      }
+  }];
+}
+
+- (void)removeObjectForTopicID:(NSString *)topicID {
+  [self setObject:nil forTopicID:topicID];
+}
+
+- (NSDictionary *)snapshot {
+  return self.currentSnapshot;
+}
+
+- (NSUInteger)count {
+  return [[self snapshot] count];
+}
+
+- (id)objectForKeyedSubscript:(NSString *)topicID {
+  return [self objectForTopicID:topicID];
+}
+
+- (void)setObject:(id)object forKeyedSubscript:(NSString *)topicID {
+  [self setObject:object forTopicID:topicID];
+}
+
+#pragma mark - Private methods
+
+// Apply a change to a copy of the snapshot and publish the copy.
+- (void)updateWithBlock:(void (^)(NSMutableDictionary *map))block {
+  @synchronized(self) {
+    NSMutableDictionary *map = [self.currentSnapshot mutableCopy];
+    block(map);
+    self.currentSnapshot = map;
+  }
+}
+
+@end
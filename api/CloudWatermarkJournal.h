@@ -0,0 +1,39 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+
+// Durable map of keys, such as topic IDs, to the latest timestamp seen for
+// them.  Reads are answered from memory.  Every update appends a small record
+// to a journal file; updates made within the commit interval are written and
+// synced to disk together.  The journal is rewritten to one record per key
+// when superseded records pile up.
+@interface CloudWatermarkJournal : NSObject
+
+// Open the journal at the given path, creating the file if needed.  Updates
+// are committed at most commitInterval seconds after they are made.
+- (id)initWithPath:(NSString *)path commitInterval:(NSTimeInterval)interval;
+
+// Return the watermark of a key, or nil if none was set.
+- (NSDate *)watermarkForKey:(NSString *)key;
+
+// Move the watermark of a key forward to date.  Dates before the current
+// watermark are ignored.
+- (void)setWatermark:(NSDate *)date forKey:(NSString *)key;
+
+// Write and sync the pending updates now, and wait until they are on disk.
+- (void)synchronize;
+
+@end
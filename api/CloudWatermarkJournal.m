@@ -0,0 +1,254 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+
+#import "CloudWatermarkJournal.h"
+
+// Every record in the journal file is this header followed by the UTF-8
+// encoded key.  The latest record of a key holds its watermark.
+typedef struct {
+  uint32_t magic;
+  uint32_t keyLength;
+  // Seconds since 1970
+  double timestamp;
+} CloudWatermarkRecordHeader;
+
+@interface CloudWatermarkJournal() {
+  NSString *_path;
+  NSTimeInterval _commitInterval;
+  // Serial queue which all file access happens on
+  dispatch_queue_t _queue;
+  NSFileHandle *_fileHandle;
+  // Key is NSString, object is the watermark as NSDate.
+  NSMutableDictionary *_watermarks;
+  // Records of the updates not committed yet
+  NSMutableData *_pendingRecords;
+  NSUInteger _pendingRecordCount;
+  BOOL _isCommitScheduled;
+  // Records in the journal file, only accessed on _queue
+  NSUInteger _recordCount;
+}
+@end
+
+
+@implementation CloudWatermarkJournal
+
+static const uint32_t kCloudWatermarkRecordMagic = 0x314d5743; // "CWM1"
+// Records tolerated per key before the journal is compacted
+static const NSUInteger kCloudWatermarkCompactionRatio = 4;
+// Records below which the journal is never compacted
+static const NSUInteger kCloudWatermarkCompactionMinimum = 256;
+
+- (id)initWithPath:(NSString *)path commitInterval:(NSTimeInterval)interval {
+  self = [super init];
+  if (self) {
+    _path = [path copy];
+    _commitInterval = interval;
+    _queue = dispatch_queue_create("com.google.cloudwatermarks",
+                                   DISPATCH_QUEUE_SERIAL);
+    _watermarks = [NSMutableDictionary dictionary];
+    _pendingRecords = [NSMutableData data];
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (![fileManager fileExistsAtPath:_path]) {
+      [fileManager createFileAtPath:_path contents:nil attributes:nil];
+    }
+
+    unsigned long long validLength = [self loadJournal];
+
+    // Drop a record which was cut short by a crash, if any
+    _fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+    [_fileHandle truncateFileAtOffset:validLength];
+  }
+
+  return self;
+}
+
+#pragma mark - Public methods
+
+- (NSDate *)watermarkForKey:(NSString *)key {
+  if (!key) {
+    return nil;
+  }
+
+  @synchronized(self) {
+    return _watermarks[key];
+  }
+}
+
+- (void)setWatermark:(NSDate *)date forKey:(NSString *)key {
+  if (!date || !key) {
+    return;
+  }
+
+  @synchronized(self) {
+    NSDate *watermark = _watermarks[key];
+    if (watermark && [watermark compare:date] != NSOrderedAscending) {
+      return;
+    }
+
+    _watermarks[key] = date;
+    [self appendRecordWithKey:key date:date toData:_pendingRecords];
+    _pendingRecordCount++;
+    if (_isCommitScheduled) {
+      return;
+    }
+    _isCommitScheduled = YES;
+  }
+
+  // Updates made until then are committed with this one
+  dispatch_time_t commitTime =
+      dispatch_time(DISPATCH_TIME_NOW,
+                    (int64_t)(_commitInterval * NSEC_PER_SEC));
+  dispatch_after(commitTime, _queue, ^{
+      [self commit];
+  });
+}
+
+- (void)synchronize {
+  dispatch_sync(_queue, ^{
+      [self commit];
+  });
+}
+
+#pragma mark - Private methods
+
+- (void)appendRecordWithKey:(NSString *)key
+                       date:(NSDate *)date
+                     toData:(NSMutableData *)data {
+  NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+  CloudWatermarkRecordHeader header;
+  header.magic = kCloudWatermarkRecordMagic;
+  header.keyLength = (uint32_t)[keyData length];
+  header.timestamp = [date timeIntervalSince1970];
+  [data appendBytes:&header length:sizeof(header)];
+  [data appendData:keyData];
+}
+
+// Read the journal into memory.  Return the length of the valid records.
+- (unsigned long long)loadJournal {
+  NSData *data = [NSData dataWithContentsOfFile:_path
+                                        options:NSDataReadingMappedIfSafe
+                                          error:NULL];
+  const uint8_t *bytes = [data bytes];
+  NSUInteger length = [data length];
+  NSUInteger offset = 0;
+
+  while (offset + sizeof(CloudWatermarkRecordHeader) <= length) {
+    CloudWatermarkRecordHeader header;
+    memcpy(&header, bytes + offset, sizeof(header));
+    NSUInteger keyOffset = offset + sizeof(header);
+    if (header.magic != kCloudWatermarkRecordMagic ||
+        header.keyLength > length - keyOffset) {
+      break;
+    }
+
+    NSString *key = [[NSString alloc] initWithBytes:bytes + keyOffset
+                                             length:header.keyLength
+                                           encoding:NSUTF8StringEncoding];
+    if (key) {
+      NSDate *date = [NSDate dateWithTimeIntervalSince1970:header.timestamp];
+      NSDate *watermark = _watermarks[key];
+      if (!watermark || [watermark compare:date] == NSOrderedAscending) {
+        _watermarks[key] = date;
+      }
+    }
+    _recordCount++;
+    offset = keyOffset + header.keyLength;
+  }
+
+  return offset;
+}
+
+// Write the pending records with a single write and sync.  Run on _queue.
+- (void)commit {
+  NSData *records = nil;
+  NSUInteger recordCount = 0;
+  NSUInteger keyCount = 0;
+  @synchronized(self) {
+    records = _pendingRecords;
+    recordCount = _pendingRecordCount;
+    keyCount = [_watermarks count];
+    _pendingRecords = [NSMutableData data];
+    _pendingRecordCount = 0;
+    _isCommitScheduled = NO;
+  }
+
+  if ([records length] == 0) {
+    return;
+  }
+
+  @try {
+    [_fileHandle seekToEndOfFile];
+    [_fileHandle writeData:records];
+    [_fileHandle synchronizeFile];
+  } @catch (NSException *exception) {
+    NSLog(@"Cannot write to watermark journal %@: %@", _path, exception);
+    return;
+  }
+
+  _recordCount += recordCount;
+  if (_recordCount > kCloudWatermarkCompactionMinimum &&
+      _recordCount > keyCount * kCloudWatermarkCompactionRatio) {
+    [self compact];
+  }
+}
+
+// Replace the journal file with one record per key.  Run on _queue.
+- (void)compact {
+  NSDictionary *watermarks = nil;
+  @synchronized(self) {
+    watermarks = [_watermarks copy];
+  }
+
+  NSMutableData *data = [NSMutableData data];
+  for (NSString *key in watermarks) {
+    [self appendRecordWithKey:key date:watermarks[key] toData:data];
+  }
+
+  NSString *compactedPath = [_path stringByAppendingPathExtension:@"tmp"];
+  [[NSFileManager defaultManager] createFileAtPath:compactedPath
+                                          contents:nil
+                                        attributes:nil];
+  NSFileHandle *compactedHandle =
+      [NSFileHandle fileHandleForWritingAtPath:compactedPath];
+  if (!compactedHandle) {
+    NSLog(@"Cannot create compacted watermark journal at %@", compactedPath);
+    return;
+  }
+
+  @try {
+    [compactedHandle writeData:data];
+    [compactedHandle synchronizeFile];
+  } @catch (NSException *exception) {
+    NSLog(@"Cannot compact watermark journal %@: %@", _path, exception);
+    [compactedHandle closeFile];
+    return;
+  }
+  [compactedHandle closeFile];
+
+  if (rename([compactedPath fileSystemRepresentation],
+             [_path fileSystemRepresentation]) != 0) {
+    NSLog(@"Cannot replace watermark journal %@", _path);
+    return;
+  }
+
+  [_fileHandle closeFile];
+  _fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+  _recordCount = [watermarks count];
+}
+
+@end
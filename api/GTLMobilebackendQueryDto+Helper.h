@@ -25,7 +25,25 @@
 // Decide if the query instance is continuous
 - (BOOL)isContinuousQuery;
 
-// Set the query id to default value if query instance has no query id
+// Replace the filter with its canonical form, see CloudFilter+Normalization.
+// Return NO, leaving the filter as it is, if the filter can never match.
+- (BOOL)normalizeFilter;
+
+// Set the query id to default value if query instance has no query id.  The
+// default is the fingerprint string, so equal queries share a topic ID.
 - (void)setDefaultQueryIDIfNeeded;
 
+// Return a 128-bit fingerprint of what the query asks the backend: its kind
+// name, canonical filter, sort order, limit, scope and subscription duration.
+// The query ID and the registration ID are left out.
+- (NSData *)fingerprint;
+
+// The fingerprint as 32 lowercase hex digits.
+- (NSString *)fingerprintString;
+
+// Return a string which is equal for queries that ask the backend the same
+// question from the same device: the fingerprint, query ID and registration
+// ID.
+- (NSString *)canonicalQueryKey;
+
 @end
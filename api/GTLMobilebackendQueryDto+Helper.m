@@ -14,10 +14,115 @@
  */
 
 #import "CloudEntity.h"
+#import "CloudFilter+Normalization.h"
 #import "GTLMobilebackendFilterDto.h"
 #import "GTLMobilebackendQueryDto+Helper.h"
 
 
+static uint64_t RotateLeft64(uint64_t value, int shift) {
+  return (value << shift) | (value >> (64 - shift));
+}
+
+static uint64_t FinalMix64(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+static uint64_t ReadLittleEndian64(const uint8_t *bytes, size_t length) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < length; i++) {
+    value |= (uint64_t)bytes[i] << (8 * i);
+  }
+  return value;
+}
+
+// MurmurHash3 x64 128-bit with seed 0.  Blocks are read byte by byte so that
+// the hash is the same on every architecture.
+static void Hash128(NSData *data, uint64_t hash[2]) {
+  const uint8_t *bytes = [data bytes];
+  size_t length = [data length];
+  size_t blockCount = length / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+
+  for (size_t i = 0; i < blockCount; i++) {
+    uint64_t k1 = ReadLittleEndian64(bytes + i * 16, 8);
+    uint64_t k2 = ReadLittleEndian64(bytes + i * 16 + 8, 8);
+
+    k1 *= c1;
+    k1 = RotateLeft64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = RotateLeft64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = RotateLeft64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = RotateLeft64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const uint8_t *tail = bytes + blockCount * 16;
+  size_t tailLength = length & 15;
+  if (tailLength > 8) {
+    uint64_t k2 = ReadLittleEndian64(tail + 8, tailLength - 8);
+    k2 *= c2;
+    k2 = RotateLeft64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+  }
+  if (tailLength > 0) {
+    uint64_t k1 = ReadLittleEndian64(tail, MIN(tailLength, (size_t)8));
+    k1 *= c1;
+    k1 = RotateLeft64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = FinalMix64(h1);
+  h2 = FinalMix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  hash[0] = h1;
+  hash[1] = h2;
+}
+
+// Append a field as its name and the description of its value, each prefixed
+// with its length.  A missing value is written as length 0xffffffff.
+static void AppendField(NSMutableData *data, NSString *name, id value) {
+  NSData *nameData = [name dataUsingEncoding:NSUTF8StringEncoding];
+  uint32_t length = CFSwapInt32HostToBig((uint32_t)[nameData length]);
+  [data appendBytes:&length length:sizeof(length)];
+  [data appendData:nameData];
+
+  if (!value) {
+    length = 0xffffffff;
+    [data appendBytes:&length length:sizeof(length)];
+    return;
+  }
+
+  NSData *valueData =
+      [[value description] dataUsingEncoding:NSUTF8StringEncoding];
+  length = CFSwapInt32HostToBig((uint32_t)[valueData length]);
+  [data appendBytes:&length length:sizeof(length)];
+  [data appendData:valueData];
+}
+
 @implementation GTLMobilebackendQueryDto (Helper)
 
 - (BOOL)isContinuousQuery {
@@ -41,17 +146,54 @@
   return copy;
 }
 
+- (BOOL)normalizeFilter {
+  CloudFilterFold fold;
+  GTLMobilebackendFilterDto *filterDto =
+      [CloudFilter normalizedFilterDto:self.filterDto fold:&fold];
+  if (fold == CloudFilterFoldContradiction) {
+    return NO;
+  }
+
+  self.filterDto = filterDto;
+  return YES;
+}
+
 - (void)setDefaultQueryIDIfNeeded {
   if (!self.queryId) {
-    NSString *queryDtoJSON = [self JSONString];
-    NSString *filterDtoJSON = [self.filterDto JSONString];
-    NSString *uniqueString =
-        [NSString stringWithFormat:@"%@%@", queryDtoJSON, filterDtoJSON];
-    NSLog(@"hash uniqueString = %@", uniqueString);
-    NSString *hashcode = [NSString stringWithFormat:@"%d", uniqueString.hash];
+    self.queryId = [self fingerprintString];
+  }
+}
+
+- (NSData *)fingerprint {
+  NSMutableData *data = [NSMutableData data];
+  AppendField(data, @"kindName", self.kindName);
+  AppendField(data, @"sortedPropertyName", self.sortedPropertyName);
+  AppendField(data, @"sortAscending", self.sortAscending);
+  AppendField(data, @"limit", self.limit);
+  AppendField(data, @"scope", self.scope);
+  AppendField(data, @"subscriptionDurationSec", self.subscriptionDurationSec);
+  [data appendData:[CloudFilter canonicalEncodingOfFilterDto:self.filterDto]];
 
-    self.queryId = hashcode;
+  uint64_t hash[2];
+  Hash128(data, hash);
+  uint64_t bigEndian[2] = {
+    CFSwapInt64HostToBig(hash[0]), CFSwapInt64HostToBig(hash[1])
+  };
+  return [NSData dataWithBytes:bigEndian length:sizeof(bigEndian)];
+}
+
+- (NSString *)fingerprintString {
+  const uint8_t *bytes = [[self fingerprint] bytes];
+  NSMutableString *string = [NSMutableString stringWithCapacity:32];
+  for (NSUInteger i = 0; i < 16; i++) {
+    [string appendFormat:@"%02x", bytes[i]];
   }
+  return string;
+}
+
+- (NSString *)canonicalQueryKey {
+  return [NSString stringWithFormat:@"%@/%@/%@", [self fingerprintString],
+                                    self.queryId, self.regId];
 }
 
 @end
@@ -17,6 +17,8 @@
 
 #import "GTLMobilebackendBlobAccess.h"
 
+#import "GTLRuntimeCommon.h"
+
 // ----------------------------------------------------------------------------
 //
 //   GTLMobilebackendBlobAccess
@@ -24,4 +26,16 @@
 
 @implementation GTLMobilebackendBlobAccess
 @dynamic accessUrl, mandatoryHeaders, shortLivedUrl;
+
++ (void)load {
+  static const GTLDynamicPropertyDescription kProperties[] = {
+    { "accessUrl", NULL, NULL },
+    { "mandatoryHeaders", NULL, NULL },
+    { "shortLivedUrl", NULL, NULL },
+  };
+  [GTLRuntimeCommon registerDynamicPropertiesOfClass:self
+                                        descriptions:kProperties
+                                               count:sizeof(kProperties) / sizeof(kProperties[0])];
+}
+
 @end
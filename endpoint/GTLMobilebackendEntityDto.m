@@ -17,6 +17,8 @@
 
 #import "GTLMobilebackendEntityDto.h"
 
+#import "GTLRuntimeCommon.h"
+
 // ----------------------------------------------------------------------------
 //
 //   GTLMobilebackendEntityDto
@@ -26,6 +28,22 @@
 @dynamic createdAt, createdBy, identifier, kindName, owner, properties,
          updatedAt, updatedBy;
 
++ (void)load {
+  static const GTLDynamicPropertyDescription kProperties[] = {
+    { "createdAt", NULL, NULL },
+    { "createdBy", NULL, NULL },
+    { "identifier", "id", NULL },
+    { "kindName", NULL, NULL },
+    { "owner", NULL, NULL },
+    { "properties", NULL, NULL },
+    { "updatedAt", NULL, NULL },
+    { "updatedBy", NULL, NULL },
+  };
+  [GTLRuntimeCommon registerDynamicPropertiesOfClass:self
+                                        descriptions:kProperties
+                                               count:sizeof(kProperties) / sizeof(kProperties[0])];
+}
+
 + (NSDictionary *)propertyToJSONKeyMap {
   NSDictionary *map =
     [NSDictionary dictionaryWithObject:@"id"
@@ -17,6 +17,8 @@
 
 #import "GTLMobilebackendEntityListDto.h"
 
+#import "GTLRuntimeCommon.h"
+
 #import "GTLMobilebackendEntityDto.h"
 
 // ----------------------------------------------------------------------------
@@ -27,6 +29,15 @@
 @implementation GTLMobilebackendEntityListDto
 @dynamic entries;
 
++ (void)load {
+  static const GTLDynamicPropertyDescription kProperties[] = {
+    { "entries", NULL, "GTLMobilebackendEntityDto" },
+  };
+  [GTLRuntimeCommon registerDynamicPropertiesOfClass:self
+                                        descriptions:kProperties
+                                               count:sizeof(kProperties) / sizeof(kProperties[0])];
+}
+
 + (NSDictionary *)arrayPropertyToClassMap {
   NSDictionary *map =
     [NSDictionary dictionaryWithObject:[GTLMobilebackendEntityDto class]
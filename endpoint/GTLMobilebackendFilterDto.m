@@ -17,6 +17,8 @@
 
 #import "GTLMobilebackendFilterDto.h"
 
+#import "GTLRuntimeCommon.h"
+
 #import "GTLMobilebackendFilter.h"
 
 // ----------------------------------------------------------------------------
@@ -27,6 +29,18 @@
 @implementation GTLMobilebackendFilterDto
 @dynamic datastoreFilter, operatorProperty, subfilters, values;
 
++ (void)load {
+  static const GTLDynamicPropertyDescription kProperties[] = {
+    { "datastoreFilter", NULL, NULL },
+    { "operatorProperty", "operator", NULL },
+    { "subfilters", NULL, "GTLMobilebackendFilterDto" },
+    { "values", NULL, "NSObject" },
+  };
+  [GTLRuntimeCommon registerDynamicPropertiesOfClass:self
+                                        descriptions:kProperties
+                                               count:sizeof(kProperties) / sizeof(kProperties[0])];
+}
+
 + (NSDictionary *)propertyToJSONKeyMap {
   NSDictionary *map =
     [NSDictionary dictionaryWithObject:@"operator"
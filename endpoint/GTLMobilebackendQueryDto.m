@@ -17,6 +17,8 @@
 
 #import "GTLMobilebackendQueryDto.h"
 
+#import "GTLRuntimeCommon.h"
+
 #import "GTLMobilebackendFilterDto.h"
 
 // ----------------------------------------------------------------------------
@@ -27,4 +29,22 @@
 @implementation GTLMobilebackendQueryDto
 @dynamic filterDto, kindName, limit, queryId, regId, scope, sortAscending,
          sortedPropertyName, subscriptionDurationSec;
+
++ (void)load {
+  static const GTLDynamicPropertyDescription kProperties[] = {
+    { "filterDto", NULL, NULL },
+    { "kindName", NULL, NULL },
+    { "limit", NULL, NULL },
+    { "queryId", NULL, NULL },
+    { "regId", NULL, NULL },
+    { "scope", NULL, NULL },
+    { "sortAscending", NULL, NULL },
+    { "sortedPropertyName", NULL, NULL },
+    { "subscriptionDurationSec", NULL, NULL },
+  };
+  [GTLRuntimeCommon registerDynamicPropertiesOfClass:self
+                                        descriptions:kProperties
+                                               count:sizeof(kProperties) / sizeof(kProperties[0])];
+}
+
 @end
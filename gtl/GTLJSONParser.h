@@ -19,11 +19,18 @@
 
 // This class is a thin wrapper around the JSON parser.  It uses
 // NSJSONSerialization when available, and SBJSON otherwise.
+//
+// GTLJSONStreamParser parses JSON incrementally, as the data arrives.
+// GTLJSONIndexedParser parses JSON from a structural index built with SIMD
+// instructions.  GTLJSONLazyParser returns containers which parse their
+// members from such an index as they are read.
 
 #import <Foundation/Foundation.h>
 
 #import "GTLDefines.h"
 
+@class GTLJSONTreeBuilder;
+
 @interface GTLJSONParser : NSObject
 + (NSString*)stringWithObject:(id)value
                 humanReadable:(BOOL)humanReadable
@@ -39,3 +46,74 @@
 + (id)objectWithData:(NSData *)jsonData
                error:(NSError **)error;
 @end
+
+// GTLJSONStreamParser builds the same tree as +[GTLJSONParser objectWithData:]
+// (mutable dictionaries and arrays) from data appended in pieces of any size,
+// such as the chunks of a download, so that parsing can overlap the network
+// transfer.  Appended data is parsed in order on a private serial queue;
+// -appendData: returns immediately and may be called from any thread.
+// The data must be UTF-8.  GTLService only parses responses with it when
+// GTL_SKIP_STREAMING_PARSE is defined to 0.
+@interface GTLJSONStreamParser : NSObject {
+ @private
+  dispatch_queue_t queue_;
+  unsigned long long appendedLength_;
+
+  // The fields below are only accessed on queue_
+  GTLJSONTreeBuilder *builder_;
+  NSMutableData *partialToken_;  // start of a token cut off by a data boundary
+  NSUInteger partialScanLength_; // bytes of a partial string known to lack
+                                 // its closing quote
+  BOOL partialHasEscapes_;
+  unsigned long long parsedLength_;
+  NSError *error_;
+}
+
+// Total length of the data appended so far.
+- (unsigned long long)appendedLength;
+
+// Queue the data for parsing.  Data appended after a parse error is ignored.
+- (void)appendData:(NSData *)data;
+
+// Wait for the appended data to be parsed and return the top-level object,
+// or nil and an error if the data is not complete, valid JSON.
+- (id)finishWithError:(NSError **)error;
+@end
+
+// GTLJSONIndexedParser builds the same tree as +[GTLJSONParser objectWithData:]
+// in two passes.  The first classifies the bytes 64 at a time, with NEON on
+// ARM, SSE2 on Intel and plain C elsewhere, into a structural index: the
+// positions of the punctuation, strings and scalars outside of strings.  The
+// second walks the index, so that whitespace and string contents are never
+// visited byte by byte, and decodes the values.
+//
+// +[GTLJSONParser objectWithData:] uses it when GTL_USE_INDEXED_JSON_PARSER
+// is defined.
+@interface GTLJSONIndexedParser : NSObject
++ (id)objectWithData:(NSData *)jsonData
+               error:(NSError **)error;
+@end
+
+// GTLJSONLazyParser checks the JSON as GTLJSONIndexedParser does, but
+// returns mutable dictionaries and arrays which are backed by the bytes and
+// their structural index, and parse a member only when it is first read.
+// A response of which few fields are read, such as a list whose entries are
+// only shown in part, then costs little more than its index.  A container
+// reads all of its members, leaving nested containers lazy, when it is
+// changed, counted or enumerated, so a change only parses the containers
+// along its path.
+//
+// Strings are checked for bad escapes and invalid UTF-8 along with the
+// grammar, so such a response fails to parse as with the other parsers, and
+// are decoded when read.  Every container keeps a copy of the whole response
+// and its index alive, so the data parsed may be released or unmapped once
+// the call returns.  Reading a container changes it, so like the GTLObject
+// whose JSON it is, it must not be used on several threads at once.
+//
+// +[GTLJSONParser objectWithData:] uses it when GTL_USE_LAZY_JSON_PARSER is
+// defined, which also keeps GTLService from parsing responses as they
+// download.
+@interface GTLJSONLazyParser : NSObject
++ (id)objectWithData:(NSData *)jsonData
+               error:(NSError **)error;
+@end
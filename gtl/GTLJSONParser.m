@@ -17,6 +17,8 @@
 //  GTLJSONParser.m
 //
 
+#include <errno.h>
+
 #import "GTLJSONParser.h"
 
 // We can assume NSJSONSerialization is present on Mac OS X 10.7 and iOS 5
@@ -117,7 +119,13 @@
 
 + (id)objectWithData:(NSData *)jsonData
                error:(NSError **)error {
-#if GTL_REQUIRES_NSJSONSERIALIZATION
+#if GTL_USE_LAZY_JSON_PARSER
+  return [GTLJSONLazyParser objectWithData:jsonData
+                                     error:error];
+#elif GTL_USE_INDEXED_JSON_PARSER
+  return [GTLJSONIndexedParser objectWithData:jsonData
+                                        error:error];
+#elif GTL_REQUIRES_NSJSONSERIALIZATION
   NSMutableDictionary *obj = [NSJSONSerialization JSONObjectWithData:jsonData
                                                              options:NSJSONReadingMutableContainers
                                                                error:error];
@@ -150,3 +158,1695 @@
 }
 
 @end
+
+typedef enum {
+  kGTLJSONExpectValue = 0,
+  kGTLJSONExpectValueOrArrayEnd,
+  kGTLJSONExpectKeyOrObjectEnd,
+  kGTLJSONExpectKey,
+  kGTLJSONExpectColon,
+  kGTLJSONExpectCommaOrEnd,
+  kGTLJSONDone
+} GTLJSONParseState;
+
+static inline BOOL IsJSONWhitespace(uint8_t c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline BOOL IsJSONNumberChar(uint8_t c) {
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.'
+    || c == 'e' || c == 'E';
+}
+
+static int HexDigitValue(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static int ReadHex4(const uint8_t *bytes) {
+  int value = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = HexDigitValue(bytes[i]);
+    if (digit < 0) return -1;
+    value = (value << 4) | digit;
+  }
+  return value;
+}
+
+static NSUInteger AppendUTF8(uint32_t codePoint, uint8_t *out) {
+  if (codePoint < 0x80) {
+    out[0] = (uint8_t)codePoint;
+    return 1;
+  } else if (codePoint < 0x800) {
+    out[0] = (uint8_t)(0xC0 | (codePoint >> 6));
+    out[1] = (uint8_t)(0x80 | (codePoint & 0x3F));
+    return 2;
+  } else if (codePoint < 0x10000) {
+    out[0] = (uint8_t)(0xE0 | (codePoint >> 12));
+    out[1] = (uint8_t)(0x80 | ((codePoint >> 6) & 0x3F));
+    out[2] = (uint8_t)(0x80 | (codePoint & 0x3F));
+    return 3;
+  } else {
+    out[0] = (uint8_t)(0xF0 | (codePoint >> 18));
+    out[1] = (uint8_t)(0x80 | ((codePoint >> 12) & 0x3F));
+    out[2] = (uint8_t)(0x80 | ((codePoint >> 6) & 0x3F));
+    out[3] = (uint8_t)(0x80 | (codePoint & 0x3F));
+    return 4;
+  }
+}
+
+// Returns the string between the quotes of a scanned string token, or nil
+// if it has an invalid escape or is not UTF-8.
+static NSString *StringWithJSONBytes(const uint8_t *bytes, NSUInteger length,
+                                     BOOL hasEscapes) {
+  if (!hasEscapes) {
+    return [[[NSString alloc] initWithBytes:bytes
+                                     length:length
+                                   encoding:NSUTF8StringEncoding] autorelease];
+  }
+
+  // Unescaping never lengthens the string
+  uint8_t *buffer = malloc(length > 0 ? length : 1);
+  NSUInteger outLength = 0;
+  NSUInteger idx = 0;
+  BOOL isValid = YES;
+  while (idx < length && isValid) {
+    uint8_t c = bytes[idx];
+    if (c != '\\') {
+      buffer[outLength++] = c;
+      idx++;
+      continue;
+    }
+
+    // The scanner made sure a character follows the backslash
+    uint8_t escaped = bytes[idx + 1];
+    idx += 2;
+    switch (escaped) {
+      case '"':  buffer[outLength++] = '"'; break;
+      case '\\': buffer[outLength++] = '\\'; break;
+      case '/':  buffer[outLength++] = '/'; break;
+      case 'b':  buffer[outLength++] = '\b'; break;
+      case 'f':  buffer[outLength++] = '\f'; break;
+      case 'n':  buffer[outLength++] = '\n'; break;
+      case 'r':  buffer[outLength++] = '\r'; break;
+      case 't':  buffer[outLength++] = '\t'; break;
+      case 'u': {
+        int unit = (idx + 4 <= length) ? ReadHex4(bytes + idx) : -1;
+        if (unit < 0) {
+          isValid = NO;
+          break;
+        }
+        idx += 4;
+
+        uint32_t codePoint = (uint32_t)unit;
+        if (unit >= 0xD800 && unit <= 0xDBFF) {
+          // A high surrogate combines with the low surrogate after it
+          int low = -1;
+          if (idx + 6 <= length && bytes[idx] == '\\' && bytes[idx + 1] == 'u') {
+            low = ReadHex4(bytes + idx + 2);
+          }
+          if (low >= 0xDC00 && low <= 0xDFFF) {
+            codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+            idx += 6;
+          } else {
+            codePoint = 0xFFFD;
+          }
+        } else if (unit >= 0xDC00 && unit <= 0xDFFF) {
+          codePoint = 0xFFFD;
+        }
+        outLength += AppendUTF8(codePoint, buffer + outLength);
+        break;
+      }
+      default:
+        isValid = NO;
+        break;
+    }
+  }
+
+  NSString *str = nil;
+  if (isValid) {
+    str = [[[NSString alloc] initWithBytes:buffer
+                                    length:outLength
+                                  encoding:NSUTF8StringEncoding] autorelease];
+  }
+  free(buffer);
+  return str;
+}
+
+// Returns YES if the bytes are a number as JSON defines it.
+static BOOL IsJSONNumber(const uint8_t *bytes, NSUInteger length) {
+  NSUInteger idx = 0;
+  if (idx < length && bytes[idx] == '-') idx++;
+  if (idx < length && bytes[idx] == '0') {
+    idx++;
+  } else {
+    NSUInteger digitsStart = idx;
+    while (idx < length && bytes[idx] >= '0' && bytes[idx] <= '9') idx++;
+    if (idx == digitsStart) return NO;
+  }
+  if (idx < length && bytes[idx] == '.') {
+    NSUInteger digitsStart = ++idx;
+    while (idx < length && bytes[idx] >= '0' && bytes[idx] <= '9') idx++;
+    if (idx == digitsStart) return NO;
+  }
+  if (idx < length && (bytes[idx] == 'e' || bytes[idx] == 'E')) {
+    idx++;
+    if (idx < length && (bytes[idx] == '+' || bytes[idx] == '-')) idx++;
+    NSUInteger digitsStart = idx;
+    while (idx < length && bytes[idx] >= '0' && bytes[idx] <= '9') idx++;
+    if (idx == digitsStart) return NO;
+  }
+  return idx == length;
+}
+
+// Returns the number of a scanned number token, or nil if it is malformed.
+static NSNumber *NumberWithJSONBytes(const uint8_t *bytes, NSUInteger length) {
+  // strtod would also take hex, "inf", "nan", leading zeros and bare dots
+  if (!IsJSONNumber(bytes, length)) return nil;
+
+  char stackBuffer[64];
+  char *buffer = (length < sizeof(stackBuffer)) ? stackBuffer : malloc(length + 1);
+  memcpy(buffer, bytes, length);
+  buffer[length] = '\0';
+
+  BOOL isInteger = (memchr(buffer, '.', length) == NULL
+                    && memchr(buffer, 'e', length) == NULL
+                    && memchr(buffer, 'E', length) == NULL);
+  NSNumber *number = nil;
+  char *end = NULL;
+  if (isInteger) {
+    errno = 0;
+    long long value = strtoll(buffer, &end, 10);
+    if (errno != ERANGE && end == buffer + length && length > 0) {
+      number = [NSNumber numberWithLongLong:value];
+    }
+  }
+  if (number == nil) {
+    // Fractions, exponents and integers too large for a long long
+    double value = strtod(buffer, &end);
+    if (end == buffer + length && length > 0 && buffer[0] != '+') {
+      number = [NSNumber numberWithDouble:value];
+    }
+  }
+
+  if (buffer != stackBuffer) free(buffer);
+  return number;
+}
+
+
+// Returns the value of a literal token, or nil if it is not one.
+static id LiteralWithJSONBytes(const uint8_t *bytes, NSUInteger length) {
+  if (length == 4 && memcmp(bytes, "true", 4) == 0) {
+    return [NSNumber numberWithBool:YES];
+  } else if (length == 5 && memcmp(bytes, "false", 5) == 0) {
+    return [NSNumber numberWithBool:NO];
+  } else if (length == 4 && memcmp(bytes, "null", 4) == 0) {
+    return [NSNull null];
+  }
+  return nil;
+}
+
+// Returns a parse error like those of NSJSONSerialization.
+static NSError *JSONErrorWithReason(NSString *reason,
+                                    unsigned long long offset) {
+  NSString *description =
+    [NSString stringWithFormat:@"%@ around character %llu.", reason, offset];
+  NSDictionary *userInfo = [NSDictionary dictionaryWithObject:description
+                                                       forKey:@"NSDebugDescription"];
+  return [NSError errorWithDomain:NSCocoaErrorDomain
+                             code:NSPropertyListReadCorruptError
+                         userInfo:userInfo];
+}
+
+#pragma mark - Structural index
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GTL_JSON_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GTL_JSON_SSE2 1
+#endif
+
+// Bit i of each mask is set if byte i of a 64 byte block is of the class.
+typedef struct {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t punctuation;  // {}[]:,
+  uint64_t whitespace;
+  uint64_t control;      // below 0x20, including whitespace other than space
+} GTLJSONBlockMasks;
+
+#if GTL_JSON_NEON
+// NEON has no movemask, so each lane keeps its own bit and the lanes of
+// each half are added together.
+static inline uint64_t MoveMask(uint8x16_t matches) {
+  static const uint8_t kBits[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+  };
+  uint8x16_t bits = vandq_u8(matches, vld1q_u8(kBits));
+  uint8x8_t low = vget_low_u8(bits);
+  uint8x8_t high = vget_high_u8(bits);
+  low = vpadd_u8(low, low);
+  low = vpadd_u8(low, low);
+  low = vpadd_u8(low, low);
+  high = vpadd_u8(high, high);
+  high = vpadd_u8(high, high);
+  high = vpadd_u8(high, high);
+  return vget_lane_u8(low, 0) | ((uint64_t)vget_lane_u8(high, 0) << 8);
+}
+
+static void ClassifyBlock(const uint8_t *block, GTLJSONBlockMasks *masks) {
+  memset(masks, 0, sizeof(*masks));
+  for (int part = 0; part < 4; part++) {
+    uint8x16_t v = vld1q_u8(block + 16 * part);
+    int shift = 16 * part;
+    uint8x16_t punctuation =
+      vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('{')),
+                        vceqq_u8(v, vdupq_n_u8('}'))),
+               vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('[')),
+                                 vceqq_u8(v, vdupq_n_u8(']'))),
+                        vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                                 vceqq_u8(v, vdupq_n_u8(',')))));
+    uint8x16_t whitespace =
+      vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                        vceqq_u8(v, vdupq_n_u8('\t'))),
+               vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                        vceqq_u8(v, vdupq_n_u8('\r'))));
+    masks->quote |= MoveMask(vceqq_u8(v, vdupq_n_u8('"'))) << shift;
+    masks->backslash |= MoveMask(vceqq_u8(v, vdupq_n_u8('\\'))) << shift;
+    masks->punctuation |= MoveMask(punctuation) << shift;
+    masks->whitespace |= MoveMask(whitespace) << shift;
+    masks->control |= MoveMask(vcltq_u8(v, vdupq_n_u8(0x20))) << shift;
+  }
+}
+#elif GTL_JSON_SSE2
+static void ClassifyBlock(const uint8_t *block, GTLJSONBlockMasks *masks) {
+  memset(masks, 0, sizeof(*masks));
+  for (int part = 0; part < 4; part++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(block + 16 * part));
+    int shift = 16 * part;
+#define GTL_JSON_EQ(ch) _mm_cmpeq_epi8(v, _mm_set1_epi8(ch))
+#define GTL_JSON_MASK(m) ((uint64_t)(uint16_t)_mm_movemask_epi8(m))
+    __m128i punctuation =
+      _mm_or_si128(_mm_or_si128(GTL_JSON_EQ('{'), GTL_JSON_EQ('}')),
+                   _mm_or_si128(_mm_or_si128(GTL_JSON_EQ('['), GTL_JSON_EQ(']')),
+                                _mm_or_si128(GTL_JSON_EQ(':'), GTL_JSON_EQ(','))));
+    __m128i whitespace =
+      _mm_or_si128(_mm_or_si128(GTL_JSON_EQ(' '), GTL_JSON_EQ('\t')),
+                   _mm_or_si128(GTL_JSON_EQ('\n'), GTL_JSON_EQ('\r')));
+    // Unsigned v <= 0x1F, as SSE2 only compares signed bytes
+    __m128i control =
+      _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v);
+    masks->quote |= GTL_JSON_MASK(GTL_JSON_EQ('"')) << shift;
+    masks->backslash |= GTL_JSON_MASK(GTL_JSON_EQ('\\')) << shift;
+    masks->punctuation |= GTL_JSON_MASK(punctuation) << shift;
+    masks->whitespace |= GTL_JSON_MASK(whitespace) << shift;
+    masks->control |= GTL_JSON_MASK(control) << shift;
+#undef GTL_JSON_EQ
+#undef GTL_JSON_MASK
+  }
+}
+#else
+static void ClassifyBlock(const uint8_t *block, GTLJSONBlockMasks *masks) {
+  memset(masks, 0, sizeof(*masks));
+  for (int idx = 0; idx < 64; idx++) {
+    uint64_t bit = 1ULL << idx;
+    uint8_t c = block[idx];
+    switch (c) {
+      case '"':  masks->quote |= bit; break;
+      case '\\': masks->backslash |= bit; break;
+      case '{': case '}': case '[': case ']': case ':': case ',':
+        masks->punctuation |= bit;
+        break;
+      case ' ': case '\t': case '\n': case '\r':
+        masks->whitespace |= bit;
+        break;
+    }
+    if (c < 0x20) masks->control |= bit;
+  }
+}
+#endif
+
+// Returns the mask of the characters escaped by a backslash, i.e. those
+// after a run of backslashes of odd length.  Runs starting at an even
+// position end on an odd one when their length is odd, and the other way
+// around; adding the start of a run to it carries past its end.
+// *prevEndsOddRun tells if the previous block ended in such a run.
+static uint64_t FindEscaped(uint64_t backslash, uint64_t *prevEndsOddRun) {
+  const uint64_t kEvenBits = 0x5555555555555555ULL;
+  const uint64_t kOddBits = ~kEvenBits;
+
+  uint64_t startEdges = backslash & ~(backslash << 1);
+  // A run carried over from the previous block starts at an odd position
+  uint64_t evenStartMask = kEvenBits ^ *prevEndsOddRun;
+  uint64_t evenStarts = startEdges & evenStartMask;
+  uint64_t oddStarts = startEdges & ~evenStartMask;
+
+  uint64_t evenCarries = backslash + evenStarts;
+  uint64_t oddCarries = backslash + oddStarts;
+  BOOL endsOddRun = (oddCarries < backslash);
+  oddCarries |= *prevEndsOddRun;
+  *prevEndsOddRun = endsOddRun ? 1 : 0;
+
+  uint64_t evenCarryEnds = evenCarries & ~backslash;
+  uint64_t oddCarryEnds = oddCarries & ~backslash;
+  return (evenCarryEnds & kOddBits) | (oddCarryEnds & kEvenBits);
+}
+
+// Bit i is set if an odd number of bits up to and including bit i are.
+static inline uint64_t PrefixXor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+// Writes the positions of the structural characters to positions, which must
+// have room for one per byte, and returns their count: the punctuation and
+// opening quotes outside of strings, and the first character of every
+// scalar.  Returns NSNotFound if a string is not terminated or holds a
+// control character.
+static NSUInteger BuildStructuralIndex(const uint8_t *bytes,
+                                       NSUInteger length,
+                                       uint32_t *positions) {
+  uint64_t prevEndsOddRun = 0;
+  uint64_t prevInString = 0;  // all ones if the block starts in a string
+  uint64_t prevScalar = 0;    // 1 if the block starts within a scalar
+  NSUInteger count = 0;
+  uint8_t paddedBlock[64];
+
+  for (NSUInteger base = 0; base < length; base += 64) {
+    const uint8_t *block = bytes + base;
+    if (length - base < 64) {
+      memset(paddedBlock, ' ', sizeof(paddedBlock));
+      memcpy(paddedBlock, block, length - base);
+      block = paddedBlock;
+    }
+
+    GTLJSONBlockMasks masks;
+    ClassifyBlock(block, &masks);
+
+    uint64_t escaped = FindEscaped(masks.backslash, &prevEndsOddRun);
+    uint64_t quotes = masks.quote & ~escaped;
+    // Set from an opening quote up to, but not including, its closing quote
+    uint64_t inString = PrefixXor(quotes) ^ prevInString;
+    prevInString = (uint64_t)((int64_t)inString >> 63);
+
+    uint64_t invalidControl = masks.control & (inString | ~masks.whitespace);
+    if (invalidControl != 0) return NSNotFound;
+
+    uint64_t punctuation = masks.punctuation & ~inString;
+    uint64_t scalar =
+      ~(masks.punctuation | masks.whitespace | quotes | inString);
+    uint64_t scalarStarts = scalar & ~((scalar << 1) | prevScalar);
+    prevScalar = scalar >> 63;
+
+    uint64_t structurals = punctuation | (quotes & inString) | scalarStarts;
+    while (structurals != 0) {
+      positions[count++] = (uint32_t)(base + __builtin_ctzll(structurals));
+      structurals &= structurals - 1;
+    }
+  }
+
+  if (prevInString != 0) return NSNotFound;
+  return count;
+}
+
+// Returns the end of the indexed token, before the whitespace after it.
+static NSUInteger TokenEnd(const uint8_t *bytes, NSUInteger length,
+                           const uint32_t *positions, NSUInteger count,
+                           NSUInteger idx) {
+  NSUInteger start = positions[idx];
+  NSUInteger end = (idx + 1 < count) ? positions[idx + 1] : length;
+  while (end > start + 1 && IsJSONWhitespace(bytes[end - 1])) end--;
+  return end;
+}
+
+#pragma mark - Tree builder
+
+// Strings of up to this many bytes are interned
+#define kGTLJSONInternMaxLength 32
+// Slots of the intern table of a response, a power of two
+static const NSUInteger kGTLJSONInternCapacity = 1024;
+// Slots probed before a string is left uninterned
+static const NSUInteger kGTLJSONInternMaxProbes = 8;
+// Shapes of objects which get a shared key set, for all responses together
+static const NSUInteger kGTLJSONMaxKeySets = 256;
+
+typedef struct {
+  NSString *string;  // retained; nil for an empty slot
+  uint32_t hash;
+  uint8_t length;
+  uint8_t bytes[kGTLJSONInternMaxLength];
+} GTLJSONInternEntry;
+
+// FNV-1a
+static inline uint32_t HashOfBytes(const uint8_t *bytes, NSUInteger length) {
+  uint32_t hash = 2166136261U;
+  for (NSUInteger idx = 0; idx < length; idx++) {
+    hash = (hash ^ bytes[idx]) * 16777619U;
+  }
+  return hash;
+}
+
+// The keys of an object in order, as a dictionary key for its key set.
+@interface GTLJSONObjectShape : NSObject <NSCopying> {
+ @private
+  NSArray *keys_;
+  NSUInteger hash_;
+}
+- (id)initWithKeys:(NSArray *)keys;
+- (NSArray *)keys;
+@end
+
+@implementation GTLJSONObjectShape
+
+- (id)initWithKeys:(NSArray *)keys {
+  self = [super init];
+  if (self) {
+    keys_ = [keys copy];
+    // NSArray hashes by count alone
+    for (NSString *key in keys_) {
+      hash_ = (hash_ << 5 | hash_ >> (sizeof(hash_) * 8 - 5)) ^ [key hash];
+    }
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [keys_ release];
+  [super dealloc];
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+  return [self retain];
+}
+
+- (NSArray *)keys {
+  return keys_;
+}
+
+- (NSUInteger)hash {
+  return hash_;
+}
+
+- (BOOL)isEqual:(id)other {
+  if (self == other) return YES;
+  if (![other isKindOfClass:[GTLJSONObjectShape class]]) return NO;
+  GTLJSONObjectShape *shape = other;
+  return hash_ == shape->hash_ && [keys_ isEqualToArray:shape->keys_];
+}
+
+@end
+
+// Builds the tree of a JSON text from its tokens in order, checking the
+// grammar.  The accept methods return nil, or the reason the token is not
+// allowed.
+//
+// Entity lists repeat the same keys and many of the same short values, so
+// short strings are interned per response, and objects with the same keys
+// in the same order, as the objects of one class are, share one key set
+// across responses.  The members of an object are collected until it ends,
+// when its keys are known.
+@interface GTLJSONTreeBuilder : NSObject {
+ @private
+  // Open containers, innermost last: arrays, and for objects their keys and
+  // values alternately
+  NSMutableArray *containers_;
+  BOOL *isObjectStack_;          // per open container, if it is an object
+  NSUInteger isObjectCapacity_;
+  id root_;
+  GTLJSONParseState state_;
+  BOOL isInObject_;              // the innermost container is an object
+  GTLJSONInternEntry *internTable_;
+  NSMutableDictionary *keySets_; // GTLJSONObjectShape to key set
+}
+- (GTLJSONParseState)state;
+- (id)root;
+- (NSString *)stringWithBytes:(const uint8_t *)bytes
+                       length:(NSUInteger)length
+                   hasEscapes:(BOOL)hasEscapes;
+- (NSString *)acceptPunctuation:(uint8_t)c;
+- (NSString *)acceptString:(NSString *)str;
+- (NSString *)acceptScalar:(id)value;
+@end
+
+@implementation GTLJSONTreeBuilder
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    containers_ = [[NSMutableArray alloc] init];
+    keySets_ = [[NSMutableDictionary alloc] init];
+    state_ = kGTLJSONExpectValue;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  if (internTable_) {
+    for (NSUInteger idx = 0; idx < kGTLJSONInternCapacity; idx++) {
+      [internTable_[idx].string release];
+    }
+    free(internTable_);
+  }
+  free(isObjectStack_);
+  [containers_ release];
+  [keySets_ release];
+  [root_ release];
+  [super dealloc];
+}
+
+- (GTLJSONParseState)state {
+  return state_;
+}
+
+- (id)root {
+  return root_;
+}
+
+- (NSString *)stringWithBytes:(const uint8_t *)bytes
+                       length:(NSUInteger)length
+                   hasEscapes:(BOOL)hasEscapes {
+  if (hasEscapes || length > kGTLJSONInternMaxLength) {
+    return StringWithJSONBytes(bytes, length, hasEscapes);
+  }
+
+  if (internTable_ == NULL) {
+    internTable_ = calloc(kGTLJSONInternCapacity, sizeof(GTLJSONInternEntry));
+    if (internTable_ == NULL) return StringWithJSONBytes(bytes, length, NO);
+  }
+
+  uint32_t hash = HashOfBytes(bytes, length);
+  for (NSUInteger probe = 0; probe < kGTLJSONInternMaxProbes; probe++) {
+    GTLJSONInternEntry *entry =
+      &internTable_[(hash + probe) & (kGTLJSONInternCapacity - 1)];
+    if (entry->string == nil) {
+      NSString *str = StringWithJSONBytes(bytes, length, NO);
+      if (str == nil) return nil;
+      entry->string = [str retain];
+      entry->hash = hash;
+      entry->length = (uint8_t)length;
+      memcpy(entry->bytes, bytes, length);
+      return str;
+    }
+    if (entry->hash == hash && entry->length == length
+        && memcmp(entry->bytes, bytes, length) == 0) {
+      return entry->string;
+    }
+  }
+  // The neighborhood is full; leave the string uninterned
+  return StringWithJSONBytes(bytes, length, NO);
+}
+
+- (BOOL)isValueExpected {
+  return state_ == kGTLJSONExpectValue
+    || state_ == kGTLJSONExpectValueOrArrayEnd;
+}
+
+- (NSString *)acceptPunctuation:(uint8_t)c {
+  if (state_ == kGTLJSONDone) return @"Garbage at end";
+
+  switch (c) {
+    case '{':
+    case '[': {
+      if (![self isValueExpected]) return @"Unexpected container";
+      NSUInteger depth = [containers_ count];
+      if (depth == isObjectCapacity_) {
+        isObjectCapacity_ = MAX(16, isObjectCapacity_ * 2);
+        isObjectStack_ = realloc(isObjectStack_,
+                                 isObjectCapacity_ * sizeof(BOOL));
+      }
+      isInObject_ = (c == '{');
+      isObjectStack_[depth] = isInObject_;
+
+      NSMutableArray *container = [[NSMutableArray alloc] init];
+      [containers_ addObject:container];
+      [container release];
+      state_ = isInObject_ ? kGTLJSONExpectKeyOrObjectEnd
+                           : kGTLJSONExpectValueOrArrayEnd;
+      return nil;
+    }
+    case '}':
+    case ']': {
+      BOOL isObjectEnd = (c == '}');
+      BOOL isEmptyEnd = isObjectEnd
+        ? (state_ == kGTLJSONExpectKeyOrObjectEnd)
+        : (state_ == kGTLJSONExpectValueOrArrayEnd);
+      BOOL isEnd = (state_ == kGTLJSONExpectCommaOrEnd
+                    && isInObject_ == isObjectEnd);
+      if (!isEmptyEnd && !isEnd) return @"Badly formed container";
+
+      NSMutableArray *container = [[containers_ lastObject] retain];
+      [containers_ removeLastObject];
+      NSUInteger depth = [containers_ count];
+      isInObject_ = (depth > 0) && isObjectStack_[depth - 1];
+
+      if (isObjectEnd) {
+        [self addValue:[self objectWithMembers:container]];
+      } else {
+        [self addValue:container];
+      }
+      [container release];
+      return nil;
+    }
+    case ':':
+      if (state_ != kGTLJSONExpectColon) return @"Unexpected colon";
+      state_ = kGTLJSONExpectValue;
+      return nil;
+    case ',':
+      if (state_ != kGTLJSONExpectCommaOrEnd) return @"Unexpected comma";
+      state_ = isInObject_ ? kGTLJSONExpectKey : kGTLJSONExpectValue;
+      return nil;
+  }
+  return @"Invalid value";
+}
+
+- (NSString *)acceptString:(NSString *)str {
+  if (state_ == kGTLJSONExpectKey
+      || state_ == kGTLJSONExpectKeyOrObjectEnd) {
+    [[containers_ lastObject] addObject:str];
+    state_ = kGTLJSONExpectColon;
+    return nil;
+  }
+  return [self acceptScalar:str];
+}
+
+- (NSString *)acceptScalar:(id)value {
+  if (state_ == kGTLJSONDone) return @"Garbage at end";
+  if (![self isValueExpected]) {
+    return isInObject_ ? @"No string key for value in object"
+                       : @"Unexpected value";
+  }
+  [self addValue:value];
+  return nil;
+}
+
+- (void)addValue:(id)value {
+  NSMutableArray *container = [containers_ lastObject];
+  if (container == nil) {
+    root_ = [value retain];
+    state_ = kGTLJSONDone;
+    return;
+  }
+
+  // An object's key is already in place before its value
+  [container addObject:value];
+  state_ = kGTLJSONExpectCommaOrEnd;
+}
+
+// Returns the dictionary of an object's alternating keys and values.
+- (NSMutableDictionary *)objectWithMembers:(NSArray *)members {
+  NSUInteger count = [members count] / 2;
+  id keySet = nil;
+  if (count > 1) {
+    NSMutableArray *keys = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger idx = 0; idx < count; idx++) {
+      [keys addObject:[members objectAtIndex:2 * idx]];
+    }
+    keySet = [self keySetForKeys:keys];
+  }
+
+  NSMutableDictionary *dict;
+  if (keySet) {
+    dict = [NSMutableDictionary dictionaryWithSharedKeySet:keySet];
+  } else {
+    dict = [NSMutableDictionary dictionaryWithCapacity:count];
+  }
+  for (NSUInteger idx = 0; idx < count; idx++) {
+    [dict setObject:[members objectAtIndex:2 * idx + 1]
+             forKey:[members objectAtIndex:2 * idx]];
+  }
+  return dict;
+}
+
+// Returns the key set shared by the objects with the keys, or nil where key
+// sets are not available or too many shapes have been seen.
+- (id)keySetForKeys:(NSArray *)keys {
+  static NSMutableDictionary *gKeySets = nil;
+  static BOOL gHasKeySets = NO;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+    // Shared key sets came with iOS 6 and OS X 10.8
+    gHasKeySets =
+      [NSDictionary respondsToSelector:@selector(sharedKeySetForKeys:)];
+    gKeySets = [[NSMutableDictionary alloc] init];
+  });
+  if (!gHasKeySets) return nil;
+
+  GTLJSONObjectShape *shape =
+    [[[GTLJSONObjectShape alloc] initWithKeys:keys] autorelease];
+  id keySet = [keySets_ objectForKey:shape];
+  if (keySet) return keySet;
+
+  @synchronized(gKeySets) {
+    keySet = [gKeySets objectForKey:shape];
+    if (keySet == nil && [gKeySets count] < kGTLJSONMaxKeySets) {
+      keySet = [NSDictionary sharedKeySetForKeys:keys];
+      [gKeySets setObject:keySet forKey:shape];
+    }
+  }
+  if (keySet) {
+    [keySets_ setObject:keySet forKey:shape];
+  }
+  return keySet;
+}
+
+@end
+
+#pragma mark - Stream parser
+
+@interface GTLJSONStreamParser ()
+- (void)parseData:(NSData *)data isFinal:(BOOL)isFinal;
+- (NSUInteger)parseBytes:(const uint8_t *)bytes
+                  length:(NSUInteger)length
+              isResuming:(BOOL)isResuming
+                 isFinal:(BOOL)isFinal;
+- (NSUInteger)scanStringAt:(NSUInteger)start
+                     bytes:(const uint8_t *)bytes
+                    length:(NSUInteger)length
+                isResuming:(BOOL)isResuming
+                    string:(NSString **)outString;
+- (void)failWithReason:(NSString *)reason atOffset:(NSUInteger)offset;
+@end
+
+@implementation GTLJSONStreamParser
+
+- (id)init {
+  self = [super init];
+  if (self) {
+    queue_ = dispatch_queue_create("com.google.GTLJSONStreamParser",
+                                   DISPATCH_QUEUE_SERIAL);
+    builder_ = [[GTLJSONTreeBuilder alloc] init];
+    partialToken_ = [[NSMutableData alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  dispatch_release(queue_);
+  [builder_ release];
+  [partialToken_ release];
+  [error_ release];
+  [super dealloc];
+}
+
+- (unsigned long long)appendedLength {
+  @synchronized(self) {
+    return appendedLength_;
+  }
+}
+
+- (void)appendData:(NSData *)data {
+  NSUInteger length = [data length];
+  if (length == 0) return;
+
+  @synchronized(self) {
+    appendedLength_ += length;
+  }
+
+  // Copy, since the caller's data may be mutable and change before it is
+  // parsed
+  NSData *dataCopy = [data copy];
+  dispatch_async(queue_, ^{
+    @autoreleasepool {
+      [self parseData:dataCopy isFinal:NO];
+    }
+    [dataCopy release];
+  });
+}
+
+- (id)finishWithError:(NSError **)error {
+  __block id result = nil;
+  __block NSError *parseError = nil;
+  dispatch_sync(queue_, ^{
+    [self parseData:nil isFinal:YES];
+    if (error_ == nil && [builder_ state] != kGTLJSONDone) {
+      [self failWithReason:@"Unexpected end of data"
+                  atOffset:[partialToken_ length]];
+    }
+
+    if (error_ == nil) {
+      result = [[builder_ root] retain];
+    } else {
+      parseError = [error_ retain];
+    }
+  });
+
+  if (error) *error = [parseError autorelease];
+  else [parseError release];
+  return [result autorelease];
+}
+
+// Runs on queue_.  Parses the data after the partial token left by the data
+// before it, and keeps a token the data cuts off for the data after it.
+- (void)parseData:(NSData *)data isFinal:(BOOL)isFinal {
+  if (error_ != nil) return;
+
+  const uint8_t *bytes;
+  NSUInteger length;
+  BOOL isResuming = ([partialToken_ length] > 0);
+  if (isResuming) {
+    if (data) [partialToken_ appendData:data];
+    bytes = [partialToken_ bytes];
+    length = [partialToken_ length];
+  } else {
+    bytes = [data bytes];
+    length = [data length];
+  }
+
+  NSUInteger consumed = [self parseBytes:bytes
+                                  length:length
+                              isResuming:isResuming
+                                 isFinal:isFinal];
+  if (error_ != nil) {
+    [partialToken_ setLength:0];
+    return;
+  }
+
+  parsedLength_ += consumed;
+  if (isResuming) {
+    [partialToken_ replaceBytesInRange:NSMakeRange(0, consumed)
+                             withBytes:NULL
+                                length:0];
+  } else if (consumed < length) {
+    [partialToken_ appendBytes:bytes + consumed
+                        length:length - consumed];
+  }
+}
+
+// Returns the length of the bytes consumed; parsing stops early at a token
+// which the end of the bytes cuts off, unless this is the final data.
+- (NSUInteger)parseBytes:(const uint8_t *)bytes
+                  length:(NSUInteger)length
+              isResuming:(BOOL)isResuming
+                 isFinal:(BOOL)isFinal {
+  NSUInteger idx = 0;
+  while (idx < length) {
+    uint8_t c = bytes[idx];
+    if (IsJSONWhitespace(c)) {
+      idx++;
+      continue;
+    }
+
+    NSString *failure = nil;
+    NSUInteger end;
+    if (c == '"') {
+      // Only the token at the start of resumed bytes is the partial one
+      NSString *str = nil;
+      end = [self scanStringAt:idx
+                         bytes:bytes
+                        length:length
+                    isResuming:(isResuming && idx == 0)
+                        string:&str];
+      if (end == NSNotFound) return idx;  // cut off, or an error
+      failure = [builder_ acceptString:str];
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      end = idx;
+      while (end < length && IsJSONNumberChar(bytes[end])) end++;
+      // The number may go on in the next data
+      if (end == length && !isFinal) return idx;
+
+      NSNumber *number = NumberWithJSONBytes(bytes + idx, end - idx);
+      failure = number ? [builder_ acceptScalar:number] : @"Invalid number";
+    } else if (c == 't' || c == 'f' || c == 'n') {
+      NSUInteger literalLength = (c == 'f') ? 5 : 4;
+      if (length - idx < literalLength && !isFinal) return idx;
+
+      end = idx + MIN(literalLength, length - idx);
+      id value = LiteralWithJSONBytes(bytes + idx, end - idx);
+      failure = value ? [builder_ acceptScalar:value] : @"Invalid value";
+    } else {
+      end = idx + 1;
+      failure = [builder_ acceptPunctuation:c];
+    }
+
+    if (failure != nil) {
+      [self failWithReason:failure atOffset:idx];
+      return idx;
+    }
+    idx = end;
+  }
+  return idx;
+}
+
+// Returns the offset after the closing quote of the string starting at
+// bytes[start], or NSNotFound if the string is cut off or invalid.  For a cut
+// off string the scanned length is remembered, so that scanning resumes
+// there rather than at the quote once more data arrives.
+- (NSUInteger)scanStringAt:(NSUInteger)start
+                     bytes:(const uint8_t *)bytes
+                    length:(NSUInteger)length
+                isResuming:(BOOL)isResuming
+                    string:(NSString **)outString {
+  NSUInteger idx = start + 1;
+  BOOL hasEscapes = NO;
+  if (isResuming && partialScanLength_ > 0) {
+    idx = start + partialScanLength_;
+    hasEscapes = partialHasEscapes_;
+  }
+  partialScanLength_ = 0;
+  partialHasEscapes_ = NO;
+
+  while (idx < length) {
+    uint8_t c = bytes[idx];
+    if (c == '"') {
+      NSString *str = [builder_ stringWithBytes:bytes + start + 1
+                                         length:idx - start - 1
+                                     hasEscapes:hasEscapes];
+      if (str == nil) {
+        [self failWithReason:@"Invalid string" atOffset:start];
+        return NSNotFound;
+      }
+      *outString = str;
+      return idx + 1;
+    } else if (c == '\\') {
+      // Stop before an escape whose character is cut off
+      if (idx + 1 >= length) break;
+      hasEscapes = YES;
+      idx += 2;
+    } else if (c < 0x20) {
+      [self failWithReason:@"Unescaped control character" atOffset:idx];
+      return NSNotFound;
+    } else {
+      idx++;
+    }
+  }
+
+  partialScanLength_ = idx - start;
+  partialHasEscapes_ = hasEscapes;
+  return NSNotFound;
+}
+
+- (void)failWithReason:(NSString *)reason atOffset:(NSUInteger)offset {
+  [error_ release];
+  error_ = [JSONErrorWithReason(reason, parsedLength_ + offset) retain];
+}
+
+@end
+
+#pragma mark - Indexed parser
+
+@implementation GTLJSONIndexedParser
+
++ (id)objectWithData:(NSData *)jsonData
+               error:(NSError **)error {
+  const uint8_t *bytes = [jsonData bytes];
+  NSUInteger length = [jsonData length];
+  if (length == 0 || length >= UINT32_MAX) {
+    // Positions are 32 bits; the stream parser has no such limit
+    GTLJSONStreamParser *streamParser =
+      [[[GTLJSONStreamParser alloc] init] autorelease];
+    [streamParser appendData:jsonData];
+    return [streamParser finishWithError:error];
+  }
+
+  uint32_t *positions = malloc(sizeof(uint32_t) * length);
+  if (positions == NULL) {
+    if (error) *error = JSONErrorWithReason(@"Out of memory", 0);
+    return nil;
+  }
+
+  NSUInteger count = BuildStructuralIndex(bytes, length, positions);
+  if (count == NSNotFound) {
+    free(positions);
+    if (error) *error = JSONErrorWithReason(@"Invalid string", 0);
+    return nil;
+  }
+
+  GTLJSONTreeBuilder *builder = [[[GTLJSONTreeBuilder alloc] init] autorelease];
+  NSString *failure = nil;
+  NSUInteger failureOffset = 0;
+  for (NSUInteger idx = 0; idx < count && failure == nil; idx++) {
+    NSUInteger start = positions[idx];
+    NSUInteger end = TokenEnd(bytes, length, positions, count, idx);
+
+    uint8_t c = bytes[start];
+    failureOffset = start;
+    if (c == '"') {
+      if (end < start + 2 || bytes[end - 1] != '"') {
+        failure = @"Invalid string";
+        break;
+      }
+      const uint8_t *contents = bytes + start + 1;
+      NSUInteger contentsLength = end - start - 2;
+      BOOL hasEscapes = (memchr(contents, '\\', contentsLength) != NULL);
+      NSString *str = [builder stringWithBytes:contents
+                                        length:contentsLength
+                                    hasEscapes:hasEscapes];
+      failure = str ? [builder acceptString:str] : @"Invalid string";
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      NSNumber *number = NumberWithJSONBytes(bytes + start, end - start);
+      failure = number ? [builder acceptScalar:number] : @"Invalid number";
+    } else if (c == 't' || c == 'f' || c == 'n') {
+      id value = LiteralWithJSONBytes(bytes + start, end - start);
+      failure = value ? [builder acceptScalar:value] : @"Invalid value";
+    } else {
+      failure = [builder acceptPunctuation:c];
+    }
+  }
+  free(positions);
+
+  if (failure == nil && [builder state] != kGTLJSONDone) {
+    failure = @"Unexpected end of data";
+    failureOffset = length;
+  }
+  if (failure != nil) {
+    if (error) *error = JSONErrorWithReason(failure, failureOffset);
+    return nil;
+  }
+
+  if (error) *error = nil;
+  return [builder root];
+}
+
+@end
+
+#pragma mark - Lazy parser
+
+// Returns the length of the UTF-8 sequence at the start of the bytes, or 0 if
+// it is not well-formed: overlong, a surrogate, beyond U+10FFFF or cut off.
+static NSUInteger UTF8SequenceLength(const uint8_t *bytes, NSUInteger length) {
+  uint8_t lead = bytes[0];
+  NSUInteger sequenceLength;
+  uint32_t codePoint;
+  if (lead < 0x80) {
+    return 1;
+  } else if (lead >= 0xC2 && lead <= 0xDF) {
+    sequenceLength = 2;
+    codePoint = lead & 0x1F;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    sequenceLength = 3;
+    codePoint = lead & 0x0F;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    sequenceLength = 4;
+    codePoint = lead & 0x07;
+  } else {
+    return 0;
+  }
+  if (sequenceLength > length) return 0;
+
+  for (NSUInteger i = 1; i < sequenceLength; i++) {
+    if ((bytes[i] & 0xC0) != 0x80) return 0;
+    codePoint = (codePoint << 6) | (bytes[i] & 0x3F);
+  }
+  if ((sequenceLength == 3 && codePoint < 0x800)
+      || (sequenceLength == 4 && codePoint < 0x10000)
+      || (codePoint >= 0xD800 && codePoint <= 0xDFFF)
+      || codePoint > 0x10FFFF) {
+    return 0;
+  }
+  return sequenceLength;
+}
+
+// Returns YES if the contents of a string token, between its quotes, decode
+// as StringWithJSONBytes decodes them: every escape is valid and the bytes
+// are UTF-8.
+static BOOL IsJSONStringContents(const uint8_t *bytes, NSUInteger length) {
+  NSUInteger idx = 0;
+  while (idx < length) {
+    uint8_t c = bytes[idx];
+    if (c == '\\') {
+      if (idx + 1 >= length) return NO;
+      uint8_t escaped = bytes[idx + 1];
+      if (escaped == 'u') {
+        if (idx + 6 > length || ReadHex4(bytes + idx + 2) < 0) return NO;
+        idx += 6;
+      } else if (escaped == '"' || escaped == '\\' || escaped == '/'
+                 || escaped == 'b' || escaped == 'f' || escaped == 'n'
+                 || escaped == 'r' || escaped == 't') {
+        idx += 2;
+      } else {
+        return NO;
+      }
+    } else if (c < 0x80) {
+      idx++;
+    } else {
+      NSUInteger sequenceLength = UTF8SequenceLength(bytes + idx, length - idx);
+      if (sequenceLength == 0) return NO;
+      idx += sequenceLength;
+    }
+  }
+  return YES;
+}
+
+// Checks the grammar of the indexed tokens as the tree builder does, and the
+// escapes and UTF-8 of every string, without building anything, and sets
+// matches[i] of every opening token i to the index of its closing token.
+// Returns nil, or the reason the JSON is invalid and its offset.
+static NSString *CheckJSONTokens(const uint8_t *bytes, NSUInteger length,
+                                 const uint32_t *positions, NSUInteger count,
+                                 uint32_t *matches, NSUInteger *failureOffset) {
+  // Indexes of the open containers' opening tokens, innermost last
+  uint32_t *openTokens = malloc(sizeof(uint32_t) * count);
+  if (openTokens == NULL) return @"Out of memory";
+
+  NSString *failure = nil;
+  NSUInteger depth = 0;
+  GTLJSONParseState state = kGTLJSONExpectValue;
+  for (NSUInteger idx = 0; idx < count && failure == nil; idx++) {
+    NSUInteger start = positions[idx];
+    uint8_t c = bytes[start];
+    *failureOffset = start;
+    if (state == kGTLJSONDone) {
+      failure = @"Garbage at end";
+      break;
+    }
+
+    BOOL isInObject = (depth > 0
+                       && bytes[positions[openTokens[depth - 1]]] == '{');
+    BOOL isValueExpected = (state == kGTLJSONExpectValue
+                            || state == kGTLJSONExpectValueOrArrayEnd);
+    NSString *unexpectedValue = isInObject
+      ? @"No string key for value in object" : @"Unexpected value";
+    switch (c) {
+      case '{':
+      case '[':
+        if (!isValueExpected) {
+          failure = @"Unexpected container";
+          break;
+        }
+        openTokens[depth++] = (uint32_t)idx;
+        state = (c == '{') ? kGTLJSONExpectKeyOrObjectEnd
+                           : kGTLJSONExpectValueOrArrayEnd;
+        break;
+      case '}':
+      case ']': {
+        BOOL isObjectEnd = (c == '}');
+        BOOL isEmptyEnd = isObjectEnd
+          ? (state == kGTLJSONExpectKeyOrObjectEnd)
+          : (state == kGTLJSONExpectValueOrArrayEnd);
+        BOOL isEnd = (state == kGTLJSONExpectCommaOrEnd
+                      && isInObject == isObjectEnd);
+        if (!isEmptyEnd && !isEnd) {
+          failure = @"Badly formed container";
+          break;
+        }
+        matches[openTokens[--depth]] = (uint32_t)idx;
+        state = (depth > 0) ? kGTLJSONExpectCommaOrEnd : kGTLJSONDone;
+        break;
+      }
+      case ':':
+        if (state != kGTLJSONExpectColon) {
+          failure = @"Unexpected colon";
+          break;
+        }
+        state = kGTLJSONExpectValue;
+        break;
+      case ',':
+        if (state != kGTLJSONExpectCommaOrEnd) {
+          failure = @"Unexpected comma";
+          break;
+        }
+        state = isInObject ? kGTLJSONExpectKey : kGTLJSONExpectValue;
+        break;
+      case '"': {
+        NSUInteger end = TokenEnd(bytes, length, positions, count, idx);
+        if (end < start + 2 || bytes[end - 1] != '"'
+            || !IsJSONStringContents(bytes + start + 1, end - start - 2)) {
+          failure = @"Invalid string";
+        } else if (state == kGTLJSONExpectKey
+                   || state == kGTLJSONExpectKeyOrObjectEnd) {
+          state = kGTLJSONExpectColon;
+        } else if (!isValueExpected) {
+          failure = unexpectedValue;
+        } else {
+          state = (depth > 0) ? kGTLJSONExpectCommaOrEnd : kGTLJSONDone;
+        }
+        break;
+      }
+      default: {
+        NSUInteger end = TokenEnd(bytes, length, positions, count, idx);
+        if (c == '-' || (c >= '0' && c <= '9')) {
+          if (!IsJSONNumber(bytes + start, end - start)) {
+            failure = @"Invalid number";
+            break;
+          }
+        } else if (LiteralWithJSONBytes(bytes + start, end - start) == nil) {
+          failure = @"Invalid value";
+          break;
+        }
+        if (!isValueExpected) {
+          failure = unexpectedValue;
+          break;
+        }
+        state = (depth > 0) ? kGTLJSONExpectCommaOrEnd : kGTLJSONDone;
+        break;
+      }
+    }
+  }
+  free(openTokens);
+
+  if (failure == nil && state != kGTLJSONDone) {
+    failure = @"Unexpected end of data";
+    *failureOffset = length;
+  }
+  return failure;
+}
+
+// The bytes of a response and their structural index, shared by the lazy
+// containers of the response.
+@interface GTLJSONLazyDocument : NSObject {
+ @private
+  NSData *data_;
+  const uint8_t *bytes_;
+  NSUInteger length_;
+  uint32_t *positions_;
+  uint32_t *matches_;  // for each opening token, the index of its closing one
+  NSUInteger count_;
+}
+// Takes ownership of the malloc'd positions and matches.
+- (id)initWithData:(NSData *)data
+         positions:(uint32_t *)positions
+           matches:(uint32_t *)matches
+             count:(NSUInteger)count;
+- (id)valueAtToken:(NSUInteger)idx;
+- (NSUInteger)valueTokenForKey:(NSString *)key
+                    inObjectAt:(NSUInteger)openToken;
+- (NSMutableDictionary *)membersOfObjectAt:(NSUInteger)openToken;
+- (NSUInteger)elementTokensOfArrayAt:(NSUInteger)openToken
+                              tokens:(uint32_t **)outTokens;
+@end
+
+// An object which reads its members from the document as they are asked for.
+// Changing, counting or enumerating it reads all of its members, as lazy
+// containers where they are objects or arrays, and it then lets go of the
+// document.
+@interface GTLJSONLazyDictionary : NSMutableDictionary {
+ @private
+  GTLJSONLazyDocument *document_;  // nil once all members are read
+  NSUInteger openToken_;
+  NSMutableDictionary *values_;    // the members read so far
+}
+- (id)initWithDocument:(GTLJSONLazyDocument *)document
+             openToken:(NSUInteger)openToken;
+@end
+
+// An array which reads its elements from the document as they are asked for,
+// and reads all of them when it is changed.
+@interface GTLJSONLazyArray : NSMutableArray {
+ @private
+  GTLJSONLazyDocument *document_;  // nil once all elements are read
+  NSUInteger openToken_;
+  uint32_t *elementTokens_;        // found on first access
+  id *elements_;                   // retained elements read so far
+  NSUInteger count_;
+  BOOL isIndexed_;
+  NSMutableArray *array_;          // all elements, once they are read
+}
+- (id)initWithDocument:(GTLJSONLazyDocument *)document
+             openToken:(NSUInteger)openToken;
+@end
+
+@implementation GTLJSONLazyDocument
+
+- (id)initWithData:(NSData *)data
+         positions:(uint32_t *)positions
+           matches:(uint32_t *)matches
+             count:(NSUInteger)count {
+  self = [super init];
+  if (self) {
+    data_ = [data retain];
+    bytes_ = [data bytes];
+    length_ = [data length];
+    positions_ = positions;
+    matches_ = matches;
+    count_ = count;
+  } else {
+    free(positions);
+    free(matches);
+  }
+  return self;
+}
+
+- (void)dealloc {
+  free(positions_);
+  free(matches_);
+  [data_ release];
+  [super dealloc];
+}
+
+// Returns the index of the token after the value starting at the index.
+- (NSUInteger)tokenAfterValueAt:(NSUInteger)idx {
+  uint8_t c = bytes_[positions_[idx]];
+  if (c == '{' || c == '[') return matches_[idx] + 1;
+  return idx + 1;
+}
+
+- (NSString *)stringAtToken:(NSUInteger)idx {
+  NSUInteger start = positions_[idx];
+  NSUInteger end = TokenEnd(bytes_, length_, positions_, count_, idx);
+  const uint8_t *contents = bytes_ + start + 1;
+  NSUInteger contentsLength = end - start - 2;
+  BOOL hasEscapes = (memchr(contents, '\\', contentsLength) != NULL);
+  return StringWithJSONBytes(contents, contentsLength, hasEscapes);
+}
+
+- (id)valueAtToken:(NSUInteger)idx {
+  NSUInteger start = positions_[idx];
+  uint8_t c = bytes_[start];
+  id value;
+  if (c == '{') {
+    value = [[[GTLJSONLazyDictionary alloc] initWithDocument:self
+                                                   openToken:idx] autorelease];
+  } else if (c == '[') {
+    value = [[[GTLJSONLazyArray alloc] initWithDocument:self
+                                              openToken:idx] autorelease];
+  } else if (c == '"') {
+    value = [self stringAtToken:idx];
+  } else {
+    NSUInteger end = TokenEnd(bytes_, length_, positions_, count_, idx);
+    if (c == '-' || (c >= '0' && c <= '9')) {
+      value = NumberWithJSONBytes(bytes_ + start, end - start);
+    } else {
+      value = LiteralWithJSONBytes(bytes_ + start, end - start);
+    }
+  }
+  // The grammar and the strings were checked up front
+  return value ? value : [NSNull null];
+}
+
+// Returns the index of the value of the key's last member, or NSNotFound.
+// Keys are compared as UTF-8 bytes, so most are never made into strings.
+- (NSUInteger)valueTokenForKey:(NSString *)key
+                    inObjectAt:(NSUInteger)openToken {
+  const char *keyBytes = [key UTF8String];
+  if (keyBytes == NULL) return NSNotFound;
+  NSUInteger keyLength = strlen(keyBytes);
+
+  NSUInteger found = NSNotFound;
+  NSUInteger closeToken = matches_[openToken];
+  for (NSUInteger idx = openToken + 1; idx < closeToken;
+       idx = [self tokenAfterValueAt:idx + 2] + 1) {
+    NSUInteger start = positions_[idx];
+    NSUInteger end = TokenEnd(bytes_, length_, positions_, count_, idx);
+    const uint8_t *contents = bytes_ + start + 1;
+    NSUInteger contentsLength = end - start - 2;
+    BOOL isMatch;
+    if (memchr(contents, '\\', contentsLength) != NULL) {
+      isMatch = [[self stringAtToken:idx] isEqualToString:key];
+    } else {
+      isMatch = (contentsLength == keyLength
+                 && memcmp(contents, keyBytes, keyLength) == 0);
+    }
+    if (isMatch) found = idx + 2;
+  }
+  return found;
+}
+
+- (NSMutableDictionary *)membersOfObjectAt:(NSUInteger)openToken {
+  NSMutableDictionary *members = [NSMutableDictionary dictionary];
+  NSUInteger closeToken = matches_[openToken];
+  for (NSUInteger idx = openToken + 1; idx < closeToken;
+       idx = [self tokenAfterValueAt:idx + 2] + 1) {
+    NSString *key = [self stringAtToken:idx];
+    if (key) {
+      [members setObject:[self valueAtToken:idx + 2] forKey:key];
+    }
+  }
+  return members;
+}
+
+// Returns the number of elements of the array, and a malloc'd list of the
+// indexes of their first tokens.
+- (NSUInteger)elementTokensOfArrayAt:(NSUInteger)openToken
+                              tokens:(uint32_t **)outTokens {
+  NSUInteger closeToken = matches_[openToken];
+  NSUInteger count = 0;
+  for (NSUInteger idx = openToken + 1; idx < closeToken;
+       idx = [self tokenAfterValueAt:idx] + 1) {
+    count++;
+  }
+
+  uint32_t *tokens = malloc(sizeof(uint32_t) * MAX(count, 1));
+  NSUInteger elementIndex = 0;
+  for (NSUInteger idx = openToken + 1; idx < closeToken;
+       idx = [self tokenAfterValueAt:idx] + 1) {
+    tokens[elementIndex++] = (uint32_t)idx;
+  }
+  *outTokens = tokens;
+  return count;
+}
+
+@end
+
+@implementation GTLJSONLazyDictionary
+
+- (id)initWithDocument:(GTLJSONLazyDocument *)document
+             openToken:(NSUInteger)openToken {
+  self = [super init];
+  if (self) {
+    document_ = [document retain];
+    openToken_ = openToken;
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithCapacity:0];
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity {
+  self = [super init];
+  if (self) {
+    values_ = [[NSMutableDictionary alloc] initWithCapacity:capacity];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [document_ release];
+  [values_ release];
+  [super dealloc];
+}
+
+- (void)readAllMembers {
+  if (document_ == nil) return;
+
+  NSMutableDictionary *members = [document_ membersOfObjectAt:openToken_];
+  // Members already read keep the values handed out for them
+  if (values_) [members addEntriesFromDictionary:values_];
+  [values_ release];
+  values_ = [members retain];
+  [document_ release];
+  document_ = nil;
+}
+
+- (NSUInteger)count {
+  [self readAllMembers];
+  return [values_ count];
+}
+
+- (id)objectForKey:(id)key {
+  id value = [values_ objectForKey:key];
+  if (value != nil || document_ == nil
+      || ![key isKindOfClass:[NSString class]]) {
+    return value;
+  }
+
+  NSUInteger valueToken = [document_ valueTokenForKey:key
+                                           inObjectAt:openToken_];
+  if (valueToken == NSNotFound) return nil;
+
+  value = [document_ valueAtToken:valueToken];
+  if (values_ == nil) {
+    values_ = [[NSMutableDictionary alloc] init];
+  }
+  [values_ setObject:value forKey:key];
+  return value;
+}
+
+- (NSEnumerator *)keyEnumerator {
+  [self readAllMembers];
+  return [values_ keyEnumerator];
+}
+
+- (void)setObject:(id)obj forKey:(id)key {
+  [self readAllMembers];
+  [values_ setObject:obj forKey:key];
+}
+
+- (void)removeObjectForKey:(id)key {
+  [self readAllMembers];
+  [values_ removeObjectForKey:key];
+}
+
+@end
+
+@implementation GTLJSONLazyArray
+
+- (id)initWithDocument:(GTLJSONLazyDocument *)document
+             openToken:(NSUInteger)openToken {
+  self = [super init];
+  if (self) {
+    document_ = [document retain];
+    openToken_ = openToken;
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithCapacity:0];
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity {
+  self = [super init];
+  if (self) {
+    array_ = [[NSMutableArray alloc] initWithCapacity:capacity];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [self releaseElements];
+  [document_ release];
+  [array_ release];
+  [super dealloc];
+}
+
+- (void)releaseElements {
+  if (elements_) {
+    for (NSUInteger idx = 0; idx < count_; idx++) {
+      [elements_[idx] release];
+    }
+    free(elements_);
+    elements_ = NULL;
+  }
+  free(elementTokens_);
+  elementTokens_ = NULL;
+}
+
+- (void)indexElements {
+  if (isIndexed_) return;
+
+  count_ = [document_ elementTokensOfArrayAt:openToken_
+                                      tokens:&elementTokens_];
+  elements_ = calloc(MAX(count_, 1), sizeof(id));
+  isIndexed_ = YES;
+}
+
+- (void)readAllElements {
+  if (document_ == nil) return;
+
+  [self indexElements];
+  array_ = [[NSMutableArray alloc] initWithCapacity:count_];
+  for (NSUInteger idx = 0; idx < count_; idx++) {
+    [array_ addObject:[self objectAtIndex:idx]];
+  }
+  [self releaseElements];
+  [document_ release];
+  document_ = nil;
+}
+
+- (NSUInteger)count {
+  if (document_ == nil) return [array_ count];
+
+  [self indexElements];
+  return count_;
+}
+
+- (id)objectAtIndex:(NSUInteger)idx {
+  if (document_ == nil) return [array_ objectAtIndex:idx];
+
+  [self indexElements];
+  if (idx >= count_) {
+    [NSException raise:NSRangeException
+                format:@"index %lu beyond bounds [0 .. %ld]",
+                       (unsigned long)idx, (long)count_ - 1];
+  }
+  if (elements_[idx] == nil) {
+    elements_[idx] = [[document_ valueAtToken:elementTokens_[idx]] retain];
+  }
+  return elements_[idx];
+}
+
+- (void)insertObject:(id)obj atIndex:(NSUInteger)idx {
+  [self readAllElements];
+  [array_ insertObject:obj atIndex:idx];
+}
+
+- (void)removeObjectAtIndex:(NSUInteger)idx {
+  [self readAllElements];
+  [array_ removeObjectAtIndex:idx];
+}
+
+- (void)addObject:(id)obj {
+  [self readAllElements];
+  [array_ addObject:obj];
+}
+
+- (void)removeLastObject {
+  [self readAllElements];
+  [array_ removeLastObject];
+}
+
+- (void)replaceObjectAtIndex:(NSUInteger)idx withObject:(id)obj {
+  [self readAllElements];
+  [array_ replaceObjectAtIndex:idx withObject:obj];
+}
+
+@end
+
+@implementation GTLJSONLazyParser
+
++ (id)objectWithData:(NSData *)jsonData
+               error:(NSError **)error {
+  NSUInteger length = [jsonData length];
+  if (length == 0 || length >= UINT32_MAX) {
+    // Positions are 32 bits; this falls back to the stream parser
+    return [GTLJSONIndexedParser objectWithData:jsonData
+                                          error:error];
+  }
+
+  // The containers read the bytes later, which must neither change nor go
+  // away meanwhile.  Copying an immutable NSData only retains it, which is
+  // not enough for one that wraps bytes it does not own, such as a memory
+  // mapping, so the bytes are always copied.
+  NSData *data = [NSData dataWithBytes:[jsonData bytes] length:length];
+  const uint8_t *bytes = [data bytes];
+  uint32_t *positions = malloc(sizeof(uint32_t) * length);
+  if (positions == NULL) {
+    if (error) *error = JSONErrorWithReason(@"Out of memory", 0);
+    return nil;
+  }
+
+  NSUInteger count = BuildStructuralIndex(bytes, length, positions);
+  if (count == NSNotFound) {
+    free(positions);
+    if (error) *error = JSONErrorWithReason(@"Invalid string", 0);
+    return nil;
+  }
+
+  uint32_t *matches = malloc(sizeof(uint32_t) * MAX(count, 1));
+  NSUInteger failureOffset = 0;
+  NSString *failure = matches
+    ? CheckJSONTokens(bytes, length, positions, count, matches, &failureOffset)
+    : @"Out of memory";
+  if (failure != nil) {
+    free(positions);
+    free(matches);
+    if (error) *error = JSONErrorWithReason(failure, failureOffset);
+    return nil;
+  }
+
+  // The index lives as long as the containers; give back the room for one
+  // position per byte
+  uint32_t *shrunk = realloc(positions, sizeof(uint32_t) * count);
+  if (shrunk) positions = shrunk;
+
+  GTLJSONLazyDocument *document =
+    [[[GTLJSONLazyDocument alloc] initWithData:data
+                                     positions:positions
+                                       matches:matches
+                                         count:count] autorelease];
+  if (error) *error = nil;
+  return [document valueAtToken:0];
+}
+
+@end
@@ -43,9 +43,29 @@
 + (Class<GTLRuntimeCommon>)ancestorClass;
 @end
 
+// A dynamic property of a class, for
+// +registerDynamicPropertiesOfClass:descriptions:count:.
+typedef struct {
+  const char *propertyName;
+  const char *jsonKey;             // NULL when it is the property name
+  const char *containedClassName;  // the class of an array's items, or NULL
+} GTLDynamicPropertyDescription;
+
+// The accessors of the dynamic properties declared by a class share a dispatch
+// table (JSON key, return class, contained class and implementation for each
+// getter and setter), which is built once, when the first of them is
+// resolved, and is read without locking after that.
 @interface GTLRuntimeCommon : NSObject
 // Wire things up.
 + (BOOL)resolveInstanceMethod:(SEL)sel onClass:(Class)onClass;
+// Build the dispatch table of a class from a static description of its
+// dynamic properties instead of from their declarations and the class's maps,
+// and add the accessors.  Generated classes call this from +load; the
+// descriptions must agree with propertyToJSONKeyMap and
+// arrayPropertyToClassMap, which debug builds assert.
++ (void)registerDynamicPropertiesOfClass:(Class<GTLRuntimeCommon>)aClass
+                            descriptions:(const GTLDynamicPropertyDescription *)descriptions
+                                   count:(NSUInteger)count;
 // Helpers
 + (id)objectFromJSON:(id)json
         defaultClass:(Class)defaultClass
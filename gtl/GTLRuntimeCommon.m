@@ -17,6 +17,8 @@
 //  GTLRuntimeCommon.m
 //
 
+#include <ctype.h>
+#include <libkern/OSAtomic.h>
 #include <objc/runtime.h>
 #include <TargetConditionals.h>
 
@@ -26,10 +28,6 @@
 #import "GTLObject.h"
 #import "GTLUtilities.h"
 
-static NSString *const kReturnClassKey = @"returnClass";
-static NSString *const kContainedClassKey = @"containedClass";
-static NSString *const kJSONKey = @"jsonKey";
-
 // Note: NSObject's class is used as a marker for the expected/default class
 // when Discovery says it can be any type of object.
 
@@ -157,69 +155,86 @@ static NSString *const kJSONKey = @"jsonKey";
 
 #pragma mark JSON/Object Utilities
 
-static NSMutableDictionary *gDispatchCache = nil;
-
-static CFStringRef SelectorKeyCopyDescriptionCallBack(const void *key) {
-  // Make a CFString from the key
-  NSString *name = NSStringFromSelector((SEL) key);
-  CFStringRef str = CFStringCreateCopy(kCFAllocatorDefault, (CFStringRef) name);
-  return str;
+// The dispatch details of an accessor of a dynamic property.
+typedef struct {
+  SEL selector;
+  IMP imp;
+  const char *types;
+  NSString *jsonKey;     // retained for the life of the table
+  Class returnClass;     // Nil for primitive types
+  Class containedClass;  // the class of an array's items, or Nil
+} GTLDispatchEntry;
+
+// The accessors of the dynamic properties declared by a class, sorted by
+// selector.  A table is built once, complete, before it is published, and is
+// never changed or freed.
+typedef struct {
+  Class dispatchClass;
+  NSUInteger count;
+  GTLDispatchEntry entries[];
+} GTLDispatchTable;
+
+// Published tables, by open addressing on the class pointer.  Tables are
+// only published, which is serialized, so the accessors find them without
+// locking.
+#define kGTLDispatchTableSlots 1024
+static GTLDispatchTable *volatile gDispatchTables[kGTLDispatchTableSlots];
+
+// Tables of classes which found every slot taken, by class.  Only looked up,
+// with the GTLRuntimeCommon class locked, once the slots are full.
+static CFMutableDictionaryRef gOverflowDispatchTables = NULL;
+
+static NSUInteger DispatchTableSlot(Class aClass) {
+  uintptr_t bits = (uintptr_t)aClass;
+  return (NSUInteger)((bits >> 4) ^ (bits >> 14)) & (kGTLDispatchTableSlots - 1);
 }
 
-// Save the dispatch details for the specified class and selector
-+ (void)setStoredDispatchForClass:(Class<GTLRuntimeCommon>)dispatchClass
-                         selector:(SEL)sel
-                      returnClass:(Class)returnClass
-                   containedClass:(Class)containedClass
-                          jsonKey:(NSString *)jsonKey {
-  // cache structure:
-  //   class ->
-  //     selector ->
-  //       returnClass
-  //       containedClass
-  //       jsonKey
+static const GTLDispatchTable *DispatchTableForClass(Class aClass) {
+  NSUInteger slot = DispatchTableSlot(aClass);
+  for (NSUInteger probe = 0; probe < kGTLDispatchTableSlots; probe++) {
+    const GTLDispatchTable *table =
+      gDispatchTables[(slot + probe) & (kGTLDispatchTableSlots - 1)];
+    if (table == NULL) return NULL;
+    if (table->dispatchClass == aClass) return table;
+  }
+
+  // Every slot is taken, so the table may be an overflow one
   @synchronized([GTLRuntimeCommon class]) {
-    if (gDispatchCache == nil) {
-      gDispatchCache = [GTLUtilities newStaticDictionary];
-    }
+    if (gOverflowDispatchTables == NULL) return NULL;
+    return CFDictionaryGetValue(gOverflowDispatchTables, aClass);
+  }
+}
 
-    CFMutableDictionaryRef classDict =
-      (CFMutableDictionaryRef) [gDispatchCache objectForKey:dispatchClass];
-    if (classDict == nil) {
-      // We create a CFDictionary since the keys are raw selectors rather than
-      // NSStrings
-      const CFDictionaryKeyCallBacks keyCallBacks = {
-        .version = 0,
-        .retain = NULL,
-        .release = NULL,
-        .copyDescription = SelectorKeyCopyDescriptionCallBack,
-        .equal = NULL,  // defaults to pointer comparison
-        .hash = NULL    // defaults to the pointer value
-      };
-      const CFIndex capacity = 0; // no limit
-      classDict = CFDictionaryCreateMutable(kCFAllocatorDefault, capacity,
-                                            &keyCallBacks,
-                                            &kCFTypeDictionaryValueCallBacks);
-      [gDispatchCache setObject:(id)classDict
-                         forKey:(id<NSCopying>)dispatchClass];
-      CFRelease(classDict);
+static const GTLDispatchEntry *DispatchEntryForSelector(const GTLDispatchTable *table,
+                                                        SEL sel) {
+  NSUInteger low = 0;
+  NSUInteger high = table->count;
+  while (low < high) {
+    NSUInteger mid = low + (high - low) / 2;
+    const GTLDispatchEntry *entry = &table->entries[mid];
+    if (entry->selector == sel) return entry;
+    if ((uintptr_t)entry->selector < (uintptr_t)sel) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
+  }
+  return NULL;
+}
 
-    NSDictionary *selDict = (NSDictionary *)CFDictionaryGetValue(classDict, sel);
-    if (selDict == nil) {
-      selDict = [NSDictionary dictionaryWithObjectsAndKeys:
-                 jsonKey, kJSONKey,
-                 returnClass, kReturnClassKey, // can be nil (primitive types)
-                 containedClass, kContainedClassKey, // may be nil
-                 nil];
-      CFDictionarySetValue(classDict, sel, selDict);
-    } else {
-      // we already have a dictionary for this selector on this class, which is
-      // surprising
-      GTL_DEBUG_LOG(@"Storing duplicate dispatch for %@ selector %@",
-            dispatchClass, NSStringFromSelector(sel));
+// Publish the table of a class which has none yet.  Called with the
+// GTLRuntimeCommon class locked.
+static BOOL PublishDispatchTable(GTLDispatchTable *table) {
+  NSUInteger slot = DispatchTableSlot(table->dispatchClass);
+  for (NSUInteger probe = 0; probe < kGTLDispatchTableSlots; probe++) {
+    NSUInteger idx = (slot + probe) & (kGTLDispatchTableSlots - 1);
+    if (gDispatchTables[idx] == NULL) {
+      // The barrier makes the table visible before the pointer to it
+      return OSAtomicCompareAndSwapPtrBarrier(NULL, table,
+                                              (void *volatile *)&gDispatchTables[idx]);
     }
   }
+  return NO;
 }
 
 + (BOOL)getStoredDispatchForClass:(Class<GTLRuntimeCommon>)dispatchClass
@@ -227,31 +242,25 @@ static CFStringRef SelectorKeyCopyDescriptionCallBack(const void *key) {
                       returnClass:(Class *)outReturnClass
                    containedClass:(Class *)outContainedClass
                           jsonKey:(NSString **)outJsonKey {
-  @synchronized([GTLRuntimeCommon class]) {
-    // walk from this class up the hierarchy to the ancestor class
-    Class<GTLRuntimeCommon> topClass = class_getSuperclass([dispatchClass ancestorClass]);
-    for (Class currClass = dispatchClass;
-         currClass != topClass;
-         currClass = class_getSuperclass(currClass)) {
-
-      CFMutableDictionaryRef classDict =
-        (CFMutableDictionaryRef) [gDispatchCache objectForKey:currClass];
-      if (classDict) {
-        NSMutableDictionary *selDict =
-          (NSMutableDictionary *) CFDictionaryGetValue(classDict, sel);
-        if (selDict) {
-          if (outReturnClass) {
-            *outReturnClass = [selDict objectForKey:kReturnClassKey];
-          }
-          if (outContainedClass) {
-            *outContainedClass = [selDict objectForKey:kContainedClassKey];
-          }
-          if (outJsonKey) {
-            *outJsonKey = [selDict objectForKey:kJSONKey];
-          }
-          return YES;
-        }
+  // walk from this class up the hierarchy to the ancestor class
+  Class<GTLRuntimeCommon> topClass = class_getSuperclass([dispatchClass ancestorClass]);
+  for (Class currClass = dispatchClass;
+       currClass != topClass;
+       currClass = class_getSuperclass(currClass)) {
+    const GTLDispatchTable *table = DispatchTableForClass(currClass);
+    const GTLDispatchEntry *entry =
+      table ? DispatchEntryForSelector(table, sel) : NULL;
+    if (entry) {
+      if (outReturnClass) {
+        *outReturnClass = entry->returnClass;
+      }
+      if (outContainedClass) {
+        *outContainedClass = entry->containedClass;
       }
+      if (outJsonKey) {
+        *outJsonKey = entry->jsonKey;
+      }
+      return YES;
     }
   }
   GTL_DEBUG_LOG(@"Failed to find stored dispatch info for %@ %s",
@@ -1105,6 +1114,256 @@ static const GTLDynamicImpInfo *DynamicImpInfoForProperty(objc_property_t prop,
   return result;
 }
 
+#pragma mark Runtime - dispatch tables
+
+static BOOL IsDynamicProperty(objc_property_t prop) {
+  const char *attr = property_getAttributes(prop);
+  const char *dynamicMarker = attr ? strstr(attr, ",D") : NULL;
+  return (dynamicMarker != NULL
+          && (dynamicMarker[2] == 0 || dynamicMarker[2] == ','));
+}
+
+// Returns the selector named by an attribute of a property, such as ",G" for
+// a custom getter, or NULL if the property has no such attribute.
+static SEL SelectorForAttribute(const char *attr, const char *marker) {
+  const char *start = strstr(attr, marker);
+  if (start == NULL) return NULL;
+
+  start += strlen(marker);
+  char *name = strndup(start, strcspn(start, ","));
+  SEL sel = sel_registerName(name);
+  free(name);
+  return sel;
+}
+
+static GTLDispatchTable *NewDispatchTable(Class aClass,
+                                          NSUInteger propertyCount) {
+  // A getter and a setter per property
+  GTLDispatchTable *table =
+    calloc(1, sizeof(GTLDispatchTable)
+              + 2 * propertyCount * sizeof(GTLDispatchEntry));
+  table->dispatchClass = aClass;
+  return table;
+}
+
+// Append the entries of the getter and the setter of a dynamic property to
+// the table, which must have room for them.
+static BOOL AddDispatchEntries(GTLDispatchTable *table, objc_property_t prop,
+                               NSString *jsonKey, Class containedClass) {
+  Class returnClass = nil;
+  const GTLDynamicImpInfo *implInfo = DynamicImpInfoForProperty(prop,
+                                                                &returnClass);
+  if (implInfo == NULL) {
+    GTL_DEBUG_LOG(@"GTLRuntimeCommon: unexpected return type class %s for "
+                    "property \"%s\" of class \"%s\"",
+                    returnClass ? class_getName(returnClass) : "<nil>",
+                    property_getName(prop),
+                    class_getName(table->dispatchClass));
+    return NO;
+  }
+
+  // Only arrays have a contained class
+  if (implInfo->getterFunction != (IMP)DynamicArrayGetter) {
+    containedClass = Nil;
+  } else if (containedClass == Nil) {
+    GTL_DEBUG_LOG(@"GTLRuntimeCommon: expected array item class for "
+                  "property \"%s\" of class \"%s\"",
+                  property_getName(prop), class_getName(table->dispatchClass));
+  }
+
+  const char *attr = property_getAttributes(prop);
+  const char *propName = property_getName(prop);
+  SEL getter = SelectorForAttribute(attr, ",G");
+  if (getter == NULL) {
+    getter = sel_registerName(propName);
+  }
+  SEL setter = SelectorForAttribute(attr, ",S");
+  if (setter == NULL) {
+    size_t setterNameSize = strlen(propName) + 5;  // "set", ':' and the null
+    char *setterName = malloc(setterNameSize);
+    snprintf(setterName, setterNameSize, "set%c%s:",
+             toupper(propName[0]), propName + 1);
+    setter = sel_registerName(setterName);
+    free(setterName);
+  }
+
+  for (int idx = 0; idx < 2; idx++) {
+    BOOL isSetter = (idx == 1);
+    GTLDispatchEntry *entry = &table->entries[table->count++];
+    entry->selector = (isSetter ? setter : getter);
+    entry->imp = (isSetter ? implInfo->setterFunction : implInfo->getterFunction);
+    entry->types = (isSetter ? implInfo->setterEncoding : implInfo->getterEncoding);
+    entry->jsonKey = [jsonKey copy];
+    entry->returnClass = returnClass;
+    entry->containedClass = containedClass;
+  }
+  return YES;
+}
+
+#if DEBUG
+// Assert that a static description of a dynamic property agrees with the
+// maps of its class, which building the table at runtime would use.
+static void AssertDescriptionMatchesClassMaps(Class<GTLRuntimeCommon> aClass,
+                                              const char *propertyName,
+                                              NSString *jsonKey,
+                                              Class containedClass) {
+  NSDictionary *keyMap =
+    [[aClass ancestorClass] propertyToJSONKeyMapForClass:aClass];
+  NSDictionary *classMap =
+    [[aClass ancestorClass] arrayPropertyToClassMapForClass:aClass];
+  NSString *propStr = [NSString stringWithUTF8String:propertyName];
+  NSString *expectedKey = [keyMap objectForKey:propStr];
+  if (expectedKey == nil) {
+    expectedKey = propStr;
+  }
+  GTL_ASSERT([jsonKey isEqual:expectedKey],
+             @"GTLRuntimeCommon: %s.%s is described with JSON key %@, "
+             "its class maps it to %@", class_getName(aClass), propertyName,
+             jsonKey, expectedKey);
+
+  Class expectedClass = [classMap objectForKey:expectedKey];
+  GTL_ASSERT(containedClass == expectedClass,
+             @"GTLRuntimeCommon: %s.%s is described with item class %s, "
+             "its class maps it to %s", class_getName(aClass), propertyName,
+             containedClass ? class_getName(containedClass) : "<nil>",
+             expectedClass ? class_getName(expectedClass) : "<nil>");
+}
+#endif
+
+static int CompareDispatchEntries(const void *a, const void *b) {
+  uintptr_t selA = (uintptr_t)((const GTLDispatchEntry *)a)->selector;
+  uintptr_t selB = (uintptr_t)((const GTLDispatchEntry *)b)->selector;
+  return (selA > selB) - (selA < selB);
+}
+
+// Sort and publish the table, and only then add the accessors to the class,
+// so that no accessor can run before its entry is found.  Called with the
+// GTLRuntimeCommon class locked.
+static const GTLDispatchTable *InstallDispatchTable(GTLDispatchTable *table) {
+  qsort(table->entries, table->count, sizeof(GTLDispatchEntry),
+        CompareDispatchEntries);
+
+  if (!PublishDispatchTable(table)) {
+    // Keep the accessors working, only slower: their entries are looked up
+    // with the class locked
+    GTL_DEBUG_LOG(@"GTLRuntimeCommon: no slot for the dispatch table of %s",
+                  class_getName(table->dispatchClass));
+    if (gOverflowDispatchTables == NULL) {
+      gOverflowDispatchTables = CFDictionaryCreateMutable(kCFAllocatorDefault,
+                                                          0, NULL, NULL);
+    }
+    CFDictionarySetValue(gOverflowDispatchTables, table->dispatchClass,
+                         table);
+  }
+
+  for (NSUInteger idx = 0; idx < table->count; idx++) {
+    const GTLDispatchEntry *entry = &table->entries[idx];
+    class_addMethod(table->dispatchClass, entry->selector, entry->imp,
+                    entry->types);
+  }
+  return table;
+}
+
+// Return the table of the dynamic properties declared by the class, building
+// it from the declarations and the class's maps the first time.
++ (const GTLDispatchTable *)dispatchTableForClass:(Class<GTLRuntimeCommon>)aClass {
+  const GTLDispatchTable *table = DispatchTableForClass(aClass);
+  if (table) return table;
+
+  @synchronized([GTLRuntimeCommon class]) {
+    table = DispatchTableForClass(aClass);
+    if (table == NULL) {
+      NSDictionary *keyMap =
+        [[aClass ancestorClass] propertyToJSONKeyMapForClass:aClass];
+      NSDictionary *classMap =
+        [[aClass ancestorClass] arrayPropertyToClassMapForClass:aClass];
+
+      unsigned int propertyCount = 0;
+      objc_property_t *properties = class_copyPropertyList(aClass,
+                                                           &propertyCount);
+      GTLDispatchTable *newTable = NewDispatchTable(aClass, propertyCount);
+      for (unsigned int idx = 0; idx < propertyCount; idx++) {
+        objc_property_t prop = properties[idx];
+        if (!IsDynamicProperty(prop)) continue;
+
+        // replace the property name with the proper JSON key if it's
+        // special-cased with a map in the class; otherwise, the property
+        // name is the JSON key
+        NSString *propStr =
+          [NSString stringWithUTF8String:property_getName(prop)];
+        NSString *jsonKey = [keyMap objectForKey:propStr];
+        if (jsonKey == nil) {
+          jsonKey = propStr;
+        }
+        AddDispatchEntries(newTable, prop, jsonKey,
+                           [classMap objectForKey:jsonKey]);
+      }
+      free(properties);
+      table = InstallDispatchTable(newTable);
+    }
+  }
+  return table;
+}
+
++ (void)registerDynamicPropertiesOfClass:(Class<GTLRuntimeCommon>)aClass
+                            descriptions:(const GTLDynamicPropertyDescription *)descriptions
+                                   count:(NSUInteger)count {
+  // Called from +load, before there is any autorelease pool
+  @autoreleasepool {
+    @synchronized([GTLRuntimeCommon class]) {
+      if (DispatchTableForClass(aClass) != NULL) {
+        GTL_DEBUG_LOG(@"GTLRuntimeCommon: dispatch table of %s is already built",
+                      class_getName(aClass));
+        return;
+      }
+
+      GTLDispatchTable *table = NewDispatchTable(aClass, count);
+      for (NSUInteger idx = 0; idx < count; idx++) {
+        const GTLDynamicPropertyDescription *description = &descriptions[idx];
+        objc_property_t prop = class_getProperty(aClass,
+                                                 description->propertyName);
+        if (prop == NULL || !IsDynamicProperty(prop)) {
+          // such as a property which a category redeclares and implements
+          continue;
+        }
+
+        const char *jsonKeyName = description->jsonKey;
+        if (jsonKeyName == NULL) {
+          jsonKeyName = description->propertyName;
+        }
+        Class containedClass = Nil;
+        if (description->containedClassName) {
+          containedClass = objc_getClass(description->containedClassName);
+        }
+        NSString *jsonKey = [NSString stringWithUTF8String:jsonKeyName];
+#if DEBUG
+        AssertDescriptionMatchesClassMaps(aClass, description->propertyName,
+                                          jsonKey, containedClass);
+#endif
+        AddDispatchEntries(table, prop, jsonKey, containedClass);
+      }
+
+#if DEBUG
+      // Every dynamic property the class declares must be described
+      unsigned int propertyCount = 0;
+      objc_property_t *properties = class_copyPropertyList(aClass,
+                                                           &propertyCount);
+      NSUInteger dynamicCount = 0;
+      for (unsigned int idx = 0; idx < propertyCount; idx++) {
+        if (IsDynamicProperty(properties[idx])) dynamicCount++;
+      }
+      free(properties);
+      GTL_ASSERT(table->count == 2 * dynamicCount,
+                 @"GTLRuntimeCommon: %s declares %lu dynamic properties, "
+                 "%lu are described", class_getName(aClass),
+                 (unsigned long)dynamicCount,
+                 (unsigned long)(table->count / 2));
+#endif
+      InstallDispatchTable(table);
+    }
+  }
+}
+
 #pragma mark Runtime - wiring point
 
 + (BOOL)resolveInstanceMethod:(SEL)sel onClass:(Class<GTLRuntimeCommon>)onClass {
@@ -1124,59 +1383,15 @@ static const GTLDynamicImpInfo *DynamicImpInfoForProperty(objc_property_t prop,
 
   objc_property_t prop = PropertyForSel(onClass, sel, isSetter, &foundClass);
   if (prop != NULL && foundClass != nil) {
-
-    Class returnClass = nil;
-    const GTLDynamicImpInfo *implInfo = DynamicImpInfoForProperty(prop,
-                                                                  &returnClass);
-    if (implInfo == NULL) {
-      GTL_DEBUG_LOG(@"GTLRuntimeCommon: unexpected return type class %s for "
-                      "property \"%s\" of class \"%s\"",
-                      returnClass ? class_getName(returnClass) : "<nil>",
-                      property_getName(prop),
-                      class_getName(onClass));
-    }
-
-    if (implInfo != NULL) {
-      IMP imp = ( isSetter ? implInfo->setterFunction : implInfo->getterFunction );
-      const char *encoding = ( isSetter ? implInfo->setterEncoding : implInfo->getterEncoding );
-
-      class_addMethod(foundClass, sel, imp, encoding);
-
-      const char *propName = property_getName(prop);
-      NSString *propStr = [NSString stringWithUTF8String:propName];
-
-      // replace the property name with the proper JSON key if it's
-      // special-cased with a map in the found class; otherwise, the property
-      // name is the JSON key
-      NSDictionary *keyMap =
-        [[foundClass ancestorClass] propertyToJSONKeyMapForClass:foundClass];
-      NSString *jsonKey = [keyMap objectForKey:propStr];
-      if (jsonKey == nil) {
-        jsonKey = propStr;
-      }
-
-      Class containedClass = nil;
-
-      // For arrays we need to look up what the contained class is.
-      if (imp == (IMP)DynamicArraySetter || imp == (IMP)DynamicArrayGetter) {
-        NSDictionary *classMap =
-          [[foundClass ancestorClass] arrayPropertyToClassMapForClass:foundClass];
-        containedClass = [classMap objectForKey:jsonKey];
-        if (containedClass == Nil) {
-          GTL_DEBUG_LOG(@"GTLRuntimeCommon: expected array item class for "
-                        "property \"%s\" of class \"%s\"",
-                        property_getName(prop), class_getName(foundClass));
-        }
-      }
-
-      // save the dispatch info to the cache
-      [GTLRuntimeCommon setStoredDispatchForClass:foundClass
-                                         selector:sel
-                                      returnClass:returnClass
-                                   containedClass:containedClass
-                                          jsonKey:jsonKey];
+    // Building the table adds every accessor of the class, so this is the
+    // only one of them to be resolved
+    const GTLDispatchTable *table = [self dispatchTableForClass:foundClass];
+    if (table != NULL && DispatchEntryForSelector(table, sel) != NULL) {
       return YES;
     }
+    GTL_DEBUG_LOG(@"GTLRuntimeCommon: no dispatch for selector %s of "
+                  "property \"%s\" of class \"%s\"",
+                  selName, property_getName(prop), class_getName(foundClass));
   }
 
   return NO;
@@ -28,6 +28,19 @@
 
 #import "GTLService.h"
 
+// Parsing responses as they download is opt-in; define
+// GTL_SKIP_STREAMING_PARSE to 0 to turn it on
+#ifndef GTL_SKIP_STREAMING_PARSE
+  #define GTL_SKIP_STREAMING_PARSE 1
+#endif
+
+#if GTL_USE_LAZY_JSON_PARSER
+// Parsing as the data arrives builds the whole tree, which the lazy parser
+// avoids
+#undef GTL_SKIP_STREAMING_PARSE
+#define GTL_SKIP_STREAMING_PARSE 1
+#endif
+
 NSString* const kGTLServiceErrorDomain = @"com.google.GTLServiceDomain";
 NSString* const kGTLJSONRPCErrorDomain = @"com.google.GTLJSONRPCErrorDomain";
 NSString* const kGTLServerErrorStringKey = @"error";
@@ -53,6 +66,8 @@ static NSString* const kFetcherParsedObjectKey         = @"_parsedObject";
 static NSString* const kFetcherBatchClassMapKey        = @"_batchClassMap";
 static NSString* const kFetcherCallbackThreadKey       = @"_callbackThread";
 static NSString* const kFetcherCallbackRunLoopModesKey = @"_runLoopModes";
+static NSString* const kFetcherStreamParserKey         = @"_streamParser";
+static NSString* const kFetcherStreamedResponseKey     = @"_streamedResponse";
 
 static const NSUInteger kMaxNumberOfNextPagesFetched = 25;
 
@@ -139,6 +154,9 @@ static NSString *ETagIfPresent(GTLObject *obj) {
      finishedWithData:(NSData *)data
                 error:(NSError *)error;
 - (void)parseObjectFromDataOfFetcher:(GTMHTTPFetcher *)fetcher;
+#if NS_BLOCKS_AVAILABLE && !GTL_SKIP_STREAMING_PARSE
+- (void)beginStreamingParseForFetcher:(GTMHTTPFetcher *)fetcher;
+#endif
 @end
 
 @interface GTLObject (StandardProperties)
@@ -540,6 +558,12 @@ static NSString *ETagIfPresent(GTLObject *obj) {
   // set the upload data
   fetcher.postData = dataToPost;
 
+#if NS_BLOCKS_AVAILABLE && !GTL_SKIP_STREAMING_PARSE
+  if (uploadParams == nil) {
+    [self beginStreamingParseForFetcher:fetcher];
+  }
+#endif
+
   // failed fetches call the failure selector, which will delete the ticket
   BOOL didFetch = [fetcher beginFetchWithDelegate:self
                                 didFinishSelector:finishedSel];
@@ -1025,6 +1049,43 @@ totalBytesExpectedToSend:(NSInteger)totalBytesExpected {
   }
 }
 
+#if NS_BLOCKS_AVAILABLE && !GTL_SKIP_STREAMING_PARSE
+// Feed the response to a stream parser as it arrives, so that parsing
+// overlaps the download rather than following it.  The fetcher hands the
+// block all of the data received so far, of which only the new part is
+// appended.  A response which is not JSON is not parsed, and a new response,
+// as after a redirect or a retry, gets a new parser.
+- (void)beginStreamingParseForFetcher:(GTMHTTPFetcher *)fetcher {
+  // The fetcher releases the block when it stops; the block does not retain
+  // the fetcher
+  __block GTMHTTPFetcher *blockFetcher = fetcher;
+  fetcher.receivedDataBlock = ^(NSData *dataReceivedSoFar) {
+    NSURLResponse *response = blockFetcher.response;
+    GTLJSONStreamParser *parser =
+      [blockFetcher propertyForKey:kFetcherStreamParserKey];
+    if ([blockFetcher propertyForKey:kFetcherStreamedResponseKey] != response) {
+      [blockFetcher setProperty:response forKey:kFetcherStreamedResponseKey];
+
+      parser = nil;
+      NSString *contentType =
+        [blockFetcher.responseHeaders objectForKey:@"Content-Type"];
+      if ([contentType hasPrefix:@"application/json"]) {
+        parser = [[[GTLJSONStreamParser alloc] init] autorelease];
+      }
+      [blockFetcher setProperty:parser forKey:kFetcherStreamParserKey];
+    }
+
+    unsigned long long appendedLength = [parser appendedLength];
+    NSUInteger length = [dataReceivedSoFar length];
+    if (parser != nil && length > appendedLength) {
+      NSRange newRange = NSMakeRange((NSUInteger)appendedLength,
+                                     length - (NSUInteger)appendedLength);
+      [parser appendData:[dataReceivedSoFar subdataWithRange:newRange]];
+    }
+  };
+}
+#endif // NS_BLOCKS_AVAILABLE && !GTL_SKIP_STREAMING_PARSE
+
 // Three methods handle parsing of the fetched JSON data:
 //   - prepareToParse posts a start notification and then spawns off parsing
 //     on the operation queue (if there's an operation queue)
@@ -1119,8 +1180,25 @@ totalBytesExpectedToSend:(NSInteger)totalBytesExpected {
 #endif
 
     NSError *parseError = nil;
-    NSMutableDictionary *jsonWrapper = [GTLJSONParser objectWithData:data
-                                                               error:&parseError];
+    NSMutableDictionary *jsonWrapper = nil;
+
+    // Use the tree built while the response arrived if the parser saw all
+    // of the downloaded data; otherwise, or if it failed, parse the data now
+    GTLJSONStreamParser *streamParser =
+      [[[properties valueForKey:kFetcherStreamParserKey] retain] autorelease];
+    [properties removeObjectForKey:kFetcherStreamParserKey];
+    if (streamParser != nil
+        && [properties valueForKey:kFetcherStreamedResponseKey] == fetcher.response
+        && [streamParser appendedLength] == [data length]
+        && fetcher.statusCode != kGTMHTTPFetcherStatusNotModified) {
+      jsonWrapper = [streamParser finishWithError:NULL];
+    }
+    [properties removeObjectForKey:kFetcherStreamedResponseKey];
+
+    if (jsonWrapper == nil) {
+      jsonWrapper = [GTLJSONParser objectWithData:data
+                                            error:&parseError];
+    }
     if ([parseOperation isCancelled]) return;
 
     if (parseError != nil) {
@@ -18,6 +18,7 @@
 
 #import "CloudControllerHelper.h"
 #import "CloudEntity.h"
+#import "CloudEntityOptimisticView.h"
 #import "Constants.h"
 #import "EditModeUITextView.h"
 #import "GTLMobilebackend.h"
@@ -29,7 +30,7 @@ NSString *const kMessageTableVCUserSignOutNotification =
     @"userSignOutNotification";
 
 @implementation MessagesTableViewController {
-  NSMutableArray *_messages; // of CloudEntity
+  CloudEntityOptimisticView *_messages;
   EditModeUITextView *_textView;
   CloudControllerHelper *_controllerHelper;
 }
@@ -40,6 +41,14 @@ static NSString *const kGuestbookPropMessage = @"message";
 static int const kLeftRightScreenMargin = 110;
 
 - (void)viewDidLoad {
+  // Writes show in the table before the backend answers
+  __weak MessagesTableViewController *weakSelf = self;
+  _messages = [[CloudEntityOptimisticView alloc]
+      initWithQuery:nil
+      changeHandler:^(CloudEntityResultSet *resultSet,
+                      CloudEntityChangeSet *changes) {
+          [weakSelf updateUIByApplyingChanges:changes];
+      }];
   [self setupControllerHelper];
 }
 
@@ -203,6 +212,45 @@ static int const kLeftRightScreenMargin = 110;
   }
 }
 
+// Animate the rows that changed instead of reloading the table.
+- (void)updateUIByApplyingChanges:(CloudEntityChangeSet *)changes {
+  if (![changes hasChanges]) {
+    return;
+  }
+
+  UITableView *tableView = self.tableView;
+  [tableView beginUpdates];
+  [tableView deleteRowsAtIndexPaths:
+                 [self indexPathsWithIndexes:changes.deletedIndexes]
+                   withRowAnimation:UITableViewRowAnimationFade];
+  [tableView insertRowsAtIndexPaths:
+                 [self indexPathsWithIndexes:changes.insertedIndexes]
+                   withRowAnimation:UITableViewRowAnimationFade];
+  for (CloudEntityMove *move in changes.moves) {
+    [tableView moveRowAtIndexPath:[NSIndexPath indexPathForRow:move.fromIndex
+                                                     inSection:0]
+                      toIndexPath:[NSIndexPath indexPathForRow:move.toIndex
+                                                     inSection:0]];
+  }
+  [tableView endUpdates];
+
+  // A moved row cannot be reloaded in the same batch, so reload them after
+  if ([changes.updatedIndexes count] > 0) {
+    [tableView reloadRowsAtIndexPaths:
+                   [self indexPathsWithIndexes:changes.updatedIndexes]
+                     withRowAnimation:UITableViewRowAnimationNone];
+  }
+}
+
+- (NSArray *)indexPathsWithIndexes:(NSIndexSet *)indexes {
+  NSMutableArray *indexPaths =
+      [NSMutableArray arrayWithCapacity:[indexes count]];
+  [indexes enumerateIndexesUsingBlock:^(NSUInteger idx, BOOL *stop) {
+      [indexPaths addObject:[NSIndexPath indexPathForRow:idx inSection:0]];
+  }];
+  return indexPaths;
+}
+
 - (void)showToolbarSpinner {
   UIActivityIndicatorView *spinner =
       [[UIActivityIndicatorView alloc]
@@ -268,15 +316,10 @@ static int const kLeftRightScreenMargin = 110;
 }
 
 - (void)removeCompletedWithObject:(CloudEntity *)returnedObject
-                            index:(NSIndexPath *)indexPath
                             error:(NSError *)error {
+  // The row is gone already, and came back if the delete failed
   if (error) {
     [self showPopupMessageWithVerb:@"deleting"];
-  } else {
-    // Remove the same item from the local list and the view
-    [_messages removeObjectAtIndex:indexPath.row];
-    [self.tableView deleteRowsAtIndexPaths:@[indexPath]
-                          withRowAnimation:UITableViewRowAnimationFade];
   }
 }
 
@@ -303,13 +346,9 @@ static int const kLeftRightScreenMargin = 110;
     [self showPopupMessageWithVerb:@"listing"];
     [self resetToolBarWithAddButton];
   } else {
-    // Assign the array into ivar, and reload table accordingly
-    NSMutableArray *array = [returnedArray mutableCopy];
-    if (![_messages isEqual:array]) {
-      _messages = array; // An array of CloudEntity
-
-      [self updateUIByReloadingTable:YES showSpinner:NO];
-    }
+    // Merge the array into the rows shown, which animates what changed
+    [self updateUIByReloadingTable:NO showSpinner:NO];
+    [_messages applyServerEntities:returnedArray];
   }
 }
 
@@ -317,7 +356,7 @@ static int const kLeftRightScreenMargin = 110;
 
 - (NSInteger)tableView:(UITableView *)tableView
     numberOfRowsInSection:(NSInteger)section {
-  return [_messages count];
+  return [_messages.resultSet count];
 }
 
 - (UITableViewCell *)tableView:(UITableView *)tableView
@@ -330,9 +369,12 @@ static int const kLeftRightScreenMargin = 110;
                                   reuseIdentifier:kCellName];
   }
 
-  CloudEntity *record = _messages[indexPath.row];
+  CloudEntity *record = _messages.resultSet[indexPath.row];
   cell.textLabel.text = record.properties[kGuestbookPropMessage];
   cell.textLabel.numberOfLines = 0;
+  // Grey out messages the backend has not confirmed yet
+  cell.textLabel.textColor = [_messages isPendingEntity:record] ?
+      [UIColor grayColor] : [UIColor blackColor];
 
   cell.detailTextLabel.text = [NSString stringWithFormat:@"%@\n%@",
                                   record.localizedUpdatedAt,
@@ -343,7 +385,7 @@ static int const kLeftRightScreenMargin = 110;
 
 - (CGFloat)tableView:(UITableView *)tableView
     heightForRowAtIndexPath:(NSIndexPath *)indexPath {
-  CloudEntity *record = _messages[indexPath.row];
+  CloudEntity *record = _messages.resultSet[indexPath.row];
   NSDictionary *propertyBag = record.properties;
   NSString *message = propertyBag[kGuestbookPropMessage];
 
@@ -373,20 +415,18 @@ static int const kLeftRightScreenMargin = 110;
      forRowAtIndexPath:(NSIndexPath *)indexPath {
   if (editingStyle == UITableViewCellEditingStyleDelete) {
     // Delete at the backend
-    CloudEntity *record = _messages[indexPath.row];
-
-    [record removeInstanceAtIndexPath:indexPath
-                             callback:^(CloudEntity *entity, NSError *error) {
-                                 [self removeCompletedWithObject:entity
-                                                           index:indexPath
-                                                           error:error];
-                             }];
+    CloudEntity *record = _messages.resultSet[indexPath.row];
+
+    [_messages removeEntity:record
+                   callback:^(CloudEntity *entity, NSError *error) {
+                       [self removeCompletedWithObject:entity error:error];
+                   }];
   }
 }
 
 - (void)tableView:(UITableView *)tableView
     didSelectRowAtIndexPath:(NSIndexPath *)indexPath {
-  CloudEntity *record = _messages[indexPath.row];
+  CloudEntity *record = _messages.resultSet[indexPath.row];
   NSDictionary *properties = record.properties;
 
   // Show the text view for edit
@@ -419,21 +459,26 @@ static int const kLeftRightScreenMargin = 110;
       CloudEntity *record = [CloudEntity entityWithKind:kGuestbookEntityName
                                              properties:dict];
 
-      [record insertInstanceWithCallback:^(CloudEntity *entity, NSError *error) {
-          [self insertCompletedWithObject:entity error:error];
-      }];
+      [_messages insertEntity:record
+                     callback:^(CloudEntity *entity, NSError *error) {
+                         [self insertCompletedWithObject:entity error:error];
+                     }];
     } else if (textView.mode == kTextViewModeEdit) {
       // Update request is detected
-      record = _messages[textView.cellIndexPath.row];
-      NSMutableDictionary *dict = record.properties;
-      dict[kGuestbookPropMessage] = textView.text;
-
-      [record putInstanceAtIndexPath:textView.cellIndexPath
-                            callback:^(CloudEntity *entity, NSError *error) {
-                                [self putCompletedWithObject:entity
-                                    index:textView.cellIndexPath
-                                    error:error];
-                            }];
+      record = _messages.resultSet[textView.cellIndexPath.row];
+      NSString *text = textView.text;
+      NSIndexPath *indexPath = textView.cellIndexPath;
+
+      [_messages updateEntity:record
+                    withBlock:^(CloudEntity *entity) {
+                        [entity setValue:text
+                         forPropertyName:kGuestbookPropMessage];
+                    }
+                     callback:^(CloudEntity *entity, NSError *error) {
+                         [self putCompletedWithObject:entity
+                                                index:indexPath
+                                                error:error];
+                     }];
     }
 
     return NO;
@@ -96,9 +96,18 @@
 
   // Handle this push notification based on this topicID
   NSString *topicID = tokens[2]; // clientSubId
+
+  // Only fetch the changed entities if the payload names all of them
+  NSArray *entityIDs = userInfo[kCloudEntityCollectionPushEntityIDsKey];
+  if (![entityIDs isKindOfClass:[NSArray class]] ||
+      [userInfo[kCloudEntityCollectionPushTruncatedKey] boolValue]) {
+    entityIDs = nil;
+  }
+
   CloudEntityCollection *entityCollection =
       [CloudEntityCollection sharedInstance];
-  [entityCollection handlePushNotificationWithTopicID:topicID];
+  [entityCollection handlePushNotificationWithTopicID:topicID
+                                            entityIDs:entityIDs];
 }
 
 @end
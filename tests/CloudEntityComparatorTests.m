@@ -0,0 +1,106 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntity.h"
+#import "GTLMobilebackendEntityDto.h"
+
+// Checks that entities sort by a property the way the backend sorts them:
+// values of different types by type, lists by their smallest or largest
+// value, and entities without the property last.
+@interface CloudEntityComparatorTests : XCTestCase
+@end
+
+
+@implementation CloudEntityComparatorTests
+
+#pragma mark - Private methods
+
+- (CloudEntity *)entityWithIdentifier:(NSString *)identifier
+                                 rank:(id)rank {
+  GTLMobilebackendEntityDto *rawObject = [GTLMobilebackendEntityDto object];
+  rawObject.kindName = @"Note";
+  rawObject.identifier = identifier;
+  NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+  if (rank) {
+    properties[@"rank"] = rank;
+  }
+  rawObject.properties = properties;
+  return [CloudEntity entityWithRawObject:rawObject];
+}
+
+- (NSArray *)identifiersOfEntities:(NSArray *)entities
+                   sortedAscending:(BOOL)isAscending {
+  NSComparator comparator = [CloudEntity comparatorForFieldName:@"rank"
+                                                      ascending:isAscending];
+  NSMutableArray *identifiers = [NSMutableArray array];
+  for (CloudEntity *entity in
+       [entities sortedArrayUsingComparator:comparator]) {
+    [identifiers addObject:entity.identifier];
+  }
+  return identifiers;
+}
+
+#pragma mark - Tests
+
+- (void)testMixedTypesSortByType {
+  NSArray *entities = @[
+    [self entityWithIdentifier:@"string" rank:@"b"],
+    [self entityWithIdentifier:@"missing" rank:nil],
+    [self entityWithIdentifier:@"boolean" rank:@YES],
+    [self entityWithIdentifier:@"date" rank:@"2013-09-24T05:20:00.000Z"],
+    [self entityWithIdentifier:@"number" rank:@3],
+    [self entityWithIdentifier:@"null" rank:[NSNull null]],
+    [self entityWithIdentifier:@"map" rank:@{ @"a" : @1 }]
+  ];
+  XCTAssertEqualObjects(
+      [self identifiersOfEntities:entities sortedAscending:YES],
+      (@[ @"null", @"number", @"date", @"boolean", @"string", @"map",
+          @"missing" ]));
+  XCTAssertEqualObjects(
+      [self identifiersOfEntities:entities sortedAscending:NO],
+      (@[ @"map", @"string", @"boolean", @"date", @"number", @"null",
+          @"missing" ]));
+}
+
+- (void)testDatesCompareAcrossTimeZones {
+  // 05:20Z is after 06:10+02:00, which a string comparison would reverse
+  NSArray *entities = @[
+    [self entityWithIdentifier:@"utc" rank:@"2013-09-24T05:20:00.000Z"],
+    [self entityWithIdentifier:@"offset"
+                          rank:@"2013-09-24T06:10:00.000+02:00"]
+  ];
+  XCTAssertEqualObjects(
+      [self identifiersOfEntities:entities sortedAscending:YES],
+      (@[ @"offset", @"utc" ]));
+}
+
+- (void)testListsSortBySmallestOrLargestValue {
+  NSArray *entities = @[
+    [self entityWithIdentifier:@"wide" rank:@[ @5, @1 ]],
+    [self entityWithIdentifier:@"middle" rank:@3],
+    [self entityWithIdentifier:@"narrow" rank:@[ @2, @4 ]],
+    [self entityWithIdentifier:@"empty" rank:@[]]
+  ];
+  XCTAssertEqualObjects(
+      [self identifiersOfEntities:entities sortedAscending:YES],
+      (@[ @"wide", @"narrow", @"middle", @"empty" ]));
+  XCTAssertEqualObjects(
+      [self identifiersOfEntities:entities sortedAscending:NO],
+      (@[ @"wide", @"narrow", @"middle", @"empty" ]));
+}
+
+@end
@@ -0,0 +1,158 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntity.h"
+#import "CloudEntityCursor.h"
+#import "CloudFilter.h"
+#import "GTLMobilebackendEntityDto.h"
+#import "GTLMobilebackendFilterDto.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Checks that consecutive pages neither skip nor repeat entities sharing a
+// sort value, and that a prefetched page is handed over once.
+@interface CloudEntityCursorTests : XCTestCase
+@end
+
+
+@implementation CloudEntityCursorTests
+
+#pragma mark - Private methods
+
+- (CloudEntity *)entityWithIdentifier:(NSString *)identifier rank:(id)rank {
+  GTLMobilebackendEntityDto *rawObject = [GTLMobilebackendEntityDto object];
+  rawObject.kindName = @"Note";
+  rawObject.identifier = identifier;
+  rawObject.properties = [NSMutableDictionary dictionaryWithObject:rank
+                                                            forKey:@"rank"];
+  return [CloudEntity entityWithRawObject:rawObject];
+}
+
+- (CloudEntityCursor *)cursorWithPageSize:(NSInteger)size {
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.kindName = @"Note";
+  query.sortedPropertyName = @"rank";
+  query.sortAscending = @YES;
+  query.limit = @(size);
+  return [CloudEntityCursor cursorWithQuery:query prefetchNextPage:NO];
+}
+
+#pragma mark - Tests
+
+- (void)testFirstPageListsPastEntitiesInTotalOrder {
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.kindName = @"Note";
+  query.queryId = @"topic";
+  CloudEntityCursor *cursor = [CloudEntityCursor cursorWithQuery:query
+                                                prefetchNextPage:NO];
+
+  GTLMobilebackendQueryDto *pageQuery = [cursor queryForNextPage];
+  XCTAssertEqualObjects(pageQuery.scope, kCloudEntityScopePast);
+  XCTAssertEqualObjects(pageQuery.sortedPropertyName,
+                        kCloudEntityFieldNameUpdatedAt);
+  XCTAssertFalse([pageQuery.sortAscending boolValue]);
+  XCTAssertNil(pageQuery.queryId);
+  XCTAssertNil(pageQuery.filterDto);
+}
+
+- (void)testTiesAreNeitherSkippedNorRepeated {
+  CloudEntityCursor *cursor = [self cursorWithPageSize:2];
+  NSArray *page = nil;
+  cursor = [cursor cursorAfterEntities:@[
+      [self entityWithIdentifier:@"a" rank:@1],
+      [self entityWithIdentifier:@"b" rank:@2] ]
+                                  page:&page];
+  XCTAssertEqualObjects([page valueForKey:@"identifier"], (@[ @"a", @"b" ]));
+  XCTAssertFalse(cursor.isExhausted);
+
+  // The next page starts at the last sort value and asks for one more entity
+  // to make up for b being listed again
+  GTLMobilebackendQueryDto *pageQuery = [cursor queryForNextPage];
+  XCTAssertEqualObjects(pageQuery.limit, @3);
+  XCTAssertEqualObjects(pageQuery.filterDto.operatorProperty, @"GE");
+  XCTAssertEqualObjects(pageQuery.filterDto.values, (@[ @"rank", @2 ]));
+
+  cursor = [cursor cursorAfterEntities:@[
+      [self entityWithIdentifier:@"b" rank:@2],
+      [self entityWithIdentifier:@"c" rank:@2],
+      [self entityWithIdentifier:@"d" rank:@3] ]
+                                  page:&page];
+  XCTAssertEqualObjects([page valueForKey:@"identifier"], (@[ @"c", @"d" ]));
+  XCTAssertFalse(cursor.isExhausted);
+
+  cursor = [cursor cursorAfterEntities:@[
+      [self entityWithIdentifier:@"d" rank:@3] ]
+                                  page:&page];
+  XCTAssertEqual([page count], (NSUInteger)0);
+  XCTAssertTrue(cursor.isExhausted);
+}
+
+- (void)testNextPageKeepsQueryFilter {
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.kindName = @"Note";
+  query.sortedPropertyName = @"rank";
+  query.limit = @1;
+  query.filterDto = [CloudFilter cloudFilterEq:@"owner" value:@"me"].filterDto;
+  CloudEntityCursor *cursor = [CloudEntityCursor cursorWithQuery:query
+                                                prefetchNextPage:NO];
+  cursor = [cursor cursorAfterEntities:@[
+      [self entityWithIdentifier:@"a" rank:@1] ]
+                                  page:NULL];
+
+  GTLMobilebackendFilterDto *filterDto = [cursor queryForNextPage].filterDto;
+  XCTAssertEqualObjects(filterDto.operatorProperty, @"AND");
+  XCTAssertEqual([filterDto.subfilters count], (NSUInteger)2);
+  // Descending by default
+  GTLMobilebackendFilterDto *pageFilterDto = filterDto.subfilters[1];
+  XCTAssertEqualObjects(pageFilterDto.operatorProperty, @"LE");
+}
+
+- (void)testPrefetchedPageIsDeliveredOnce {
+  CloudEntityCursor *cursor = [self cursorWithPageSize:2];
+  __block NSArray *delivered = nil;
+  void (^delivery)(NSArray *, NSError *) = ^(NSArray *entities,
+                                              NSError *error) {
+      delivered = entities;
+  };
+  XCTAssertFalse([cursor deliverPrefetchedEntitiesTo:delivery]);
+
+  NSArray *entities = @[ [self entityWithIdentifier:@"a" rank:@1] ];
+  [cursor beginPrefetch];
+  [cursor finishPrefetchWithEntities:entities error:nil];
+  XCTAssertTrue([cursor deliverPrefetchedEntitiesTo:delivery]);
+  XCTAssertEqual(delivered, entities);
+  XCTAssertFalse([cursor deliverPrefetchedEntitiesTo:delivery]);
+
+  // A delivery waiting for the prefetch gets it when it arrives
+  delivered = nil;
+  [cursor beginPrefetch];
+  XCTAssertTrue([cursor deliverPrefetchedEntitiesTo:delivery]);
+  XCTAssertNil(delivered);
+  [cursor finishPrefetchWithEntities:entities error:nil];
+  XCTAssertEqual(delivered, entities);
+}
+
+- (void)testFailedPrefetchIsDropped {
+  CloudEntityCursor *cursor = [self cursorWithPageSize:2];
+  [cursor beginPrefetch];
+  NSError *failure = [NSError errorWithDomain:@"test" code:1 userInfo:nil];
+  [cursor finishPrefetchWithEntities:nil error:failure];
+  XCTAssertFalse([cursor deliverPrefetchedEntitiesTo:^(NSArray *entities,
+                                                        NSError *error) {
+  }]);
+}
+
+@end
@@ -0,0 +1,163 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntity.h"
+#import "CloudEntityCollection.h"
+#import "CloudFilter.h"
+#import "CloudNotificationHandler.h"
+#import "GTLDateTime.h"
+#import "GTLMobilebackendEntityDto.h"
+#import "GTLMobilebackendFilterDto.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Private methods of the delta sync.
+@interface CloudEntityCollection (Tests)
+- (BOOL)canSyncDeltaWithHandler:(CloudNotificationHandler *)handler;
+- (GTLMobilebackendQueryDto *)deltaQueryForHandler:
+    (CloudNotificationHandler *)handler;
+- (void)mergeEntities:(NSArray *)entities
+          intoHandler:(CloudNotificationHandler *)handler;
+@end
+
+// Checks which queries can be synced by delta, the query listing the delta,
+// and merging a delta into the result of a continuous query.
+@interface CloudEntityDeltaSyncTests : XCTestCase {
+  CloudEntityCollection *_collection;
+}
+@end
+
+
+@implementation CloudEntityDeltaSyncTests
+
+- (void)setUp {
+  [super setUp];
+  _collection = [[CloudEntityCollection alloc] init];
+}
+
+#pragma mark - Private methods
+
+- (CloudEntity *)entityWithIdentifier:(NSString *)identifier
+                            updatedAt:(NSTimeInterval)updatedAt {
+  GTLMobilebackendEntityDto *rawObject = [GTLMobilebackendEntityDto object];
+  rawObject.kindName = @"Note";
+  rawObject.identifier = identifier;
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:updatedAt];
+  rawObject.updatedAt = [GTLDateTime dateTimeWithDate:date
+                                             timeZone:nil];
+  return [CloudEntity entityWithRawObject:rawObject];
+}
+
+- (CloudNotificationHandler *)handlerWithFilter:(CloudFilter *)filter
+                                          limit:(NSInteger)limit {
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.kindName = @"Note";
+  query.filterDto = filter.filterDto;
+  query.limit = @(limit);
+  CloudNotificationHandler *handler = [[CloudNotificationHandler alloc] init];
+  handler.query = query;
+  handler.isDeltaSync = YES;
+  return handler;
+}
+
+#pragma mark - Tests
+
+- (void)testInequalityOnOtherPropertyPreventsDelta {
+  CloudFilter *equal = [CloudFilter cloudFilterEq:@"owner" value:@"me"];
+  CloudFilter *recent =
+      [CloudFilter cloudFilterGe:kCloudEntityFieldNameUpdatedAt
+                           value:[NSDate date]];
+  CloudFilter *ranked = [CloudFilter cloudFilterGt:@"rank" value:@3];
+
+  XCTAssertTrue([_collection canSyncDeltaWithHandler:
+      [self handlerWithFilter:nil limit:0]]);
+  XCTAssertTrue([_collection canSyncDeltaWithHandler:
+      [self handlerWithFilter:[CloudFilter cloudFilterAndFilters:equal,
+                                                                 recent, nil]
+                        limit:0]]);
+  XCTAssertFalse([_collection canSyncDeltaWithHandler:
+      [self handlerWithFilter:ranked limit:0]]);
+  XCTAssertFalse([_collection canSyncDeltaWithHandler:
+      [self handlerWithFilter:[CloudFilter cloudFilterOrFilters:equal,
+                                                                ranked, nil]
+                        limit:0]]);
+}
+
+- (void)testDeltaQueryListsOldestChangesFirst {
+  CloudFilter *equal = [CloudFilter cloudFilterEq:@"owner" value:@"me"];
+  CloudNotificationHandler *handler = [self handlerWithFilter:equal limit:10];
+  handler.highWaterMark = [NSDate dateWithTimeIntervalSince1970:1380000000];
+
+  GTLMobilebackendQueryDto *deltaQuery =
+      [_collection deltaQueryForHandler:handler];
+  XCTAssertEqualObjects(deltaQuery.sortedPropertyName,
+                        kCloudEntityFieldNameUpdatedAt);
+  XCTAssertTrue([deltaQuery.sortAscending boolValue]);
+  XCTAssertEqualObjects(deltaQuery.limit, @10);
+
+  // Writes at the high-water mark itself are listed again
+  GTLMobilebackendFilterDto *filterDto = deltaQuery.filterDto;
+  XCTAssertEqualObjects(filterDto.operatorProperty, @"AND");
+  GTLMobilebackendFilterDto *changedFilterDto = filterDto.subfilters[1];
+  XCTAssertEqualObjects(changedFilterDto.operatorProperty, @"GE");
+  XCTAssertEqualObjects(changedFilterDto.values[0],
+                        kCloudEntityFieldNameUpdatedAt);
+
+  // The handler's query is left as it is
+  XCTAssertEqualObjects(handler.query.filterDto.operatorProperty, @"EQ");
+  XCTAssertNil(handler.query.sortedPropertyName);
+}
+
+- (void)testMergeReplacesByIdentifierAndKeepsLimit {
+  CloudNotificationHandler *handler = [self handlerWithFilter:nil limit:2];
+  [_collection mergeEntities:@[
+      [self entityWithIdentifier:@"a" updatedAt:1380000001],
+      [self entityWithIdentifier:@"b" updatedAt:1380000002] ]
+                 intoHandler:handler];
+  XCTAssertEqualObjects([handler.results valueForKey:@"identifier"],
+                        (@[ @"b", @"a" ]));
+
+  // A same-timestamp write listed again is merged, not duplicated
+  CloudEntity *updated = [self entityWithIdentifier:@"a" updatedAt:1380000003];
+  [_collection mergeEntities:@[
+      [self entityWithIdentifier:@"b" updatedAt:1380000002], updated ]
+                 intoHandler:handler];
+  XCTAssertEqualObjects([handler.results valueForKey:@"identifier"],
+                        (@[ @"a", @"b" ]));
+  XCTAssertEqual(handler.results[0], updated);
+  XCTAssertEqualObjects(handler.highWaterMark,
+                        [NSDate dateWithTimeIntervalSince1970:1380000003]);
+
+  // The oldest entity falls out of the limit
+  [_collection mergeEntities:@[
+      [self entityWithIdentifier:@"c" updatedAt:1380000004] ]
+                 intoHandler:handler];
+  XCTAssertEqualObjects([handler.results valueForKey:@"identifier"],
+                        (@[ @"c", @"a" ]));
+}
+
+- (void)testHighWaterMarkNeverMovesBack {
+  CloudNotificationHandler *handler = [self handlerWithFilter:nil limit:0];
+  NSDate *mark = [NSDate dateWithTimeIntervalSince1970:1380000010];
+  handler.highWaterMark = mark;
+  [_collection mergeEntities:@[
+      [self entityWithIdentifier:@"a" updatedAt:1380000001] ]
+                 intoHandler:handler];
+  XCTAssertEqualObjects(handler.highWaterMark, mark);
+  XCTAssertEqual([handler.results count], (NSUInteger)1);
+}
+
+@end
@@ -0,0 +1,206 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntityIndex.h"
+#import "CloudEntityStore.h"
+#import "CloudFilter.h"
+#import "CloudFilterEvaluator.h"
+#import "GTLDateTime.h"
+#import "GTLMobilebackendEntityDto.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Checks that queries answered from the indexes match the ones answered by
+// scanning every entity: dates across time zone offsets, list values, values
+// of different types and missing values.
+@interface CloudEntityIndexTests : XCTestCase {
+  NSString *_path;
+  CloudEntityStore *_store;
+  CloudEntityIndex *_index;
+}
+@end
+
+
+@implementation CloudEntityIndexTests
+
+- (void)setUp {
+  [super setUp];
+  NSString *name = [[NSProcessInfo processInfo] globallyUniqueString];
+  _path = [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+  _store = [[CloudEntityStore alloc] initWithPath:_path];
+  _index = [[CloudEntityIndex alloc] initWithKindName:@"Note" store:_store];
+}
+
+- (void)tearDown {
+  _index = nil;
+  _store = nil;
+  [[NSFileManager defaultManager] removeItemAtPath:_path error:nil];
+  [super tearDown];
+}
+
+#pragma mark - Private methods
+
+- (void)putEntityWithIdentifier:(NSString *)identifier
+                     properties:(NSDictionary *)properties {
+  GTLMobilebackendEntityDto *entity = [GTLMobilebackendEntityDto object];
+  entity.kindName = @"Note";
+  entity.identifier = identifier;
+  entity.properties = [properties mutableCopy];
+  [_store putEntity:entity];
+}
+
+- (GTLMobilebackendQueryDto *)queryWithFilter:(CloudFilter *)filter {
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.kindName = @"Note";
+  query.filterDto = filter.filterDto;
+  return query;
+}
+
+// Return the sorted identifiers of the query result, from the indexes and
+// from a scan of the store.
+- (NSArray *)identifiersOfResultOfQuery:(GTLMobilebackendQueryDto *)query
+                        scanIdentifiers:(NSArray **)scanIdentifiers {
+  NSMutableArray *entities = [NSMutableArray array];
+  for (GTLMobilebackendEntityDto *object in [_store entitiesWithKind:@"Note"]) {
+    [entities addObject:[CloudEntity entityWithRawObject:object]];
+  }
+  NSArray *scan = [CloudFilterEvaluator resultOfQuery:query
+                                         withEntities:entities];
+  *scanIdentifiers = [scan valueForKey:@"identifier"];
+  return [[_index resultOfQuery:query] valueForKey:@"identifier"];
+}
+
+- (void)assertIndexAnswersQuery:(GTLMobilebackendQueryDto *)query
+                    identifiers:(NSArray *)expected {
+  NSArray *scan = nil;
+  NSArray *identifiers = [self identifiersOfResultOfQuery:query
+                                          scanIdentifiers:&scan];
+  if (!query.sortedPropertyName) {
+    identifiers = [identifiers sortedArrayUsingSelector:@selector(compare:)];
+    scan = [scan sortedArrayUsingSelector:@selector(compare:)];
+  }
+  XCTAssertEqualObjects(identifiers, expected);
+  XCTAssertEqualObjects(scan, expected);
+}
+
+- (GTLDateTime *)dateTimeWithInterval:(NSTimeInterval)interval {
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:interval];
+  return [GTLDateTime dateTimeWithDate:date
+                              timeZone:[NSTimeZone
+                                           timeZoneForSecondsFromGMT:0]];
+}
+
+#pragma mark - Tests
+
+- (void)testDatesMatchAcrossTimeZoneOffsets {
+  [_index addHashIndexForFieldName:@"due"];
+  [_index addOrderedIndexForFieldName:@"due"];
+  // 1380000000 is 2013-09-24T05:20:00Z
+  [self putEntityWithIdentifier:@"utc"
+                     properties:@{ @"due" : @"2013-09-24T05:20:00.000Z" }];
+  [self putEntityWithIdentifier:@"offset"
+                     properties:@{ @"due" :
+                                       @"2013-09-24T07:20:00.000+02:00" }];
+  [self putEntityWithIdentifier:@"earlier"
+                     properties:@{ @"due" :
+                                       @"2013-09-24T06:10:00.000+02:00" }];
+  [self putEntityWithIdentifier:@"text" properties:@{ @"due" : @"soon" }];
+
+  GTLDateTime *dateTime = [self dateTimeWithInterval:1380000000];
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterEq:@"due"
+                                                       value:dateTime]]
+                    identifiers:(@[ @"offset", @"utc" ])];
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterLt:@"due"
+                                                       value:dateTime]]
+                    identifiers:(@[ @"earlier" ])];
+
+  GTLMobilebackendQueryDto *query = [self queryWithFilter:nil];
+  query.sortedPropertyName = @"due";
+  query.sortAscending = @YES;
+  query.limit = @2;
+  NSArray *scan = nil;
+  NSArray *identifiers = [self identifiersOfResultOfQuery:query
+                                          scanIdentifiers:&scan];
+  XCTAssertEqualObjects([identifiers firstObject], @"earlier");
+  XCTAssertEqualObjects(scan[0], @"earlier");
+}
+
+- (void)testListValuesAreIndexedByElement {
+  [_index addHashIndexForFieldName:@"tags"];
+  [_index addOrderedIndexForFieldName:@"rank"];
+  [self putEntityWithIdentifier:@"a"
+                     properties:@{ @"tags" : @[ @"red", @"blue" ],
+                                   @"rank" : @[ @5, @1 ] }];
+  [self putEntityWithIdentifier:@"b"
+                     properties:@{ @"tags" : @"blue", @"rank" : @3 }];
+  [self putEntityWithIdentifier:@"c"
+                     properties:@{ @"tags" : @[], @"rank" : @[ @2, @4 ] }];
+  [self putEntityWithIdentifier:@"d" properties:@{ @"tags" : @"green" }];
+
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterEq:@"tags"
+                                                       value:@"blue"]]
+                    identifiers:(@[ @"a", @"b" ])];
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterGe:@"rank"
+                                                       value:@4]]
+                    identifiers:(@[ @"a", @"c" ])];
+
+  // Sorted by the smallest element ascending and the largest descending;
+  // d has no rank and is left out
+  GTLMobilebackendQueryDto *query = [self queryWithFilter:nil];
+  query.sortedPropertyName = @"rank";
+  query.sortAscending = @YES;
+  [self assertIndexAnswersQuery:query identifiers:(@[ @"a", @"c", @"b" ])];
+  query.sortAscending = @NO;
+  [self assertIndexAnswersQuery:query identifiers:(@[ @"a", @"c", @"b" ])];
+}
+
+- (void)testValuesOfDifferentTypesStayApart {
+  [_index addHashIndexForFieldName:@"seen"];
+  [_index addOrderedIndexForFieldName:@"rank"];
+  [self putEntityWithIdentifier:@"true"
+                     properties:@{ @"seen" : @YES, @"rank" : @"3" }];
+  [self putEntityWithIdentifier:@"one"
+                     properties:@{ @"seen" : @1, @"rank" : @3 }];
+  [self putEntityWithIdentifier:@"null"
+                     properties:@{ @"seen" : [NSNull null],
+                                   @"rank" : [NSNull null] }];
+
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterEq:@"seen"
+                                                       value:@YES]]
+                    identifiers:(@[ @"true" ])];
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterEq:@"seen"
+                                                       value:[NSNull null]]]
+                    identifiers:(@[ @"null" ])];
+  [self assertIndexAnswersQuery:
+            [self queryWithFilter:[CloudFilter cloudFilterGe:@"rank"
+                                                       value:@2]]
+                    identifiers:(@[ @"one" ])];
+
+  // Null sorts before numbers, and numbers before strings
+  GTLMobilebackendQueryDto *query = [self queryWithFilter:nil];
+  query.sortedPropertyName = @"rank";
+  query.sortAscending = @YES;
+  [self assertIndexAnswersQuery:query
+                    identifiers:(@[ @"null", @"one", @"true" ])];
+}
+
+@end
@@ -0,0 +1,186 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntity.h"
+#import "CloudEntityResultSet.h"
+#import "GTLDateTime.h"
+#import "GTLMobilebackendEntityDto.h"
+
+// Checks the change sets of consecutive results: deletions and insertions,
+// the fewest moves that reorder the entities both results hold, and updates.
+@interface CloudEntityResultSetTests : XCTestCase
+@end
+
+
+@implementation CloudEntityResultSetTests
+
+#pragma mark - Private methods
+
+- (CloudEntity *)entityWithIdentifier:(NSString *)identifier
+                            updatedAt:(NSTimeInterval)updatedAt {
+  GTLMobilebackendEntityDto *rawObject = [GTLMobilebackendEntityDto object];
+  rawObject.kindName = @"Note";
+  rawObject.identifier = identifier;
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:updatedAt];
+  rawObject.updatedAt = [GTLDateTime dateTimeWithDate:date
+                                             timeZone:nil];
+  return [CloudEntity entityWithRawObject:rawObject];
+}
+
+- (NSArray *)entitiesWithIdentifiers:(NSArray *)identifiers {
+  NSMutableArray *entities = [NSMutableArray array];
+  for (NSString *identifier in identifiers) {
+    [entities addObject:[self entityWithIdentifier:identifier
+                                         updatedAt:1380000000]];
+  }
+  return entities;
+}
+
+// Return the moves of a change set as "from>to" strings.
+- (NSArray *)descriptionsOfMoves:(NSArray *)moves {
+  NSMutableArray *descriptions = [NSMutableArray array];
+  for (CloudEntityMove *move in moves) {
+    [descriptions addObject:
+        [NSString stringWithFormat:@"%lu>%lu",
+                                   (unsigned long)move.fromIndex,
+                                   (unsigned long)move.toIndex]];
+  }
+  return descriptions;
+}
+
+#pragma mark - Tests
+
+- (void)testFirstResultIsAllInsertions {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:[self entitiesWithIdentifiers:@[ @"a", @"b" ]]];
+  XCTAssertEqualObjects(changes.insertedIndexes,
+                        [NSIndexSet indexSetWithIndexesInRange:
+                            NSMakeRange(0, 2)]);
+  XCTAssertEqual([changes.deletedIndexes count], (NSUInteger)0);
+  XCTAssertEqual([changes.moves count], (NSUInteger)0);
+  XCTAssertEqual([resultSet count], (NSUInteger)2);
+  XCTAssertEqual([resultSet indexOfEntityWithIdentifier:@"b"], (NSUInteger)1);
+}
+
+- (void)testSameResultHasNoChanges {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  NSArray *entities = [self entitiesWithIdentifiers:@[ @"a", @"b", @"c" ]];
+  [resultSet applyEntities:entities];
+  XCTAssertFalse([[resultSet applyEntities:entities] hasChanges]);
+}
+
+- (void)testDeletionsAndInsertionsWithoutMoves {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [resultSet applyEntities:
+      [self entitiesWithIdentifiers:@[ @"a", @"b", @"c", @"d" ]]];
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:
+          [self entitiesWithIdentifiers:@[ @"a", @"x", @"c", @"y" ]]];
+  NSMutableIndexSet *expected = [NSMutableIndexSet indexSetWithIndex:1];
+  [expected addIndex:3];
+  XCTAssertEqualObjects(changes.deletedIndexes, expected);
+  XCTAssertEqualObjects(changes.insertedIndexes, expected);
+  XCTAssertEqual([changes.moves count], (NSUInteger)0);
+  XCTAssertEqual([changes.updatedIndexes count], (NSUInteger)0);
+}
+
+- (void)testRotationTakesOneMove {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [resultSet applyEntities:
+      [self entitiesWithIdentifiers:@[ @"a", @"b", @"c", @"d" ]]];
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:
+          [self entitiesWithIdentifiers:@[ @"d", @"a", @"b", @"c" ]]];
+  XCTAssertEqualObjects([self descriptionsOfMoves:changes.moves],
+                        (@[ @"3>0" ]));
+  XCTAssertEqual([changes.insertedIndexes count], (NSUInteger)0);
+  XCTAssertEqual([changes.deletedIndexes count], (NSUInteger)0);
+}
+
+- (void)testReversalKeepsOneEntityInPlace {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [resultSet applyEntities:
+      [self entitiesWithIdentifiers:@[ @"a", @"b", @"c", @"d", @"e" ]]];
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:
+          [self entitiesWithIdentifiers:@[ @"e", @"d", @"c", @"b", @"a" ]]];
+  XCTAssertEqual([changes.moves count], (NSUInteger)4);
+}
+
+- (void)testMovesAroundTheLongestRunInOrder {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [resultSet applyEntities:
+      [self entitiesWithIdentifiers:@[ @"a", @"b", @"c", @"d", @"e", @"f" ]]];
+  // b, d, e and f keep their order; a and c move, x is new
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:
+          [self entitiesWithIdentifiers:
+              @[ @"b", @"d", @"a", @"e", @"x", @"f", @"c" ]]];
+  XCTAssertEqualObjects([self descriptionsOfMoves:changes.moves],
+                        (@[ @"0>2", @"2>6" ]));
+  XCTAssertEqualObjects(changes.insertedIndexes,
+                        [NSIndexSet indexSetWithIndex:4]);
+}
+
+- (void)testLaterDuplicateIsIgnored {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:
+          [self entitiesWithIdentifiers:@[ @"a", @"b", @"a" ]]];
+  XCTAssertEqual([resultSet count], (NSUInteger)2);
+  XCTAssertEqual([changes.insertedIndexes count], (NSUInteger)2);
+}
+
+- (void)testNewerUpdatedAtIsAnUpdate {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [resultSet applyEntities:[self entitiesWithIdentifiers:@[ @"a", @"b" ]]];
+  NSArray *entities = @[ [self entityWithIdentifier:@"a"
+                                          updatedAt:1380000000],
+                         [self entityWithIdentifier:@"b"
+                                          updatedAt:1380000060] ];
+  CloudEntityChangeSet *changes = [resultSet applyEntities:entities];
+  XCTAssertEqualObjects(changes.updatedIndexes,
+                        [NSIndexSet indexSetWithIndex:1]);
+  XCTAssertEqual([changes.moves count], (NSUInteger)0);
+}
+
+- (void)testUnsavedEntityKeepsItsPlaceOnceInserted {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  CloudEntity *unsaved = [self entityWithIdentifier:nil updatedAt:1380000000];
+  CloudEntity *saved = [self entityWithIdentifier:@"a" updatedAt:1380000000];
+  [resultSet applyEntities:@[ unsaved, saved ]];
+
+  unsaved.innerObject.identifier = @"n";
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:@[ unsaved, saved ]];
+  XCTAssertEqual([changes.insertedIndexes count], (NSUInteger)0);
+  XCTAssertEqual([changes.deletedIndexes count], (NSUInteger)0);
+  XCTAssertEqual([resultSet indexOfEntityWithIdentifier:@"n"], (NSUInteger)0);
+}
+
+- (void)testRemovedEntityIsNotDeletedAgain {
+  CloudEntityResultSet *resultSet = [[CloudEntityResultSet alloc] init];
+  [resultSet applyEntities:
+      [self entitiesWithIdentifiers:@[ @"a", @"b", @"c" ]]];
+  [resultSet removeEntityAtIndex:1];
+  CloudEntityChangeSet *changes =
+      [resultSet applyEntities:[self entitiesWithIdentifiers:@[ @"a", @"c" ]]];
+  XCTAssertFalse([changes hasChanges]);
+}
+
+@end
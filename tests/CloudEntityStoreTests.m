@@ -0,0 +1,217 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntityStore.h"
+#import "GTLMobilebackendEntityDto.h"
+
+// Checks that entities written to the log file read back the same after the
+// store is reopened, and that a record cut short by a crash is dropped
+// without losing the records before it.
+@interface CloudEntityStoreTests : XCTestCase {
+  NSString *_path;
+}
+@end
+
+
+@implementation CloudEntityStoreTests
+
+- (void)setUp {
+  [super setUp];
+  NSString *name = [[NSProcessInfo processInfo] globallyUniqueString];
+  _path = [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+}
+
+- (void)tearDown {
+  [[NSFileManager defaultManager] removeItemAtPath:_path error:nil];
+  [super tearDown];
+}
+
+#pragma mark - Private methods
+
+- (GTLMobilebackendEntityDto *)entityWithIdentifier:(NSString *)identifier
+                                              title:(NSString *)title {
+  GTLMobilebackendEntityDto *entity = [GTLMobilebackendEntityDto object];
+  entity.kindName = @"Note";
+  entity.identifier = identifier;
+  entity.properties = [@{ @"title" : title, @"rank" : @3 } mutableCopy];
+  return entity;
+}
+
+- (unsigned long long)fileLength {
+  NSDictionary *attributes =
+      [[NSFileManager defaultManager] attributesOfItemAtPath:_path error:nil];
+  return [attributes fileSize];
+}
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)length {
+  NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+  [fileHandle seekToEndOfFile];
+  [fileHandle writeData:[NSData dataWithBytes:bytes length:length]];
+  [fileHandle closeFile];
+}
+
+#pragma mark - Tests
+
+- (void)testPutEntityRoundTripsThroughReopen {
+  NSString *title = @"Quote \" slash \\ tab \t café \U0001F600";
+  GTLMobilebackendEntityDto *entity = [self entityWithIdentifier:@"a"
+                                                           title:title];
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntity:entity];
+  XCTAssertEqualObjects([store entityWithKind:@"Note" identifier:@"a"].JSON,
+                        entity.JSON);
+  store = nil;
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  GTLMobilebackendEntityDto *stored = [store entityWithKind:@"Note"
+                                                 identifier:@"a"];
+  XCTAssertEqual([store count], (NSUInteger)1);
+  XCTAssertEqualObjects(stored.JSON, entity.JSON);
+  XCTAssertEqualObjects(stored.properties[@"title"], title);
+}
+
+- (void)testLatestRecordWinsAfterReopen {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntity:[self entityWithIdentifier:@"a" title:@"first"]];
+  [store putEntities:@[ [self entityWithIdentifier:@"a" title:@"second"],
+                        [self entityWithIdentifier:@"b" title:@"other"] ]];
+  [store removeEntityWithKind:@"Note" identifier:@"b"];
+  store = nil;
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)1);
+  XCTAssertEqualObjects(
+      [store entityWithKind:@"Note" identifier:@"a"].properties[@"title"],
+      @"second");
+  XCTAssertNil([store entityWithKind:@"Note" identifier:@"b"]);
+  XCTAssertEqual([[store entitiesWithKind:@"Note"] count], (NSUInteger)1);
+}
+
+- (void)testCompactKeepsLiveEntities {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  for (NSUInteger i = 0; i < 10; i++) {
+    NSString *title = [NSString stringWithFormat:@"version %lu",
+                                                 (unsigned long)i];
+    [store putEntity:[self entityWithIdentifier:@"a" title:title]];
+  }
+  [store putEntity:[self entityWithIdentifier:@"b" title:@"kept"]];
+  [store putEntity:[self entityWithIdentifier:@"c" title:@"removed"]];
+  [store removeEntityWithKind:@"Note" identifier:@"c"];
+  unsigned long long lengthBefore = [self fileLength];
+
+  [store compact];
+  XCTAssertTrue([self fileLength] < lengthBefore);
+  XCTAssertEqualObjects(
+      [store entityWithKind:@"Note" identifier:@"a"].properties[@"title"],
+      @"version 9");
+  store = nil;
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)2);
+  XCTAssertEqualObjects(
+      [store entityWithKind:@"Note" identifier:@"b"].properties[@"title"],
+      @"kept");
+  XCTAssertNil([store entityWithKind:@"Note" identifier:@"c"]);
+}
+
+- (void)testEntityReadBeforeCompactionStaysReadable {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntity:[self entityWithIdentifier:@"a" title:@"first"]];
+  [store putEntity:[self entityWithIdentifier:@"a" title:@"second"]];
+  [store putEntity:[self entityWithIdentifier:@"b" title:@"other"]];
+  GTLMobilebackendEntityDto *entity = [store entityWithKind:@"Note"
+                                                 identifier:@"a"];
+
+  // Compaction and removal replace the mapping the entity was read from
+  [store compact];
+  XCTAssertEqualObjects(entity.properties[@"title"], @"second");
+  [store removeAllEntities];
+  XCTAssertEqualObjects(entity.properties[@"title"], @"second");
+  XCTAssertEqualObjects(entity.properties[@"rank"], @3);
+  XCTAssertEqualObjects(entity.identifier, @"a");
+}
+
+- (void)testTornRecordIsDroppedOnReopen {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntity:[self entityWithIdentifier:@"a" title:@"intact"]];
+  store = nil;
+  unsigned long long intactLength = [self fileLength];
+
+  // A header which promises more bytes than follow it
+  uint32_t header[3] = { 0x31534543, 6, 1000 };
+  [self appendBytes:header length:sizeof(header)];
+  [self appendBytes:"Note\x1f" "b{\"id\"" length:11];
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)1);
+  XCTAssertEqualObjects(
+      [store entityWithKind:@"Note" identifier:@"a"].properties[@"title"],
+      @"intact");
+  XCTAssertEqual([self fileLength], intactLength);
+
+  // Records written after the truncation are found on the next open
+  [store putEntity:[self entityWithIdentifier:@"c" title:@"after"]];
+  store = nil;
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)2);
+  XCTAssertEqualObjects(
+      [store entityWithKind:@"Note" identifier:@"c"].properties[@"title"],
+      @"after");
+}
+
+- (void)testPartialHeaderIsDroppedOnReopen {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntity:[self entityWithIdentifier:@"a" title:@"intact"]];
+  store = nil;
+  unsigned long long intactLength = [self fileLength];
+
+  uint32_t magic = 0x31534543;
+  [self appendBytes:&magic length:sizeof(magic)];
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)1);
+  XCTAssertEqual([self fileLength], intactLength);
+}
+
+- (void)testGarbageAfterLastRecordIsDroppedOnReopen {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntity:[self entityWithIdentifier:@"a" title:@"intact"]];
+  store = nil;
+  unsigned long long intactLength = [self fileLength];
+
+  const char garbage[] = "not a record header at all";
+  [self appendBytes:garbage length:sizeof(garbage)];
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)1);
+  XCTAssertEqual([self fileLength], intactLength);
+}
+
+- (void)testRemoveAllEntitiesEmptiesTheFile {
+  CloudEntityStore *store = [[CloudEntityStore alloc] initWithPath:_path];
+  [store putEntities:@[ [self entityWithIdentifier:@"a" title:@"one"],
+                        [self entityWithIdentifier:@"b" title:@"two"] ]];
+  [store removeAllEntities];
+  XCTAssertEqual([store count], (NSUInteger)0);
+  store = nil;
+
+  store = [[CloudEntityStore alloc] initWithPath:_path];
+  XCTAssertEqual([store count], (NSUInteger)0);
+  XCTAssertEqual([self fileLength], 0ULL);
+}
+
+@end
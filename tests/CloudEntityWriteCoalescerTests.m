@@ -0,0 +1,150 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntity.h"
+#import "CloudEntityWriteCoalescer.h"
+#import "GTLMobilebackendEntityDto.h"
+
+// Private method called back with the batch response.
+@interface CloudEntityWriteCoalescer (Tests)
+- (void)completePendingWrites:(NSArray *)writes
+                 withEntities:(NSArray *)entities
+                        error:(NSError *)error;
+@end
+
+// Checks that the coalescer keeps one write per entity, matching instances by
+// kind name and identifier, and answers every callback with its entity of the
+// batch response.  The flush window is long enough that nothing is sent.
+@interface CloudEntityWriteCoalescerTests : XCTestCase {
+  CloudEntityWriteCoalescer *_coalescer;
+}
+@end
+
+
+@implementation CloudEntityWriteCoalescerTests
+
+- (void)setUp {
+  [super setUp];
+  _coalescer = [[CloudEntityWriteCoalescer alloc] initWithFlushInterval:3600
+                                                            maxBatchSize:100];
+}
+
+#pragma mark - Private methods
+
+- (CloudEntity *)entityWithKind:(NSString *)kindName
+                     identifier:(NSString *)identifier {
+  GTLMobilebackendEntityDto *rawObject = [GTLMobilebackendEntityDto object];
+  rawObject.kindName = kindName;
+  rawObject.identifier = identifier;
+  rawObject.properties = [NSMutableDictionary dictionary];
+  return [CloudEntity entityWithRawObject:rawObject];
+}
+
+// Array of the buffered CloudEntityPendingWrite.
+- (NSArray *)pendingWrites {
+  return [_coalescer valueForKey:@"pendingWrites"];
+}
+
+#pragma mark - Tests
+
+- (void)testCopiesOfAnEntityShareOneWrite {
+  CloudEntity *first = [self entityWithKind:@"Note" identifier:@"a"];
+  CloudEntity *second = [self entityWithKind:@"Note" identifier:@"a"];
+  CloudEntity *otherKind = [self entityWithKind:@"Task" identifier:@"a"];
+  [_coalescer putEntity:first callback:nil];
+  [_coalescer putEntity:second callback:nil];
+  [_coalescer putEntity:otherKind callback:nil];
+
+  NSArray *writes = [self pendingWrites];
+  XCTAssertEqual([writes count], (NSUInteger)2);
+  // The latest state is sent
+  XCTAssertEqual([writes[0] valueForKey:@"entity"], second);
+  XCTAssertEqual([writes[1] valueForKey:@"entity"], otherKind);
+}
+
+- (void)testNewEntitiesOnlyMatchThemselves {
+  CloudEntity *first = [CloudEntity entityWithKind:@"Note" properties:@{}];
+  CloudEntity *second = [CloudEntity entityWithKind:@"Note" properties:@{}];
+  [_coalescer insertEntity:first callback:nil];
+  [_coalescer insertEntity:second callback:nil];
+  [_coalescer putEntity:first callback:nil];
+  XCTAssertEqual([[self pendingWrites] count], (NSUInteger)2);
+}
+
+- (void)testDeleteSupersedesUpdates {
+  CloudEntity *updated = [self entityWithKind:@"Note" identifier:@"a"];
+  CloudEntity *deleted = [self entityWithKind:@"Note" identifier:@"a"];
+  CloudEntity *updatedLater = [self entityWithKind:@"Note" identifier:@"a"];
+  [_coalescer putEntity:updated callback:nil];
+  [_coalescer removeEntity:deleted callback:nil];
+  [_coalescer putEntity:updatedLater callback:nil];
+
+  NSArray *writes = [self pendingWrites];
+  XCTAssertEqual([writes count], (NSUInteger)1);
+  XCTAssertEqual([writes[0] valueForKey:@"entity"], deleted);
+  XCTAssertEqual([[writes[0] valueForKey:@"callbacks"] count], (NSUInteger)3);
+}
+
+- (void)testDeleteOfPendingInsertSendsNothing {
+  CloudEntity *entity = [CloudEntity entityWithKind:@"Note" properties:@{}];
+  [_coalescer insertEntity:entity callback:nil];
+  [_coalescer removeEntity:entity callback:nil];
+  XCTAssertEqual([[self pendingWrites] count], (NSUInteger)0);
+}
+
+- (void)testUpdatesMatchResponseByIdentifier {
+  NSMutableDictionary *results = [NSMutableDictionary dictionary];
+  for (NSString *identifier in @[ @"a", @"b" ]) {
+    [_coalescer putEntity:[self entityWithKind:@"Note" identifier:identifier]
+                 callback:^(CloudEntity *entity, NSError *error) {
+        results[identifier] = entity ? entity : [NSNull null];
+    }];
+  }
+
+  // The response leaves out a, so b is not matched by position
+  CloudEntity *response = [self entityWithKind:@"Note" identifier:@"b"];
+  [_coalescer completePendingWrites:[self pendingWrites]
+                       withEntities:@[ response ]
+                              error:nil];
+  XCTAssertEqualObjects(results[@"a"], [NSNull null]);
+  XCTAssertEqual(results[@"b"], response);
+}
+
+- (void)testInsertResponseMismatchFails {
+  NSMutableArray *errors = [NSMutableArray array];
+  for (NSUInteger i = 0; i < 2; i++) {
+    [_coalescer insertEntity:[CloudEntity entityWithKind:@"Note"
+                                              properties:@{}]
+                    callback:^(CloudEntity *entity, NSError *error) {
+        XCTAssertNil(entity);
+        [errors addObject:error];
+    }];
+  }
+
+  CloudEntity *response = [self entityWithKind:@"Note" identifier:@"a"];
+  [_coalescer completePendingWrites:[self pendingWrites]
+                       withEntities:@[ response ]
+                              error:nil];
+  XCTAssertEqual([errors count], (NSUInteger)2);
+  for (NSError *error in errors) {
+    XCTAssertEqualObjects(error.domain, kCloudEntityWriteCoalescerErrorDomain);
+    XCTAssertEqual(error.code,
+                   (NSInteger)CloudEntityWriteCoalescerErrorResponseMismatch);
+  }
+}
+
+@end
@@ -0,0 +1,156 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudEntity.h"
+#import "CloudFilter.h"
+#import "CloudFilterEvaluator.h"
+#import "GTLDateTime.h"
+#import "GTLMobilebackendEntityDto.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Checks that filters match entities the way the backend matches them: only
+// values of the same type compare, a missing property never matches, a list
+// matches when any element does, and sorted queries leave out entities
+// without the sort property.
+@interface CloudFilterEvaluatorTests : XCTestCase
+@end
+
+
+@implementation CloudFilterEvaluatorTests
+
+#pragma mark - Private methods
+
+- (CloudEntity *)entityWithIdentifier:(NSString *)identifier
+                           properties:(NSDictionary *)properties {
+  GTLMobilebackendEntityDto *rawObject = [GTLMobilebackendEntityDto object];
+  rawObject.kindName = @"Note";
+  rawObject.identifier = identifier;
+  rawObject.properties = [properties mutableCopy];
+  return [CloudEntity entityWithRawObject:rawObject];
+}
+
+- (BOOL)filter:(CloudFilter *)filter
+    matchesProperties:(NSDictionary *)properties {
+  CloudEntity *entity = [self entityWithIdentifier:@"a"
+                                        properties:properties];
+  return [[CloudFilterEvaluator evaluatorWithFilter:filter]
+             evaluateWithEntity:entity];
+}
+
+#pragma mark - Tests
+
+- (void)testMissingPropertyMatchesNoFilter {
+  NSDictionary *properties = @{ @"title" : @"x" };
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterNe:@"rank" value:@3]
+            matchesProperties:properties]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterLt:@"rank" value:@3]
+            matchesProperties:properties]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterEq:@"rank"
+                                                   value:[NSNull null]]
+            matchesProperties:properties]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterInValues:@"rank"
+                                                        values:@3, nil]
+            matchesProperties:properties]);
+}
+
+- (void)testValuesOfDifferentTypesNeverCompare {
+  NSDictionary *properties = @{ @"rank" : @"3" };
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterNe:@"rank" value:@3]
+            matchesProperties:properties]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterEq:@"rank" value:@3]
+            matchesProperties:properties]);
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterNe:@"rank" value:@"4"]
+           matchesProperties:properties]);
+
+  // true and 1 are equal NSNumbers but not equal values
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterEq:@"seen" value:@1]
+            matchesProperties:@{ @"seen" : @YES }]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterInValues:@"seen"
+                                                        values:@1, nil]
+            matchesProperties:@{ @"seen" : @YES }]);
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterEq:@"seen" value:@YES]
+           matchesProperties:@{ @"seen" : @YES }]);
+}
+
+- (void)testNullMatchesOnlyNull {
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterEq:@"owner"
+                                                  value:[NSNull null]]
+           matchesProperties:@{ @"owner" : [NSNull null] }]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterNe:@"owner"
+                                                   value:[NSNull null]]
+            matchesProperties:@{ @"owner" : @"someone" }]);
+}
+
+- (void)testDatesCompareAsDates {
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:1380000000];
+  GTLDateTime *dateTime =
+      [GTLDateTime dateTimeWithDate:date
+                           timeZone:[NSTimeZone timeZoneForSecondsFromGMT:0]];
+  // The same instant written with another offset
+  NSDictionary *properties = @{ @"due" : @"2013-09-24T07:20:00.000+02:00" };
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterEq:@"due"
+                                                  value:dateTime]
+           matchesProperties:properties]);
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterInValues:@"due"
+                                                       values:dateTime, nil]
+           matchesProperties:properties]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterLt:@"due"
+                                                   value:dateTime]
+            matchesProperties:properties]);
+}
+
+- (void)testListMatchesWhenAnyElementDoes {
+  NSDictionary *properties = @{ @"tags" : @[ @"red", @"blue", @4 ] };
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterEq:@"tags" value:@"blue"]
+           matchesProperties:properties]);
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterInValues:@"tags"
+                                                       values:@"green", @4,
+                                                              nil]
+           matchesProperties:properties]);
+  XCTAssertTrue([self filter:[CloudFilter cloudFilterGt:@"tags" value:@3]
+           matchesProperties:properties]);
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterEq:@"tags"
+                                                   value:@"green"]
+            matchesProperties:properties]);
+
+  // An empty list is no value at all
+  XCTAssertFalse([self filter:[CloudFilter cloudFilterNe:@"tags"
+                                                   value:@"green"]
+            matchesProperties:@{ @"tags" : @[] }]);
+}
+
+- (void)testSortedQueryLeavesOutEntitiesWithoutSortProperty {
+  NSArray *entities = @[
+    [self entityWithIdentifier:@"b" properties:@{ @"rank" : @2 }],
+    [self entityWithIdentifier:@"none" properties:@{ @"title" : @"x" }],
+    [self entityWithIdentifier:@"empty" properties:@{ @"rank" : @[] }],
+    [self entityWithIdentifier:@"a" properties:@{ @"rank" : @1 }]
+  ];
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.kindName = @"Note";
+  query.sortedPropertyName = @"rank";
+  query.sortAscending = @YES;
+  NSArray *results = [CloudFilterEvaluator resultOfQuery:query
+                                            withEntities:entities];
+  XCTAssertEqualObjects([results valueForKey:@"identifier"], (@[ @"a", @"b" ]));
+
+  query.sortedPropertyName = nil;
+  results = [CloudFilterEvaluator resultOfQuery:query withEntities:entities];
+  XCTAssertEqual([results count], (NSUInteger)4);
+}
+
+@end
@@ -0,0 +1,133 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudFilter+Normalization.h"
+#import "CloudFilter.h"
+#import "GTLMobilebackendFilterDto.h"
+
+// Checks that filters asking the same question share one canonical form, and
+// that range bounds are tightened and folded only when their order is known.
+@interface CloudFilterNormalizationTests : XCTestCase
+@end
+
+
+@implementation CloudFilterNormalizationTests
+
+#pragma mark - Private methods
+
+- (CloudFilterFold)foldOfFilter:(CloudFilter *)filter {
+  CloudFilterFold fold = CloudFilterFoldNone;
+  [filter normalizedFilterWithFold:&fold];
+  return fold;
+}
+
+#pragma mark - Tests
+
+- (void)testJunctionsAreFlattenedSortedAndDeduplicated {
+  CloudFilter *a = [CloudFilter cloudFilterEq:@"a" value:@1];
+  CloudFilter *b = [CloudFilter cloudFilterEq:@"b" value:@"x"];
+  CloudFilter *c = [CloudFilter cloudFilterNe:@"c" value:@2];
+  CloudFilter *nested = [CloudFilter cloudFilterAndFilters:a,
+      [CloudFilter cloudFilterAndFilters:b, c, nil], nil];
+  CloudFilter *flat = [CloudFilter cloudFilterAndFilters:c, b, a, a, nil];
+  XCTAssertEqualObjects([nested canonicalEncoding], [flat canonicalEncoding]);
+
+  GTLMobilebackendFilterDto *normalized =
+      [flat normalizedFilterWithFold:NULL].filterDto;
+  XCTAssertEqualObjects(normalized.operatorProperty, @"AND");
+  XCTAssertEqual([normalized.subfilters count], (NSUInteger)3);
+}
+
+- (void)testInValuesAreSortedAndDeduplicated {
+  CloudFilter *unsorted = [CloudFilter cloudFilterInValues:@"a"
+                                                    values:@2, @1, @2, nil];
+  CloudFilter *sorted = [CloudFilter cloudFilterInValues:@"a"
+                                                  values:@1, @2, nil];
+  XCTAssertEqualObjects([unsorted canonicalEncoding],
+                        [sorted canonicalEncoding]);
+
+  // A single value is an equality
+  CloudFilter *single = [CloudFilter cloudFilterInValues:@"a"
+                                                  values:@1, @1, nil];
+  XCTAssertEqualObjects([single canonicalEncoding],
+                        [[CloudFilter cloudFilterEq:@"a" value:@1]
+                            canonicalEncoding]);
+}
+
+- (void)testIntegralNumbersEncodeAlike {
+  XCTAssertEqualObjects(
+      [[CloudFilter cloudFilterEq:@"a" value:@1] canonicalEncoding],
+      [[CloudFilter cloudFilterEq:@"a" value:@1.0] canonicalEncoding]);
+  XCTAssertNotEqualObjects(
+      [[CloudFilter cloudFilterEq:@"a" value:@1] canonicalEncoding],
+      [[CloudFilter cloudFilterEq:@"a" value:@YES] canonicalEncoding]);
+}
+
+- (void)testRangesAreTightened {
+  CloudFilter *loose = [CloudFilter cloudFilterAndFilters:
+      [CloudFilter cloudFilterGt:@"a" value:@1],
+      [CloudFilter cloudFilterGe:@"a" value:@3],
+      [CloudFilter cloudFilterGt:@"a" value:@3],
+      [CloudFilter cloudFilterLt:@"a" value:@10], nil];
+  CloudFilter *tight = [CloudFilter cloudFilterAndFilters:
+      [CloudFilter cloudFilterGt:@"a" value:@3],
+      [CloudFilter cloudFilterLt:@"a" value:@10], nil];
+  XCTAssertEqualObjects([loose canonicalEncoding], [tight canonicalEncoding]);
+}
+
+- (void)testDisjointRangesFoldToContradiction {
+  CloudFilter *disjoint = [CloudFilter cloudFilterAndFilters:
+      [CloudFilter cloudFilterGt:@"a" value:@5],
+      [CloudFilter cloudFilterLt:@"a" value:@3], nil];
+  XCTAssertEqual([self foldOfFilter:disjoint], CloudFilterFoldContradiction);
+
+  CloudFilter *point = [CloudFilter cloudFilterAndFilters:
+      [CloudFilter cloudFilterGe:@"a" value:@3],
+      [CloudFilter cloudFilterLe:@"a" value:@3], nil];
+  XCTAssertEqual([self foldOfFilter:point], CloudFilterFoldNone);
+
+  // The contradiction absorbs the AND and is dropped from the OR
+  CloudFilter *either = [CloudFilter cloudFilterOrFilters:disjoint, point,
+                                                          nil];
+  XCTAssertEqualObjects([either canonicalEncoding], [point canonicalEncoding]);
+}
+
+- (void)testBoundsOfDifferentTypesAreKept {
+  CloudFilter *mixed = [CloudFilter cloudFilterAndFilters:
+      [CloudFilter cloudFilterGt:@"a" value:@5],
+      [CloudFilter cloudFilterLt:@"a" value:@"3"], nil];
+  XCTAssertEqual([self foldOfFilter:mixed], CloudFilterFoldNone);
+  GTLMobilebackendFilterDto *normalized =
+      [mixed normalizedFilterWithFold:NULL].filterDto;
+  XCTAssertEqual([normalized.subfilters count], (NSUInteger)2);
+}
+
+- (void)testEqualitiesAreNotFolded {
+  // A list property can hold both values
+  CloudFilter *both = [CloudFilter cloudFilterAndFilters:
+      [CloudFilter cloudFilterEq:@"a" value:@1],
+      [CloudFilter cloudFilterEq:@"a" value:@2], nil];
+  XCTAssertEqual([self foldOfFilter:both], CloudFilterFoldNone);
+}
+
+- (void)testMissingFilterIsTautology {
+  CloudFilterFold fold = CloudFilterFoldNone;
+  XCTAssertNil([CloudFilter normalizedFilterDto:nil fold:&fold]);
+  XCTAssertEqual(fold, CloudFilterFoldTautology);
+}
+
+@end
@@ -0,0 +1,38 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <Foundation/Foundation.h>
+
+// Times the JSON parsers of the GTL runtime on synthetic entity list
+// responses, from the bytes to a GTLMobilebackendEntityListDto whose entries
+// have been read, so that GTL_USE_INDEXED_JSON_PARSER and
+// GTL_USE_LAZY_JSON_PARSER can be decided by measurement on the device.
+// Compares NSJSONSerialization, the path responses take by default, with
+// GTLJSONIndexedParser, GTLJSONLazyParser and GTLJSONStreamParser fed in
+// download-sized chunks.  Only the kind name of each entry is read, which
+// favors the lazy parser as a list shown in part does.
+// Built into the CloudBackendIOSClientTests target only, which runs it from
+// CloudJSONParserBenchmarkTests; run the tests on a device for real numbers.
+@interface CloudJSONParserBenchmark : NSObject
+
+// Return the body of a list response with the number of entities.
++ (NSData *)entityListDataWithCount:(NSUInteger)count;
+
+// Run every parser the number of times on a response with the number of
+// entities, and return and log the best time of each.
++ (NSString *)runWithEntityCount:(NSUInteger)count
+                      iterations:(NSUInteger)iterations;
+
+@end
@@ -0,0 +1,156 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import "CloudJSONParserBenchmark.h"
+#import "GTLJSONParser.h"
+#import "GTLMobilebackendEntityDto.h"
+#import "GTLMobilebackendEntityListDto.h"
+
+typedef id (^CloudJSONParse)(NSData *data, NSError **error);
+
+@implementation CloudJSONParserBenchmark
+
+// Size of the pieces the stream parser is fed, about what a download
+// delivers at a time
+static const NSUInteger kCloudJSONBenchmarkChunkSize = 16 * 1024;
+
+#pragma mark - Public methods
+
++ (NSData *)entityListDataWithCount:(NSUInteger)count {
+  NSArray *owners = @[ @"alice@example.com", @"bob@example.com",
+                       @"carol@example.com" ];
+  NSMutableArray *entries = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger i = 0; i < count; i++) {
+    NSString *owner = owners[i % [owners count]];
+    NSString *timestamp =
+        [NSString stringWithFormat:@"2013-06-%02luT10:%02lu:%02lu.%03luZ",
+            (unsigned long)(i % 28 + 1), (unsigned long)(i % 60),
+            (unsigned long)(i * 7 % 60), (unsigned long)(i % 1000)];
+    NSDictionary *properties = @{
+      @"message" : [NSString stringWithFormat:
+          @"Message %lu with \"quotes\", a tab\tand caf\u00e9",
+          (unsigned long)i],
+      @"count" : @(i),
+      @"score" : @(i * 0.25),
+      @"read" : @(i % 2 == 0),
+      @"tags" : @[ @"guestbook", @"sample" ],
+      @"replyTo" : [NSNull null]
+    };
+    [entries addObject:@{
+      @"id" : [NSString stringWithFormat:@"%lu", (unsigned long)(i + 1)],
+      @"kindName" : @"Guestbook",
+      @"createdAt" : timestamp,
+      @"updatedAt" : timestamp,
+      @"createdBy" : owner,
+      @"updatedBy" : owner,
+      @"owner" : owner,
+      @"properties" : properties
+    }];
+  }
+
+  return [NSJSONSerialization dataWithJSONObject:@{ @"entries" : entries }
+                                         options:NSJSONWritingPrettyPrinted
+                                           error:NULL];
+}
+
++ (NSString *)runWithEntityCount:(NSUInteger)count
+                      iterations:(NSUInteger)iterations {
+  NSData *data = [self entityListDataWithCount:count];
+  id reference =
+      [NSJSONSerialization JSONObjectWithData:data
+                                      options:NSJSONReadingMutableContainers
+                                        error:NULL];
+
+  NSDictionary *parsers = @{
+    @"NSJSONSerialization" : [^id(NSData *json, NSError **error) {
+        return [NSJSONSerialization
+            JSONObjectWithData:json
+                       options:NSJSONReadingMutableContainers
+                         error:error];
+    } copy],
+    @"GTLJSONIndexedParser" : [^id(NSData *json, NSError **error) {
+        return [GTLJSONIndexedParser objectWithData:json error:error];
+    } copy],
+    @"GTLJSONLazyParser" : [^id(NSData *json, NSError **error) {
+        return [GTLJSONLazyParser objectWithData:json error:error];
+    } copy],
+    @"GTLJSONStreamParser" : [^id(NSData *json, NSError **error) {
+        GTLJSONStreamParser *parser = [[GTLJSONStreamParser alloc] init];
+        NSUInteger length = [json length];
+        for (NSUInteger offset = 0; offset < length;
+             offset += kCloudJSONBenchmarkChunkSize) {
+          NSRange range = NSMakeRange(offset,
+              MIN(kCloudJSONBenchmarkChunkSize, length - offset));
+          [parser appendData:[json subdataWithRange:range]];
+        }
+        return [parser finishWithError:error];
+    } copy]
+  };
+
+  NSMutableString *report = [NSMutableString stringWithFormat:
+      @"%lu entities, %lu bytes, best of %lu:",
+      (unsigned long)count, (unsigned long)[data length],
+      (unsigned long)iterations];
+  for (NSString *name in
+       [[parsers allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+    NSTimeInterval bestTime = [self bestTimeOfParse:parsers[name]
+                                           withData:data
+                                         iterations:iterations
+                                          reference:reference];
+    if (bestTime < 0) {
+      [report appendFormat:@"\n  %@: wrong result", name];
+    } else {
+      [report appendFormat:@"\n  %@: %.2f ms", name, bestTime * 1000];
+    }
+  }
+
+  NSLog(@"%@", report);
+  return report;
+}
+
+#pragma mark - Private methods
+
+// Return the best time of parsing the data and reading the entries of the
+// list, or -1 if the parse does not yield the reference tree.
++ (NSTimeInterval)bestTimeOfParse:(CloudJSONParse)parse
+                         withData:(NSData *)data
+                       iterations:(NSUInteger)iterations
+                        reference:(id)reference {
+  NSTimeInterval bestTime = INFINITY;
+  for (NSUInteger i = 0; i < MAX(iterations, 1); i++) {
+    @autoreleasepool {
+      CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+      NSMutableDictionary *json = parse(data, NULL);
+      GTLMobilebackendEntityListDto *list = (GTLMobilebackendEntityListDto *)
+          [GTLObject objectForJSON:json
+                      defaultClass:[GTLMobilebackendEntityListDto class]
+                        surrogates:nil
+                     batchClassMap:nil];
+      NSUInteger kindNameCount = 0;
+      for (GTLMobilebackendEntityDto *entry in list.entries) {
+        kindNameCount += entry.kindName ? 1 : 0;
+      }
+      bestTime = MIN(bestTime, CFAbsoluteTimeGetCurrent() - start);
+
+      if (![json isEqual:reference] ||
+          kindNameCount != [list.entries count]) {
+        return -1;
+      }
+    }
+  }
+  return bestTime;
+}
+
+@end
@@ -0,0 +1,40 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudJSONParserBenchmark.h"
+
+// Runs the JSON parser benchmark on small and large list responses.  Fails if
+// a parser does not yield the tree NSJSONSerialization does; the times are
+// logged with the test output.
+@interface CloudJSONParserBenchmarkTests : XCTestCase
+@end
+
+
+@implementation CloudJSONParserBenchmarkTests
+
+- (void)testParsersOnEntityLists {
+  for (NSNumber *count in @[ @10, @100, @1000 ]) {
+    NSUInteger entityCount = [count unsignedIntegerValue];
+    NSString *report =
+        [CloudJSONParserBenchmark runWithEntityCount:entityCount
+                                          iterations:5];
+    XCTAssertEqual([report rangeOfString:@"wrong result"].location,
+                   (NSUInteger)NSNotFound, @"%@", report);
+  }
+}
+
+@end
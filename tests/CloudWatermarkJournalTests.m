@@ -0,0 +1,151 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "CloudWatermarkJournal.h"
+
+// Checks that committed watermarks are read back when the journal is
+// reopened, and that a record cut short by a crash is dropped.
+@interface CloudWatermarkJournalTests : XCTestCase {
+  NSString *_path;
+}
+@end
+
+
+@implementation CloudWatermarkJournalTests
+
+- (void)setUp {
+  [super setUp];
+  NSString *name = [[NSProcessInfo processInfo] globallyUniqueString];
+  _path = [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+}
+
+- (void)tearDown {
+  [[NSFileManager defaultManager] removeItemAtPath:_path error:nil];
+  [super tearDown];
+}
+
+#pragma mark - Private methods
+
+- (CloudWatermarkJournal *)openJournal {
+  return [[CloudWatermarkJournal alloc] initWithPath:_path
+                                      commitInterval:60];
+}
+
+- (unsigned long long)fileLength {
+  NSDictionary *attributes =
+      [[NSFileManager defaultManager] attributesOfItemAtPath:_path error:nil];
+  return [attributes fileSize];
+}
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)length {
+  NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:_path];
+  [fileHandle seekToEndOfFile];
+  [fileHandle writeData:[NSData dataWithBytes:bytes length:length]];
+  [fileHandle closeFile];
+}
+
+#pragma mark - Tests
+
+- (void)testWatermarksRoundTripThroughReopen {
+  NSDate *first = [NSDate dateWithTimeIntervalSince1970:1380000000.25];
+  NSDate *second = [NSDate dateWithTimeIntervalSince1970:1380000100.5];
+  CloudWatermarkJournal *journal = [self openJournal];
+  [journal setWatermark:first forKey:@"topic-a"];
+  [journal setWatermark:second forKey:@"topic-b"];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic-a"], first);
+  [journal synchronize];
+
+  journal = [self openJournal];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic-a"], first);
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic-b"], second);
+  XCTAssertNil([journal watermarkForKey:@"topic-c"]);
+}
+
+- (void)testWatermarkOnlyMovesForward {
+  NSDate *later = [NSDate dateWithTimeIntervalSince1970:1380000100];
+  NSDate *earlier = [NSDate dateWithTimeIntervalSince1970:1380000000];
+  CloudWatermarkJournal *journal = [self openJournal];
+  [journal setWatermark:later forKey:@"topic"];
+  [journal setWatermark:earlier forKey:@"topic"];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic"], later);
+  [journal synchronize];
+
+  journal = [self openJournal];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic"], later);
+}
+
+- (void)testTornRecordIsDroppedOnReopen {
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:1380000000];
+  CloudWatermarkJournal *journal = [self openJournal];
+  [journal setWatermark:date forKey:@"topic"];
+  [journal synchronize];
+  journal = nil;
+  unsigned long long intactLength = [self fileLength];
+
+  // A record whose key was cut short: magic, key length, timestamp
+  struct {
+    uint32_t magic;
+    uint32_t keyLength;
+    double timestamp;
+  } header = { 0x314d5743, 5, 1390000000 };
+  [self appendBytes:&header length:sizeof(header)];
+  [self appendBytes:"top" length:3];
+
+  journal = [self openJournal];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic"], date);
+  XCTAssertEqual([self fileLength], intactLength);
+
+  // Records committed after the truncation are found on the next open
+  NSDate *later = [date dateByAddingTimeInterval:60];
+  [journal setWatermark:later forKey:@"topic"];
+  [journal synchronize];
+  journal = [self openJournal];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic"], later);
+}
+
+- (void)testPartialHeaderIsDroppedOnReopen {
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:1380000000];
+  CloudWatermarkJournal *journal = [self openJournal];
+  [journal setWatermark:date forKey:@"topic"];
+  [journal synchronize];
+  journal = nil;
+  unsigned long long intactLength = [self fileLength];
+
+  uint32_t magic = 0x314d5743;
+  [self appendBytes:&magic length:sizeof(magic)];
+
+  journal = [self openJournal];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic"], date);
+  XCTAssertEqual([self fileLength], intactLength);
+}
+
+- (void)testSupersededRecordsAreCompacted {
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:1380000000];
+  CloudWatermarkJournal *journal = [self openJournal];
+  for (NSUInteger i = 0; i < 300; i++) {
+    [journal setWatermark:[date dateByAddingTimeInterval:i] forKey:@"topic"];
+    [journal synchronize];
+  }
+  unsigned long long recordLength = 16 + [@"topic" length];
+  XCTAssertTrue([self fileLength] < 300 * recordLength);
+
+  journal = [self openJournal];
+  XCTAssertEqualObjects([journal watermarkForKey:@"topic"],
+                        [date dateByAddingTimeInterval:299]);
+}
+
+@end
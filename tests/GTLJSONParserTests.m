@@ -0,0 +1,275 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "GTLJSONParser.h"
+
+// Checks that the stream, indexed and lazy parsers build the tree
+// NSJSONSerialization does, including strings whose escapes straddle the
+// 64-byte blocks of the structural index, and that they reject bad escapes
+// and invalid UTF-8.
+@interface GTLJSONParserTests : XCTestCase
+@end
+
+
+@implementation GTLJSONParserTests
+
+#pragma mark - Private methods
+
+- (NSData *)dataWithString:(NSString *)string {
+  return [string dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+// Parse the data with every parser, the stream parser both in one piece and
+// one byte at a time.  Keys are the parser names.
+- (NSDictionary *)resultsOfParsingData:(NSData *)data
+                                errors:(NSDictionary **)errors {
+  NSMutableDictionary *results = [NSMutableDictionary dictionary];
+  NSMutableDictionary *parseErrors = [NSMutableDictionary dictionary];
+  void (^record)(NSString *, id, NSError *) =
+      ^(NSString *name, id result, NSError *error) {
+          results[name] = result ? result : [NSNull null];
+          if (error) {
+            parseErrors[name] = error;
+          }
+      };
+
+  NSError *error = nil;
+  id result = [GTLJSONIndexedParser objectWithData:data error:&error];
+  record(@"indexed", result, error);
+
+  error = nil;
+  result = [GTLJSONLazyParser objectWithData:data error:&error];
+  record(@"lazy", result, error);
+
+  GTLJSONStreamParser *streamParser = [[GTLJSONStreamParser alloc] init];
+  [streamParser appendData:data];
+  error = nil;
+  result = [streamParser finishWithError:&error];
+  record(@"stream", result, error);
+
+  streamParser = [[GTLJSONStreamParser alloc] init];
+  const uint8_t *bytes = [data bytes];
+  for (NSUInteger i = 0; i < [data length]; i++) {
+    [streamParser appendData:[NSData dataWithBytes:bytes + i length:1]];
+  }
+  error = nil;
+  result = [streamParser finishWithError:&error];
+  record(@"stream by byte", result, error);
+
+  if (errors) {
+    *errors = parseErrors;
+  }
+  return results;
+}
+
+- (void)assertParsersMatchFoundationOnData:(NSData *)data {
+  id expected = [NSJSONSerialization JSONObjectWithData:data
+                                                options:0
+                                                  error:NULL];
+  XCTAssertNotNil(expected);
+  NSDictionary *errors = nil;
+  NSDictionary *results = [self resultsOfParsingData:data errors:&errors];
+  for (NSString *name in results) {
+    XCTAssertEqualObjects(results[name], expected, @"%@ parser, errors %@",
+                          name, errors);
+  }
+}
+
+- (void)assertParsersRejectData:(NSData *)data
+                        parsers:(NSArray *)names {
+  NSDictionary *errors = nil;
+  NSDictionary *results = [self resultsOfParsingData:data errors:&errors];
+  for (NSString *name in names) {
+    XCTAssertEqualObjects(results[name], [NSNull null], @"%@ parser on %@",
+                          name, data);
+    XCTAssertNotNil(errors[name], @"%@ parser on %@", name, data);
+  }
+}
+
+#pragma mark - Tests
+
+- (void)testParsersMatchFoundationOnEntityList {
+  NSString *json =
+      @"{\"kind\":\"mobilebackend#entityListDto\",\"entries\":["
+      @"{\"id\":\"a1\",\"kindName\":\"Guestbook\",\"properties\":"
+      @"{\"message\":\"Hello\",\"rank\":-12.5e3,\"seen\":true,\"tags\":[],"
+      @"\"owner\":null}},"
+      @" { \"id\" : \"a2\" , \"kindName\" : \"Guestbook\" ,\n"
+      @"   \"properties\" : { \"message\" : \"\" , \"rank\" : 0 } } ]}";
+  [self assertParsersMatchFoundationOnData:[self dataWithString:json]];
+}
+
+- (void)testEscapesDecodeAsFoundationDoes {
+  NSString *json =
+      @"[\"\\u00e9\\u20AC\\ud83d\\ude00\",\"\\n\\t\\r\\b\\f\",\"\\\"\\\\\\/\","
+      @"\"caf\u00e9 \U0001F600\",\"\\u0000\"]";
+  [self assertParsersMatchFoundationOnData:[self dataWithString:json]];
+
+  NSArray *strings =
+      [GTLJSONLazyParser objectWithData:[self dataWithString:json] error:NULL];
+  XCTAssertEqualObjects(strings[0], @"\u00e9\u20ac\U0001F600");
+  XCTAssertEqualObjects(strings[2], @"\"\\/");
+}
+
+- (void)testLoneSurrogateEscapeDecodesAsReplacementCharacter {
+  NSData *data = [self dataWithString:@"[\"\\ud800x\",\"\\udc00\"]"];
+  NSString *replacement = [NSString stringWithFormat:@"%C", (unichar)0xFFFD];
+  NSArray *expected = @[ [replacement stringByAppendingString:@"x"],
+                         replacement ];
+  NSDictionary *results = [self resultsOfParsingData:data errors:NULL];
+  for (NSString *name in results) {
+    XCTAssertEqualObjects(results[name], expected, @"%@ parser", name);
+  }
+}
+
+- (void)testStringsStraddlingBlockBoundaries {
+  // Move escaped quotes and runs of backslashes across every position
+  // around the end of the first 64-byte block.
+  NSArray *tails = @[ @"\\\"", @"\\\\", @"\\\\\\\"", @"\\\\\\\\\\\\",
+                      @"\\u00e9", @"\u00e9\U0001F600" ];
+  for (NSUInteger padding = 48; padding < 80; padding++) {
+    NSString *pad = [@"" stringByPaddingToLength:padding
+                                      withString:@"x"
+                                 startingAtIndex:0];
+    for (NSString *tail in tails) {
+      NSString *json =
+          [NSString stringWithFormat:@"{\"%@\":\"%@%@\",\"k\":[1,\"%@\"]}",
+                                     pad, tail, pad, tail];
+      [self assertParsersMatchFoundationOnData:[self dataWithString:json]];
+    }
+  }
+}
+
+- (void)testInternedStringsAndSharedKeySets {
+  // More shapes than get a shared key set, short values repeated across
+  // objects and strings just either side of the interning limit
+  NSString *shortValue = @"abcdefghijklmnopqrstuvwxyz012345";
+  NSString *longValue = [shortValue stringByAppendingString:@"6"];
+  NSMutableArray *objects = [NSMutableArray array];
+  for (NSUInteger i = 0; i < 300; i++) {
+    NSString *key = [NSString stringWithFormat:@"key%lu", (unsigned long)i];
+    [objects addObject:@{ @"kindName" : @"Guestbook",
+                          key : shortValue,
+                          @"long" : longValue,
+                          @"été" : @"café" }];
+  }
+  NSData *data = [NSJSONSerialization dataWithJSONObject:objects
+                                                 options:0
+                                                   error:NULL];
+  [self assertParsersMatchFoundationOnData:data];
+}
+
+- (void)testObjectsSharingAKeySetChangeIndependently {
+  NSData *data = [self dataWithString:
+      @"[{\"id\":\"a1\",\"rank\":1},{\"id\":\"a2\",\"rank\":2}]"];
+  NSDictionary *results = [self resultsOfParsingData:data errors:NULL];
+  for (NSString *name in results) {
+    NSArray *objects = results[name];
+    NSMutableDictionary *first = objects[0];
+    first[@"extra"] = @YES;
+    first[@"id"] = @"changed";
+    [first removeObjectForKey:@"rank"];
+    XCTAssertEqualObjects(objects[1], (@{ @"id" : @"a2", @"rank" : @2 }),
+                          @"%@ parser", name);
+    XCTAssertEqualObjects(first, (@{ @"id" : @"changed", @"extra" : @YES }),
+                          @"%@ parser", name);
+  }
+}
+
+- (void)testBadEscapesAreRejected {
+  NSArray *allParsers = @[ @"indexed", @"lazy", @"stream",
+                           @"stream by byte" ];
+  for (NSString *json in @[ @"[\"\\x\"]", @"[\"\\u12G4\"]", @"[\"\\u12\"]",
+                            @"{\"a\":{\"b\":[\"ok\",\"\\q\"]}}",
+                            @"{\"\\v\":1}" ]) {
+    [self assertParsersRejectData:[self dataWithString:json]
+                          parsers:allParsers];
+  }
+}
+
+- (void)testMalformedNumbersAreRejected {
+  NSArray *allParsers = @[ @"indexed", @"lazy", @"stream",
+                           @"stream by byte" ];
+  for (NSString *json in @[ @"[01]", @"[1.]", @"[-.5]", @"[.5]", @"[+1]",
+                            @"[1e]", @"[-]", @"{\"a\":00}",
+                            @"{\"a\":[1,2.e3]}" ]) {
+    [self assertParsersRejectData:[self dataWithString:json]
+                          parsers:allParsers];
+  }
+}
+
+- (void)testNumbersParseAsFoundationParsesThem {
+  NSString *json = @"[0,-0,1,-12,0.5,-0.25,1e3,2E-2,-1.5e+2,10.0]";
+  [self assertParsersMatchFoundationOnData:[self dataWithString:json]];
+}
+
+- (void)testInvalidUTF8IsRejected {
+  // Stray continuation byte and a byte UTF-8 never uses
+  const char *stray[] = { "[\"a\x80\"]", "{\"a\":[\"\xff\"]}" };
+  for (size_t i = 0; i < sizeof(stray) / sizeof(stray[0]); i++) {
+    NSData *data = [NSData dataWithBytes:stray[i] length:strlen(stray[i])];
+    [self assertParsersRejectData:data parsers:@[ @"indexed", @"lazy" ]];
+  }
+
+  // The lazy parser checks every string up front, even in containers that
+  // are never read: overlong, surrogate, out of range and truncated
+  // sequences
+  const char *lazy[] = { "[\"\xc0\xaf\"]", "[\"\xe0\x80\xaf\"]",
+                         "[\"\xed\xa0\x80\"]", "[\"\xf4\x90\x80\x80\"]",
+                         "[\"\xe2\x82\"]", "{\"a\":{\"b\":\"\xf0\x9f\x98\"}}" };
+  for (size_t i = 0; i < sizeof(lazy) / sizeof(lazy[0]); i++) {
+    NSData *data = [NSData dataWithBytes:lazy[i] length:strlen(lazy[i])];
+    [self assertParsersRejectData:data parsers:@[ @"lazy" ]];
+  }
+}
+
+- (void)testLazyContainersReadAndChangeLikeMutableOnes {
+  NSData *data = [self dataWithString:
+      @"{\"a\":{\"b\":[1,2,{\"c\":\"d\"}]},\"e\":\"f\"}"];
+  NSMutableDictionary *lazy = [GTLJSONLazyParser objectWithData:data
+                                                          error:NULL];
+  NSMutableDictionary *expected =
+      [NSJSONSerialization JSONObjectWithData:data
+                                      options:NSJSONReadingMutableContainers
+                                        error:NULL];
+
+  XCTAssertEqualObjects(lazy[@"a"][@"b"][2][@"c"], @"d");
+  [lazy[@"a"][@"b"] addObject:@3];
+  [expected[@"a"][@"b"] addObject:@3];
+  [lazy removeObjectForKey:@"e"];
+  [expected removeObjectForKey:@"e"];
+  XCTAssertEqualObjects(lazy, expected);
+  XCTAssertEqual([lazy count], (NSUInteger)1);
+}
+
+- (void)testLazyContainersOutliveBytesTheyDoNotOwn {
+  const char json[] = "{\"a\":{\"b\":\"value\"},\"c\":[1,\"two\"]}";
+  char *bytes = malloc(sizeof(json));
+  memcpy(bytes, json, sizeof(json));
+  NSData *data = [NSData dataWithBytesNoCopy:bytes
+                                      length:sizeof(json) - 1
+                                freeWhenDone:NO];
+  NSDictionary *lazy = [GTLJSONLazyParser objectWithData:data error:NULL];
+
+  // Nothing was read yet; overwrite and free the bytes parsed
+  memset(bytes, '!', sizeof(json));
+  free(bytes);
+  XCTAssertEqualObjects(lazy[@"a"][@"b"], @"value");
+  XCTAssertEqualObjects(lazy[@"c"], (@[ @1, @"two" ]));
+}
+
+@end
@@ -0,0 +1,145 @@
+/* Copyright (c) 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "GTLDateTime.h"
+#import "GTLMobilebackendEntityDto.h"
+#import "GTLMobilebackendEntityListDto.h"
+#import "GTLMobilebackendFilterDto.h"
+#import "GTLMobilebackendQueryDto.h"
+
+// Checks the dynamic property accessors added from the dispatch tables of the
+// generated classes: JSON keys, conversion to and from the JSON, and array
+// item classes.
+@interface GTLRuntimeCommonTests : XCTestCase
+@end
+
+
+@implementation GTLRuntimeCommonTests
+
+- (void)testStringPropertiesUseTheirJSONKeys {
+  GTLMobilebackendEntityDto *entity = [GTLMobilebackendEntityDto object];
+  entity.identifier = @"a1";
+  entity.kindName = @"Guestbook";
+  XCTAssertEqualObjects(entity.JSON[@"id"], @"a1");
+  XCTAssertEqualObjects(entity.JSON[@"kindName"], @"Guestbook");
+  XCTAssertNil(entity.JSON[@"identifier"]);
+  XCTAssertEqualObjects(entity.identifier, @"a1");
+
+  entity.identifier = nil;
+  XCTAssertNil(entity.JSON[@"id"]);
+  XCTAssertNil(entity.identifier);
+
+  GTLMobilebackendFilterDto *filter = [GTLMobilebackendFilterDto object];
+  filter.operatorProperty = @"EQ";
+  XCTAssertEqualObjects(filter.JSON[@"operator"], @"EQ");
+}
+
+- (void)testGettersReadTheJSON {
+  NSMutableDictionary *json = [@{ @"id" : @"a1",
+                                  @"owner" : @"someone",
+                                  @"properties" : @{ @"rank" : @3 } }
+                               mutableCopy];
+  GTLMobilebackendEntityDto *entity =
+      [GTLMobilebackendEntityDto objectWithJSON:json];
+  XCTAssertEqualObjects(entity.identifier, @"a1");
+  XCTAssertEqualObjects(entity.owner, @"someone");
+  XCTAssertEqualObjects(entity.properties[@"rank"], @3);
+  XCTAssertNil(entity.updatedBy);
+}
+
+- (void)testDateTimeRoundTripsThroughRFC3339String {
+  NSDate *date = [NSDate dateWithTimeIntervalSince1970:1380000000];
+  GTLMobilebackendEntityDto *entity = [GTLMobilebackendEntityDto object];
+  entity.updatedAt = [GTLDateTime dateTimeWithDate:date
+                                          timeZone:[NSTimeZone
+                                              timeZoneForSecondsFromGMT:0]];
+  XCTAssertTrue([entity.JSON[@"updatedAt"] isKindOfClass:[NSString class]]);
+  XCTAssertEqualObjects(entity.updatedAt.date, date);
+
+  GTLMobilebackendEntityDto *copy =
+      [GTLMobilebackendEntityDto objectWithJSON:[entity.JSON mutableCopy]];
+  XCTAssertEqualObjects(copy.updatedAt.date, date);
+}
+
+- (void)testNumberProperties {
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.limit = @50;
+  query.sortAscending = @YES;
+  XCTAssertEqualObjects(query.JSON[@"limit"], @50);
+  XCTAssertEqual([query.limit intValue], 50);
+  XCTAssertTrue([query.sortAscending boolValue]);
+}
+
+- (void)testObjectPropertiesAndArraysUseTheirClasses {
+  GTLMobilebackendFilterDto *subfilter = [GTLMobilebackendFilterDto object];
+  subfilter.operatorProperty = @"GT";
+  subfilter.values = @[ @"rank", @3 ];
+  GTLMobilebackendFilterDto *filter = [GTLMobilebackendFilterDto object];
+  filter.operatorProperty = @"AND";
+  filter.subfilters = @[ subfilter ];
+  GTLMobilebackendQueryDto *query = [GTLMobilebackendQueryDto object];
+  query.filterDto = filter;
+
+  NSMutableDictionary *json = [query.JSON mutableCopy];
+  XCTAssertTrue([json[@"filterDto"] isKindOfClass:[NSDictionary class]]);
+  XCTAssertEqualObjects(json[@"filterDto"][@"subfilters"][0][@"operator"],
+                        @"GT");
+
+  GTLMobilebackendQueryDto *parsed =
+      [GTLMobilebackendQueryDto objectWithJSON:json];
+  GTLMobilebackendFilterDto *parsedSubfilter =
+      parsed.filterDto.subfilters[0];
+  XCTAssertTrue([parsed.filterDto isKindOfClass:
+                    [GTLMobilebackendFilterDto class]]);
+  XCTAssertTrue([parsedSubfilter isKindOfClass:
+                    [GTLMobilebackendFilterDto class]]);
+  XCTAssertEqualObjects(parsedSubfilter.operatorProperty, @"GT");
+  XCTAssertEqualObjects(parsedSubfilter.values, (@[ @"rank", @3 ]));
+}
+
+- (void)testListEntriesAreEntities {
+  NSMutableDictionary *json =
+      [@{ @"entries" : @[ @{ @"id" : @"a1" }, @{ @"id" : @"a2" } ] }
+       mutableCopy];
+  GTLMobilebackendEntityListDto *list =
+      [GTLMobilebackendEntityListDto objectWithJSON:json];
+  XCTAssertEqual([list.entries count], (NSUInteger)2);
+  GTLMobilebackendEntityDto *entry = list.entries[1];
+  XCTAssertTrue([entry isKindOfClass:[GTLMobilebackendEntityDto class]]);
+  XCTAssertEqualObjects(entry.identifier, @"a2");
+}
+
+- (void)testAccessorsFromManyThreads {
+  // The tables are read without locking once built
+  dispatch_queue_t queue =
+      dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+  __block NSUInteger failures = 0;
+  dispatch_apply(1000, queue, ^(size_t i) {
+      GTLMobilebackendFilterDto *filter = [GTLMobilebackendFilterDto object];
+      NSString *op = [NSString stringWithFormat:@"op%zu", i];
+      filter.operatorProperty = op;
+      if (![filter.operatorProperty isEqual:op] ||
+          ![filter.JSON[@"operator"] isEqual:op]) {
+        @synchronized(self) {
+          failures++;
+        }
+      }
+  });
+  XCTAssertEqual(failures, (NSUInteger)0);
+}
+
+@end